@@ -298,6 +298,31 @@ AdjustRoDPlugin::isIdentity(const IsIdentityArguments &args,
         return true;
     }
 
+    // Inside the source RoD, the output is exactly the source, whatever the border conditions:
+    // let the host use the source image instead of copying it.
+    // In Sony Catalyst Edit, clipGetRegionOfDefinition returns the RoD in pixels instead of canonical coordinates.
+    if ( _srcClip && _srcClip->isConnected() && getImageEffectHostDescription()->supportsMultiResolution ) {
+        const OfxRectD& srcRod = _srcClip->getRegionOfDefinition(args.time);
+        if ( !Coords::rectIsEmpty(srcRod) ) {
+            OfxRectD rod = srcRod;
+            rod.x1 -= w;
+            rod.x2 += w;
+            rod.y1 -= h;
+            rod.y2 += h;
+            OfxRectI rodPixel;
+            // if the RoD was reduced, the output RoD is smaller than the source RoD
+            if ( Coords::rectIntersection(rod, srcRod, &rod) ) {
+                Coords::toPixelEnclosing(rod, args.renderScale, _srcClip->getPixelAspectRatio(), &rodPixel);
+                if ( (args.renderWindow.x1 >= rodPixel.x1) && (args.renderWindow.x2 <= rodPixel.x2) &&
+                     ( args.renderWindow.y1 >= rodPixel.y1) && ( args.renderWindow.y2 <= rodPixel.y2) ) {
+                    identityClip = _srcClip;
+
+                    return true;
+                }
+            }
+        }
+    }
+
     return false;
 }
 
@@ -62,6 +62,7 @@ typedef void (APIENTRYP PFNGLBLENDEQUATIONSEPARATEPROC)(GLenum modeRGB, GLenum m
 #include "ofxsLut.h"
 #include "ofxsMacros.h"
 #include "ofxsThreadSuite.h"
+#include "ofxsHistogram.h"
 #ifdef OFX_USE_MULTITHREAD_MUTEX
 namespace {
     typedef MultiThread::Mutex Mutex;
@@ -100,9 +101,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // 1.0 initial version
 // 1.1 (10/2017) add display/computation of histogram and master curve modes
+// 1.2 the histogram is computed where the mask is non-zero, over the input range if the Range is empty
 #define kPluginIdentifier "net.sf.openfx.ColorLookupPlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -206,7 +208,7 @@ enum DisplayEnum
 #define kParamDisplayDefault eDisplayColorRamp
 
 #define kParamUpdateHistogram "updateHistogram"
-#define kParamUpdateHistogramLabel "Update Histogram", "Update the histogram from the input at current time."
+#define kParamUpdateHistogramLabel "Update Histogram", "Update the histogram from the input at current time, where the mask is non-zero. The histogram covers the Range, or the range of the input values if the Range is empty. It is estimated from a sample of about 262144 pixels of the input."
 
 #define kParamRange "range"
 #define kParamRangeLabel "Range"
@@ -744,6 +746,7 @@ luminance(T r,
 }
 
 #define HISTOGRAM_BINS 256
+#define HISTOGRAM_SAMPLES 262144 // the displayed histogram is estimated from about that many pixels
 
 struct RGBAValues
 {
@@ -773,124 +776,6 @@ struct Results
     unsigned long hmax;
 };
 
-class HistogramProcessorBase
-: public ImageProcessor
-{
-protected:
-    Mutex _mutex; //< this is used so we can multi-thread the analysis and protect the shared results
-    unsigned long _count;
-
-public:
-    HistogramProcessorBase(ImageEffect &instance)
-    : ImageProcessor(instance)
-    , _mutex()
-    , _count(0)
-    {
-    }
-
-    virtual ~HistogramProcessorBase()
-    {
-    }
-
-    virtual void getResults(Results *results) const = 0;
-};
-
-
-template <class PIX, int nComponents, int maxValue>
-class HistogramProcessor
-: public HistogramProcessorBase
-{
-private:
-    std::vector<unsigned long> _histogram;
-    double _rangemin;
-    double _rangemax;
-    bool _premult;
-    int _premultChannel;
-
-public:
-    HistogramProcessor(ImageEffect &instance, double rangemin, double rangemax, bool premult, int premultChannel)
-    : HistogramProcessorBase(instance)
-    , _histogram(HISTOGRAM_BINS * nComponents)
-    , _rangemin(rangemin)
-    , _rangemax(rangemax)
-    , _premult(premult)
-    , _premultChannel(premultChannel)
-    {
-    }
-
-    ~HistogramProcessor()
-    {
-    }
-
-    void getResults(Results *results) const OVERRIDE FINAL
-    {
-        results->rangemin = _rangemin;
-        results->rangemax = _rangemax;
-        results->histogram = _histogram;
-        results->bins = HISTOGRAM_BINS;
-        results->components = nComponents;
-        unsigned long hmax = 0;
-        // compute the max, excluding the first and last bins
-        for (int c = 0; c < nComponents; ++c) {
-            for (int i = 1; i < HISTOGRAM_BINS - 1; ++i) {
-                unsigned long h = _histogram[c * HISTOGRAM_BINS + i];
-                if (h > hmax) {
-                    hmax = h;
-                }
-            }
-        }
-        results->hmax = hmax;
-    }
-
-private:
-
-    void addResults(const std::vector<unsigned long>& histogram,
-                    unsigned long count)
-    {
-        AutoMutex l (&_mutex);
-        assert(histogram.size() == _histogram.size());
-        for (size_t i = 0; i < HISTOGRAM_BINS * nComponents; ++i) {
-            _histogram[i] += histogram[i];
-        }
-        _count += count;
-    }
-
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
-    {
-        unused(rs);
-        std::vector<unsigned long> histogram(HISTOGRAM_BINS * nComponents);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float unpPix[4] = {0.f, 0.f, 0.f, 0.f};
-                ofxsUnPremult<PIX, nComponents, maxValue>(dstPix, unpPix, _premult, _premultChannel);
-
-                for (int c = 0; c < (std::min)(nComponents, 3); ++c) {
-                    int bin = 0;
-                    if (unpPix[c] >= _rangemax) {
-                        bin = HISTOGRAM_BINS - 1;
-                    } else if (unpPix[c] >= _rangemin) {
-                        bin = static_cast<int>( std::floor(HISTOGRAM_BINS * (unpPix[c] - _rangemin) / (_rangemax - _rangemin)) );
-                    }
-                    ++histogram[c * HISTOGRAM_BINS + bin];
-                }
-                dstPix += nComponents;
-            }
-            count += procWindow.x2 - procWindow.x1;
-        }
-
-        addResults(histogram, count);
-    }
-};
-
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class ColorLookupPlugin
@@ -904,6 +789,9 @@ public:
         , _maskClip(NULL)
         , _luminanceMath(NULL)
         , _premultChanged(NULL)
+        , _histogramMutex()
+        , _histogram()
+        , _histogramCache()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert( _dstClip && (!_dstClip->isConnected() || _dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -980,114 +868,6 @@ private:
 
     void updateHistogram(const InstanceChangedArgs &args);
 
-    /* set up and run a processor */
-    void
-    setupAndProcess(HistogramProcessorBase &processor,
-                    const Image* srcImg,
-                    const OfxRectI &analysisWindow,
-                    const OfxPointD& rs,
-                    Results *results)
-    {
-        // set the images
-        processor.setDstImg( const_cast<Image*>(srcImg) ); // not a bug: we only set dst
-
-        // set the render window
-        processor.setRenderWindow(analysisWindow, rs);
-
-        // Call the base class process member, this will call the derived templated process code
-        processor.process();
-
-        if ( !abort() ) {
-            processor.getResults(results);
-        }
-    }
-
-    // update image statistics
-    void
-    update(const Image* srcImg,
-           double time,
-           const OfxRectI &analysisWindow,
-           const OfxPointD& renderScale)
-    {
-        // TODO: CHECK if checkDoubleAnalysis param is true and analysisWindow is the same as btmLeft/sizeAnalysis
-        Results results;
-
-        if ( !abort() ) {
-            updateSub<HistogramProcessor>(srcImg, time, analysisWindow, renderScale, &results);
-        }
-        {
-            AutoMutex l (&_histogramMutex);
-            _histogram = results; // uses default copy constructor
-        }
-    }
-
-    template <template<class PIX, int nComponents, int maxValue> class Processor, class PIX, int nComponents, int maxValue>
-    void updateSubComponentsDepth(const Image* srcImg,
-                                  double time,
-                                  const OfxRectI &analysisWindow,
-                                  const OfxPointD& renderScale,
-                                  Results* results)
-    {
-        double rangemin, rangemax;
-        _range->getValueAtTime(time, rangemin, rangemax);
-        bool premult;
-        int premultChannel;
-        _premult->getValueAtTime(time, premult);
-        _premultChannel->getValueAtTime(time, premultChannel);
-        Processor<PIX, nComponents, maxValue> fred(*this, rangemin, rangemax, premult, premultChannel);
-        setupAndProcess(fred, srcImg, analysisWindow, renderScale, results);
-    }
-
-    template <template<class PIX, int nComponents, int maxValue> class Processor, int nComponents>
-    void updateSubComponents(const Image* srcImg,
-                             double time,
-                             const OfxRectI &analysisWindow,
-                             const OfxPointD& renderScale,
-                             Results* results)
-    {
-        BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
-
-        switch (srcBitDepth) {
-            case eBitDepthUByte: {
-                updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, renderScale, results);
-                break;
-            }
-            case eBitDepthUShort: {
-                updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, renderScale, results);
-                break;
-            }
-            case eBitDepthFloat: {
-                updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, renderScale, results);
-                break;
-            }
-            default:
-                throwSuiteStatusException(kOfxStatErrUnsupported);
-        }
-    }
-
-    template <template<class PIX, int nComponents, int maxValue> class Processor>
-    void updateSub(const Image* srcImg,
-                   double time,
-                   const OfxRectI &analysisWindow,
-                   const OfxPointD& renderScale,
-                   Results* results)
-    {
-        PixelComponentEnum srcComponents  = srcImg->getPixelComponents();
-
-        assert(srcComponents == ePixelComponentAlpha || srcComponents == ePixelComponentRGB || srcComponents == ePixelComponentRGBA);
-        if (srcComponents == ePixelComponentAlpha) {
-            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, renderScale, results);
-        } else if (srcComponents == ePixelComponentRGBA) {
-            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, renderScale, results);
-        } else if (srcComponents == ePixelComponentRGB) {
-            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, renderScale, results);
-        } else {
-            // coverity[dead_error_line]
-            throwSuiteStatusException(kOfxStatErrUnsupported);
-        }
-    }
-
-
 private:
     Clip *_dstClip;
     Clip *_srcClip;
@@ -1111,6 +891,7 @@ private:
     BooleanParam* _premultChanged; // set to true the first time the user connects src
     Mutex _histogramMutex; //< this is used so we can multi-thread the analysis and protect the shared results
     Results _histogram;
+    HistogramCache _histogramCache; // results of the last histogram computation at each frame
 };
 
 void
@@ -1366,20 +1147,63 @@ ColorLookupPlugin::changedClip(const InstanceChangedArgs &args,
 void
 ColorLookupPlugin::updateHistogram(const InstanceChangedArgs &args)
 {
+    const double time = args.time;
     auto_ptr<Image> src( ( _srcClip && _srcClip->isConnected() ) ?
-                             _srcClip->fetchImage(args.time) : 0 );
-    if ( src.get() ) {
-        checkBadRenderScale(src, args);
+                             _srcClip->fetchImage(time) : 0 );
+    if ( !src.get() ) {
+        return;
+    }
+    checkBadRenderScale(src, args);
+    EditBlock eb(*this, "analyzeFrame");
+    bool doMasking = ( ( !_maskApply || _maskApply->getValueAtTime(time) ) && _maskClip && _maskClip->isConnected() );
+    auto_ptr<const Image> mask(doMasking ? _maskClip->fetchImage(time) : 0);
+    bool maskInvert = false;
+    if (doMasking) {
+        _maskInvert->getValueAtTime(time, maskInvert);
+    }
+    // histogram of the unpremultiplied RGB values
+    HistogramSettings settings;
+    _premult->getValueAtTime(time, settings.premult);
+    _premultChannel->getValueAtTime(time, settings.premultChannel);
+    settings.bins = HISTOGRAM_BINS;
+    settings.components = 3;
+    settings.samples = HISTOGRAM_SAMPLES;
+    _range->getValueAtTime(time, settings.rangemin, settings.rangemax); // if the range is empty, the input range is used
+    const OfxRectI& analysisWindow = src->getBounds();
+    HistogramResults histogram;
+    if ( !_histogramCache.get(time, src.get(), mask.get(), maskInvert, analysisWindow, settings, &histogram) ) {
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
 #     endif
-        EditBlock eb(*this, "analyzeFrame");
-        update(src.get(), args.time, src->getBounds(), args.renderScale);
+        bool analyzed = analyzeHistogram(*this, src.get(), mask.get(), maskInvert, analysisWindow, args.renderScale, settings, &histogram);
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
 #     endif
+        if (!analyzed) {
+            return;
+        }
+        _histogramCache.set(time, src.get(), mask.get(), maskInvert, analysisWindow, settings, histogram);
+    }
+
+    Results results;
+    results.rangemin = histogram.rangemin;
+    results.rangemax = histogram.rangemax;
+    results.histogram = histogram.histogram;
+    results.bins = histogram.bins;
+    results.components = histogram.components;
+    // compute the max, excluding the first and last bins
+    unsigned long hmax = 0;
+    for (int c = 0; c < results.components; ++c) {
+        for (int i = 1; i < results.bins - 1; ++i) {
+            hmax = (std::max)(hmax, results.histogram[c * results.bins + i]);
+        }
     }
-}
+    results.hmax = hmax;
+    {
+        AutoMutex l (&_histogramMutex);
+        _histogram = results; // uses default copy constructor
+    }
+} // ColorLookupPlugin::updateHistogram
 
 void
 ColorLookupPlugin::changedParam(const InstanceChangedArgs &args,
@@ -1603,7 +1427,7 @@ public:
                 effect->getHistogram(&histogram); // copy the histogram
             }
             if (histogram.hmax > 0 && histogram.rangemin < histogram.rangemax && !histogram.histogram.empty()) {
-                double binSize = (histogram.rangemax - histogram.rangemin) / HISTOGRAM_BINS;
+                double binSize = (histogram.rangemax - histogram.rangemin) / histogram.bins;
                 glEnable(GL_BLEND);
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
                 if (glBlendEquationSeparate) {
@@ -1616,7 +1440,7 @@ public:
                 glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
                 glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ONE, GL_ONE);
 #endif
-                for (int c = 0; c < 3; ++c) {
+                for (int c = 0; c < histogram.components; ++c) {
                     glBegin(GL_QUADS);
                     // use three colors with equal luminance (0.33), so that the blue is visible and their sum is white
                     // we divide by two to get 50% white.
@@ -1631,10 +1455,10 @@ public:
                             glColor3f(0.288480472595996f/2, 0.288480472595996f/2, 0.835466579148890f/2);
                             break;
                     }
-                    for (unsigned int i = 0; i < HISTOGRAM_BINS; ++i) {
+                    for (int i = 0; i < histogram.bins; ++i) {
                         double binMinX = histogram.rangemin + i * binSize;
                         double binMaxX = binMinX + binSize;
-                        double binY = histogram.histogram[c* HISTOGRAM_BINS + i] / (double)histogram.hmax;
+                        double binY = histogram.histogram[c * histogram.bins + i] / (double)histogram.hmax;
                         glVertex2d(binMinX, 0);
                         glVertex2d(binMinX, binY);
                         glVertex2d(binMaxX, binY);
@@ -306,6 +306,7 @@ private:
 
     /* Override the render */
     virtual void render(const RenderArguments &args) OVERRIDE FINAL;
+    virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime, int& view, std::string& plane) OVERRIDE FINAL;
 
     /** @brief The sync private data action, called when the effect needs to sync any private data to persistent parameters */
     virtual void syncPrivateData(void) OVERRIDE FINAL
@@ -626,6 +627,60 @@ CropPlugin::render(const RenderArguments &args)
     }
 }
 
+// overridden is identity
+// Inside the crop rectangle (and away from the soft edges and the black border),
+// the output is exactly the source, so the host can use the source image
+// instead of having us copy it.
+bool
+CropPlugin::isIdentity(const IsIdentityArguments &args,
+                       Clip * &identityClip,
+                       double & /*identityTime*/
+                       , int& /*view*/, std::string& /*plane*/)
+{
+    if ( !_srcClip || !_srcClip->isConnected() ) {
+        return false;
+    }
+    // In Sony Catalyst Edit, clipGetRegionOfDefinition returns the RoD in pixels instead of canonical coordinates.
+    if ( !getImageEffectHostDescription()->supportsMultiResolution ) {
+        return false;
+    }
+    const double time = args.time;
+    if ( _reformat->getValueAtTime(time) ) {
+        // the image is translated
+        return false;
+    }
+
+    // the crop rectangle, intersected with the source RoD (outside of the source RoD, render() extends the edges)
+    OfxRectD cropRect;
+    double par;
+    getCropRectangle(time, args.renderScale, /*useIntersect=*/ true, /*forceIntersect=*/ true, /*useBlackOutside=*/ false, /*useReformat=*/ false, &cropRect, &par);
+    double softness = _softness->getValueAtTime(time);
+    if (softness > 0.) {
+        cropRect.x1 += softness;
+        cropRect.y1 += softness;
+        cropRect.x2 -= softness;
+        cropRect.y2 -= softness;
+    }
+    if ( Coords::rectIsEmpty(cropRect) ) {
+        return false;
+    }
+    OfxRectI cropRectPixel;
+    Coords::toPixelNearest(cropRect, args.renderScale, par, &cropRectPixel);
+    // remove one pixel on each side: this is where the black border is drawn, and it also covers rounding issues
+    cropRectPixel.x1 += 1;
+    cropRectPixel.y1 += 1;
+    cropRectPixel.x2 -= 1;
+    cropRectPixel.y2 -= 1;
+    if ( (args.renderWindow.x1 >= cropRectPixel.x1) && (args.renderWindow.x2 <= cropRectPixel.x2) &&
+         ( args.renderWindow.y1 >= cropRectPixel.y1) && ( args.renderWindow.y2 <= cropRectPixel.y2) ) {
+        identityClip = _srcClip;
+
+        return true;
+    }
+
+    return false;
+} // CropPlugin::isIdentity
+
 void
 CropPlugin::updateParamsVisibility()
 {
@@ -23,14 +23,45 @@
 
 #include <cstring> // for memcpy
 #include <cmath>
+#include <cstddef> // for ptrdiff_t
+#include <cassert>
 #include <algorithm>
+#include <list>
+#include <vector>
+
+// The yadif line filter is vectorized with AVX2 if the compiler targets it
+// (e.g. -mavx2), else with SSE2, which is always available on x86-64.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DEINTERLACE_SIMD 2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DEINTERLACE_SIMD 1
+#endif
 
 #include "ofxsImageEffect.h"
 #include "ofxsThreadSuite.h"
 #include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
+#include "ofxsCoords.h"
+#include "ofxsCopier.h"
 #include "ofxsMacros.h"
 
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -49,10 +80,14 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "- Yadif: Interpolator (Yet Another DeInterlacing Filter) from MPlayer by Michael Niedermayer (http://www.mplayerhq.hu). It checks pixels of previous, current and next frames to re-create the missed field by some local adaptive method (edge-directed interpolation) and uses spatial check to prevent most artifacts." \
 
 #define kPluginIdentifier    "net.sf.openfx.Deinterlace"
+// History:
+// version 1.0: initial version
+// version 1.1: tiles, multithreaded and vectorized yadif
+// version 1.2: reuse the source frames between the renders of a sequence
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 0
 #define kSupportsRenderScale 1 // are images still fielded at any renderscale?
 #define kSupportsMultipleClipPARs false
@@ -123,11 +158,307 @@ enum YadifModeEnum
     eYadifModeTemporal,
 };
 
+#define kFrameCacheSize 3 // the previous, current and next frames
+
+inline int
+getPixelBytes(PixelComponentEnum components,
+              BitDepthEnum depth)
+{
+    int pixelBytes;
+
+    switch (components) {
+    case ePixelComponentRGBA:
+        pixelBytes = 4;
+        break;
+    case ePixelComponentRGB:
+        pixelBytes = 3;
+        break;
+#ifdef OFX_EXTENSIONS_NATRON
+    case ePixelComponentXY:
+        pixelBytes = 2;
+        break;
+#endif
+    case ePixelComponentAlpha:
+        pixelBytes = 1;
+        break;
+    default:
+
+        return 0;
+    }
+    switch (depth) {
+    case eBitDepthUByte:
+        break;
+    case eBitDepthUShort:
+        pixelBytes *= 2;
+        break;
+    case eBitDepthFloat:
+        pixelBytes *= 4;
+        break;
+    default:
+
+        return 0;
+    }
+
+    return pixelBytes;
+}
+
+// The pixels of a source frame: either a fetched image, or a copy kept in the FrameCache.
+struct SourceFrame
+{
+    const unsigned char *data; // address of the pixel at (bounds.x1, bounds.y1)
+    OfxRectI bounds;
+    int rowBytes; // may be negative, @see kOfxImagePropRowBytes
+    int pixelBytes;
+
+    SourceFrame()
+        : data(NULL)
+        , rowBytes(0)
+        , pixelBytes(0)
+    {
+        bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+    }
+
+    explicit SourceFrame(const Image *img)
+        : data( (const unsigned char *)img->getPixelData() )
+        , bounds( img->getBounds() )
+        , rowBytes( img->getRowBytes() )
+        , pixelBytes( getPixelBytes( img->getPixelComponents(), img->getPixelDepth() ) )
+    {
+    }
+
+    const void * getPixelAddress(int x,
+                                 int y) const
+    {
+        if ( (x < bounds.x1) || (x >= bounds.x2) || (y < bounds.y1) || (y >= bounds.y2) ) {
+            return NULL;
+        }
+
+        return data + (ptrdiff_t)(y - bounds.y1) * rowBytes + (ptrdiff_t)(x - bounds.x1) * pixelBytes;
+    }
+};
+
+// A copy of a source frame, kept across renders by FrameCache.
+// OFX images cannot be held after the render action returns, so the pixels are copied.
+struct CachedFrame
+{
+    double time;
+    int view;
+    OfxPointD renderScale;
+    BitDepthEnum depth;
+    PixelComponentEnum components;
+    std::vector<unsigned char> pixels;
+    SourceFrame frame; // points to pixels
+    int users; // number of renders using this frame (protected by the cache mutex)
+    bool stale; // the frame was removed from the cache while in use, and will be deleted when released
+};
+
+// Instance-level cache of the last source frames.
+// Each render reads three consecutive source frames, so that when rendering a
+// sequence, two of them were already fetched by the render of the previous frame.
+// Frames are identified by their time and view, since the views of a stereo render
+// are rendered in turn.
+class FrameCache
+{
+public:
+    FrameCache()
+        : _mutex()
+        , _frames()
+    {
+    }
+
+    ~FrameCache()
+    {
+        for (FramesList::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            assert( (*it)->users == 0 );
+            delete *it;
+        }
+    }
+
+    // remove all frames (e.g. because the input changed)
+    void clear()
+    {
+        AutoMutex guard(&_mutex);
+
+        for (FramesList::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            (*it)->stale = true;
+        }
+        evict();
+    }
+
+    // return the cached frame at time and view which contains window, or NULL. The frame must be released.
+    const CachedFrame* acquire(double time,
+                               int view,
+                               const OfxPointD &renderScale,
+                               BitDepthEnum depth,
+                               PixelComponentEnum components,
+                               const OfxRectI &window)
+    {
+        AutoMutex guard(&_mutex);
+
+        for (FramesList::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            CachedFrame *f = *it;
+            const OfxRectI &bounds = f->frame.bounds;
+            if ( !f->stale && (f->time == time) && (f->view == view) &&
+                 (f->renderScale.x == renderScale.x) && (f->renderScale.y == renderScale.y) &&
+                 (f->depth == depth) && (f->components == components) &&
+                 (bounds.x1 <= window.x1) && (window.x2 <= bounds.x2) &&
+                 (bounds.y1 <= window.y1) && (window.y2 <= bounds.y2) ) {
+                ++f->users;
+                // most recently used frames are at the front of the list
+                _frames.splice(_frames.begin(), _frames, it);
+
+                return f;
+            }
+        }
+
+        return NULL;
+    }
+
+    // copy img into the cache, and return the cached frame, or NULL if its format is not supported.
+    // The frame must be released.
+    const CachedFrame* insert(double time,
+                              int view,
+                              const OfxPointD &renderScale,
+                              const Image *img)
+    {
+        const int pixelBytes = getPixelBytes( img->getPixelComponents(), img->getPixelDepth() );
+
+        if (pixelBytes == 0) {
+            return NULL;
+        }
+        const OfxRectI &bounds = img->getBounds();
+        const size_t rowBytes = (size_t)(bounds.x2 - bounds.x1) * pixelBytes;
+
+        // copy the pixels without holding the lock
+        auto_ptr<CachedFrame> f(new CachedFrame);
+        f->time = time;
+        f->view = view;
+        f->renderScale = renderScale;
+        f->depth = img->getPixelDepth();
+        f->components = img->getPixelComponents();
+        f->pixels.resize( rowBytes * (bounds.y2 - bounds.y1) );
+        for (int y = bounds.y1; y < bounds.y2; ++y) {
+            const unsigned char *srcPix = (const unsigned char *)img->getPixelAddress(bounds.x1, y);
+            assert(srcPix);
+            std::copy(srcPix, srcPix + rowBytes, &f->pixels[(y - bounds.y1) * rowBytes]);
+        }
+        f->frame.data = f->pixels.empty() ? NULL : &f->pixels[0];
+        f->frame.bounds = bounds;
+        f->frame.rowBytes = (int)rowBytes;
+        f->frame.pixelBytes = pixelBytes;
+        f->users = 1;
+        f->stale = false;
+
+        AutoMutex guard(&_mutex);
+        _frames.push_front( f.get() );
+        evict();
+
+        return f.release();
+    }
+
+    void release(const CachedFrame *frame)
+    {
+        AutoMutex guard(&_mutex);
+        CachedFrame *f = const_cast<CachedFrame *>(frame);
+
+        assert(f->users > 0);
+        --f->users;
+        if (f->users == 0) {
+            evict();
+        }
+    }
+
+private:
+    // remove stale frames which are not used anymore, and the least recently used frames
+    // until at most kFrameCacheSize frames are left. Frames in use are never removed.
+    // must be called with the mutex locked
+    void evict()
+    {
+        FramesList::iterator it = _frames.end();
+        while ( it != _frames.begin() ) {
+            --it;
+            CachedFrame *f = *it;
+            if (f->users > 0) {
+                continue;
+            }
+            if ( f->stale || (_frames.size() > kFrameCacheSize) ) {
+                it = _frames.erase(it);
+                delete f;
+            }
+        }
+    }
+
+    typedef std::list<CachedFrame *> FramesList;
+    Mutex _mutex;
+    FramesList _frames; // most recently used first
+};
+
+// Holds a source frame for the duration of a render: either a fetched image or a frame of the FrameCache.
+class SourceFrameHolder
+{
+public:
+    SourceFrameHolder()
+        : _img()
+        , _cache(NULL)
+        , _cached(NULL)
+        , _frame()
+        , _valid(false)
+    {
+    }
+
+    ~SourceFrameHolder()
+    {
+        reset();
+    }
+
+    void setImage(const Image *img)
+    {
+        reset();
+        _img.reset(img);
+        _frame = SourceFrame(img);
+        _valid = true;
+    }
+
+    void setCached(FrameCache *cache,
+                   const CachedFrame *f)
+    {
+        reset();
+        _cache = cache;
+        _cached = f;
+        _frame = f->frame;
+        _valid = true;
+    }
+
+    void reset()
+    {
+        if (_cached) {
+            _cache->release(_cached);
+            _cached = NULL;
+        }
+        _img.reset(0);
+        _frame = SourceFrame();
+        _valid = false;
+    }
+
+    // NULL if there is no frame
+    const SourceFrame* get() const
+    {
+        return _valid ? &_frame : NULL;
+    }
+
+private:
+    auto_ptr<const Image> _img;
+    FrameCache *_cache;
+    const CachedFrame *_cached;
+    SourceFrame _frame;
+    bool _valid;
+};
+
 class DeinterlacePlugin
     : public ImageEffect
 {
 public:
-    DeinterlacePlugin(OfxImageEffectHandle handle) : ImageEffect(handle), _dstClip(NULL), _srcClip(NULL)
+    DeinterlacePlugin(OfxImageEffectHandle handle) : ImageEffect(handle), _dstClip(NULL), _srcClip(NULL), _frameCache()
     {
 
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -153,14 +484,212 @@ private:
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const FramesNeededArguments &args, FramesNeededSetter &frames) OVERRIDE FINAL;
 
+    // override the roi call
+    virtual void getRegionsOfInterest(const RegionsOfInterestArguments &args, RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    /** @brief called when a clip has just been changed in some way (a rewire maybe) */
+    virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    /** @brief the cache is only used between these two actions */
+    virtual void beginSequenceRender(const BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+    virtual void endSequenceRender(const EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    void fetchSourceFrame(const RenderArguments &args, double time, const OfxRectI &window, bool useCache, SourceFrameHolder *frame);
+
 private:
     // do not need to delete these, the ImageEffect is managing them for us
     Clip *_dstClip;
     Clip *_srcClip;
     ChoiceParam *fieldOrder, *mode, *parity;
+    FrameCache _frameCache;
 };
 
 
+#ifdef DEINTERLACE_SIMD
+// SIMD vectors used by filter_line_simd. Integer samples are widened to 32-bit
+// ints, which gives the same results as the scalar code with Diff=int.
+#if DEINTERLACE_SIMD == 2
+struct YadifVecFloat
+{
+    typedef float Comp;
+    typedef __m256 Reg;
+    enum { N = 8 };
+
+    static Reg load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, Reg v) { _mm256_storeu_ps(p, v); }
+    static Reg zero() { return _mm256_setzero_ps(); }
+    static Reg one() { return _mm256_setzero_ps(); } // see one1(float*)
+    static Reg add(Reg a, Reg b) { return _mm256_add_ps(a, b); }
+    static Reg sub(Reg a, Reg b) { return _mm256_sub_ps(a, b); }
+    static Reg min(Reg a, Reg b) { return _mm256_min_ps(a, b); }
+    static Reg max(Reg a, Reg b) { return _mm256_max_ps(a, b); }
+    static Reg abs(Reg a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+    static Reg half(Reg a) { return _mm256_mul_ps( a, _mm256_set1_ps(0.5f) ); }
+    static Reg lt(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Reg eq(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static Reg andm(Reg a, Reg b) { return _mm256_and_ps(a, b); }
+    static Reg sel(Reg m, Reg a, Reg b) { return _mm256_blendv_ps(b, a, m); }
+};
+
+struct YadifVecInt
+{
+    typedef __m256i Reg;
+    enum { N = 8 };
+
+    static Reg zero() { return _mm256_setzero_si256(); }
+    static Reg one() { return _mm256_set1_epi32(1); }
+    static Reg add(Reg a, Reg b) { return _mm256_add_epi32(a, b); }
+    static Reg sub(Reg a, Reg b) { return _mm256_sub_epi32(a, b); }
+    static Reg min(Reg a, Reg b) { return _mm256_min_epi32(a, b); }
+    static Reg max(Reg a, Reg b) { return _mm256_max_epi32(a, b); }
+    static Reg abs(Reg a) { return _mm256_abs_epi32(a); }
+    static Reg half(Reg a) { return _mm256_srai_epi32(a, 1); }
+    static Reg lt(Reg a, Reg b) { return _mm256_cmpgt_epi32(b, a); }
+    static Reg eq(Reg a, Reg b) { return _mm256_cmpeq_epi32(a, b); }
+    static Reg andm(Reg a, Reg b) { return _mm256_and_si256(a, b); }
+    static Reg sel(Reg m, Reg a, Reg b) { return _mm256_blendv_epi8(b, a, m); }
+};
+
+struct YadifVecUByte
+    : public YadifVecInt
+{
+    typedef unsigned char Comp;
+
+    static Reg load(const unsigned char *p) { return _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)p ) ); }
+    static void store(unsigned char *p, Reg v)
+    {
+        __m128i w = _mm_packus_epi32( _mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1) );
+
+        _mm_storel_epi64( (__m128i*)p, _mm_packus_epi16(w, w) );
+    }
+};
+
+struct YadifVecUShort
+    : public YadifVecInt
+{
+    typedef unsigned short Comp;
+
+    static Reg load(const unsigned short *p) { return _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i*)p ) ); }
+    static void store(unsigned short *p, Reg v)
+    {
+        _mm_storeu_si128( (__m128i*)p, _mm_packus_epi32( _mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1) ) );
+    }
+};
+
+#else // DEINTERLACE_SIMD == 1
+struct YadifVecFloat
+{
+    typedef float Comp;
+    typedef __m128 Reg;
+    enum { N = 4 };
+
+    static Reg load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, Reg v) { _mm_storeu_ps(p, v); }
+    static Reg zero() { return _mm_setzero_ps(); }
+    static Reg one() { return _mm_setzero_ps(); } // see one1(float*)
+    static Reg add(Reg a, Reg b) { return _mm_add_ps(a, b); }
+    static Reg sub(Reg a, Reg b) { return _mm_sub_ps(a, b); }
+    static Reg min(Reg a, Reg b) { return _mm_min_ps(a, b); }
+    static Reg max(Reg a, Reg b) { return _mm_max_ps(a, b); }
+    static Reg abs(Reg a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+    static Reg half(Reg a) { return _mm_mul_ps( a, _mm_set1_ps(0.5f) ); }
+    static Reg lt(Reg a, Reg b) { return _mm_cmplt_ps(a, b); }
+    static Reg eq(Reg a, Reg b) { return _mm_cmpeq_ps(a, b); }
+    static Reg andm(Reg a, Reg b) { return _mm_and_ps(a, b); }
+    static Reg sel(Reg m, Reg a, Reg b) { return _mm_or_ps( _mm_and_ps(m, a), _mm_andnot_ps(m, b) ); }
+};
+
+// SSE2 has no 32-bit min, max and abs: they are built from compares.
+struct YadifVecInt
+{
+    typedef __m128i Reg;
+    enum { N = 4 };
+
+    static Reg zero() { return _mm_setzero_si128(); }
+    static Reg one() { return _mm_set1_epi32(1); }
+    static Reg add(Reg a, Reg b) { return _mm_add_epi32(a, b); }
+    static Reg sub(Reg a, Reg b) { return _mm_sub_epi32(a, b); }
+    static Reg min(Reg a, Reg b) { return sel(lt(a, b), a, b); }
+    static Reg max(Reg a, Reg b) { return sel(lt(a, b), b, a); }
+    static Reg abs(Reg a)
+    {
+        Reg s = _mm_srai_epi32(a, 31);
+
+        return _mm_sub_epi32(_mm_xor_si128(a, s), s);
+    }
+
+    static Reg half(Reg a) { return _mm_srai_epi32(a, 1); }
+    static Reg lt(Reg a, Reg b) { return _mm_cmplt_epi32(a, b); }
+    static Reg eq(Reg a, Reg b) { return _mm_cmpeq_epi32(a, b); }
+    static Reg andm(Reg a, Reg b) { return _mm_and_si128(a, b); }
+    static Reg sel(Reg m, Reg a, Reg b) { return _mm_or_si128( _mm_and_si128(m, a), _mm_andnot_si128(m, b) ); }
+};
+
+struct YadifVecUByte
+    : public YadifVecInt
+{
+    typedef unsigned char Comp;
+
+    static Reg load(const unsigned char *p)
+    {
+        int v;
+
+        std::memcpy(&v, p, sizeof(v));
+        const __m128i z = _mm_setzero_si128();
+
+        return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), z), z);
+    }
+
+    static void store(unsigned char *p, Reg v)
+    {
+        __m128i w = _mm_packs_epi32(v, v);
+        int r = _mm_cvtsi128_si32( _mm_packus_epi16(w, w) );
+
+        std::memcpy(p, &r, sizeof(r));
+    }
+};
+
+struct YadifVecUShort
+    : public YadifVecInt
+{
+    typedef unsigned short Comp;
+
+    static Reg load(const unsigned short *p) { return _mm_unpacklo_epi16( _mm_loadl_epi64( (const __m128i*)p ), _mm_setzero_si128() ); }
+    static void store(unsigned short *p, Reg v)
+    {
+        // there is no unsigned 32->16 bit pack in SSE2: bias to the signed range, pack, and unbias
+        __m128i w = _mm_packs_epi32( _mm_sub_epi32( v, _mm_set1_epi32(32768) ), _mm_setzero_si128() );
+
+        _mm_storel_epi64( (__m128i*)p, _mm_xor_si128( w, _mm_set1_epi16( (short)0x8000 ) ) );
+    }
+};
+
+#endif // DEINTERLACE_SIMD == 1
+
+template<typename Comp>
+struct YadifVec;
+
+template<>
+struct YadifVec<unsigned char>
+{
+    typedef YadifVecUByte type;
+};
+
+template<>
+struct YadifVec<unsigned short>
+{
+    typedef YadifVecUShort type;
+};
+
+template<>
+struct YadifVec<float>
+{
+    typedef YadifVecFloat type;
+};
+
+#endif // DEINTERLACE_SIMD
+
+
 // =========== GNU Lesser General Public License code start =================
 
 // Yadif (yet another deinterlacing filter)
@@ -217,31 +746,62 @@ one1(unsigned short *) { return 1; }
 inline float
 one1(float *) { return 0.f; }
 
+// Row pointers used to interpolate one line of the missing field.
+// The original filter addresses the lines above and below with a single stride
+// (mrefs/prefs) shared by the three frames, which only works if the three images
+// have the same layout. With tiles, each frame may come with its own bounds and
+// row bytes, so every line is addressed separately. All pointers point to the
+// first component of the first pixel of the segment.
+template<typename Comp>
+struct YadifLine
+{
+    const Comp *prevm, *prevp; // previous frame, lines y-1 and y+1 (mirrored at the frame edges)
+    const Comp *curm, *curp; // current frame, lines y-1 and y+1
+    const Comp *nextm, *nextp; // next frame, lines y-1 and y+1
+    const Comp *prev2, *next2; // line y of the frames of the same field
+    const Comp *prev2mm, *next2mm; // lines y-2 of the frames of the same field (only if !(mode & 2))
+    const Comp *prev2pp, *next2pp; // lines y+2 of the frames of the same field (only if !(mode & 2))
+
+    void offset(int n)
+    {
+        prevm += n; prevp += n;
+        curm += n; curp += n;
+        nextm += n; nextp += n;
+        prev2 += n; next2 += n;
+        if (prev2mm) {
+            prev2mm += n; next2mm += n;
+            prev2pp += n; next2pp += n;
+        }
+    }
+};
+
 #define CHECK(j) \
-    {   Diff score = FFABS(cur[mrefs + ch * ( -1 + (j) )] - cur[prefs + ch * ( -1 - (j) )]) \
-                     + FFABS(cur[mrefs   + ch * (j)] - cur[prefs   - ch * (j)]) \
-                     + FFABS(cur[mrefs + ch * ( 1 + (j) )] - cur[prefs + ch * ( 1 - (j) )]); \
+    {   Diff score = FFABS(curm[x + ch * ( -1 + (j) )] - curp[x + ch * ( -1 - (j) )]) \
+                     + FFABS(curm[x   + ch * (j)] - curp[x   - ch * (j)]) \
+                     + FFABS(curm[x + ch * ( 1 + (j) )] - curp[x + ch * ( 1 - (j) )]); \
         if (score < spatial_score) { \
             spatial_score = score; \
-            spatial_pred = halven(cur[mrefs  + ch * (j)] + cur[prefs  - ch * (j)]); \
+            spatial_pred = halven(curm[x  + ch * (j)] + curp[x  - ch * (j)]); \
 
 /* The is_not_edge argument here controls when the code will enter a branch
- * which reads up to and including x-3 and x+3. */
+ * which reads up to and including x-3 and x+3.
+ * Components are interleaved, so that x runs over all the components of the
+ * line, and the horizontal neighbours of a sample are ch samples away. */
 
 #define FILTER(start, end, is_not_edge) \
     for (x = start; x < end; x++) { \
-        Diff c = cur[mrefs]; \
-        Diff d = halven(prev2[0] + next2[0]); \
-        Diff e = cur[prefs]; \
-        Diff temporal_diff0 = FFABS(prev2[0] - next2[0]); \
-        Diff temporal_diff1 = halven( FFABS(prev[mrefs] - c) + FFABS(prev[prefs] - e) ); \
-        Diff temporal_diff2 = halven( FFABS(next[mrefs] - c) + FFABS(next[prefs] - e) ); \
+        Diff c = curm[x]; \
+        Diff d = halven(prev2[x] + next2[x]); \
+        Diff e = curp[x]; \
+        Diff temporal_diff0 = FFABS(prev2[x] - next2[x]); \
+        Diff temporal_diff1 = halven( FFABS(prevm[x] - c) + FFABS(prevp[x] - e) ); \
+        Diff temporal_diff2 = halven( FFABS(nextm[x] - c) + FFABS(nextp[x] - e) ); \
         Diff diff = FFMAX3(halven(temporal_diff0), temporal_diff1, temporal_diff2); \
         Diff spatial_pred = halven(c + e); \
  \
         if (is_not_edge) { \
-            Diff spatial_score = FFABS(cur[mrefs - ch] - cur[prefs - ch]) + FFABS(c - e) \
-                                 + FFABS(cur[mrefs + ch] - cur[prefs + ch]) - one1( (Comp*)0 ); \
+            Diff spatial_score = FFABS(curm[x - ch] - curp[x - ch]) + FFABS(c - e) \
+                                 + FFABS(curm[x + ch] - curp[x + ch]) - one1( (Comp*)0 ); \
             CHECK(-1) CHECK(-2) } \
     } \
     } \
@@ -253,8 +813,8 @@ one1(float *) { return 0.f; }
     } \
  \
     if ( !(mode & 2) ) { \
-        Diff b = halven(prev2[2 * mrefs] + next2[2 * mrefs]); \
-        Diff f = halven(prev2[2 * prefs] + next2[2 * prefs]); \
+        Diff b = halven(prev2mm[x] + next2mm[x]); \
+        Diff f = halven(prev2pp[x] + next2pp[x]); \
         Diff max = FFMAX3( d - e, d - c, FFMIN(b - c, f - e) ); \
         Diff min = FFMIN3( d - e, d - c, FFMAX(b - c, f - e) ); \
  \
@@ -266,174 +826,356 @@ one1(float *) { return 0.f; }
     else if (spatial_pred < d - diff) { \
         spatial_pred = d - diff; } \
  \
-    dst[0] = (Comp)spatial_pred; \
- \
-    dst += ch; \
-    cur += ch; \
-    prev += ch; \
-    next += ch; \
-    prev2 += ch; \
-    next2 += ch; \
+    dst[x] = (Comp)spatial_pred; \
     }
 
+// Process w samples (w/ch pixels) of a line. The line must have 3 valid pixels on each side.
 template<int ch, typename Comp, typename Diff>
 inline void
-filter_line_c(Comp *dst1,
-              const Comp *prev1,
-              const Comp *cur1,
-              const Comp *next1,
+filter_line_c(Comp *dst,
+              const YadifLine<Comp> &l,
+              int start,
               int w,
-              int prefs,
-              int mrefs,
-              int parity,
               int mode)
 {
-    Comp *dst  = dst1;
-    const Comp *prev = prev1;
-    const Comp *cur  = cur1;
-    const Comp *next = next1;
+    const Comp *prevm = l.prevm, *prevp = l.prevp;
+    const Comp *curm = l.curm, *curp = l.curp;
+    const Comp *nextm = l.nextm, *nextp = l.nextp;
+    const Comp *prev2 = l.prev2, *next2 = l.next2;
+    const Comp *prev2mm = l.prev2mm, *next2mm = l.next2mm;
+    const Comp *prev2pp = l.prev2pp, *next2pp = l.next2pp;
     int x;
-    const Comp *prev2 = parity ? prev : cur;
-    const Comp *next2 = parity ? cur  : next;
-
-    /* The function is called with the pointers already pointing to data[3] and
-     * with 6 subtracted from the width.  This allows the FILTER macro to be
-     * called so that it processes all the pixels normally.  A constant value of
-     * true for is_not_edge lets the compiler ignore the if statement. */
-    FILTER(0, w, 1)
+
+    /* A constant value of true for is_not_edge lets the compiler ignore the if
+     * statement. */
+    FILTER(start, w, 1)
 }
 
-#define MAX_ALIGN 8
 template<int ch, typename Comp, typename Diff>
 inline void
-filter_edges(Comp *dst1,
-             const Comp *prev1,
-             const Comp *cur1,
-             const Comp *next1,
+filter_edges(Comp *dst,
+             const YadifLine<Comp> &l,
              int w,
-             int prefs,
-             int mrefs,
-             int parity,
              int mode)
 {
-    Comp *dst  = dst1;
-    const Comp *prev = prev1;
-    const Comp *cur  = cur1;
-    const Comp *next = next1;
+    const Comp *prevm = l.prevm, *prevp = l.prevp;
+    const Comp *curm = l.curm, *curp = l.curp;
+    const Comp *nextm = l.nextm, *nextp = l.nextp;
+    const Comp *prev2 = l.prev2, *next2 = l.next2;
+    const Comp *prev2mm = l.prev2mm, *next2mm = l.next2mm;
+    const Comp *prev2pp = l.prev2pp, *next2pp = l.next2pp;
     int x;
-    const Comp *prev2 = parity ? prev : cur;
-    const Comp *next2 = parity ? cur  : next;
 
     /* Only edge pixels need to be processed here.  A constant value of false
      * for is_not_edge should let the compiler ignore the whole branch. */
-    FILTER(0, 3, 0)
+    FILTER(0, w, 0)
+}
+
+#undef FILTER
+#undef CHECK
+
+#ifdef DEINTERLACE_SIMD
 
-    dst  = dst1  + (w - 3) * ch;
-    prev = prev1 + (w - 3) * ch;
-    cur  = cur1  + (w - 3) * ch;
-    next = next1 + (w - 3) * ch;
-    prev2 = parity ? prev : cur;
-    next2 = parity ? cur  : next;
+// Vectorized version of FILTER(0, w, 1), written as a branchless sequence:
+// the nested CHECKs become masked selects. V is one of the YadifVec* structs
+// above, and processes V::N samples at a time.
 
-    FILTER(w - 3, w, 0)
+// spatial score of the direction j, as in CHECK(j)
+template<int ch, class V, int j>
+inline typename V::Reg
+yadifScore(const typename V::Comp *curm,
+           const typename V::Comp *curp)
+{
+    return V::add( V::add( V::abs( V::sub( V::load(curm + ch * (-1 + j) ), V::load(curp + ch * (-1 - j) ) ) ),
+                           V::abs( V::sub( V::load(curm + ch * j), V::load(curp - ch * j) ) ) ),
+                   V::abs( V::sub( V::load(curm + ch * (1 + j) ), V::load(curp + ch * (1 - j) ) ) ) );
 }
 
-#if 0
+// CHECK(j) on the lanes selected by *better
+template<int ch, class V, int j>
 inline void
-interpolate(unsigned char *dst,
-            const unsigned char *cur0,
-            const unsigned char *cur2,
-            int w)
+yadifCheck(const typename V::Comp *curm,
+           const typename V::Comp *curp,
+           typename V::Reg *spatial_score,
+           typename V::Reg *spatial_pred,
+           typename V::Reg *better) // in: lanes where the check is done, out: lanes that were improved
 {
-    int x;
+    typename V::Reg score = yadifScore<ch, V, j>(curm, curp);
+    typename V::Reg m = V::andm( *better, V::lt(score, *spatial_score) );
 
-    for (x = 0; x < w; x++) {
-        dst[x] = (cur0[x] + cur2[x] + 1) >> 1; // simple average
-    }
+    *spatial_score = V::sel(m, score, *spatial_score);
+    *spatial_pred = V::sel( m, V::half( V::add( V::load(curm + ch * j), V::load(curp - ch * j) ) ), *spatial_pred );
+    *better = m;
 }
 
-inline void
-interpolate(float *dst,
-            const float *cur0,
-            const float *cur2,
-            int w)
+// Returns the number of samples processed, the remaining ones must be processed by filter_line_c.
+template<int ch, class V>
+inline int
+filter_line_simd(typename V::Comp *dst,
+                 const YadifLine<typename V::Comp> &l,
+                 int w,
+                 int mode)
 {
-    int x;
+    typedef typename V::Reg Reg;
+    const bool spatialCheck = !(mode & 2);
+    const Reg allOnes = V::eq( V::zero(), V::zero() );
+    int x = 0;
+
+    for (; x + V::N <= w; x += V::N) {
+        Reg c = V::load(l.curm + x);
+        Reg p2 = V::load(l.prev2 + x);
+        Reg n2 = V::load(l.next2 + x);
+        Reg d = V::half( V::add(p2, n2) );
+        Reg e = V::load(l.curp + x);
+        Reg temporal_diff0 = V::abs( V::sub(p2, n2) );
+        Reg temporal_diff1 = V::half( V::add( V::abs( V::sub(V::load(l.prevm + x), c) ), V::abs( V::sub(V::load(l.prevp + x), e) ) ) );
+        Reg temporal_diff2 = V::half( V::add( V::abs( V::sub(V::load(l.nextm + x), c) ), V::abs( V::sub(V::load(l.nextp + x), e) ) ) );
+        Reg diff = V::max( V::max(V::half(temporal_diff0), temporal_diff1), temporal_diff2 );
+        Reg spatial_pred = V::half( V::add(c, e) );
+        Reg spatial_score = V::sub( V::add( V::add( V::abs( V::sub( V::load(l.curm + x - ch), V::load(l.curp + x - ch) ) ),
+                                                    V::abs( V::sub(c, e) ) ),
+                                            V::abs( V::sub( V::load(l.curm + x + ch), V::load(l.curp + x + ch) ) ) ),
+                                    V::one() );
+        Reg better = allOnes;
+        yadifCheck<ch, V, -1>(l.curm + x, l.curp + x, &spatial_score, &spatial_pred, &better);
+        yadifCheck<ch, V, -2>(l.curm + x, l.curp + x, &spatial_score, &spatial_pred, &better);
+        better = allOnes;
+        yadifCheck<ch, V, 1>(l.curm + x, l.curp + x, &spatial_score, &spatial_pred, &better);
+        yadifCheck<ch, V, 2>(l.curm + x, l.curp + x, &spatial_score, &spatial_pred, &better);
+
+        if (spatialCheck) {
+            Reg b = V::half( V::add( V::load(l.prev2mm + x), V::load(l.next2mm + x) ) );
+            Reg f = V::half( V::add( V::load(l.prev2pp + x), V::load(l.next2pp + x) ) );
+            Reg dme = V::sub(d, e);
+            Reg dmc = V::sub(d, c);
+            Reg bmc = V::sub(b, c);
+            Reg fme = V::sub(f, e);
+            Reg max = V::max( V::max(dme, dmc), V::min(bmc, fme) );
+            Reg min = V::min( V::min(dme, dmc), V::max(bmc, fme) );
+
+            diff = V::max( V::max(diff, min), V::sub(V::zero(), max) );
+        }
 
-    for (x = 0; x < w; x++) {
-        dst[x] = (cur0[x] + cur2[x] ) * 0.5f; // simple average
+        // diff >= 0, so that the clamp below is equivalent to the original if/else
+        spatial_pred = V::max( V::min( spatial_pred, V::add(d, diff) ), V::sub(d, diff) );
+        V::store(dst + x, spatial_pred);
     }
-}
 
-#endif
+    return x;
+} // filter_line_simd
+
+#endif // DEINTERLACE_SIMD
+
+// =========== GNU Lesser General Public License code end =================
+
+class YadifProcessorBase
+    : public ImageProcessor
+{
+protected:
+    const SourceFrame *_prevImg;
+    const SourceFrame *_curImg;
+    const SourceFrame *_nextImg;
+    OfxRectI _frame; // the source frame, in pixels: field parity and edges are relative to it, not to the render window
+    int _mode;
+    int _parity; // the field to interpolate
+    int _fieldParity; // parity ^ tff: which of the previous and next frames belongs to the same field
+
+public:
+    YadifProcessorBase(ImageEffect &instance)
+        : ImageProcessor(instance)
+        , _prevImg(NULL)
+        , _curImg(NULL)
+        , _nextImg(NULL)
+        , _mode(0)
+        , _parity(0)
+        , _fieldParity(0)
+    {
+        _frame.x1 = _frame.y1 = _frame.x2 = _frame.y2 = 0;
+    }
+
+    /** @brief set the source images. The previous and next images must be non-NULL
+       (pass the current image if they are missing), and must contain the render window
+       plus 3 pixels on each side and 2 lines above and below (within the frame). */
+    void setSrcImgs(const SourceFrame *prev,
+                    const SourceFrame *cur,
+                    const SourceFrame *next)
+    {
+        _prevImg = prev;
+        _curImg = cur;
+        _nextImg = next;
+    }
+
+    void setValues(const OfxRectI &frame,
+                   int mode,
+                   int parity,
+                   int tff)
+    {
+        _frame = frame;
+        _mode = mode;
+        _parity = parity;
+        _fieldParity = parity ^ tff;
+    }
+};
+
 
 template<int ch, typename Comp, typename Diff>
-static void
-filter_plane(int mode,
-             Comp *dst,
-             int dst_stride,
-             const Comp *prev0,
-             const Comp *cur0,
-             const Comp *next0,
-             int refs,
-             int w,
-             int h,
-             int parity,
-             int tff)
-{
-    int pix_3 = 3 * ch;
-
-    for (int y = 0; y < h; ++y) {
-        if ( ( (y ^ parity) & 1 ) ) {
-            const Comp *prev = prev0 + y * refs;
-            const Comp *cur = cur0 + y * refs;
-            const Comp *next = next0 + y * refs;
-            Comp *dst2 = dst + y * dst_stride;
-            int mode2 = y == 1 || y + 2 == h ? 2 : mode;
-
-            for (int c = 0; c < ch; ++c) {
-                filter_line_c<ch, Comp, Diff>(dst2 + c + pix_3, prev + c + pix_3, cur + c + pix_3, next + c + pix_3, w - 6,
-                                              y + 1 < h ? refs : -refs,
-                                              y ? -refs : refs,
-                                              parity ^ tff, mode2);
-                filter_edges<ch, Comp, Diff>(dst2 + c, prev + c, cur + c, next + c, w,
-                                             y + 1 < h ? refs : -refs,
-                                             y ? -refs : refs,
-                                             parity ^ tff, mode2);
+class YadifProcessor
+    : public YadifProcessorBase
+{
+public:
+    YadifProcessor(ImageEffect &instance)
+        : YadifProcessorBase(instance)
+    {
+    }
+
+private:
+    static const Comp * getLine(const SourceFrame *img,
+                                int x,
+                                int y)
+    {
+        const Comp *p = (const Comp *)img->getPixelAddress(x, y);
+
+        assert(p);
+
+        return p;
+    }
+
+    void multiThreadProcessImages(const OfxRectI &procWindow,
+                                  const OfxPointD &rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_prevImg && _curImg && _nextImg && _dstImg);
+        const int x1 = procWindow.x1;
+        const int x2 = procWindow.x2;
+        const int h = _frame.y2 - _frame.y1;
+        // [x1,xl) and [xr,x2) are within 3 pixels of the frame edges
+        const int xl = (std::max)( x1, (std::min)(x2, _frame.x1 + 3) );
+        const int xr = (std::min)( x2, (std::max)(xl, _frame.x2 - 3) );
+        const SourceFrame *prev2Img = _fieldParity ? _prevImg : _curImg;
+        const SourceFrame *next2Img = _fieldParity ? _curImg : _nextImg;
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            Comp *dst = (Comp *)_dstImg->getPixelAddress(x1, y);
+            assert(dst);
+            const int yf = y - _frame.y1; // line number in the frame
+            if ( !( (yf ^ _parity) & 1 ) ) {
+                std::memcpy( dst, getLine(_curImg, x1, y), (x2 - x1) * ch * sizeof(Comp) ); // copy original
+                continue;
+            }
+
+            const int ym = yf ? y - 1 : y + 1;
+            const int yp = yf + 1 < h ? y + 1 : y - 1;
+            const int mode = (yf == 1 || yf + 2 == h) ? 2 : _mode;
+            YadifLine<Comp> l;
+            l.prevm = getLine(_prevImg, x1, ym);
+            l.prevp = getLine(_prevImg, x1, yp);
+            l.curm = getLine(_curImg, x1, ym);
+            l.curp = getLine(_curImg, x1, yp);
+            l.nextm = getLine(_nextImg, x1, ym);
+            l.nextp = getLine(_nextImg, x1, yp);
+            l.prev2 = getLine(prev2Img, x1, y);
+            l.next2 = getLine(next2Img, x1, y);
+            if (mode & 2) {
+                l.prev2mm = l.next2mm = l.prev2pp = l.next2pp = NULL;
+            } else {
+                const int ymm = yf ? y - 2 : y + 2;
+                const int ypp = yf + 1 < h ? y + 2 : y - 2;
+                l.prev2mm = getLine(prev2Img, x1, ymm);
+                l.next2mm = getLine(next2Img, x1, ymm);
+                l.prev2pp = getLine(prev2Img, x1, ypp);
+                l.next2pp = getLine(next2Img, x1, ypp);
+            }
+
+            if (x1 < xl) {
+                filter_edges<ch, Comp, Diff>(dst, l, (xl - x1) * ch, mode);
+            }
+            if (xl < xr) {
+                YadifLine<Comp> li = l;
+                li.offset( (xl - x1) * ch );
+                Comp *dsti = dst + (xl - x1) * ch;
+                const int w = (xr - xl) * ch;
+                int start = 0;
+#ifdef DEINTERLACE_SIMD
+                start = filter_line_simd<ch, typename YadifVec<Comp>::type>(dsti, li, w, mode);
+#endif
+                filter_line_c<ch, Comp, Diff>(dsti, li, start, w, mode);
+            }
+            if (xr < x2) {
+                YadifLine<Comp> lr = l;
+                lr.offset( (xr - x1) * ch );
+                filter_edges<ch, Comp, Diff>(dst + (xr - x1) * ch, lr, (x2 - xr) * ch, mode);
             }
-        } else {
-            std::memcpy( &dst[y * dst_stride],
-                         &cur0[y * refs], w * ch * sizeof(Comp) ); // copy original
         }
-    }
-}
+    } // multiThreadProcessImages
+};
+
 
 template<int ch, typename Comp, typename Diff>
 static void
-filter_plane_ofx(int mode,
-                 Image *dst_,
-                 const Image *srcp,
-                 const Image *src,
-                 const Image *srcn,
+filter_plane_ofx(ImageEffect &instance,
+                 const RenderArguments &args,
+                 int mode,
+                 Image *dst,
+                 const SourceFrame *srcp,
+                 const SourceFrame *src,
+                 const SourceFrame *srcn,
+                 const OfxRectI &frame,
                  int parity,
                  int tff)
 {
-    Comp *dst = (Comp*)dst_->getPixelData(); // change this when we support renderWindow
-    int dst_stride = dst_->getRowBytes() / sizeof(Comp); // may be negative, @see kOfxImagePropRowBytes
-    const Comp *prev0 = (const Comp*)( srcp ? srcp->getPixelData() : src->getPixelData() );
-    const Comp *cur0 = (const Comp*)src->getPixelData();
-    const Comp *next0 = (const Comp*)( srcn ? srcn->getPixelData() : src->getPixelData() );
-    int refs = src->getRowBytes() / sizeof(Comp); // may be negative, @see kOfxImagePropRowBytes
-    const OfxRectI bounds = dst_->getBounds();
-
-    filter_plane<ch, Comp, Diff>(mode, dst, dst_stride,
-                                 prev0, cur0, next0,
-                                 refs,
-                                 bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
-                                 parity, tff);
+    YadifProcessor<ch, Comp, Diff> processor(instance);
+
+    processor.setDstImg(dst);
+    processor.setSrcImgs(srcp ? srcp : src, src, srcn ? srcn : src);
+    processor.setValues(frame, mode, parity, tff);
+    processor.setRenderWindow(args.renderWindow, args.renderScale);
+    processor.process();
 }
 
-// =========== GNU Lesser General Public License code end =================
+inline bool
+rectContains(const OfxRectI &a,
+             const OfxRectI &b)
+{
+    return a.x1 <= b.x1 && b.x2 <= a.x2 && a.y1 <= b.y1 && b.y2 <= a.y2;
+}
+
+void
+DeinterlacePlugin::fetchSourceFrame(const RenderArguments &args,
+                                    double time,
+                                    const OfxRectI &window,
+                                    bool useCache,
+                                    SourceFrameHolder *frame)
+{
+    if (useCache) {
+        const CachedFrame *f = _frameCache.acquire( time, args.renderView, args.renderScale, _srcClip->getPixelDepth(), _srcClip->getPixelComponents(), window );
+        if (f) {
+            frame->setCached(&_frameCache, f);
+
+            return;
+        }
+    }
+    auto_ptr<const Image> img( _srcClip->fetchImage(time) );
+    if ( !img.get() ) {
+        frame->reset();
+
+        return;
+    }
+    checkBadRenderScaleOrField(img, args);
+    if (useCache) {
+        // the image is copied to the cache, and released right away
+        const CachedFrame *f = _frameCache.insert( time, args.renderView, args.renderScale, img.get() );
+        if (f) {
+            frame->setCached(&_frameCache, f);
+
+            return;
+        }
+    }
+    frame->setImage( img.release() );
+}
 
 void
 DeinterlacePlugin::render(const RenderArguments &args)
@@ -453,82 +1195,104 @@ DeinterlacePlugin::render(const RenderArguments &args)
     }
     checkBadRenderScaleOrField(dst, args);
 
-    auto_ptr<const Image> src( ( _srcClip && _srcClip->isConnected() ) ?
-                                    _srcClip->fetchImage(args.time) : 0 );
-    auto_ptr<const Image> srcp( ( _srcClip && _srcClip->isConnected() ) ?
-                                     _srcClip->fetchImage(args.time - 1) : 0 );
-    auto_ptr<const Image> srcn( ( _srcClip && _srcClip->isConnected() ) ?
-                                     _srcClip->fetchImage(args.time + 1) : 0 );
-    if ( src.get() ) {
-        checkBadRenderScaleOrField(src, args);
-    } else {
+    if ( !_srcClip || !_srcClip->isConnected() ) {
         //All the code below expects src to be valid
         setPersistentMessage(Message::eMessageError, "", "Failed to fetch input image");
         throwSuiteStatusException(kOfxStatFailed);
     }
-    if ( srcp.get() ) {
-        checkBadRenderScaleOrField(srcp, args);
-    }
-    if ( srcn.get() ) {
-        checkBadRenderScaleOrField(srcn, args);
-    }
-
-    const OfxRectI rect = dst->getBounds();
-    int width = rect.x2 - rect.x1;
-    int height = rect.y2 - rect.y1;
-    int imode       = 0;
-    int ifieldOrder = 2;
-    int iparity     = 0;
-
-    mode->getValueAtTime(args.time, imode);
-    fieldOrder->getValueAtTime(args.time, ifieldOrder);
-    parity->getValueAtTime(args.time, iparity);
 
-    imode *= 2;
-
-    if (ifieldOrder == 2) {
-        if (width > 1024) {
-            ifieldOrder = 1;
-        } else {
-            ifieldOrder = 0;
-        }
+    // the source frame, in pixels: the field parity and the edges are relative to it
+    OfxRectI frame;
+    Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(args.time), args.renderScale, _srcClip->getPixelAspectRatio(), &frame);
+    int width = frame.x2 - frame.x1;
+    int height = frame.y2 - frame.y1;
+
+    // the lines and columns read by the filter (see getRegionsOfInterest)
+    OfxRectI srcWindow = args.renderWindow;
+    srcWindow.x1 -= 3;
+    srcWindow.x2 += 3;
+    srcWindow.y1 -= 2;
+    srcWindow.y2 += 2;
+    if ( !Coords::rectIntersection(srcWindow, frame, &srcWindow) || !rectContains(frame, args.renderWindow) ) {
+        // render window not inside the frame: just copy src to dst
+        width = height = 0;
     }
 
-
     if ( (width < 3) || (height < 3) ) {
         // Video of less than 3 columns or lines is not supported
         // just copy src to dst
-        for (int y = 0; y < height; y++) {
-            unsigned char* lineStart = (unsigned char*)dst->getPixelAddress(0, y);
-            unsigned int lineLen = std::abs( dst->getRowBytes() );
-            if ( src.get() ) {
-                std::memcpy( lineStart, src->getPixelAddress(0, y), lineLen );
+        auto_ptr<const Image> src( _srcClip->fetchImage(args.time) );
+        if ( !src.get() ) {
+            setPersistentMessage(Message::eMessageError, "", "Failed to fetch input image");
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        checkBadRenderScaleOrField(src, args);
+        copyPixels( *this, args.renderWindow, args.renderScale, src.get(), dst.get() );
+    } else {
+        // While the host renders a sequence, the source frames are kept in a cache: the render of the
+        // next frame reads two of the three frames read by this render. Interactive renders always
+        // fetch the source frames, since changes upstream of this effect cannot be detected.
+        const bool useCache = args.sequentialRenderStatus && !args.interactiveRenderStatus;
+        SourceFrameHolder srcp, src, srcn;
+        fetchSourceFrame(args, args.time - 1, srcWindow, useCache, &srcp);
+        fetchSourceFrame(args, args.time, srcWindow, useCache, &src);
+        fetchSourceFrame(args, args.time + 1, srcWindow, useCache, &srcn);
+        if ( !src.get() ) {
+            //All the code below expects src to be valid
+            setPersistentMessage(Message::eMessageError, "", "Failed to fetch input image");
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        if ( !rectContains(src.get()->bounds, srcWindow) ) {
+            setPersistentMessage(Message::eMessageError, "", "Input image does not contain the region of interest");
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        // a neighbour frame that does not cover the region of interest is treated as missing
+        if ( srcp.get() && !rectContains(srcp.get()->bounds, srcWindow) ) {
+            srcp.reset();
+        }
+        if ( srcn.get() && !rectContains(srcn.get()->bounds, srcWindow) ) {
+            srcn.reset();
+        }
+
+        int imode       = 0;
+        int ifieldOrder = 2;
+        int iparity     = 0;
+
+        mode->getValueAtTime(args.time, imode);
+        fieldOrder->getValueAtTime(args.time, ifieldOrder);
+        parity->getValueAtTime(args.time, iparity);
+
+        imode *= 2;
+
+        if (ifieldOrder == 2) {
+            if (width / args.renderScale.x > 1024) {
+                ifieldOrder = 1;
             } else {
-                std::fill( lineStart, lineStart + lineLen, 0 );
+                ifieldOrder = 0;
             }
         }
-    } else {
+
         if (dstComponents == ePixelComponentRGBA) {
             switch (dstBitDepth) {
             case eBitDepthUByte:
-                filter_plane_ofx<4, unsigned char, int>(imode, // mode
+                filter_plane_ofx<4, unsigned char, int>(*this, args, imode, // mode
                                                         dst.get(),
                                                         srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder); // parity, tff
+                                                        frame, iparity, ifieldOrder); // frame, parity, tff
                 break;
 
             case eBitDepthUShort:
-                filter_plane_ofx<4, unsigned short, int>(imode, // mode
+                filter_plane_ofx<4, unsigned short, int>(*this, args, imode, // mode
                                                          dst.get(),
                                                          srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder); // parity, tff
+                                                         frame, iparity, ifieldOrder); // frame, parity, tff
                 break;
 
             case eBitDepthFloat:
-                filter_plane_ofx<4, float, float>(imode,   // mode
+                filter_plane_ofx<4, float, float>(*this, args, imode,   // mode
                                                   dst.get(),
                                                   srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
+                                                  frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             default:
@@ -537,24 +1301,24 @@ DeinterlacePlugin::render(const RenderArguments &args)
         } else if (dstComponents == ePixelComponentRGB) {
             switch (dstBitDepth) {
             case eBitDepthUByte:
-                filter_plane_ofx<3, unsigned char, int>(imode,   // mode
+                filter_plane_ofx<3, unsigned char, int>(*this, args, imode,   // mode
                                                         dst.get(),
                                                         srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder);  // parity, tff
+                                                        frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             case eBitDepthUShort:
-                filter_plane_ofx<3, unsigned short, int>(imode,   // mode
+                filter_plane_ofx<3, unsigned short, int>(*this, args, imode,   // mode
                                                          dst.get(),
                                                          srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder);  // parity, tff
+                                                         frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             case eBitDepthFloat:
-                filter_plane_ofx<3, float, float>(imode,   // mode
+                filter_plane_ofx<3, float, float>(*this, args, imode,   // mode
                                                   dst.get(),
                                                   srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
+                                                  frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             default:
@@ -564,24 +1328,24 @@ DeinterlacePlugin::render(const RenderArguments &args)
         } else if (dstComponents == ePixelComponentXY) {
             switch (dstBitDepth) {
             case eBitDepthUByte:
-                filter_plane_ofx<2, unsigned char, int>(imode,   // mode
+                filter_plane_ofx<2, unsigned char, int>(*this, args, imode,   // mode
                                                         dst.get(),
                                                         srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder);  // parity, tff
+                                                        frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             case eBitDepthUShort:
-                filter_plane_ofx<2, unsigned short, int>(imode,   // mode
+                filter_plane_ofx<2, unsigned short, int>(*this, args, imode,   // mode
                                                          dst.get(),
                                                          srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder);  // parity, tff
+                                                         frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             case eBitDepthFloat:
-                filter_plane_ofx<2, float, float>(imode,   // mode
+                filter_plane_ofx<2, float, float>(*this, args, imode,   // mode
                                                   dst.get(),
                                                   srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
+                                                  frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             default:
@@ -591,24 +1355,24 @@ DeinterlacePlugin::render(const RenderArguments &args)
         } else if (dstComponents == ePixelComponentAlpha) {
             switch (dstBitDepth) {
             case eBitDepthUByte:
-                filter_plane_ofx<1, unsigned char, int>(imode,   // mode
+                filter_plane_ofx<1, unsigned char, int>(*this, args, imode,   // mode
                                                         dst.get(),
                                                         srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder);  // parity, tff
+                                                        frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             case eBitDepthUShort:
-                filter_plane_ofx<1, unsigned short, int>(imode,   // mode
+                filter_plane_ofx<1, unsigned short, int>(*this, args, imode,   // mode
                                                          dst.get(),
                                                          srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder);  // parity, tff
+                                                         frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             case eBitDepthFloat:
-                filter_plane_ofx<1, float, float>(imode,   // mode
+                filter_plane_ofx<1, float, float>(*this, args, imode,   // mode
                                                   dst.get(),
                                                   srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
+                                                  frame, iparity, ifieldOrder);  // frame, parity, tff
                 break;
 
             default:
@@ -661,6 +1425,50 @@ DeinterlacePlugin::getFramesNeeded(const FramesNeededArguments &args,
     frames.setFramesNeeded(*_srcClip, range);
 }
 
+void
+DeinterlacePlugin::getRegionsOfInterest(const RegionsOfInterestArguments &args,
+                                        RegionOfInterestSetter &rois)
+{
+    if ( !_srcClip || !_srcClip->isConnected() ) {
+        return;
+    }
+    // yadif reads 3 pixels on each side, and 2 lines above and below
+    double par = _srcClip->getPixelAspectRatio();
+    OfxRectD roi = args.regionOfInterest;
+    roi.x1 -= 3 * par / args.renderScale.x;
+    roi.x2 += 3 * par / args.renderScale.x;
+    roi.y1 -= 2 / args.renderScale.y;
+    roi.y2 += 2 / args.renderScale.y;
+    OfxRectD srcRod = _srcClip->getRegionOfDefinition(args.time);
+    if ( !Coords::rectIntersection(roi, srcRod, &roi) ) {
+        return;
+    }
+    rois.setRegionOfInterest(*_srcClip, roi);
+}
+
+void
+DeinterlacePlugin::changedClip(const InstanceChangedArgs & /*args*/,
+                               const std::string &clipName)
+{
+    if (clipName == kOfxImageEffectSimpleSourceClipName) {
+        _frameCache.clear();
+    }
+}
+
+void
+DeinterlacePlugin::beginSequenceRender(const BeginSequenceRenderArguments & /*args*/)
+{
+    // the input may have changed since the last sequence
+    _frameCache.clear();
+}
+
+void
+DeinterlacePlugin::endSequenceRender(const EndSequenceRenderArguments & /*args*/)
+{
+    // free the memory
+    _frameCache.clear();
+}
+
 mDeclarePluginFactory(DeinterlacePluginFactory, {ofxsThreadSuiteCheck();}, {});
 void
 DeinterlacePluginFactory::describe(ImageEffectDescriptor &desc)
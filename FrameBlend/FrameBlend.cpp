@@ -30,6 +30,8 @@
 #include <cassert>
 #include <algorithm>
 #include <limits>
+#include <list>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsThreadSuite.h"
@@ -40,6 +42,22 @@
 #include "ofxsCoords.h"
 #include "ofxsMacros.h"
 #include "ofxsMerging.h"
+#include "ofxsFetchAndProcess.h"
+
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
 
 using namespace OFX;
 
@@ -56,8 +74,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: add incremental parameter
+// version 2.2: add median and percentile operations
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -120,6 +140,8 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamOperationOptionSum "Sum", "Output is the sum/addition of selected frames.", "sum"
 #define kParamOperationOptionProduct "Product", "Output is the product/multiplication of selected frames.", "product"
 #define kParamOperationOptionOver "Over", "Output is the 'over' composition of selected frames.", "over"
+#define kParamOperationOptionMedian "Median", "Output is the median of selected frames. It is exact for up to " kQuantileExactFramesString " frames, and approximate for more frames.", "median"
+#define kParamOperationOptionPercentile "Percentile", "Output is the percentile of selected frames given by the Percentile parameter. It is exact for up to " kQuantileExactFramesString " frames, and approximate for more frames.", "percentile"
 #define kParamOperationDefault eOperationAverage
 enum OperationEnum
 {
@@ -129,8 +151,19 @@ enum OperationEnum
     eOperationSum,
     eOperationProduct,
     eOperationOver,
+    eOperationMedian,
+    eOperationPercentile,
 };
 
+#define kParamPercentileName  "percentile"
+#define kParamPercentileLabel "Percentile"
+#define kParamPercentileHint \
+    "Percentile computed by the Percentile operation, from 0 (the minimum) to 100 (the maximum).\n" \
+    "Median and Percentile are computed exactly for up to " kQuantileExactFramesString " frames. With more frames, they are approximated using the P-square algorithm (Jain and Chlamtac, 1985), which only keeps " kQuantileExactFramesString " values per pixel instead of all the frames: the result may differ from the exact value by a fraction of the spread of the values. Decay is not used by these operations."
+
+#define kQuantileExactFrames 9 // max number of frames for which the median and percentile are exact
+#define kQuantileExactFramesString "9"
+
 #define kParamDecayName  "decay"
 #define kParamDecayLabel "Decay"
 #define kParamDecayHint  "Before applying the blending operation, frame t is multiplied by (1-decay)^(last-t)."
@@ -139,6 +172,14 @@ enum OperationEnum
 #define kParamOutputCountLabel "Output Count to Alpha"
 #define kParamOutputCountHint  "Output image count at each pixel to alpha (input must have an alpha channel)."
 
+#define kParamIncrementalName  "incremental"
+#define kParamIncrementalLabel "Incremental"
+#define kParamIncrementalHint \
+    "When rendering consecutive frames, update the result of the previous render by removing the frames that left the frame range and adding the frames that entered it, instead of blending the whole frame range again. " \
+    "This is used with the Average, Sum and Product operations, when Decay is zero.\n" \
+    "The result of the last render of each view and render window is kept in memory, and it is discarded when a parameter or an input of this effect changes. " \
+    "Changes made upstream of this effect cannot be detected: uncheck and check this parameter to force a full update."
+
 #define kClipFgMName "FgM"
 #define kClipFgMHint "The foreground matte. If it is connected, only pixels with a negative or zero foreground value are taken into account."
 
@@ -150,6 +191,123 @@ enum OperationEnum
 #define OFX_COMPONENTS_OK(c) ((c)== ePixelComponentAlpha || (c) == ePixelComponentRGB || (c) == ePixelComponentRGBA)
 #endif
 
+// Streaming quantile estimation, using the P-square algorithm:
+// R. Jain and I. Chlamtac, "The P2 algorithm for dynamic calculation of quantiles and histograms without storing observations",
+// Communications of the ACM 28(10), 1985.
+// Each estimator has room for size >= 5 values. While there are at most size values, q holds the sorted values,
+// and the quantile is exact.
+// After that, q holds the heights of 5 markers, at positions 0, pos[0], pos[1], pos[2] and count-1 in the sorted values,
+// and the middle marker estimates the p-quantile. The markers are initialized from the size first values.
+
+// add the value v to an estimator which already holds count values
+static inline void
+quantileAdd(float *q,
+            unsigned short *pos,
+            int size,
+            int count,
+            float v,
+            double p)
+{
+    assert(size >= 5);
+    // desired positions of the markers are count * dn
+    const double dn[5] = { 0., p / 2, p, (1. + p) / 2, 1. };
+    if (count < size) {
+        // insertion sort
+        int i = count;
+        while (i > 0 && q[i - 1] > v) {
+            q[i] = q[i - 1];
+            --i;
+        }
+        q[i] = v;
+
+        return;
+    }
+    if (count == size) {
+        // keep 5 of the sorted values as markers, as close as possible to their desired positions
+        // (the extreme markers stay at the extreme values, and the markers must be distinct)
+        int n1 = (std::max)( 1, (std::min)( (int)(dn[1] * (size - 1) + 0.5), size - 4 ) );
+        int n2 = (std::max)( n1 + 1, (std::min)( (int)(dn[2] * (size - 1) + 0.5), size - 3 ) );
+        int n3 = (std::max)( n2 + 1, (std::min)( (int)(dn[3] * (size - 1) + 0.5), size - 2 ) );
+        // each marker is taken from a position which is not before its own, so that q can be overwritten in place
+        q[1] = q[n1];
+        q[2] = q[n2];
+        q[3] = q[n3];
+        q[4] = q[size - 1];
+        pos[0] = (unsigned short)n1;
+        pos[1] = (unsigned short)n2;
+        pos[2] = (unsigned short)n3;
+    }
+    // find the cell k such that q[k] <= v < q[k+1], and update the extreme markers
+    int k;
+    if (v < q[0]) {
+        q[0] = v;
+        k = 0;
+    } else if (v >= q[4]) {
+        q[4] = v;
+        k = 3;
+    } else {
+        k = 0;
+        while (v >= q[k + 1]) {
+            ++k;
+        }
+    }
+    // positions of the markers after adding v (there are count + 1 values)
+    int n[5] = { 0, pos[0], pos[1], pos[2], count };
+    for (int i = k + 1; i < 4; ++i) {
+        ++n[i];
+    }
+    for (int i = 1; i < 4; ++i) {
+        double d = count * dn[i] - n[i];
+        if ( ( (d >= 1.) && (n[i + 1] - n[i] > 1) ) || ( (d <= -1.) && (n[i - 1] - n[i] < -1) ) ) {
+            int s = (d > 0.) ? 1 : -1;
+            // piecewise-parabolic prediction
+            double qp = q[i] + (double)s / (n[i + 1] - n[i - 1]) *
+                        ( (n[i] - n[i - 1] + s) * (double)(q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+                          (n[i + 1] - n[i] - s) * (double)(q[i] - q[i - 1]) / (n[i] - n[i - 1]) );
+            if ( (q[i - 1] < qp) && (qp < q[i + 1]) ) {
+                q[i] = (float)qp;
+            } else {
+                // linear prediction
+                q[i] = (float)( q[i] + s * (double)(q[i + s] - q[i]) / (n[i + s] - n[i]) );
+            }
+            n[i] += s;
+        }
+    }
+    pos[0] = (unsigned short)n[1];
+    pos[1] = (unsigned short)n[2];
+    pos[2] = (unsigned short)n[3];
+} // quantileAdd
+
+// the p-quantile of the values added to the estimator
+static inline float
+quantileGet(const float *q,
+            int size,
+            int count,
+            double p)
+{
+    if (count <= 0) {
+        return 0.f;
+    }
+    if (count <= size) {
+        // exact value, interpolated between the sorted values
+        double x = p * (count - 1);
+        int i = (int)std::floor(x);
+        if (i >= count - 1) {
+            return q[count - 1];
+        }
+
+        return (float)( q[i] + (x - i) * (q[i + 1] - q[i]) );
+    }
+    if (p <= 0.) {
+        return q[0];
+    }
+    if (p >= 1.) {
+        return q[4];
+    }
+
+    return q[2];
+}
+
 class FrameBlendProcessorBase
     : public PixelProcessor
 {
@@ -160,6 +318,9 @@ protected:
     float *_accumulatorData;
     unsigned short *_countData;
     float *_sumWeightsData;
+    float *_quantileData;
+    unsigned short *_quantilePosData;
+    int _quantileSize;
     const Image *_maskImg;
     bool _processR;
     bool _processG;
@@ -171,6 +332,7 @@ protected:
     bool _doMasking;
     double _mix;
     bool _maskInvert;
+    double _percentile;
 
 public:
 
@@ -182,6 +344,9 @@ public:
         , _accumulatorData(NULL)
         , _countData(NULL)
         , _sumWeightsData(NULL)
+        , _quantileData(NULL)
+        , _quantilePosData(NULL)
+        , _quantileSize(5)
         , _maskImg(NULL)
         , _processR(true)
         , _processG(true)
@@ -193,6 +358,7 @@ public:
         , _doMasking(false)
         , _mix(1.)
         , _maskInvert(false)
+        , _percentile(0.5)
     {
     }
 
@@ -206,6 +372,15 @@ public:
                          float* sumWeightsData)
     {_accumulatorData = accumulatorData; _countData = countData; _sumWeightsData = sumWeightsData; }
 
+    // the state of the quantile estimators (median and percentile operations), with room for quantileSize values each
+    void setQuantileAccumulators(float *quantileData,
+                                 unsigned short *quantilePosData,
+                                 int quantileSize)
+    {_quantileData = quantileData; _quantilePosData = quantilePosData; _quantileSize = quantileSize; }
+
+    // percentile, between 0 and 1 (percentile operation)
+    void setPercentile(double percentile) {_percentile = percentile; }
+
     void setMaskImg(const Image *v,
                     bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
 
@@ -232,6 +407,68 @@ public:
 
     virtual OperationEnum getOperation() = 0;
 
+protected:
+    // compute the final value of a pixel from the blended value tmpPix, and write it to dstPix
+    template <class PIX, int nComponents, int maxValue, OperationEnum operation>
+    void outputPixel(float *tmpPix,
+                     int count,
+                     float sumWeights,
+                     bool processR,
+                     bool processG,
+                     bool processB,
+                     bool processA,
+                     int x,
+                     int y,
+                     const PIX *srcPix,
+                     PIX *dstPix)
+    {
+        if (nComponents == 1) {
+            int c = 0;
+            if (_outputCount) {
+                tmpPix[c] = count;
+            } else if (operation == eOperationAverage) {
+                tmpPix[c] =  (count ? (tmpPix[c] / sumWeights) : 0);
+            }
+        } else if ( (3 <= nComponents) && (nComponents <= 4) ) {
+            if (operation == eOperationAverage) {
+                for (int c = 0; c < 3; ++c) {
+                    tmpPix[c] = (count ? (tmpPix[c] / sumWeights) : 0);
+                }
+            }
+            if (nComponents >= 4) {
+                int c = nComponents - 1;
+                if (_outputCount) {
+                    tmpPix[c] = count;
+                } else if (operation == eOperationAverage) {
+                    tmpPix[c] =  (count ? (tmpPix[c] / sumWeights) : 0);
+                }
+            }
+        }
+        // tmpPix is not normalized, it is within [0,maxValue]
+        ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking,
+                                                         _maskImg, _mix, _maskInvert,
+                                                         dstPix);
+        // copy back original values from unprocessed channels
+        if (nComponents == 1) {
+            if (!processA) {
+                dstPix[0] = srcPix ? srcPix[0] : PIX();
+            }
+        } else {
+            if (!processR) {
+                dstPix[0] = srcPix ? srcPix[0] : PIX();
+            }
+            if ( (nComponents >= 2) && !processG ) {
+                dstPix[1] = srcPix ? srcPix[1] : PIX();
+            }
+            if ( (nComponents >= 3) && !processB ) {
+                dstPix[2] = srcPix ? srcPix[2] : PIX();
+            }
+            if ( (nComponents >= 4) && !processA ) {
+                dstPix[3] = srcPix ? srcPix[3] : PIX();
+            }
+        }
+    }
+
 private:
 };
 
@@ -348,10 +585,19 @@ private:
                 initVal = 1.;
                 break;
             case eOperationOver:
+            case eOperationMedian:
+            case eOperationPercentile:
                 initVal = 0.;
                 break;
             }
         }
+        const bool quantile = (operation == eOperationMedian || operation == eOperationPercentile);
+        const double p = (operation == eOperationMedian) ? 0.5 : _percentile;
+        const int qSize = _quantileSize;
+        assert(5 <= qSize && qSize <= kQuantileExactFrames);
+        // quantile estimators, if they are not stored in _quantileData
+        float qLocal[nComponents * kQuantileExactFrames];
+        unsigned short qPosLocal[nComponents * 3];
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if ( _effect.abort() ) {
@@ -376,6 +622,8 @@ private:
                 } else {
                     std::fill(tmpPix, tmpPix + nComponents, initVal);
                 }
+                float *q = quantile ? (_quantileData ? &_quantileData[renderPix * nComponents * qSize] : qLocal) : 0;
+                unsigned short *qPos = quantile ? (_quantilePosData ? &_quantilePosData[renderPix * nComponents * 3] : qPosLocal) : 0;
                 // accumulate
                 for (unsigned i = 0; i < _srcImgs.size(); ++i) {
                     const PIX *fgMPix = (const PIX *)  (_fgMImgs[i] ? _fgMImgs[i]->getPixelAddress(x, y) : 0);
@@ -387,7 +635,12 @@ private:
                             sumWeights *= (1. - _decay);
                         }
                         const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
-                        if (srcPixi) {
+                        if (quantile) {
+                            // pixels outside of the source image are black, as with the other operations
+                            for (int c = 0; c < nComponents; ++c) {
+                                quantileAdd(&q[c * qSize], &qPos[c * 3], qSize, count, srcPixi ? (float)srcPixi[c] : 0.f, p);
+                            }
+                        } else if (srcPixi) {
                             PIX a = PIX();
                             float b = 0.;
                             if (operation == eOperationOver) {
@@ -423,6 +676,9 @@ private:
                                 case eOperationOver:
                                     tmpPix[c] = MergeImages2D::overFunc<PIX, maxValue>(srcPixi[c], tmpPix[c], a, b);
                                     break;
+                                case eOperationMedian:
+                                case eOperationPercentile:
+                                    break;
                                 }
                             }
                         }
@@ -441,57 +697,356 @@ private:
                         std::copy(tmpPix, tmpPix + nComponents, &_accumulatorData[renderPix * nComponents]);
                     }
                 } else {
-                    if (nComponents == 1) {
-                        int c = 0;
-                        if (_outputCount) {
-                            tmpPix[c] = count;
-                        } else if (operation == eOperationAverage) {
-                            tmpPix[c] =  (count ? (tmpPix[c] / sumWeights) : 0);
+                    if (quantile) {
+                        for (int c = 0; c < nComponents; ++c) {
+                            tmpPix[c] = quantileGet(&q[c * qSize], qSize, count, p);
                         }
-                    } else if ( (3 <= nComponents) && (nComponents <= 4) ) {
-                        if (operation == eOperationAverage) {
-                            for (int c = 0; c < 3; ++c) {
-                                tmpPix[c] = (count ? (tmpPix[c] / sumWeights) : 0);
+                    }
+                    outputPixel<PIX, nComponents, maxValue, operation>(tmpPix, count, sumWeights,
+                                                                       processR, processG, processB, processA,
+                                                                       x, y, srcPix, dstPix);
+                    // increment the dst pixel
+                    dstPix += nComponents;
+                }
+            }
+        }
+    } // process
+};
+
+// State of an incremental blend over a render window: the blend of the frames
+// first, first + interval, ..., first + (n - 1) * interval.
+struct FrameBlendIncrementalState
+{
+    int view;
+    OfxRectI renderWindow;
+    OfxPointD renderScale;
+    BitDepthEnum bitDepth;
+    int nComponents;
+    OperationEnum operation;
+    bool fgM;
+    int first;
+    int interval;
+    int n;
+    std::vector<double> accumulator; // Average, Sum: sum of the values. Product: product of the non-zero normalized values
+    std::vector<unsigned short> zeros; // Product: number of zero values
+    std::vector<unsigned short> count; // number of frames taken into account at each pixel
+
+    FrameBlendIncrementalState(int view_,
+                               const OfxRectI& renderWindow_,
+                               const OfxPointD& renderScale_,
+                               BitDepthEnum bitDepth_,
+                               int nComponents_,
+                               OperationEnum operation_,
+                               bool fgM_,
+                               int first_,
+                               int interval_,
+                               int n_)
+        : view(view_)
+        , renderWindow(renderWindow_)
+        , renderScale(renderScale_)
+        , bitDepth(bitDepth_)
+        , nComponents(nComponents_)
+        , operation(operation_)
+        , fgM(fgM_)
+        , first(first_)
+        , interval(interval_)
+        , n(n_)
+    {
+        size_t nPixels = (size_t)(renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
+
+        count.resize(nPixels, 0);
+        switch (operation) {
+        case eOperationAverage:
+        case eOperationSum:
+            accumulator.resize(nPixels * nComponents, 0.);
+            break;
+        case eOperationProduct:
+            accumulator.resize(nPixels * nComponents, 1.);
+            zeros.resize(nPixels * nComponents, 0);
+            break;
+        case eOperationMin:
+        case eOperationMax:
+        case eOperationOver:
+        case eOperationMedian:
+        case eOperationPercentile:
+            assert(false);
+            break;
+        }
+    }
+
+    // can this state be updated to the frames first_, first_ + interval_, ..., first_ + (n_ - 1) * interval_?
+    // If yes, shift is the number of frames that left the range.
+    bool canUpdate(int view_,
+                   const OfxRectI& renderWindow_,
+                   const OfxPointD& renderScale_,
+                   BitDepthEnum bitDepth_,
+                   int nComponents_,
+                   OperationEnum operation_,
+                   bool fgM_,
+                   int first_,
+                   int interval_,
+                   int n_,
+                   int *shift) const
+    {
+        if ( (view_ != view) ||
+             (renderWindow_.x1 != renderWindow.x1) || (renderWindow_.x2 != renderWindow.x2) ||
+             (renderWindow_.y1 != renderWindow.y1) || (renderWindow_.y2 != renderWindow.y2) ||
+             (renderScale_.x != renderScale.x) || (renderScale_.y != renderScale.y) ||
+             (bitDepth_ != bitDepth) || (nComponents_ != nComponents) || (operation_ != operation) ||
+             (fgM_ != fgM) || (interval_ != interval) || (n_ != n) ) {
+            return false;
+        }
+        int d = first_ - first;
+        if (d % interval != 0) {
+            return false;
+        }
+        *shift = d / interval;
+
+        // shift == 0 is not updated: the host only renders the same frame again if something changed upstream
+        return (0 < *shift) && (*shift < n);
+    }
+};
+
+// The incremental states left by the previous renders of an instance.
+// The views of a stereo render, and the tiles of a tiled render, are rendered independently, so
+// there is one state per view and render window. The windows of the states of a view never
+// overlap (a new state replaces the states it overlaps, e.g. when the viewer is panned), so that
+// they hold at most one copy of each view.
+class FrameBlendIncrementalStates
+{
+public:
+    FrameBlendIncrementalStates()
+        : _mutex()
+        , _states()
+    {
+    }
+
+    ~FrameBlendIncrementalStates()
+    {
+        clear();
+    }
+
+    // remove all states (e.g. because the parameters or the inputs changed)
+    void clear()
+    {
+        AutoMutex guard(&_mutex);
+
+        for (StatesList::iterator it = _states.begin(); it != _states.end(); ++it) {
+            delete *it;
+        }
+        _states.clear();
+    }
+
+    // remove and return the state for the view and render window, if it can be updated to the given frames
+    // (see FrameBlendIncrementalState::canUpdate()), or return NULL
+    FrameBlendIncrementalState* take(int view,
+                                     const OfxRectI& renderWindow,
+                                     const OfxPointD& renderScale,
+                                     BitDepthEnum bitDepth,
+                                     int nComponents,
+                                     OperationEnum operation,
+                                     bool fgM,
+                                     int first,
+                                     int interval,
+                                     int n,
+                                     int *shift)
+    {
+        AutoMutex guard(&_mutex);
+
+        for (StatesList::iterator it = _states.begin(); it != _states.end(); ++it) {
+            FrameBlendIncrementalState* state = *it;
+            if ( state->canUpdate(view, renderWindow, renderScale, bitDepth, nComponents, operation, fgM,
+                                  first, interval, n, shift) ) {
+                _states.erase(it);
+
+                return state;
+            }
+        }
+
+        return NULL;
+    }
+
+    // keep the state for the next renders, replacing the states of the same view that it overlaps
+    void put(FrameBlendIncrementalState* state)
+    {
+        AutoMutex guard(&_mutex);
+
+        for (StatesList::iterator it = _states.begin(); it != _states.end();) {
+            if ( ( (*it)->view == state->view ) &&
+                 Coords::rectIntersection<OfxRectI>( (*it)->renderWindow, state->renderWindow, 0 ) ) {
+                delete *it;
+                it = _states.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _states.push_back(state);
+    }
+
+private:
+    typedef std::list<FrameBlendIncrementalState*> StatesList;
+    Mutex _mutex;
+    StatesList _states;
+};
+
+class FrameBlendIncrementalProcessorBase
+    : public FrameBlendProcessorBase
+{
+protected:
+    FrameBlendIncrementalState *_state;
+    std::vector<const Image*> _removedSrcImgs;
+    std::vector<const Image*> _removedFgMImgs;
+
+public:
+
+    FrameBlendIncrementalProcessorBase(ImageEffect &instance)
+        : FrameBlendProcessorBase(instance)
+        , _state(NULL)
+        , _removedSrcImgs()
+        , _removedFgMImgs()
+    {
+    }
+
+    void setState(FrameBlendIncrementalState *state) {_state = state; }
+
+    // images of the frames leaving the range (the source images may be NULL if they are not needed)
+    void setRemovedImgs(const std::vector<const Image*> &src,
+                        const std::vector<const Image*> &fgM) {_removedSrcImgs = src; _removedFgMImgs = fgM; }
+};
+
+
+template <class PIX, int nComponents, int maxValue, OperationEnum operation>
+class FrameBlendIncrementalProcessor
+    : public FrameBlendIncrementalProcessorBase
+{
+public:
+    FrameBlendIncrementalProcessor(ImageEffect &instance)
+        : FrameBlendIncrementalProcessorBase(instance)
+    {
+    }
+
+private:
+
+    virtual OperationEnum getOperation() OVERRIDE FINAL { return operation; };
+
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(1 <= nComponents && nComponents <= 4);
+        assert(_state && _state->nComponents == nComponents && _state->operation == operation);
+        assert(!_lastPass || _dstPixelData);
+        assert( _srcImgs.size() == _fgMImgs.size() );
+        assert( _removedSrcImgs.size() == _removedFgMImgs.size() );
+        const bool processR = _processR && (nComponents != 1);
+        const bool processG = _processG && (nComponents >= 2);
+        const bool processB = _processB && (nComponents >= 3);
+        const bool processA = _processA && (nComponents == 1 || nComponents == 4);
+        float tmpPix[nComponents];
+
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = _lastPass ? (PIX *) getDstPixelAddress(procWindow.x1, y) : 0;
+            assert(!_lastPass || dstPix);
+            if (_lastPass && !dstPix) {
+                // coverity[dead_error_line]
+                continue;
+            }
+
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                size_t renderPix = ( (size_t)(_renderWindow.x2 - _renderWindow.x1) * (y - _renderWindow.y1) +
+                                     (x - _renderWindow.x1) );
+                int count = _state->count[renderPix];
+                // remove the frames leaving the range
+                for (unsigned i = 0; i < _removedFgMImgs.size(); ++i) {
+                    const PIX *fgMPix = (const PIX *)  (_removedFgMImgs[i] ? _removedFgMImgs[i]->getPixelAddress(x, y) : 0);
+                    if ( !fgMPix || (*fgMPix <= 0) ) {
+                        const PIX *srcPixi = (const PIX *)  (_removedSrcImgs[i] ? _removedSrcImgs[i]->getPixelAddress(x, y) : 0);
+                        if (srcPixi) {
+                            for (int c = 0; c < nComponents; ++c) {
+                                double &acc = _state->accumulator[renderPix * nComponents + c];
+                                if (operation == eOperationProduct) {
+                                    if (srcPixi[c] == 0) {
+                                        --_state->zeros[renderPix * nComponents + c];
+                                    } else {
+                                        acc /= (double)srcPixi[c] / maxValue;
+                                    }
+                                } else {
+                                    acc -= srcPixi[c];
+                                }
                             }
                         }
-                        if (nComponents >= 4) {
-                            int c = nComponents - 1;
-                            if (_outputCount) {
-                                tmpPix[c] = count;
-                            } else if (operation == eOperationAverage) {
-                                tmpPix[c] =  (count ? (tmpPix[c] / sumWeights) : 0);
+                        --count;
+                    }
+                }
+                // add the frames entering the range
+                for (unsigned i = 0; i < _srcImgs.size(); ++i) {
+                    const PIX *fgMPix = (const PIX *)  (_fgMImgs[i] ? _fgMImgs[i]->getPixelAddress(x, y) : 0);
+                    if ( !fgMPix || (*fgMPix <= 0) ) {
+                        const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
+                        if (srcPixi) {
+                            for (int c = 0; c < nComponents; ++c) {
+                                size_t pc = renderPix * nComponents + c;
+                                switch (operation) {
+                                case eOperationAverage:
+                                case eOperationSum:
+                                    _state->accumulator[pc] += srcPixi[c];
+                                    break;
+                                case eOperationProduct:
+                                    if (srcPixi[c] == 0) {
+                                        ++_state->zeros[pc];
+                                    } else {
+                                        _state->accumulator[pc] *= (double)srcPixi[c] / maxValue;
+                                    }
+                                    break;
+                                case eOperationMin:
+                                case eOperationMax:
+                                case eOperationOver:
+                                case eOperationMedian:
+                                case eOperationPercentile:
+                                    break;
+                                }
                             }
                         }
+                        ++count;
                     }
-                    // tmpPix is not normalized, it is within [0,maxValue]
-                    ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking,
-                                                                     _maskImg, _mix, _maskInvert,
-                                                                     dstPix);
-                    // copy back original values from unprocessed channels
-                    if (nComponents == 1) {
-                        if (!processA) {
-                            dstPix[0] = srcPix ? srcPix[0] : PIX();
-                        }
-                    } else {
-                        if (!processR) {
-                            dstPix[0] = srcPix ? srcPix[0] : PIX();
-                        }
-                        if ( (nComponents >= 2) && !processG ) {
-                            dstPix[1] = srcPix ? srcPix[1] : PIX();
-                        }
-                        if ( (nComponents >= 3) && !processB ) {
-                            dstPix[2] = srcPix ? srcPix[2] : PIX();
-                        }
-                        if ( (nComponents >= 4) && !processA ) {
-                            dstPix[3] = srcPix ? srcPix[3] : PIX();
+                }
+                assert(count >= 0);
+                _state->count[renderPix] = (unsigned short)count;
+
+                if (_lastPass) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        size_t pc = renderPix * nComponents + c;
+                        switch (operation) {
+                        case eOperationAverage:
+                        case eOperationSum:
+                            tmpPix[c] = (float)_state->accumulator[pc];
+                            break;
+                        case eOperationProduct:
+                            tmpPix[c] = _state->zeros[pc] ? 0.f : (float)_state->accumulator[pc];
+                            break;
+                        case eOperationMin:
+                        case eOperationMax:
+                        case eOperationOver:
+                        case eOperationMedian:
+                        case eOperationPercentile:
+                            tmpPix[c] = 0.f;
+                            break;
                         }
                     }
+                    // decay is zero, so that the sum of weights is the count
+                    outputPixel<PIX, nComponents, maxValue, operation>(tmpPix, count, (float)count,
+                                                                       processR, processG, processB, processA,
+                                                                       x, y, srcPix, dstPix);
                     // increment the dst pixel
                     dstPix += nComponents;
                 }
             }
         }
-    } // process
+    } // multiThreadProcessImages
 };
 
 
@@ -517,11 +1072,14 @@ public:
         , _inputRange(NULL)
         , _frameInterval(NULL)
         , _operation(NULL)
+        , _percentile(NULL)
         , _decay(NULL)
         , _outputCount(NULL)
+        , _incremental(NULL)
         , _mix(NULL)
         , _maskApply(NULL)
         , _maskInvert(NULL)
+        , _incrementalStates()
     {
 
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -543,13 +1101,17 @@ public:
         _inputRange = fetchPushButtonParam(kParamInputRangeName);
         _frameInterval = fetchIntParam(kParamFrameIntervalName);
         _operation = fetchChoiceParam(kParamOperation);
+        _percentile = fetchDoubleParam(kParamPercentileName);
         _decay = fetchDoubleParam(kParamDecayName);
         _outputCount = fetchBooleanParam(kParamOutputCountName);
-        assert(_frameRange && _absolute && _inputRange && _operation && _decay && _outputCount);
+        _incremental = fetchBooleanParam(kParamIncrementalName);
+        assert(_frameRange && _absolute && _inputRange && _operation && _percentile && _decay && _outputCount && _incremental);
         _mix = fetchDoubleParam(kParamMix);
         _maskApply = ( ofxsMaskIsAlwaysConnected( OFX::getImageEffectHostDescription() ) && paramExists(kParamMaskApply) ) ? fetchBooleanParam(kParamMaskApply) : 0;
         _maskInvert = fetchBooleanParam(kParamMaskInvert);
         assert(_mix && _maskInvert);
+
+        updateVisibility();
     }
 
 private:
@@ -557,7 +1119,29 @@ private:
     virtual void render(const RenderArguments &args) OVERRIDE FINAL;
 
     /* set up and run a processor */
-    void setupAndProcess(FrameBlendProcessorBase &, const RenderArguments &args);
+    void setupAndProcess(FrameBlendProcessorBase &, FrameBlendIncrementalProcessorBase *, const RenderArguments &args);
+
+    void updateVisibility()
+    {
+        OperationEnum operation = (OperationEnum)_operation->getValue();
+
+        _percentile->setIsSecretAndDisabled(operation != eOperationPercentile);
+    }
+
+    /* update the incremental state to the frame range and render the output */
+    void processIncremental(FrameBlendIncrementalProcessorBase &processor,
+                            const RenderArguments &args,
+                            Image *dst,
+                            const Image *src,
+                            int first,
+                            int interval,
+                            int n,
+                            bool processR,
+                            bool processG,
+                            bool processB,
+                            bool processA,
+                            bool outputCount,
+                            double mix);
 
     virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime, int& view, std::string& plane) OVERRIDE FINAL;
 
@@ -568,6 +1152,9 @@ private:
     /** @brief called when a param has just had its value changed */
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /** @brief called when a clip has just been changed in some way (a rewire maybe) */
+    virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
 private:
 
     template<int nComponents>
@@ -593,11 +1180,14 @@ private:
     PushButtonParam* _inputRange;
     IntParam* _frameInterval;
     ChoiceParam* _operation;
+    DoubleParam* _percentile;
     DoubleParam* _decay;
     BooleanParam* _outputCount;
+    BooleanParam* _incremental;
     DoubleParam* _mix;
     BooleanParam* _maskApply;
     BooleanParam* _maskInvert;
+    FrameBlendIncrementalStates _incrementalStates;
 };
 
 
@@ -626,6 +1216,25 @@ struct OptionalImagesHolder_RAII
     }
 };
 
+// requests for the source images and the foreground mattes of the frames first + i * interval, for i in [imin, imax)
+static void
+getChunkRequests(Clip *srcClip,
+                 Clip *fgMClip,
+                 int first,
+                 int interval,
+                 int imin,
+                 int imax,
+                 std::vector<ImageRequest> *requests)
+{
+    requests->clear();
+    for (int i = imin; i < imax; ++i) {
+        requests->push_back( ImageRequest(srcClip, first + i * interval) );
+    }
+    for (int i = imin; i < imax; ++i) {
+        requests->push_back( ImageRequest(fgMClip, first + i * interval) );
+    }
+}
+
 // Exponentiation by squaring
 // works with positive or negative integer exponents
 template<typename T>
@@ -659,11 +1268,19 @@ ipow(T base,
 
 /* set up and run a processor */
 void
-FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
+FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &blendProcessor,
+                                  FrameBlendIncrementalProcessorBase *incrementalProcessor,
                                   const RenderArguments &args)
 {
     const double time = args.time;
 
+    // the incremental processor can only be used if there is no decay
+    FrameBlendIncrementalProcessorBase *incremental = NULL;
+    if ( incrementalProcessor && _incremental->getValueAtTime(time) && (_decay->getValueAtTime(time) == 0.) ) {
+        incremental = incrementalProcessor;
+    }
+    FrameBlendProcessorBase &processor = incremental ? *incremental : blendProcessor;
+
     auto_ptr<Image> dst( _dstClip->fetchImage(time) );
 
     if ( !dst.get() ) {
@@ -753,12 +1370,31 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
         //last += time; // last is not used anymore
     }
 
+    if (incremental) {
+        processIncremental(*incremental, args, dst.get(), src.get(), first, interval, n,
+                           processR, processG, processB, processA, outputCount, mix);
+
+        return;
+    }
+
     const OfxRectI& renderWindow = args.renderWindow;
     size_t nPixels = (size_t)(renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
     OperationEnum operation = processor.getOperation();
+    const bool quantile = (operation == eOperationMedian || operation == eOperationPercentile);
+    auto_ptr<ImageMemory> quantileAccumulator;
+    float *quantileData = NULL;
+    auto_ptr<ImageMemory> quantilePos;
+    unsigned short *quantilePosData = NULL;
+    // the quantile estimators hold the values of all frames, up to kQuantileExactFrames
+    const int quantileSize = (std::max)( 5, (std::min)(n, kQuantileExactFrames) );
+    if (quantile) {
+        processor.setPercentile(_percentile->getValueAtTime(time) / 100.);
+    }
 
     // Main processing loop.
     // We process the frame range by chunks, to avoid using too much memory.
+    const bool fgM = ( _fgMClip && _fgMClip->isConnected() );
+    OptionalImagesHolder_RAII imgs; // the images of the current chunk
     int imin;
     int imax = 0;
     while (imax < n) {
@@ -768,7 +1404,7 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
 
         if (!lastPass) {
             // Initialize accumulator image (always use float)
-            if (!accumulatorData) {
+            if (!accumulatorData && !quantile) {
                 int dstNComponents = _dstClip->getPixelComponentCount();
                 accumulator.reset( new ImageMemory(nPixels * dstNComponents * sizeof(float), this) );
                 accumulatorData = (float*)accumulator->lock();
@@ -776,6 +1412,8 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
                 case eOperationAverage:
                 case eOperationSum:
                 case eOperationOver:
+                case eOperationMedian:
+                case eOperationPercentile:
                     std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.);
                     break;
                 case eOperationMin:
@@ -789,8 +1427,19 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
                     break;
                 }
             }
-            // Initialize count image if operator is average or outputCount is true and output has alpha (use short)
-            if ( !countData && ( (operation == eOperationAverage) || outputCount ) ) {
+            // Initialize the quantile estimators: quantileSize values (or 5 marker heights) and 3 marker positions per component
+            if (!quantileData && quantile) {
+                int dstNComponents = _dstClip->getPixelComponentCount();
+                quantileAccumulator.reset( new ImageMemory(nPixels * dstNComponents * quantileSize * sizeof(float), this) );
+                quantileData = (float*)quantileAccumulator->lock();
+                quantilePos.reset( new ImageMemory(nPixels * dstNComponents * 3 * sizeof(unsigned short), this) );
+                quantilePosData = (unsigned short*)quantilePos->lock();
+                if (!quantileData || !quantilePosData) {
+                    throwSuiteStatusException(kOfxStatErrMemory);
+                }
+            }
+            // Initialize count image if operator is average or a quantile, or outputCount is true and output has alpha (use short)
+            if ( !countData && ( (operation == eOperationAverage) || quantile || outputCount ) ) {
                 count.reset( new ImageMemory(nPixels * sizeof(unsigned short), this) );
                 countData = (unsigned short*)count->lock();
                 std::fill(countData, countData + nPixels, 0);
@@ -803,56 +1452,179 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
             }
         }
 
-        // fetch the source images
-        OptionalImagesHolder_RAII srcImgs;
-        for (int i = imin; i < imax; ++i) {
-            if ( abort() ) {
-                return;
-            }
-            const Image* src = _srcClip ? _srcClip->fetchImage(first + i * interval) : 0;
-#         ifndef NDEBUG
-            if (src) {
-                checkBadRenderScaleOrField(src, args);
-                BitDepthEnum srcBitDepth      = src->getPixelDepth();
-                PixelComponentEnum srcComponents = src->getPixelComponents();
+        if (imin == 0) {
+            // fetch the images of the first chunk
+            std::vector<ImageRequest> requests;
+            getChunkRequests(_srcClip, fgM ? _fgMClip : NULL, first, interval, imin, imax, &requests);
+            fetchImagesAndProcess(*this, NULL, requests, &imgs.images);
+        }
+        if ( abort() ) {
+            return;
+        }
+        assert( imgs.images.size() == (size_t)(2 * (imax - imin)) );
+        // the source images, followed by the foreground mattes
+        std::vector<const Image*> srcImgs( imgs.images.begin(), imgs.images.begin() + (imax - imin) );
+        std::vector<const Image*> fgMImgs( imgs.images.begin() + (imax - imin), imgs.images.end() );
+#     ifndef NDEBUG
+        for (int i = 0; i < imax - imin; ++i) {
+            if (srcImgs[i]) {
+                checkBadRenderScaleOrField(srcImgs[i], args);
+                BitDepthEnum srcBitDepth      = srcImgs[i]->getPixelDepth();
+                PixelComponentEnum srcComponents = srcImgs[i]->getPixelComponents();
                 if ( (srcBitDepth != dstBitDepth) || (srcComponents != dstComponents) ) {
                     throwSuiteStatusException(kOfxStatErrImageFormat);
                 }
             }
-#         endif
-            srcImgs.images.push_back(src);
         }
-        // fetch the foreground mattes
-        OptionalImagesHolder_RAII fgMImgs;
-        for (int i = imin; i < imax; ++i) {
-            if ( abort() ) {
-                return;
-            }
-            const Image* mask = ( _fgMClip && _fgMClip->isConnected() ) ? _fgMClip->fetchImage(first + i * interval) : 0;
-            if (mask) {
+#     endif
+        for (int i = 0; i < imax - imin; ++i) {
+            if (fgMImgs[i]) {
                 assert( _fgMClip->isConnected() );
-                checkBadRenderScaleOrField(mask, args);
+                checkBadRenderScaleOrField(fgMImgs[i], args);
             }
-            fgMImgs.images.push_back(mask);
         }
 
         // set the images
         if (lastPass) {
             processor.setDstImg( dst.get() );
         }
-        processor.setSrcImgs(lastPass ? src.get() : 0, srcImgs.images);
-        processor.setFgMImgs(fgMImgs.images);
+        processor.setSrcImgs(lastPass ? src.get() : 0, srcImgs);
+        processor.setFgMImgs(fgMImgs);
         // set the render window
         processor.setRenderWindow(renderWindow, args.renderScale);
         processor.setAccumulators(accumulatorData, countData, sumWeightsData);
+        processor.setQuantileAccumulators(quantileData, quantilePosData, quantileSize);
 
         processor.setValues(processR, processG, processB, processA,
                             lastPass, decay, outputCount, mix);
 
+        // Call the base class process member, this will call the derived templated process code,
+        // while the images of the next chunk are being fetched
+        OptionalImagesHolder_RAII nextImgs;
+        std::vector<ImageRequest> requests;
+        getChunkRequests(_srcClip, fgM ? _fgMClip : NULL, first, interval, imax, (std::min)(imax + kFrameChunk, n), &requests);
+        fetchImagesAndProcess(*this, &processor, requests, &nextImgs.images);
+        // the images of this chunk are released by nextImgs
+        std::swap(imgs.images, nextImgs.images);
+    }
+} // FrameBlendPlugin::setupAndProcess
+
+void
+FrameBlendPlugin::processIncremental(FrameBlendIncrementalProcessorBase &processor,
+                                     const RenderArguments &args,
+                                     Image *dst,
+                                     const Image *src,
+                                     int first,
+                                     int interval,
+                                     int n,
+                                     bool processR,
+                                     bool processG,
+                                     bool processB,
+                                     bool processA,
+                                     bool outputCount,
+                                     double mix)
+{
+    const OfxRectI& renderWindow = args.renderWindow;
+    const BitDepthEnum dstBitDepth = dst->getPixelDepth();
+    const PixelComponentEnum dstComponents = dst->getPixelComponents();
+    const int nComponents = dst->getPixelComponentCount();
+    const OperationEnum operation = processor.getOperation();
+    const bool fgM = ( _fgMClip && _fgMClip->isConnected() );
+
+    // take the state left by the previous render, if it can be updated to the current frame range
+    auto_ptr<FrameBlendIncrementalState> state;
+    int nRemoved = 0; // number of frames leaving the range, from the beginning of the previous range
+    int nAdded = n; // number of frames entering the range, at the end of the current range
+    {
+        int shift;
+        state.reset( _incrementalStates.take(args.renderView, renderWindow, args.renderScale, dstBitDepth, nComponents, operation, fgM,
+                                             first, interval, n, &shift) );
+        if ( state.get() ) {
+            nRemoved = nAdded = shift;
+        }
+    }
+    if ( !state.get() ) {
+        state.reset( new FrameBlendIncrementalState(args.renderView, renderWindow, args.renderScale, dstBitDepth, nComponents, operation, fgM,
+                                                    first, interval, n) );
+    }
+    const int previousFirst = state->first;
+    state->first = first;
+    processor.setState( state.get() );
+
+    // Main processing loop: remove the frames which left the range, then add the frames which entered it.
+    // We process the frames by chunks, to avoid using too much memory.
+    int iRemoved = 0;
+    int iAdded = n - nAdded;
+    bool lastPass = false;
+    while (!lastPass) {
+        OptionalImagesHolder_RAII removedSrcImgs;
+        OptionalImagesHolder_RAII removedFgMImgs;
+        OptionalImagesHolder_RAII srcImgs;
+        OptionalImagesHolder_RAII fgMImgs;
+        if (iRemoved < nRemoved) {
+            int imax = (std::min)(iRemoved + kFrameChunk, nRemoved);
+            for (int i = iRemoved; i < imax; ++i) {
+                if ( abort() ) {
+                    return;
+                }
+                const int t = previousFirst + i * interval;
+                const Image* srci = _srcClip ? _srcClip->fetchImage(t) : 0;
+                removedSrcImgs.images.push_back(srci);
+                const Image* mask = fgM ? _fgMClip->fetchImage(t) : 0;
+                removedFgMImgs.images.push_back(mask);
+            }
+            iRemoved = imax;
+        } else {
+            int imax = (std::min)(iAdded + kFrameChunk, n);
+            for (int i = iAdded; i < imax; ++i) {
+                if ( abort() ) {
+                    return;
+                }
+                const int t = first + i * interval;
+                const Image* srci = _srcClip ? _srcClip->fetchImage(t) : 0;
+#             ifndef NDEBUG
+                if (srci) {
+                    checkBadRenderScaleOrField(srci, args);
+                    if ( (srci->getPixelDepth() != dstBitDepth) || (srci->getPixelComponents() != dstComponents) ) {
+                        delete srci;
+                        throwSuiteStatusException(kOfxStatErrImageFormat);
+                    }
+                }
+#             endif
+                srcImgs.images.push_back(srci);
+                const Image* mask = fgM ? _fgMClip->fetchImage(t) : 0;
+                if (mask) {
+                    checkBadRenderScaleOrField(mask, args);
+                }
+                fgMImgs.images.push_back(mask);
+            }
+            iAdded = imax;
+        }
+        lastPass = (iRemoved == nRemoved) && (iAdded == n);
+
+        // set the images
+        if (lastPass) {
+            processor.setDstImg(dst);
+        }
+        processor.setSrcImgs(lastPass ? src : 0, srcImgs.images);
+        processor.setFgMImgs(fgMImgs.images);
+        processor.setRemovedImgs(removedSrcImgs.images, removedFgMImgs.images);
+        // set the render window
+        processor.setRenderWindow(renderWindow, args.renderScale);
+
+        processor.setValues(processR, processG, processB, processA,
+                            lastPass, 0., outputCount, mix);
+
         // Call the base class process member, this will call the derived templated process code
         processor.process();
     }
-} // FrameBlendPlugin::setupAndProcess
+
+    if ( abort() ) {
+        // the state is incomplete
+        return;
+    }
+    _incrementalStates.put( state.release() );
+} // FrameBlendPlugin::processIncremental
 
 // the overridden render function
 void
@@ -930,6 +1702,14 @@ FrameBlendPlugin::renderForBitDepth(const RenderArguments &args)
     case eOperationOver:
         renderForOperation<PIX, nComponents, maxValue, eOperationOver>(args);
         break;
+
+    case eOperationMedian:
+        renderForOperation<PIX, nComponents, maxValue, eOperationMedian>(args);
+        break;
+
+    case eOperationPercentile:
+        renderForOperation<PIX, nComponents, maxValue, eOperationPercentile>(args);
+        break;
     }
 }
 
@@ -938,7 +1718,14 @@ void
 FrameBlendPlugin::renderForOperation(const RenderArguments &args)
 {
     FrameBlendProcessor<PIX, nComponents, maxValue, operation> fred(*this);
-    setupAndProcess(fred, args);
+    if ( (operation == eOperationAverage) || (operation == eOperationSum) || (operation == eOperationProduct) ) {
+        FrameBlendIncrementalProcessor<PIX, nComponents, maxValue, operation> incremental(*this);
+        setupAndProcess(fred, &incremental, args);
+    } else {
+        // over depends on the order of the frames, and the extrema and quantiles of the frames
+        // cannot be updated when a frame leaves the range without keeping all the frames
+        setupAndProcess(fred, NULL, args);
+    }
 }
 
 bool
@@ -1103,7 +1890,19 @@ FrameBlendPlugin::changedParam(const InstanceChangedArgs &args,
         }
         _frameRange->setValue( (int)range.min, (int)range.max );
         _absolute->setValue(true);
+    } else if (paramName == kParamOperation) {
+        updateVisibility();
     }
+
+    // the incremental states may not correspond to the parameters anymore
+    _incrementalStates.clear();
+}
+
+void
+FrameBlendPlugin::changedClip(const InstanceChangedArgs & /*args*/,
+                              const std::string & /*clipName*/)
+{
+    _incrementalStates.clear();
 }
 
 mDeclarePluginFactory(FrameBlendPluginFactory, {ofxsThreadSuiteCheck();}, {});
@@ -1290,12 +2089,28 @@ FrameBlendPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         param->appendOption(kParamOperationOptionProduct);
         assert(param->getNOptions() == (int)eOperationOver);
         param->appendOption(kParamOperationOptionOver);
+        assert(param->getNOptions() == (int)eOperationMedian);
+        param->appendOption(kParamOperationOptionMedian);
+        assert(param->getNOptions() == (int)eOperationPercentile);
+        param->appendOption(kParamOperationOptionPercentile);
         param->setDefault( (int)kParamOperationDefault );
         if (page) {
             page->addChild(*param);
         }
     }
 
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamPercentileName);
+        param->setLabel(kParamPercentileLabel);
+        param->setHint(kParamPercentileHint);
+        param->setRange(0., 100.);
+        param->setDisplayRange(0., 100.);
+        param->setDefault(50.);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         DoubleParamDescriptor *param = desc.defineDoubleParam(kParamDecayName);
         param->setLabel(kParamDecayLabel);
@@ -1317,6 +2132,17 @@ FrameBlendPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamIncrementalName);
+        param->setLabel(kParamIncrementalLabel);
+        param->setHint(kParamIncrementalHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     ofxsMaskMixDescribeParams(desc, page);
 } // FrameBlendPluginFactory::describeInContext
 
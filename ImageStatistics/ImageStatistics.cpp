@@ -22,10 +22,20 @@
  */
 
 #include <cmath>
+#include <cstring>
 #include <cfloat> // DBL_MAX
 #include <climits>
 #include <algorithm>
 #include <limits>
+#include <vector>
+#include <map>
+#include <string>
+#include <cerrno>
+#include <cstdio>
+#include <stdio.h> // for snprintf & _snprintf
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#  define snprintf _snprintf
+#endif
 
 #include "ofxsProcessing.H"
 #include "ofxsRectangleInteract.h"
@@ -35,10 +45,15 @@
 #include "ofxsLut.h"
 #include "ofxsThreadSuite.h"
 #include "ofxsMultiThread.h"
+#include "ofxsReduction.h"
+#include "ofxsSampling.h"
+#include "ofxsMaskMix.h"
+#include "ofxsFileOpen.h"
+
 #ifdef OFX_USE_MULTITHREAD_MUTEX
 namespace {
-typedef MultiThread::Mutex Mutex;
-typedef MultiThread::AutoMutex AutoMutex;
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
 }
 #else
 // some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
@@ -78,11 +93,22 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "The statistics can be computed either on RGBA components, in the HSVL colorspace " \
     "(which is the HSV colorspace with an additional L component from HSL), or the " \
     "position and value of the pixels with the maximum and minimum luminance values can be computed.\n" \
+    "The median and two percentiles of the RGBA components are computed with the RGBA statistics.\n" \
+    "If the Mask input is connected, only the pixels where the mask is non-zero are analyzed.\n" \
+    "The RGBA statistics of each analyzed frame can also be appended to a CSV file (see Export File), " \
+    "so that they can be collected while rendering.\n" \
     "The color values of the minimum and maximum luma pixels for an image sequence " \
     "can be used as black and white point in a Grade node to remove flicker from the same sequence."
 #define kPluginIdentifier "net.sf.openfx.ImageStatistics"
+// History:
+// version 1.0: initial version
+// version 1.1: single-pass computation of all statistics
+// version 1.2: Analyze Sequence only fetches the analysis region and analyzes several frames concurrently
+// version 1.3: add Mask input, median and percentiles
+// version 1.4: add Sampled Auto Update and Mean Error
+// version 1.5: add Export File
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 5 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -116,6 +142,12 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamAutoUpdateLabel "Auto Update"
 #define kParamAutoUpdateHint "Automatically update values when input or rectangle changes if an analysis was performed at current frame. If not checked, values are only updated if the plugin parameters change. "
 
+#define kParamSampledUpdate "sampledUpdate"
+#define kParamSampledUpdateLabel "Sampled Auto Update"
+#define kParamSampledUpdateHint "While the rectangle is dragged in the viewer with Interactive Update checked, only analyze one pixel in each block of a regular grid, so that about 65536 pixels are analyzed whatever the size of the analysis region. The values are then estimates, and Mean Error gives the precision of the mean. All pixels are analyzed again when the mouse button is released, and in all other cases."
+
+#define kParamRectangleDrag "rectangleDrag" // secret, true while the rectangle is dragged with sampled updates
+
 #define kParamGroupRGBA "RGBA"
 
 #define kParamStatMin "statMin"
@@ -130,6 +162,20 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStatMeanLabel "Mean"
 #define kParamStatMeanHint "The mean is the average. Add up the values, and divide by the number of values."
 
+#define kParamExportFile "exportFile"
+#define kParamExportFileLabel "Export File"
+#define kParamExportFileHint "If not empty, the RGBA statistics of each analyzed frame are appended to this CSV file: by Analyze Frame, Analyze Sequence, and automatic updates. " \
+    "If Auto Update is checked, each frame rendered non-interactively (e.g. when rendering to disk) is analyzed and exported, even if it was never analyzed before, so that statistics can be collected by rendering. " \
+    "The whole analysis region is analyzed, even if the frame is rendered in tiles. In a stereo or multiview render, only the main view (the first one) is exported. " \
+    "The lines of the rendered frames are written when the render ends, and the host waits for the file to be written. " \
+    "The first line gives the column names: time, count (the number of analyzed pixels), then the R, G, B and A values of Min., Max., Mean, Mean Error, S.Dev., Skewness, Kurtosis, Median, Low Percentile Value and High Percentile Value. " \
+    "A frame appears once each time it is analyzed or rendered: the last line for a frame is the most recent analysis. " \
+    "Several processes should not export to the same file: their lines may be interleaved, and the column names may be written several times."
+
+#define kParamStatMeanError "statMeanError"
+#define kParamStatMeanErrorLabel "Mean Error"
+#define kParamStatMeanErrorHint "Half-width of the 95% confidence interval of the Mean, if the values were estimated from a sample of the pixels (see Sampled Auto Update), or 0 if all pixels were analyzed."
+
 #define kParamStatSDev "statSDev"
 #define kParamStatSDevLabel "S.Dev."
 #define kParamStatSDevHint "The standard deviation (S.Dev.) quantifies variability or scatter, and it is expressed in the same units as your data."
@@ -155,6 +201,26 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "• The skewness is unitless.\n" \
     "• Any threshold or rule of thumb is arbitrary, but here is one: If the skewness is greater than 1.0 (or less than -1.0), the skewness is substantial and the distribution is far from symmetrical."
 
+#define kParamStatMedian "statMedian"
+#define kParamStatMedianLabel "Median"
+#define kParamStatMedianHint "The median is the value that separates the lower half from the upper half of the values."
+
+#define kParamPercentileLow "percentileLow"
+#define kParamPercentileLowLabel "Low Percentile"
+#define kParamPercentileLowHint "The percentile reported by Low Percentile Value, from 0 to 100. 0 gives the minimum value."
+
+#define kParamStatPercentileLow "statPercentileLow"
+#define kParamStatPercentileLowLabel "Low Percentile Value"
+#define kParamStatPercentileLowHint "The value below which Low Percentile percent of the values fall. Percentiles are interpolated linearly between the closest values."
+
+#define kParamPercentileHigh "percentileHigh"
+#define kParamPercentileHighLabel "High Percentile"
+#define kParamPercentileHighHint "The percentile reported by High Percentile Value, from 0 to 100. 100 gives the maximum value."
+
+#define kParamStatPercentileHigh "statPercentileHigh"
+#define kParamStatPercentileHighLabel "High Percentile Value"
+#define kParamStatPercentileHighHint "The value below which High Percentile percent of the values fall. Percentiles are interpolated linearly between the closest values."
+
 
 #define kParamGroupHSVL "HSVL"
 
@@ -273,6 +339,11 @@ static bool gHostSupportsDefaultCoordinateSystem = true; // for kParamDefaultsNo
 #define POINT_TOLERANCE 6
 #define POINT_SIZE 5
 
+// maximum memory used by the source images of the frames analyzed concurrently by Analyze Sequence
+#define kSequenceAnalysisMaxMemory (1024 * 1024 * 1024)
+#define kSampledUpdateSamples 65536 // number of pixels analyzed by a sampled update
+#define kConfidence95 1.959963984540054 // two-sided 95% quantile of the normal distribution
+
 
 struct RGBAValues
 {
@@ -285,777 +356,713 @@ struct RGBAValues
 struct Results
 {
     Results()
-    : min( std::numeric_limits<double>::infinity() )
+    : count(0)
+    , min( std::numeric_limits<double>::infinity() )
     , max( -std::numeric_limits<double>::infinity() )
     , mean(0.)
+    , meanError(0.)
     , sdev( std::numeric_limits<double>::infinity() )
     , skewness( std::numeric_limits<double>::infinity() )
     , kurtosis( std::numeric_limits<double>::infinity() )
+    , median(0.)
+    , percentileLow(0.)
+    , percentileHigh(0.)
     , maxVal( -std::numeric_limits<double>::infinity() )
     , minVal( std::numeric_limits<double>::infinity() )
     {
         maxPos.x = maxPos.y = minPos.x = minPos.y = 0.;
     }
 
+    unsigned long count; // number of analyzed pixels
     RGBAValues min;
     RGBAValues max;
     RGBAValues mean;
+    RGBAValues meanError; // RGBA only
     RGBAValues sdev;
     RGBAValues skewness;
     RGBAValues kurtosis;
+    RGBAValues median; // RGBA only
+    RGBAValues percentileLow; // RGBA only
+    RGBAValues percentileHigh; // RGBA only
     OfxPointD maxPos; // luma only
     RGBAValues maxVal; // luma only
     OfxPointD minPos; // luma only
     RGBAValues minVal; // luma only
 };
 
-class ImageStatisticsProcessorBase
-    : public ImageProcessor
+// The results of the analysis of a frame
+struct FrameAnalysis
 {
-protected:
-    Mutex _mutex; //< this is used so we can multi-thread the analysis and protect the shared results
-    unsigned long _count;
-
-public:
-    ImageStatisticsProcessorBase(ImageEffect &instance)
-        : ImageProcessor(instance)
-        , _mutex()
-        , _count(0)
-    {
-    }
-
-    virtual ~ImageStatisticsProcessorBase()
+    FrameAnalysis()
+    : time(0.)
+    , valid(false)
+    , rgba()
+    , hsvl()
+    , luma()
     {
     }
 
-    virtual void setPrevResults(double time, const Results &results) = 0;
-    virtual void getResults(Results *results) = 0;
+    double time;
+    bool valid; // false if the frame could not be analyzed
+    Results rgba;
+    Results hsvl;
+    Results luma;
+};
 
-protected:
+// Streaming statistics of a set of samples: min, max, mean, and sums of the powers of the deviations from the mean.
+// Samples are added with the single-pass update by Welford, extended to the third and fourth powers
+// by Terriberry, and partial statistics (e.g. computed by different threads) are combined with the
+// pairwise formulas from P. Pébay, "Formulas for robust, one-pass parallel computation of covariances
+// and arbitrary-order statistical moments", Sandia report SAND2008-6212, 2008.
+// The number of samples is not stored here, since it is the same for all the components of a pixel.
+struct Moments
+{
+    double min;
+    double max;
+    double mean;
+    double m2; // sum of (x - mean)^2
+    double m3; // sum of (x - mean)^3
+    double m4; // sum of (x - mean)^4
 
-    template<class PIX, int nComponents, int maxValue>
-    void toRGBA(const PIX *p,
-                RGBAValues* rgba)
+    Moments()
+        : min( std::numeric_limits<double>::infinity() )
+        , max( -std::numeric_limits<double>::infinity() )
+        , mean(0.)
+        , m2(0.)
+        , m3(0.)
+        , m4(0.)
     {
-        if (nComponents == 4) {
-            rgba->r = p[0] / (double)maxValue;
-            rgba->g = p[1] / (double)maxValue;
-            rgba->b = p[2] / (double)maxValue;
-            rgba->a = p[3] / (double)maxValue;
-        } else if (nComponents == 3) {
-            rgba->r = p[0] / (double)maxValue;
-            rgba->g = p[1] / (double)maxValue;
-            rgba->b = p[2] / (double)maxValue;
-            rgba->a = 0;
-        } else if (nComponents == 2) {
-            rgba->r = p[0] / (double)maxValue;
-            rgba->g = p[1] / (double)maxValue;
-            rgba->b = 0;
-            rgba->a = 0;
-        } else if (nComponents == 1) {
-            rgba->r = 0;
-            rgba->g = 0;
-            rgba->b = 0;
-            rgba->a = p[0] / (double)maxValue;
-        } else {
-            rgba->r = 0;
-            rgba->g = 0;
-            rgba->b = 0;
-            rgba->a = 0;
-        }
     }
 
-    template<class PIX, int nComponents, int maxValue>
-    void pixToHSVL(const PIX *p,
-                   float hsvl[4])
+    // add sample x. n is the number of samples including x, and invn = 1/n.
+    void add(double x,
+             double n,
+             double invn)
     {
-        if ( (nComponents == 4) || (nComponents == 3) ) {
-            float r, g, b;
-            r = p[0] / (float)maxValue;
-            g = p[1] / (float)maxValue;
-            b = p[2] / (float)maxValue;
-            Color::rgb_to_hsv(r, g, b, &hsvl[0], &hsvl[1], &hsvl[2]);
-            hsvl[0] *= 360 / OFXS_HUE_CIRCLE;
-            float min = (std::min)((std::min)(r, g), b);
-            float max = (std::max)((std::max)(r, g), b);
-            hsvl[3] = (min + max) / 2;
-        } else {
-            hsvl[0] = hsvl[1] = hsvl[2] = hsvl[3] = 0.f;
-        }
+        min = (std::min)(min, x);
+        max = (std::max)(max, x);
+        double delta = x - mean;
+        double delta_n = delta * invn;
+        double delta_n2 = delta_n * delta_n;
+        double term1 = delta * delta_n * (n - 1);
+        mean += delta_n;
+        m4 += term1 * delta_n2 * (n * n - 3 * n + 3) + 6 * delta_n2 * m2 - 4 * delta_n * m3;
+        m3 += term1 * delta_n * (n - 2) - 3 * delta_n * m2;
+        m2 += term1;
     }
 
-    template<class PIX, int nComponents, int maxValue>
-    void toComponents(const RGBAValues& rgba,
-                      PIX *p)
+    // merge the statistics b of nb samples into these statistics of na samples
+    void merge(const Moments &b,
+               double na,
+               double nb)
     {
-        if (nComponents == 4) {
-            p[0] = rgba.r * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-            p[1] = rgba.g * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-            p[2] = rgba.b * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-            p[3] = rgba.a * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-        } else if (nComponents == 3) {
-            p[0] = rgba.r * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-            p[1] = rgba.g * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-            p[2] = rgba.b * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-        } else if (nComponents == 2) {
-            p[0] = rgba.r * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-            p[1] = rgba.g * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
-        } else if (nComponents == 1) {
-            p[0] = rgba.a * maxValue + ( (maxValue != 1) ? 0.5 : 0 );
+        if (nb <= 0) {
+            return;
         }
-    }
-};
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageMinMaxMeanProcessor
-    : public ImageStatisticsProcessorBase
-{
-private:
-    double _min[nComponents];
-    double _max[nComponents];
-    double _sum[nComponents];
+        if (na <= 0) {
+            *this = b;
 
-public:
-    ImageMinMaxMeanProcessor(ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill( _min, _min + nComponents, +std::numeric_limits<double>::infinity() );
-        std::fill( _max, _max + nComponents, -std::numeric_limits<double>::infinity() );
-        std::fill(_sum, _sum + nComponents, 0.);
+            return;
+        }
+        min = (std::min)(min, b.min);
+        max = (std::max)(max, b.max);
+        double n = na + nb;
+        double delta = b.mean - mean;
+        double delta2 = delta * delta;
+        double nanb = na * nb;
+        double m2a = m2;
+        double m3a = m3;
+        mean += delta * nb / n;
+        m2 += b.m2 + delta2 * nanb / n;
+        m3 += b.m3 + delta2 * delta * nanb * (na - nb) / (n * n) + 3 * delta * (na * b.m2 - nb * m2a) / n;
+        m4 += b.m4 + delta2 * delta2 * nanb * (na * na - nanb + nb * nb) / (n * n * n)
+              + 6 * delta2 * (na * na * b.m2 + nb * nb * m2a) / (n * n) + 4 * delta * (na * b.m3 - nb * m3a) / n;
     }
 
-    ~ImageMinMaxMeanProcessor()
+    // compute the statistics from the moments of n samples, following the same definitions as the Results hints
+    double sdev(double n) const
     {
+        // sdev^2 is an unbiased estimator for the population variance
+        return std::sqrt( (std::max)( 0., m2 / (n - 1) ) );
     }
 
-    void setPrevResults(double /* time */,
-                        const Results & /*results*/) OVERRIDE FINAL {}
-
-    void getResults(Results *results) OVERRIDE FINAL
+    double skewness(double n) const
     {
-        if (_count > 0) {
-            toRGBA<double, nComponents, 1>(_min, &results->min);
-            toRGBA<double, nComponents, 1>(_max, &results->max);
-            double mean[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                mean[c] = _sum[c] / _count;
-            }
-            toRGBA<double, nComponents, 1>(mean, &results->mean);
-        }
-    }
-
-private:
+        double s = sdev(n);
 
-    void addResults(double min[nComponents],
-                    double max[nComponents],
-                    double sum[nComponents],
-                    unsigned long count)
-    {
-        AutoMutex l (&_mutex);
-        for (int c = 0; c < nComponents; ++c) {
-            _min[c] = (std::min)(_min[c], min[c]);
-            _max[c] = (std::max)(_max[c], max[c]);
-            _sum[c] += sum[c];
+        if (s <= 0.) {
+            return 0.;
         }
-        _count += count;
+
+        // adjusted Fisher-Pearson standardized moment coefficient G_1
+        return n / ( (n - 1) * (n - 2) ) * m3 / (s * s * s);
     }
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    double kurtosis(double n) const
     {
-        unused(rs);
-        double min[nComponents], max[nComponents], sum[nComponents];
+        double s = sdev(n);
+        double kurtshift = -3 * ( (n - 1) * (n - 1) ) / ( (n - 2) * (n - 3) );
 
-        std::fill( min, min + nComponents, +std::numeric_limits<double>::infinity() );
-        std::fill( max, max + nComponents, -std::numeric_limits<double>::infinity() );
-        std::fill(sum, sum + nComponents, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = *dstPix;
-                    min[c] = (std::min)(min[c], v);
-                    max[c] = (std::max)(max[c], v);
-                    sumLine[c] += v;
-                    ++dstPix;
-                }
-            }
-            for (int c = 0; c < nComponents; ++c) {
-                sum[c] += sumLine[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+        if (s <= 0.) {
+            return kurtshift;
         }
+        double kurtfac = ( (n + 1) * n ) / ( (n - 1) * (n - 2) * (n - 3) );
 
-        addResults(min, max, sum, count);
+        return kurtfac * m4 / (s * s * s * s) + kurtshift;
     }
 };
 
+#define nComponentsHSVL 4
 
-template <class PIX, int nComponents, int maxValue>
-class ImageSDevProcessor
-    : public ImageStatisticsProcessorBase
+// The position and value of the pixels with the minimum and maximum luma
+struct LumaExtrema
 {
-private:
-    double _mean[nComponents];
-    double _sum_p2[nComponents];
-
-public:
-    ImageSDevProcessor(ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean + nComponents, 0.);
-        std::fill(_sum_p2, _sum_p2 + nComponents, 0.);
-    }
-
-    ~ImageSDevProcessor()
-    {
-    }
+    OfxPointD maxPos;
+    double maxVal[4];
+    double maxLuma;
+    OfxPointD minPos;
+    double minVal[4];
+    double minLuma;
 
-    void setPrevResults(double /* time */,
-                        const Results &results) OVERRIDE FINAL
+    LumaExtrema()
+        : maxLuma( -std::numeric_limits<double>::infinity() )
+        , minLuma( std::numeric_limits<double>::infinity() )
     {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
+        maxPos.x = maxPos.y = minPos.x = minPos.y = 0.;
+        std::fill( maxVal, maxVal + 4, -std::numeric_limits<double>::infinity() );
+        std::fill( minVal, minVal + 4, +std::numeric_limits<double>::infinity() );
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    void merge(const LumaExtrema &b)
     {
-        if (_count > 1) {
-            double sdev[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt( (std::max)( 0., _sum_p2[c] / (_count - 1) ) );
-            }
-            toRGBA<double, nComponents, 1>(sdev, &results->sdev);
+        if (b.maxLuma > maxLuma) {
+            maxPos = b.maxPos;
+            std::copy(b.maxVal, b.maxVal + 4, maxVal);
+            maxLuma = b.maxLuma;
+        }
+        if (b.minLuma < minLuma) {
+            minPos = b.minPos;
+            std::copy(b.minVal, b.minVal + 4, minVal);
+            minLuma = b.minLuma;
         }
     }
+};
 
-private:
+// Percentiles are computed from per-component histograms of an order-preserving integer key.
+// Integer samples have one bin per value, so that the histogram gives the exact percentiles.
+// Float samples are binned using the 16 most significant bits of their key, so that floats of
+// any magnitude can be binned in the same pass as the moments, without knowing their range.
+// The remaining bits of the keys of the percentiles are then found by radix selection: each
+// refinement pass computes the histograms of the next kRefineBits bits of the keys that start
+// with the known bits, so that memory does not depend on the number of samples in a bin.
+template <class PIX>
+struct HistogramBinning;
+
+template <>
+struct HistogramBinning<unsigned char>
+{
+    static const int nBins = 256;
+    static const int shift = 0; // number of key bits below the bin
+    static unsigned int key(unsigned char v) { return v; }
+    static int bin(unsigned char v) { return v; }
+    static unsigned char value(unsigned int k) { return (unsigned char)k; }
+};
 
-    void addResults(double sum_p2[nComponents],
-                    unsigned long count)
-    {
-        AutoMutex l (&_mutex);
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p2[c] += sum_p2[c];
-        }
-        _count += count;
-    }
+template <>
+struct HistogramBinning<unsigned short>
+{
+    static const int nBins = 65536;
+    static const int shift = 0;
+    static unsigned int key(unsigned short v) { return v; }
+    static int bin(unsigned short v) { return v; }
+    static unsigned short value(unsigned int k) { return (unsigned short)k; }
+};
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+template <>
+struct HistogramBinning<float>
+{
+    static const int nBins = 65536;
+    static const int shift = 16;
+    static unsigned int key(float v)
     {
-        unused(rs);
-        double sum_p2[nComponents];
+        unsigned int u;
 
-        std::fill(sum_p2, sum_p2 + nComponents, 0.);
-        unsigned long count = 0;
+        std::memcpy( &u, &v, sizeof(u) );
 
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
+        // negative floats are ordered backwards
+        return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+    }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p2[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponents, 0.);
+    static int bin(float v) { return (int)(key(v) >> shift); }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = (*dstPix - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                    ++dstPix;
-                }
-            }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p2[c] += sumLine_p2[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
-        }
+    static float value(unsigned int k)
+    {
+        unsigned int u = (k & 0x80000000u) ? (k & 0x7fffffffu) : ~k;
+        float v;
 
-        addResults(sum_p2, count);
+        std::memcpy( &v, &u, sizeof(v) );
+
+        return v;
     }
 };
 
+#define kRefineBits 8 // number of key bits found by each refinement pass
+#define kRefineBins (1 << kRefineBits)
 
-template <class PIX, int nComponents, int maxValue>
-class ImageSkewnessKurtosisProcessor
-    : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponents];
-    double _sdev[nComponents];
-    double _sum_p3[nComponents];
-    double _sum_p4[nComponents];
-
-public:
-    ImageSkewnessKurtosisProcessor(ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean + nComponents, 0.);
-        std::fill(_sdev, _sdev + nComponents, 0.);
-        std::fill(_sum_p3, _sum_p3 + nComponents, 0.);
-        std::fill(_sum_p4, _sum_p4 + nComponents, 0.);
-    }
+#define kPercentileCount 3 // median, low and high percentiles
 
-    ~ImageSkewnessKurtosisProcessor()
-    {
-    }
+// All the statistics computed in a single pass over an image
+struct Statistics
+{
+    unsigned long count;
+    Moments rgba[4]; // indexed by component
+    Moments hsvl[nComponentsHSVL];
+    LumaExtrema luma;
+    std::vector<unsigned long> histogram[4]; // RGBA histograms, empty if percentiles are not computed
 
-    void setPrevResults(double /* time */,
-                        const Results &results) OVERRIDE FINAL
+    Statistics()
+        : count(0)
     {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
-        toComponents<double, nComponents, 1>(results.sdev, _sdev);
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    void merge(const Statistics &b)
     {
-        if (_count > 2) {
-            double skewness[nComponents];
-            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ( (double)_count * _count ) / ( (double)(_count - 1) * (_count - 2) );
-            assert( !OFX::IsNaN(skewfac) );
-            for (int c = 0; c < nComponents; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
-            }
-            toRGBA<double, nComponents, 1>(skewness, &results->skewness);
-            assert( !OFX::IsNaN(results->skewness.r) && !OFX::IsNaN(results->skewness.g) && !OFX::IsNaN(results->skewness.b) && !OFX::IsNaN(results->skewness.a) );
+        for (int c = 0; c < 4; ++c) {
+            rgba[c].merge(b.rgba[c], count, b.count);
         }
-        if (_count > 3) {
-            double kurtosis[nComponents];
-            double kurtfac = ( (double)(_count + 1) * _count ) / ( (double)(_count - 1) * (_count - 2) * (_count - 3) );
-            double kurtshift = -3 * ( (double)(_count - 1) * (_count - 1) ) / ( (double)(_count - 2) * (_count - 3) );
-            assert( !OFX::IsNaN(kurtfac) && !OFX::IsNaN(kurtshift) );
-            for (int c = 0; c < nComponents; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
+        for (int c = 0; c < nComponentsHSVL; ++c) {
+            hsvl[c].merge(b.hsvl[c], count, b.count);
+        }
+        luma.merge(b.luma);
+        for (int c = 0; c < 4; ++c) {
+            if ( histogram[c].empty() ) {
+                histogram[c] = b.histogram[c];
+            } else if ( !b.histogram[c].empty() ) {
+                assert( histogram[c].size() == b.histogram[c].size() );
+                for (size_t i = 0; i < histogram[c].size(); ++i) {
+                    histogram[c][i] += b.histogram[c][i];
+                }
             }
-            toRGBA<double, nComponents, 1>(kurtosis, &results->kurtosis);
-            assert( !OFX::IsNaN(results->kurtosis.r) && !OFX::IsNaN(results->kurtosis.g) && !OFX::IsNaN(results->kurtosis.b) && !OFX::IsNaN(results->kurtosis.a) );
         }
+        count += b.count;
     }
+};
 
-private:
-
-    void addResults(double sum_p3[nComponents],
-                    double sum_p4[nComponents],
-                    unsigned long count)
-    {
-        AutoMutex l (&_mutex);
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
-        }
-        _count += count;
-    }
+// The histograms computed by a refinement pass: for each component, kRefineBins bins for each
+// key prefix being refined
+struct RefinementHistograms
+{
+    std::vector<unsigned long> histogram[4]; // indexed by component
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    void merge(const RefinementHistograms &b)
     {
-        unused(rs);
-        double sum_p3[nComponents];
-        double sum_p4[nComponents];
-
-        std::fill(sum_p3, sum_p3 + nComponents, 0.);
-        std::fill(sum_p4, sum_p4 + nComponents, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p3[nComponents]; // partial sum to avoid underflows
-            double sumLine_p4[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponents, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (*dstPix - _mean[c]) / _sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
-                    }
-                    ++dstPix;
+        for (int c = 0; c < 4; ++c) {
+            if ( histogram[c].empty() ) {
+                histogram[c] = b.histogram[c];
+            } else if ( !b.histogram[c].empty() ) {
+                assert( histogram[c].size() == b.histogram[c].size() );
+                for (size_t i = 0; i < histogram[c].size(); ++i) {
+                    histogram[c][i] += b.histogram[c][i];
                 }
             }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
         }
-
-        addResults(sum_p3, sum_p4, count);
     }
 };
 
-#define nComponentsHSVL 4
-
-template <class PIX, int nComponents, int maxValue>
-class ImageHSVLMinMaxMeanProcessor
-    : public ImageStatisticsProcessorBase
+class ImageStatisticsProcessorBase
+    : public ImageProcessor
 {
-private:
-    double _min[nComponentsHSVL];
-    double _max[nComponentsHSVL];
-    double _sum[nComponentsHSVL];
+protected:
+    ThreadReduction<Statistics> _partials; //< the results of each thread, merged once process() returns
+    ThreadReduction<RefinementHistograms> _refinements; //< the histograms computed by each thread in the refinement pass
+    const Image *_maskImg;
+    bool _doMasking;
+    bool _maskInvert;
+    bool _doRGBA;
+    bool _doHSVL;
+    bool _doLuma;
+    LuminanceMathEnum _luminanceMath;
+    double _percentiles[kPercentileCount];
+    int _samplingStep; // if > 1, one pixel is analyzed in each block of _samplingStep x _samplingStep pixels
 
 public:
-    ImageHSVLMinMaxMeanProcessor(ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
+    ImageStatisticsProcessorBase(ImageEffect &instance)
+        : ImageProcessor(instance)
+        , _partials()
+        , _refinements()
+        , _maskImg(NULL)
+        , _doMasking(false)
+        , _maskInvert(false)
+        , _doRGBA(false)
+        , _doHSVL(false)
+        , _doLuma(false)
+        , _luminanceMath(eLuminanceMathRec709)
+        , _samplingStep(1)
     {
-        std::fill( _min, _min + nComponentsHSVL, +std::numeric_limits<double>::infinity() );
-        std::fill( _max, _max + nComponentsHSVL, -std::numeric_limits<double>::infinity() );
-        std::fill(_sum, _sum + nComponentsHSVL, 0.);
+        _percentiles[0] = 50.;
+        _percentiles[1] = 0.;
+        _percentiles[2] = 100.;
     }
 
-    ~ImageHSVLMinMaxMeanProcessor()
+    virtual ~ImageStatisticsProcessorBase()
     {
     }
 
-    void setPrevResults(double /* time */,
-                        const Results & /*results*/) OVERRIDE FINAL {}
+    // only the pixels where the mask is non-zero are analyzed
+    void setMaskImg(const Image *v,
+                    bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    void doMasking(bool v) { _doMasking = v; }
+
+    // select the statistics to compute. Percentiles are computed with the RGBA statistics.
+    void setValues(bool doRGBA,
+                   bool doHSVL,
+                   bool doLuma,
+                   LuminanceMathEnum luminanceMath,
+                   double percentileLow,
+                   double percentileHigh)
     {
-        if (_count > 0) {
-            toRGBA<double, nComponentsHSVL, 1>(_min, &results->min);
-            toRGBA<double, nComponentsHSVL, 1>(_max, &results->max);
-            double mean[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                mean[c] = _sum[c] / _count;
-            }
-            toRGBA<double, nComponentsHSVL, 1>(mean, &results->mean);
-        }
+        _doRGBA = doRGBA;
+        _doHSVL = doHSVL;
+        _doLuma = doLuma;
+        _luminanceMath = luminanceMath;
+        _percentiles[1] = percentileLow;
+        _percentiles[2] = percentileHigh;
     }
 
-private:
+    // only analyze one pixel in each block of step x step pixels of the render window
+    void setSamplingStep(int step) { _samplingStep = (std::max)(1, step); }
+
+    // must be called each time process() returns. If it returns true, process() must be called
+    // again to run a refinement pass.
+    virtual bool prepareRefinement() = 0;
+
+    // must be called once process() returns, and after the refinement pass if there is one
+    virtual void getResults(Results *rgbaResults, Results *hsvlResults, Results *lumaResults) = 0;
 
-    void addResults(double min[nComponentsHSVL],
-                    double max[nComponentsHSVL],
-                    double sum[nComponentsHSVL],
-                    unsigned long count)
+protected:
+
+    template<class PIX, int nComponents, int maxValue>
+    void toRGBA(const PIX *p,
+                RGBAValues* rgba)
     {
-        AutoMutex l (&_mutex);
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _min[c] = (std::min)(_min[c], min[c]);
-            _max[c] = (std::max)(_max[c], max[c]);
-            _sum[c] += sum[c];
+        if (nComponents == 4) {
+            rgba->r = p[0] / (double)maxValue;
+            rgba->g = p[1] / (double)maxValue;
+            rgba->b = p[2] / (double)maxValue;
+            rgba->a = p[3] / (double)maxValue;
+        } else if (nComponents == 3) {
+            rgba->r = p[0] / (double)maxValue;
+            rgba->g = p[1] / (double)maxValue;
+            rgba->b = p[2] / (double)maxValue;
+            rgba->a = 0;
+        } else if (nComponents == 2) {
+            rgba->r = p[0] / (double)maxValue;
+            rgba->g = p[1] / (double)maxValue;
+            rgba->b = 0;
+            rgba->a = 0;
+        } else if (nComponents == 1) {
+            rgba->r = 0;
+            rgba->g = 0;
+            rgba->b = 0;
+            rgba->a = p[0] / (double)maxValue;
+        } else {
+            rgba->r = 0;
+            rgba->g = 0;
+            rgba->b = 0;
+            rgba->a = 0;
         }
-        _count += count;
     }
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    template<class PIX, int nComponents, int maxValue>
+    void pixToHSVL(const PIX *p,
+                   float hsvl[4])
     {
-        unused(rs);
-        double min[nComponentsHSVL], max[nComponentsHSVL], sum[nComponentsHSVL];
-
-        std::fill( min, min + nComponentsHSVL, +std::numeric_limits<double>::infinity() );
-        std::fill( max, max + nComponentsHSVL, -std::numeric_limits<double>::infinity() );
-        std::fill(sum, sum + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
+        if ( (nComponents == 4) || (nComponents == 3) ) {
+            float r, g, b;
+            r = p[0] / (float)maxValue;
+            g = p[1] / (float)maxValue;
+            b = p[2] / (float)maxValue;
+            Color::rgb_to_hsv(r, g, b, &hsvl[0], &hsvl[1], &hsvl[2]);
+            hsvl[0] *= 360 / OFXS_HUE_CIRCLE;
+            float min = (std::min)((std::min)(r, g), b);
+            float max = (std::max)((std::max)(r, g), b);
+            hsvl[3] = (min + max) / 2;
+        } else {
+            hsvl[0] = hsvl[1] = hsvl[2] = hsvl[3] = 0.f;
+        }
+    }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponentsHSVL, 0.);
+    // mask value at (x,y), given the mask row at y (which may be NULL)
+    template<class PIX, int maxValue>
+    bool isMasked(const PIX *maskRow,
+                  const OfxRectI &maskBounds,
+                  int x)
+    {
+        float m = 0.f;
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = hsvl[c];
-                    min[c] = (std::min)(min[c], v);
-                    max[c] = (std::max)(max[c], v);
-                    sumLine[c] += v;
-                }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum[c] += sumLine[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+        if ( maskRow && (maskBounds.x1 <= x) && (x < maskBounds.x2) ) {
+            m = maskRow[x - maskBounds.x1] / (float)maxValue;
+        }
+        if (_maskInvert) {
+            m = 1.f - m;
         }
 
-        addResults(min, max, sum, count);
+        return !(m > 0.f);
     }
-};
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSDevProcessor
-    : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponentsHSVL];
-    double _sum_p2[nComponentsHSVL];
 
-public:
-    ImageHSVLSDevProcessor(ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
+    // get the mask row at y, or NULL if there is no mask
+    template<class PIX>
+    const PIX * getMaskRow(int y,
+                           OfxRectI *maskBounds)
     {
-        std::fill(_mean, _mean + nComponentsHSVL, 0.);
-        std::fill(_sum_p2, _sum_p2 + nComponentsHSVL, 0.);
+        if (!_maskImg) {
+            return NULL;
+        }
+        *maskBounds = _maskImg->getBounds();
+        if ( (y < maskBounds->y1) || (maskBounds->y2 <= y) ) {
+            return NULL;
+        }
+
+        return (const PIX *) _maskImg->getPixelAddress(maskBounds->x1, y);
     }
 
-    ~ImageHSVLSDevProcessor()
+    // Stratified sampling of the render window (see ofxsSampling.h): both passes analyze the same pixels.
+    // Returns the first analyzed pixel of line y at or after x, or _renderWindow.x2 if there is none.
+    int nextSample(int x,
+                   int y) const
     {
+        return nextStratifiedSample(_renderWindow, _samplingStep, x, y);
     }
 
-    void setPrevResults(double /* time */,
-                        const Results &results) OVERRIDE FINAL
+    // compute the ranks of the samples used to compute a percentile (linear interpolation between the closest ranks)
+    static void percentileRanks(double percentile,
+                                unsigned long count,
+                                unsigned long *lo,
+                                unsigned long *hi,
+                                double *frac)
     {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
+        assert(count > 0);
+        double pos = (std::max)( 0., (std::min)(percentile, 100.) ) / 100. * (count - 1);
+        *lo = (unsigned long)std::floor(pos);
+        *lo = (std::min)(*lo, count - 1);
+        *hi = (std::min)(*lo + 1, count - 1);
+        *frac = pos - *lo;
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    // find the histogram bin containing the sample of a given rank, and the number of samples in the previous bins
+    static int findBin(const unsigned long *histogram,
+                       int nBins,
+                       unsigned long rank,
+                       unsigned long *before)
     {
-        if (_count > 1) {
-            double sdev[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt( (std::max)( 0., _sum_p2[c] / (_count - 1) ) );
-            }
-            toRGBA<double, nComponentsHSVL, 1>(sdev, &results->sdev);
-        }
-    }
+        unsigned long cumulated = 0;
 
-private:
+        for (int b = 0; b < nBins; ++b) {
+            if (rank < cumulated + histogram[b]) {
+                *before = cumulated;
 
-    void addResults(double sum_p2[nComponentsHSVL],
-                    unsigned long count)
-    {
-        AutoMutex l (&_mutex);
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p2[c] += sum_p2[c];
+                return b;
+            }
+            cumulated += histogram[b];
         }
-        _count += count;
+        assert(false);
+        *before = cumulated;
+
+        return nBins - 1;
     }
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    // convert the moments of n components to results
+    template<int n>
+    void momentsToResults(const Moments *moments,
+                          unsigned long count,
+                          Results *results)
     {
-        unused(rs);
-        double sum_p2[nComponentsHSVL];
-
-        std::fill(sum_p2, sum_p2 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
+        double v[n];
+        const double dcount = (double)count;
 
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
+        results->count = count;
+        if (count > 0) {
+            for (int c = 0; c < n; ++c) {
+                v[c] = moments[c].min;
             }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p2[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = (hsvl[c] - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                }
-                dstPix += nComponents;
+            toRGBA<double, n, 1>(v, &results->min);
+            for (int c = 0; c < n; ++c) {
+                v[c] = moments[c].max;
             }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p2[c] += sumLine_p2[c];
+            toRGBA<double, n, 1>(v, &results->max);
+            for (int c = 0; c < n; ++c) {
+                v[c] = moments[c].mean;
             }
-            count += procWindow.x2 - procWindow.x1;
+            toRGBA<double, n, 1>(v, &results->mean);
+        }
+        if (count > 1) {
+            for (int c = 0; c < n; ++c) {
+                v[c] = moments[c].sdev(dcount);
+            }
+            toRGBA<double, n, 1>(v, &results->sdev);
+        }
+        if (count > 2) {
+            for (int c = 0; c < n; ++c) {
+                v[c] = moments[c].skewness(dcount);
+            }
+            toRGBA<double, n, 1>(v, &results->skewness);
+            assert( !OFX::IsNaN(results->skewness.r) && !OFX::IsNaN(results->skewness.g) && !OFX::IsNaN(results->skewness.b) && !OFX::IsNaN(results->skewness.a) );
+        }
+        if (count > 3) {
+            for (int c = 0; c < n; ++c) {
+                v[c] = moments[c].kurtosis(dcount);
+            }
+            toRGBA<double, n, 1>(v, &results->kurtosis);
+            assert( !OFX::IsNaN(results->kurtosis.r) && !OFX::IsNaN(results->kurtosis.g) && !OFX::IsNaN(results->kurtosis.b) && !OFX::IsNaN(results->kurtosis.a) );
         }
-
-        addResults(sum_p2, count);
     }
 };
 
 
+// Compute the RGBA, HSVL and luma statistics in a single pass over the image.
 template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSkewnessKurtosisProcessor
+class ImageStatisticsProcessor
     : public ImageStatisticsProcessorBase
 {
-private:
-    double _mean[nComponentsHSVL];
-    double _sdev[nComponentsHSVL];
-    double _sum_p3[nComponentsHSVL];
-    double _sum_p4[nComponentsHSVL];
-
 public:
-    ImageHSVLSkewnessKurtosisProcessor(ImageEffect &instance)
+    ImageStatisticsProcessor(ImageEffect &instance)
         : ImageStatisticsProcessorBase(instance)
+        , _stats()
+        , _reduced(false)
+        , _refining(false)
+        , _selected(false)
+        , _keyShift(0)
     {
-        std::fill(_mean, _mean + nComponentsHSVL, 0.);
-        std::fill(_sdev, _sdev + nComponentsHSVL, 0.);
-        std::fill(_sum_p3, _sum_p3 + nComponentsHSVL, 0.);
-        std::fill(_sum_p4, _sum_p4 + nComponentsHSVL, 0.);
     }
 
-    ~ImageHSVLSkewnessKurtosisProcessor()
+    ~ImageStatisticsProcessor()
     {
     }
 
-    void setPrevResults(double /* time */,
-                        const Results &results) OVERRIDE FINAL
+    bool prepareRefinement() OVERRIDE FINAL
     {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
-        toComponents<double, nComponentsHSVL, 1>(results.sdev, _sdev);
-    }
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        if (_count > 2) {
-            double skewness[nComponentsHSVL];
-            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ( (double)_count * _count ) / ( (double)(_count - 1) * (_count - 2) );
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
+        if (!_refining) {
+            _partials.reduce(&_stats);
+            _reduced = true;
+            if ( !_doRGBA || (_stats.count == 0) ) {
+                return false;
             }
-            toRGBA<double, nComponentsHSVL, 1>(skewness, &results->skewness);
+            // select the histogram bins containing the samples used by the percentiles
+            for (int c = 0; c < nComponents; ++c) {
+                for (int i = 0; i < kPercentileCount; ++i) {
+                    unsigned long ranks[2];
+                    double frac;
+                    percentileRanks(_percentiles[i], _stats.count, &ranks[0], &ranks[1], &frac);
+                    for (int j = 0; j < 2; ++j) {
+                        unsigned long before;
+                        RankSelection &s = _selections[c][2 * i + j];
+                        s.prefix = findBin(&_stats.histogram[c][0], Binning::nBins, ranks[j], &before);
+                        s.rank = ranks[j] - before;
+                    }
+                }
+            }
+            _keyShift = Binning::shift;
+            _refining = true;
+        } else {
+            // a refinement pass returned: select the next key bits
+            RefinementHistograms refinement;
+            _refinements.reduce(&refinement);
+            _refinements.clear();
+            for (int c = 0; c < nComponents; ++c) {
+                for (int i = 0; i < 2 * kPercentileCount; ++i) {
+                    RankSelection &s = _selections[c][i];
+                    size_t p = std::find(_prefixes[c].begin(), _prefixes[c].end(), s.prefix) - _prefixes[c].begin();
+                    assert( p < _prefixes[c].size() );
+                    unsigned long before;
+                    int b = findBin(&refinement.histogram[c][p * kRefineBins], kRefineBins, s.rank, &before);
+                    s.prefix = (s.prefix << kRefineBits) | b;
+                    s.rank -= before;
+                }
+            }
+            _keyShift -= kRefineBits;
+        }
+        _selected = (_keyShift == 0);
+        if (_selected) {
+            return false;
         }
-        if (_count > 3) {
-            double kurtosis[nComponentsHSVL];
-            double kurtfac = ( (double)(_count + 1) * _count ) / ( (double)(_count - 1) * (_count - 2) * (_count - 3) );
-            double kurtshift = -3 * ( (double)(_count - 1) * (_count - 1) ) / ( (double)(_count - 2) * (_count - 3) );
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
+        // the distinct key prefixes to refine, and the bins they belong to
+        for (int c = 0; c < nComponents; ++c) {
+            _prefixes[c].clear();
+            _refineBins[c].assign(Binning::nBins, 0);
+            for (int i = 0; i < 2 * kPercentileCount; ++i) {
+                unsigned int prefix = _selections[c][i].prefix;
+                if ( std::find(_prefixes[c].begin(), _prefixes[c].end(), prefix) == _prefixes[c].end() ) {
+                    _prefixes[c].push_back(prefix);
+                    _refineBins[c][prefix >> (Binning::shift - _keyShift)] = 1;
+                }
             }
-            toRGBA<double, nComponentsHSVL, 1>(kurtosis, &results->kurtosis);
         }
-    }
-
-private:
 
-    void addResults(double sum_p3[nComponentsHSVL],
-                    double sum_p4[nComponentsHSVL],
-                    unsigned long count)
-    {
-        AutoMutex l (&_mutex);
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
-        }
-        _count += count;
+        return true;
     }
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    void getResults(Results *rgbaResults,
+                    Results *hsvlResults,
+                    Results *lumaResults) OVERRIDE FINAL
     {
-        unused(rs);
-        double sum_p3[nComponentsHSVL];
-        double sum_p4[nComponentsHSVL];
-
-        std::fill(sum_p3, sum_p3 + nComponentsHSVL, 0.);
-        std::fill(sum_p4, sum_p4 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p3[nComponentsHSVL]; // partial sum to avoid underflows
-            double sumLine_p4[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponentsHSVL, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (hsvl[c] - _mean[c]) / _sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
-                    }
-                }
-                dstPix += nComponents;
+        if (!_reduced) {
+            _partials.reduce(&_stats);
+            _reduced = true;
+        }
+        const Statistics &stats = _stats;
+        if (_doRGBA) {
+            momentsToResults<nComponents>(stats.rgba, stats.count, rgbaResults);
+            if ( (_samplingStep > 1) && (stats.count > 1) ) {
+                // standard error of the mean of a random sample, with the finite population correction
+                double blockSize = (double)_samplingStep * _samplingStep;
+                double f = kConfidence95 * std::sqrt( (1. - 1. / blockSize) / stats.count );
+                const RGBAValues &sdev = rgbaResults->sdev;
+                rgbaResults->meanError = RGBAValues(0.);
+                rgbaResults->meanError.r = f * sdev.r;
+                rgbaResults->meanError.g = f * sdev.g;
+                rgbaResults->meanError.b = f * sdev.b;
+                rgbaResults->meanError.a = f * sdev.a;
             }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
+            // float percentiles need the refinement passes (see prepareRefinement())
+            if ( (stats.count > 0) && _selected ) {
+                getPercentiles(rgbaResults);
             }
-            count += procWindow.x2 - procWindow.x1;
         }
-
-        addResults(sum_p3, sum_p4, count);
+        if (_doHSVL) {
+            momentsToResults<nComponentsHSVL>(stats.hsvl, stats.count, hsvlResults);
+        }
+        if (_doLuma) {
+            lumaResults->maxPos = stats.luma.maxPos;
+            toRGBA<double, nComponents, 1>(stats.luma.maxVal, &lumaResults->maxVal);
+            lumaResults->minPos = stats.luma.minPos;
+            toRGBA<double, nComponents, 1>(stats.luma.minVal, &lumaResults->minVal);
+        }
     }
-};
 
-template <class PIX, int nComponents, int maxValue>
-class ImageLumaProcessor
-    : public ImageStatisticsProcessorBase
-{
 private:
-    OfxPointD _maxPos;
-    double _maxVal[nComponents];
-    double _maxLuma;
-    OfxPointD _minPos;
-    double _minVal[nComponents];
-    double _minLuma;
-    LuminanceMathEnum _luminanceMath;
+    typedef HistogramBinning<PIX> Binning;
 
-public:
-    ImageLumaProcessor(ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
-        , _luminanceMath(eLuminanceMathRec709)
+    // compute the percentiles from the selected keys
+    void getPercentiles(Results *results)
     {
-        _maxPos.x = _maxPos.y = 0.;
-        std::fill( _maxVal, _maxVal + nComponents, -std::numeric_limits<double>::infinity() );
-        _maxLuma = -std::numeric_limits<double>::infinity();
-        _minPos.x = _minPos.y = 0.;
-        std::fill( _minVal, _minVal + nComponents, +std::numeric_limits<double>::infinity() );
-        _minLuma = +std::numeric_limits<double>::infinity();
-    }
+        double values[kPercentileCount][nComponents];
 
-    ImageLumaProcessor()
-    {
-    }
-
-    void setPrevResults(double time,
-                        const Results & /*results*/) OVERRIDE FINAL
-    {
-        ChoiceParam* luminanceMath = _effect.fetchChoiceParam(kParamLuminanceMath);
-
-        assert(luminanceMath);
-        _luminanceMath = (LuminanceMathEnum)luminanceMath->getValueAtTime(time);
-    }
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        results->maxPos = _maxPos;
-        toRGBA<double, nComponents, 1>(_maxVal, &results->maxVal);
-        results->minPos = _minPos;
-        toRGBA<double, nComponents, 1>(_minVal, &results->minVal);
+        for (int c = 0; c < nComponents; ++c) {
+            for (int i = 0; i < kPercentileCount; ++i) {
+                unsigned long lo, hi;
+                double frac;
+                percentileRanks(_percentiles[i], _stats.count, &lo, &hi, &frac);
+                double v0 = Binning::value(_selections[c][2 * i].prefix);
+                double v1 = Binning::value(_selections[c][2 * i + 1].prefix);
+                values[i][c] = v0 + frac * (v1 - v0);
+            }
+        }
+        toRGBA<double, nComponents, 1>(values[0], &results->median);
+        toRGBA<double, nComponents, 1>(values[1], &results->percentileLow);
+        toRGBA<double, nComponents, 1>(values[2], &results->percentileHigh);
     }
 
-private:
-
     double
     luminance(const PIX *p)
     {
@@ -1093,75 +1100,145 @@ private:
         return 0.;
     }
 
-    void addResults(const OfxPointD& maxPos,
-                    double maxVal[nComponents],
-                    double maxLuma,
-                    const OfxPointD& minPos,
-                    double minVal[nComponents],
-                    double minLuma)
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
+               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
+        if (_refining) {
+            refine(procWindow);
+        } else {
+            analyze(procWindow);
+        }
+    }
+
+    // first pass: compute all statistics and histograms
+    void analyze(const OfxRectI& procWindow)
     {
-        AutoMutex l (&_mutex);
-        if (maxLuma > _maxLuma) {
-            _maxPos = maxPos;
+        Statistics stats;
+        LumaExtrema &luma = stats.luma;
+
+        if (_doRGBA) {
             for (int c = 0; c < nComponents; ++c) {
-                _maxVal[c] = maxVal[c];
+                stats.histogram[c].assign(Binning::nBins, 0);
             }
-            _maxLuma = maxLuma;
         }
-        if (minLuma < _minLuma) {
-            _minPos = minPos;
-            for (int c = 0; c < nComponents; ++c) {
-                _minVal[c] = minVal[c];
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            const PIX *rowPix = (const PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            OfxRectI maskBounds;
+            const PIX *maskRow = getMaskRow<PIX>(y, &maskBounds);
+
+            for (int x = nextSample(procWindow.x1, y); x < procWindow.x2; x = nextSample(x + 1, y)) {
+                if ( _doMasking && isMasked<PIX, maxValue>(maskRow, maskBounds, x) ) {
+                    continue;
+                }
+                const PIX *dstPix = rowPix + (x - procWindow.x1) * nComponents;
+                ++stats.count;
+                // the sample count and its inverse are shared by all components
+                double n = (double)stats.count;
+                double invn = 1. / n;
+                if (_doRGBA) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        stats.rgba[c].add(dstPix[c], n, invn);
+                        ++stats.histogram[c][Binning::bin(dstPix[c])];
+                    }
+                }
+                if (_doHSVL) {
+                    float hsvl[nComponentsHSVL];
+                    pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
+                    for (int c = 0; c < nComponentsHSVL; ++c) {
+                        stats.hsvl[c].add(hsvl[c], n, invn);
+                    }
+                }
+                if (_doLuma) {
+                    double l = luminance(dstPix);
+
+                    if (l > luma.maxLuma) {
+                        luma.maxPos.x = x;
+                        luma.maxPos.y = y;
+                        for (int c = 0; c < nComponents; ++c) {
+                            luma.maxVal[c] = dstPix[c] / (double)maxValue;
+                        }
+                        luma.maxLuma = l;
+                    }
+                    if (l < luma.minLuma) {
+                        luma.minPos.x = x;
+                        luma.minPos.y = y;
+                        for (int c = 0; c < nComponents; ++c) {
+                            luma.minVal[c] = dstPix[c] / (double)maxValue;
+                        }
+                        luma.minLuma = l;
+                    }
+                }
             }
-            _minLuma = minLuma;
         }
+
+        _partials.add(procWindow.y1, stats);
     }
 
-    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    // refinement pass: compute the histograms of the next key bits of the samples whose key starts with a selected prefix
+    void refine(const OfxRectI& procWindow)
     {
-        unused(rs);
-        OfxPointD maxPos = {0., 0.};
-        double maxVal[nComponents] = {0.};
-        double maxLuma = -std::numeric_limits<double>::infinity();
-        OfxPointD minPos = {0., 0.};
-        double minVal[nComponents] = {0.};
-        double minLuma = +std::numeric_limits<double>::infinity();
+        RefinementHistograms refinement;
+        const int subShift = _keyShift - kRefineBits;
+
+        for (int c = 0; c < nComponents; ++c) {
+            refinement.histogram[c].assign(_prefixes[c].size() * kRefineBins, 0);
+        }
 
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if ( _effect.abort() ) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                double luma = luminance(dstPix);
+            const PIX *rowPix = (const PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            OfxRectI maskBounds;
+            const PIX *maskRow = getMaskRow<PIX>(y, &maskBounds);
 
-                if (luma > maxLuma) {
-                    maxPos.x = x;
-                    maxPos.y = y;
-                    for (int c = 0; c < nComponents; ++c) {
-                        maxVal[c] = dstPix[c] / (double)maxValue;
-                    }
-                    maxLuma = luma;
+            for (int x = nextSample(procWindow.x1, y); x < procWindow.x2; x = nextSample(x + 1, y)) {
+                if ( _doMasking && isMasked<PIX, maxValue>(maskRow, maskBounds, x) ) {
+                    continue;
                 }
-                if (luma < minLuma) {
-                    minPos.x = x;
-                    minPos.y = y;
-                    for (int c = 0; c < nComponents; ++c) {
-                        minVal[c] = dstPix[c] / (double)maxValue;
+                const PIX *dstPix = rowPix + (x - procWindow.x1) * nComponents;
+                for (int c = 0; c < nComponents; ++c) {
+                    unsigned int key = Binning::key(dstPix[c]);
+                    if (!_refineBins[c][key >> Binning::shift]) {
+                        continue;
+                    }
+                    unsigned int prefix = key >> _keyShift;
+                    for (size_t p = 0; p < _prefixes[c].size(); ++p) {
+                        if (_prefixes[c][p] == prefix) {
+                            ++refinement.histogram[c][p * kRefineBins + ( (key >> subShift) & (kRefineBins - 1) )];
+                            break;
+                        }
                     }
-                    minLuma = luma;
                 }
-
-                dstPix += nComponents;
             }
         }
 
-        addResults(maxPos, maxVal, maxLuma, minPos, minVal, minLuma);
+        _refinements.add(procWindow.y1, refinement);
     }
+
+    Statistics _stats; // the merged statistics
+    bool _reduced; // true if _stats was merged from _partials
+    bool _refining; // true during the refinement passes
+    bool _selected; // true once the keys of the percentiles are known
+
+    // the sample of a given rank, as far as it is known
+    struct RankSelection
+    {
+        unsigned int prefix; // the known bits of its key
+        unsigned long rank; // its rank among the samples whose key starts with prefix
+    };
+
+    RankSelection _selections[nComponents][2 * kPercentileCount]; // the samples used by each percentile
+    int _keyShift; // the number of key bits not known yet
+    std::vector<unsigned int> _prefixes[nComponents]; // the distinct prefixes being refined
+    std::vector<unsigned char> _refineBins[nComponents]; // the bins containing these prefixes
 };
 
 
@@ -1170,17 +1247,23 @@ private:
 class ImageStatisticsPlugin
     : public ImageEffect
 {
+    friend class SequenceAnalysisProcessor;
+
 public:
     /** @brief ctor */
     ImageStatisticsPlugin(OfxImageEffectHandle handle)
         : ImageEffect(handle)
         , _dstClip(NULL)
         , _srcClip(NULL)
+        , _maskClip(NULL)
+        , _maskApply(NULL)
+        , _maskInvert(NULL)
         , _btmLeft(NULL)
         , _size(NULL)
         , _interactive(NULL)
         , _hiDPI(NULL)
         , _restrictToRectangle(NULL)
+        , _rectangleDrag(NULL)
     {
 
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -1192,6 +1275,11 @@ public:
                 ( _srcClip && (!_srcClip->isConnected() || _srcClip->getPixelComponents() ==  ePixelComponentAlpha ||
                                _srcClip->getPixelComponents() == ePixelComponentRGB ||
                                _srcClip->getPixelComponents() == ePixelComponentRGBA) ) );
+        _maskClip = fetchClip("Mask");
+        assert(!_maskClip || !_maskClip->isConnected() || _maskClip->getPixelComponents() == ePixelComponentAlpha);
+        _maskApply = ( ofxsMaskIsAlwaysConnected( OFX::getImageEffectHostDescription() ) && paramExists(kParamMaskApply) ) ? fetchBooleanParam(kParamMaskApply) : 0;
+        _maskInvert = fetchBooleanParam(kParamMaskInvert);
+        assert(_maskInvert);
 
         _btmLeft = fetchDouble2DParam(kParamRectangleInteractBtmLeft);
         _size = fetchDouble2DParam(kParamRectangleInteractSize);
@@ -1202,14 +1290,24 @@ public:
         }
         _restrictToRectangle = fetchBooleanParam(kParamRestrictToRectangle);
         _autoUpdate = fetchBooleanParam(kParamAutoUpdate);
-        assert(_btmLeft && _size && _interactive && _restrictToRectangle && _autoUpdate);
+        _sampledUpdate = fetchBooleanParam(kParamSampledUpdate);
+        _rectangleDrag = fetchBooleanParam(kParamRectangleDrag);
+        assert(_btmLeft && _size && _interactive && _restrictToRectangle && _autoUpdate && _sampledUpdate && _rectangleDrag);
         _statMin = fetchRGBAParam(kParamStatMin);
         _statMax = fetchRGBAParam(kParamStatMax);
         _statMean = fetchRGBAParam(kParamStatMean);
+        _statMeanError = fetchRGBAParam(kParamStatMeanError);
+        _exportFile = fetchStringParam(kParamExportFile);
         _statSDev = fetchRGBAParam(kParamStatSDev);
         _statSkewness = fetchRGBAParam(kParamStatSkewness);
         _statKurtosis = fetchRGBAParam(kParamStatKurtosis);
-        assert(_statMin && _statMax && _statMean && _statSDev && _statSkewness);
+        assert(_statMin && _statMax && _statMean && _statMeanError && _statSDev && _statSkewness && _exportFile);
+        _percentileLow = fetchDoubleParam(kParamPercentileLow);
+        _percentileHigh = fetchDoubleParam(kParamPercentileHigh);
+        _statMedian = fetchRGBAParam(kParamStatMedian);
+        _statPercentileLow = fetchRGBAParam(kParamStatPercentileLow);
+        _statPercentileHigh = fetchRGBAParam(kParamStatPercentileHigh);
+        assert(_percentileLow && _percentileHigh && _statMedian && _statPercentileLow && _statPercentileHigh);
         _analyzeFrame = fetchPushButtonParam(kParamAnalyzeFrame);
         _analyzeSequence = fetchPushButtonParam(kParamAnalyzeSequence);
         assert(_analyzeFrame && _analyzeSequence);
@@ -1262,6 +1360,7 @@ private:
 
     /* Override the render */
     virtual void render(const RenderArguments &args) OVERRIDE FINAL;
+    virtual void endSequenceRender(const EndSequenceRenderArguments &args) OVERRIDE FINAL;
     virtual void getRegionsOfInterest(const RegionsOfInterestArguments &args, RegionOfInterestSetter &rois) OVERRIDE FINAL;
     virtual bool getRegionOfDefinition(const RegionOfDefinitionArguments &args, OfxRectD & rod) OVERRIDE FINAL;
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
@@ -1275,55 +1374,91 @@ private:
         _size->setIsSecretAndDisabled(!restrictToRectangle);
         bool doUpdate = _autoUpdate->getValue();
         _interactive->setIsSecretAndDisabled(!restrictToRectangle || !doUpdate);
+        _sampledUpdate->setEnabled(doUpdate);
         if (_hiDPI) {
             _hiDPI->setIsSecretAndDisabled(!restrictToRectangle);
         }
     }
 
-    /* set up and run a processor */
-    void setupAndProcess(ImageStatisticsProcessorBase &processor, const Image* srcImg, double time, const OfxRectI &analysisWindow, const OfxPointD& renderScale, const Results &prevResults, Results *results);
+    /* set up and run a processor */
+    void setupAndProcess(ImageStatisticsProcessorBase &processor, const Image* srcImg, const Image* maskImg, double time, const OfxRectI &analysisWindow, const OfxPointD& renderScale, bool sampled, Results *rgbaResults, Results *hsvlResults, Results *lumaResults);
+
+    // compute the analysis region, in canonical coordinates
+    void getAnalysisRegion(double time, OfxRectD *regionOfInterest);
+
+    // compute computation window in srcImg
+    bool computeWindow(const Image* srcImg, const OfxPointD& renderScale, double time, OfxRectI *analysisWindow);
+
+    // true if the analysis is restricted to the non-zero pixels of the mask at the given time
+    bool doMasking(double time)
+    {
+        return ( !_maskApply || _maskApply->getValueAtTime(time) ) && _maskClip && _maskClip->isConnected();
+    }
+
+    // compute image statistics: all the requested statistics are computed in a single pass over the image.
+    // If sampled is true, the statistics are estimated from about kSampledUpdateSamples pixels.
+    void analyze(const Image* srcImg, const Image* maskImg, double time, const OfxRectI& analysisWindow, const OfxPointD& renderScale, bool sampled, bool doRGBA, bool doHSVL, bool doLuma, FrameAnalysis *analysis);
+
+    // fetch the analysis region of the source at the given time and analyze it
+    void analyzeFrame(const InstanceChangedArgs &args, double time, bool sampled, bool doRGBA, bool doHSVL, bool doLuma, FrameAnalysis *analysis);
 
-    // compute computation window in srcImg
-    bool computeWindow(const Image* srcImg, const OfxPointD& renderScale, double time, OfxRectI *analysisWindow);
+    // analyze all frames from the source, and set the values once all frames were analyzed
+    void analyzeSequence(const InstanceChangedArgs &args, bool doRGBA, bool doHSVL, bool doLuma);
+
+    // set the values from the analysis of a frame
+    void setResults(const FrameAnalysis &analysis, bool doRGBA, bool doHSVL, bool doLuma);
 
     // update image statistics
-    void update(const Image* srcImg, double time, const OfxRectI& analysisWindow, const OfxPointD& renderScale);
-    void updateHSVL(const Image* srcImg, double time, const OfxRectI& analysisWindow, const OfxPointD& renderScale);
-    void updateLuma(const Image* srcImg, double time, const OfxRectI& analysisWindow, const OfxPointD& renderScale);
+    void update(const Image* srcImg, const Image* maskImg, double time, const OfxRectI& analysisWindow, const OfxPointD& renderScale, bool sampled, bool doRGBA, bool doHSVL, bool doLuma, bool doExport);
 
-    template <template<class PIX, int nComponents, int maxValue> class Processor, class PIX, int nComponents, int maxValue>
+    // append the RGBA statistics of a frame to the export file
+    void exportResults(const FrameAnalysis &analysis) { writeExport( exportLine(analysis) ); }
+
+    // the line of the export file giving the RGBA statistics of a frame
+    static std::string exportLine(const FrameAnalysis &analysis);
+
+    // append lines to the export file, preceded by the column names if the file is empty
+    void writeExport(const std::string &lines);
+
+    template <class PIX, int nComponents, int maxValue>
     void updateSubComponentsDepth(const Image* srcImg,
+                                  const Image* maskImg,
                                   double time,
                                   const OfxRectI &analysisWindow,
                                   const OfxPointD& renderScale,
-                                  const Results& prevResults,
-                                  Results* results)
+                                  bool sampled,
+                                  Results* rgbaResults,
+                                  Results* hsvlResults,
+                                  Results* lumaResults)
     {
-        Processor<PIX, nComponents, maxValue> fred(*this);
-        setupAndProcess(fred, srcImg, time, analysisWindow, renderScale, prevResults, results);
+        ImageStatisticsProcessor<PIX, nComponents, maxValue> fred(*this);
+        setupAndProcess(fred, srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
     }
 
-    template <template<class PIX, int nComponents, int maxValue> class Processor, int nComponents>
+    template <int nComponents>
     void updateSubComponents(const Image* srcImg,
+                             const Image* maskImg,
                              double time,
                              const OfxRectI &analysisWindow,
                              const OfxPointD& renderScale,
-                             const Results& prevResults,
-                             Results* results)
+                             bool sampled,
+                             Results* rgbaResults,
+                             Results* hsvlResults,
+                             Results* lumaResults)
     {
         BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
 
         switch (srcBitDepth) {
         case eBitDepthUByte: {
-            updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, renderScale, prevResults, results);
+            updateSubComponentsDepth<unsigned char, nComponents, 255>(srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
             break;
         }
         case eBitDepthUShort: {
-            updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, renderScale, prevResults, results);
+            updateSubComponentsDepth<unsigned short, nComponents, 65535>(srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
             break;
         }
         case eBitDepthFloat: {
-            updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, renderScale, prevResults, results);
+            updateSubComponentsDepth<float, nComponents, 1>(srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
             break;
         }
         default:
@@ -1331,23 +1466,25 @@ private:
         }
     }
 
-    template <template<class PIX, int nComponents, int maxValue> class Processor>
     void updateSub(const Image* srcImg,
+                   const Image* maskImg,
                    double time,
                    const OfxRectI &analysisWindow,
                    const OfxPointD& renderScale,
-                   const Results& prevResults,
-                   Results* results)
+                   bool sampled,
+                   Results* rgbaResults,
+                   Results* hsvlResults,
+                   Results* lumaResults)
     {
         PixelComponentEnum srcComponents  = srcImg->getPixelComponents();
 
         assert(srcComponents == ePixelComponentAlpha || srcComponents == ePixelComponentRGB || srcComponents == ePixelComponentRGBA);
         if (srcComponents == ePixelComponentAlpha) {
-            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, renderScale, prevResults, results);
+            updateSubComponents<1>(srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
         } else if (srcComponents == ePixelComponentRGBA) {
-            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, renderScale, prevResults, results);
+            updateSubComponents<4>(srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
         } else if (srcComponents == ePixelComponentRGB) {
-            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, renderScale, prevResults, results);
+            updateSubComponents<3>(srcImg, maskImg, time, analysisWindow, renderScale, sampled, rgbaResults, hsvlResults, lumaResults);
         } else {
             // coverity[dead_error_line]
             throwSuiteStatusException(kOfxStatErrUnsupported);
@@ -1359,18 +1496,30 @@ private:
     // do not need to delete these, the ImageEffect is managing them for us
     Clip *_dstClip;
     Clip *_srcClip;
+    Clip *_maskClip;
+    BooleanParam* _maskApply;
+    BooleanParam* _maskInvert;
     Double2DParam* _btmLeft;
     Double2DParam* _size;
     BooleanParam* _interactive;
     BooleanParam* _hiDPI;
     BooleanParam* _restrictToRectangle;
     BooleanParam* _autoUpdate;
+    BooleanParam* _sampledUpdate;
+    BooleanParam* _rectangleDrag;
     RGBAParam* _statMin;
     RGBAParam* _statMax;
     RGBAParam* _statMean;
+    RGBAParam* _statMeanError;
+    StringParam* _exportFile;
     RGBAParam* _statSDev;
     RGBAParam* _statSkewness;
     RGBAParam* _statKurtosis;
+    DoubleParam* _percentileLow;
+    DoubleParam* _percentileHigh;
+    RGBAParam* _statMedian;
+    RGBAParam* _statPercentileLow;
+    RGBAParam* _statPercentileHigh;
     PushButtonParam* _analyzeFrame;
     PushButtonParam* _analyzeSequence;
     RGBAParam* _statHSVLMin;
@@ -1386,6 +1535,8 @@ private:
     RGBAParam* _maxLumaPixVal;
     Double2DParam* _minLumaPix;
     RGBAParam* _minLumaPixVal;
+    Mutex _exportMutex;
+    std::map<double, std::string> _exportQueue; // lines of the rendered frames, written by endSequenceRender()
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1430,26 +1581,51 @@ ImageStatisticsPlugin::render(const RenderArguments &args)
         assert(autoUpdate); // render should only be called if autoUpdate is true: in other cases isIdentity returns true
         if (autoUpdate) {
             // check if there is already a Keyframe, if yes update it
-            int k = _statMean->getKeyIndex(args.time, eKeySearchNear);
+            bool doRGBA = (_statMean->getKeyIndex(args.time, eKeySearchNear) != -1);
+            bool doHSVL = (_statHSVLMean->getKeyIndex(args.time, eKeySearchNear) != -1);
+            bool doLuma = (_maxLumaPix->getKeyIndex(args.time, eKeySearchNear) != -1);
+            // if there is an export file, each frame rendered non-interactively is analyzed once, even
+            // if it is rendered in several tiles (getRegionsOfInterest() requests the whole analysis
+            // region). The export file has no view column, and the parameters are not per view, so
+            // only the main view is exported.
+            std::string exportFile;
+            _exportFile->getValue(exportFile);
+            bool doExport = !exportFile.empty() && !args.interactiveRenderStatus && (args.renderView == 0);
+            if (doExport) {
+                // reserve the line of this frame, so that the other tiles do not analyze it
+                AutoMutex l(&_exportMutex);
+                doExport = _exportQueue.insert( std::make_pair( args.time, std::string() ) ).second;
+            }
             OfxRectI analysisWindow;
-            bool intersect = computeWindow(src.get(), args.renderScale, args.time, &analysisWindow);
-            if (intersect) {
-                if (k != -1) {
-                    update(src.get(), args.time, analysisWindow, args.renderScale);
-                }
-                k = _statHSVLMean->getKeyIndex(args.time, eKeySearchNear);
-                if (k != -1) {
-                    updateHSVL(src.get(), args.time, analysisWindow, args.renderScale);
-                }
-                k = _maxLumaPix->getKeyIndex(args.time, eKeySearchNear);
-                if (k != -1) {
-                    updateLuma(src.get(), args.time, analysisWindow, args.renderScale);
+            if ( (doRGBA || doHSVL || doLuma || doExport) && computeWindow(src.get(), args.renderScale, args.time, &analysisWindow) ) {
+                auto_ptr<const Image> mask( doMasking(args.time) ? _maskClip->fetchImage(args.time) : 0 );
+                if ( mask.get() ) {
+                    checkBadRenderScaleOrField(mask, args);
                 }
+                // only sample while the rectangle is dragged: the exact values are computed when it is released
+                bool sampled = _rectangleDrag->getValue() && _sampledUpdate->getValueAtTime(args.time);
+                update(src.get(), mask.get(), args.time, analysisWindow, args.renderScale, sampled, doRGBA, doHSVL, doLuma, doExport);
             }
         }
     }
 } // ImageStatisticsPlugin::render
 
+void
+ImageStatisticsPlugin::endSequenceRender(const EndSequenceRenderArguments & /*args*/)
+{
+    // write the lines of the rendered frames at once, by increasing time
+    std::map<double, std::string> queue;
+    {
+        AutoMutex l(&_exportMutex);
+        queue.swap(_exportQueue);
+    }
+    std::string lines;
+    for (std::map<double, std::string>::const_iterator it = queue.begin(); it != queue.end(); ++it) {
+        lines += it->second;
+    }
+    writeExport(lines);
+}
+
 // override the roi call
 // Required if the plugin requires a region from the inputs which is different from the rendered region of the output.
 // (this is the case here)
@@ -1458,16 +1634,19 @@ ImageStatisticsPlugin::getRegionsOfInterest(const RegionsOfInterestArguments &ar
                                             RegionOfInterestSetter &rois)
 {
     bool restrictToRectangle = _restrictToRectangle->getValueAtTime(args.time);
+    // when exporting, render() analyzes the whole analysis region, whatever the tile being rendered
+    std::string exportFile;
 
-    if (restrictToRectangle) {
+    _exportFile->getValue(exportFile);
+    if ( restrictToRectangle || !exportFile.empty() ) {
         OfxRectD regionOfInterest;
-        _btmLeft->getValueAtTime(args.time, regionOfInterest.x1, regionOfInterest.y1);
-        _size->getValueAtTime(args.time, regionOfInterest.x2, regionOfInterest.y2);
-        regionOfInterest.x2 += regionOfInterest.x1;
-        regionOfInterest.y2 += regionOfInterest.y1;
+        getAnalysisRegion(args.time, &regionOfInterest);
         // Union with output RoD, so that render works
         Coords::rectBoundingBox(args.regionOfInterest, regionOfInterest, &regionOfInterest);
         rois.setRegionOfInterest(*_srcClip, regionOfInterest);
+        if ( doMasking(args.time) ) {
+            rois.setRegionOfInterest(*_maskClip, regionOfInterest);
+        }
     }
 }
 
@@ -1519,7 +1698,6 @@ ImageStatisticsPlugin::changedParam(const InstanceChangedArgs &args,
     bool doAnalyzeSequenceRGBA = false;
     bool doAnalyzeSequenceHSVL = false;
     bool doAnalyzeSequenceLuma = false;
-    OfxRectI analysisWindow;
     const double time = args.time;
 
     if (paramName == kParamRestrictToRectangle) {
@@ -1531,18 +1709,31 @@ ImageStatisticsPlugin::changedParam(const InstanceChangedArgs &args,
         if (_hiDPI) {
             _hiDPI->setIsSecretAndDisabled(!restrictToRectangle);
         }
-        doUpdate = true;
+        doUpdate = _autoUpdate->getValueAtTime(time);
     }
     if (paramName == kParamAutoUpdate) {
         bool restrictToRectangle = _restrictToRectangle->getValueAtTime(time);
         doUpdate = _autoUpdate->getValueAtTime(time);
         _interactive->setIsSecretAndDisabled(!restrictToRectangle || !doUpdate);
+        _sampledUpdate->setEnabled(doUpdate);
     }
     if (//paramName == kParamRectangleInteractBtmLeft ||
         // only trigger on kParamRectangleInteractSize (the last one changed)
         paramName == kParamRectangleInteractSize) {
         doUpdate = _autoUpdate->getValueAtTime(time);
     }
+    if ( (paramName == kParamPercentileLow) || (paramName == kParamPercentileHigh) ||
+         (paramName == kParamMaskApply) || (paramName == kParamMaskInvert) ||
+         (paramName == kParamSampledUpdate) ) {
+        doUpdate = _autoUpdate->getValueAtTime(time);
+    }
+    if ( (paramName == kParamRectangleDrag) && !_rectangleDrag->getValue() ) {
+        // the rectangle was released: replace the sampled values by the exact ones
+        doUpdate = _autoUpdate->getValueAtTime(time);
+    }
+    if (paramName == kParamExportFile) {
+        clearPersistentMessage();
+    }
     if (paramName == kParamAnalyzeFrame) {
         doAnalyzeRGBA = true;
     }
@@ -1565,17 +1756,25 @@ ImageStatisticsPlugin::changedParam(const InstanceChangedArgs &args,
         _statMin->deleteKeyAtTime(args.time);
         _statMax->deleteKeyAtTime(args.time);
         _statMean->deleteKeyAtTime(args.time);
+        _statMeanError->deleteKeyAtTime(args.time);
         _statSDev->deleteKeyAtTime(args.time);
         _statSkewness->deleteKeyAtTime(args.time);
         _statKurtosis->deleteKeyAtTime(args.time);
+        _statMedian->deleteKeyAtTime(args.time);
+        _statPercentileLow->deleteKeyAtTime(args.time);
+        _statPercentileHigh->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequence) {
         _statMin->deleteAllKeys();
         _statMax->deleteAllKeys();
         _statMean->deleteAllKeys();
+        _statMeanError->deleteAllKeys();
         _statSDev->deleteAllKeys();
         _statSkewness->deleteAllKeys();
         _statKurtosis->deleteAllKeys();
+        _statMedian->deleteAllKeys();
+        _statPercentileLow->deleteAllKeys();
+        _statPercentileHigh->deleteAllKeys();
     }
     if (paramName == kParamClearFrameHSVL) {
         _statHSVLMin->deleteKeyAtTime(args.time);
@@ -1614,84 +1813,210 @@ ImageStatisticsPlugin::changedParam(const InstanceChangedArgs &args,
         k = _maxLumaPix->getKeyIndex(args.time, eKeySearchNear);
         doAnalyzeLuma = (k != -1);
     }
-    // RGBA analysis
-#pragma message WARN("TODO: only fetchImage() the required region.")
     if ( (doAnalyzeRGBA || doAnalyzeHSVL || doAnalyzeLuma) && _srcClip && _srcClip->isConnected() ) {
-        auto_ptr<Image> src( ( _srcClip && _srcClip->isConnected() ) ?
-                                  _srcClip->fetchImage(args.time) : 0 );
-        if ( src.get() ) {
-            checkBadRenderScale(src, args);
-            bool intersect = computeWindow(src.get(), args.renderScale, args.time, &analysisWindow);
-            if (intersect) {
-#             ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
-                getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
-#             endif
-                EditBlock eb(*this, "analyzeFrame");
-                if (doAnalyzeRGBA) {
-                    update(src.get(), args.time, analysisWindow, args.renderScale);
-                }
-                if (doAnalyzeHSVL) {
-                    updateHSVL(src.get(), args.time, analysisWindow, args.renderScale);
-                }
-                if (doAnalyzeLuma) {
-                    updateLuma(src.get(), args.time, analysisWindow, args.renderScale);
-                }
-#             ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
-                getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
-#             endif
+        FrameAnalysis analysis;
+#     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+        getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
+#     endif
+        // updates may be sampled while the rectangle is dragged, explicit analyses are always exact
+        bool sampled = doUpdate && _rectangleDrag->getValue() && _sampledUpdate->getValueAtTime(time);
+        analyzeFrame(args, args.time, sampled, doAnalyzeRGBA, doAnalyzeHSVL, doAnalyzeLuma, &analysis);
+        if (analysis.valid) {
+            EditBlock eb(*this, "analyzeFrame");
+            setResults(analysis, doAnalyzeRGBA, doAnalyzeHSVL, doAnalyzeLuma);
+            // estimates are not exported: the exact values follow when the rectangle is released
+            if (doAnalyzeRGBA && !sampled) {
+                exportResults(analysis);
             }
         }
+#     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+        getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
+#     endif
     }
     if ( (doAnalyzeSequenceRGBA || doAnalyzeSequenceHSVL || doAnalyzeSequenceLuma) && _srcClip && _srcClip->isConnected() ) {
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
 #     endif
-        progressStart("Analyzing sequence...");
-        EditBlock eb(*this, "analyzeSequence");
-        OfxRangeD range = _srcClip->getFrameRange();
-        //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
-        int tmin = (int)std::ceil(range.min);
-        int tmax = (int)std::floor(range.max);
-        for (int t = tmin; t <= tmax; ++t) {
-            auto_ptr<Image> src( ( _srcClip && _srcClip->isConnected() ) ?
-                                      _srcClip->fetchImage(t) : 0 );
-            if ( src.get() ) {
-                checkBadRenderScale(src, args);
-                bool intersect = computeWindow(src.get(), args.renderScale, t, &analysisWindow);
-                if (intersect) {
-                    if (doAnalyzeSequenceRGBA) {
-                        update(src.get(), t, analysisWindow, args.renderScale);
-                    }
-                    if (doAnalyzeSequenceHSVL) {
-                        updateHSVL(src.get(), t, analysisWindow, args.renderScale);
-                    }
-                    if (doAnalyzeSequenceLuma) {
-                        updateLuma(src.get(), t, analysisWindow, args.renderScale);
-                    }
-                }
-            }
-            if (tmax != tmin) {
-                if ( !progressUpdate( (t - tmin) / (double)(tmax - tmin) ) ) {
-                    break;
-                }
-            }
-        }
-        progressEnd();
+        analyzeSequence(args, doAnalyzeSequenceRGBA, doAnalyzeSequenceHSVL, doAnalyzeSequenceLuma);
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
 #     endif
     }
 } // ImageStatisticsPlugin::changedParam
 
+void
+ImageStatisticsPlugin::analyzeFrame(const InstanceChangedArgs &args,
+                                    double time,
+                                    bool sampled,
+                                    bool doRGBA,
+                                    bool doHSVL,
+                                    bool doLuma,
+                                    FrameAnalysis *analysis)
+{
+    analysis->time = time;
+    analysis->valid = false;
+
+    // only fetch the analysis region
+    OfxRectD regionOfInterest;
+    getAnalysisRegion(time, &regionOfInterest);
+    auto_ptr<Image> src( ( _srcClip && _srcClip->isConnected() ) ?
+                         _srcClip->fetchImage(time, regionOfInterest) : 0 );
+    if ( !src.get() ) {
+        return;
+    }
+    checkBadRenderScale(src, args);
+    OfxRectI analysisWindow;
+    bool intersect = computeWindow(src.get(), args.renderScale, time, &analysisWindow);
+    if (intersect) {
+        auto_ptr<const Image> mask( doMasking(time) ? _maskClip->fetchImage(time, regionOfInterest) : 0 );
+        if ( mask.get() ) {
+            checkBadRenderScale(mask, args);
+        }
+        analyze(src.get(), mask.get(), time, analysisWindow, args.renderScale, sampled, doRGBA, doHSVL, doLuma, analysis);
+    }
+}
+
+// Analyze a chunk of frames, one frame per thread.
+// Images may only be fetched from the threads of the multithread suite in Natron.
+class SequenceAnalysisProcessor
+    : public MultiThread::Processor
+{
+public:
+    SequenceAnalysisProcessor(ImageStatisticsPlugin &plugin,
+                              const InstanceChangedArgs &args,
+                              bool doRGBA,
+                              bool doHSVL,
+                              bool doLuma,
+                              FrameAnalysis *analyses,
+                              unsigned int nFrames)
+        : _plugin(plugin)
+        , _args(args)
+        , _doRGBA(doRGBA)
+        , _doHSVL(doHSVL)
+        , _doLuma(doLuma)
+        , _analyses(analyses)
+        , _nFrames(nFrames)
+    {
+    }
+
+    void process()
+    {
+        multiThread(_nFrames);
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        for (unsigned int i = threadID; i < _nFrames; i += nThreads) {
+            FrameAnalysis &analysis = _analyses[i];
+            // exceptions must not leave the thread
+            try {
+                _plugin.analyzeFrame(_args, analysis.time, false, _doRGBA, _doHSVL, _doLuma, &analysis);
+            } catch (...) {
+                analysis.valid = false;
+            }
+        }
+    }
+
+    ImageStatisticsPlugin &_plugin;
+    const InstanceChangedArgs &_args;
+    bool _doRGBA;
+    bool _doHSVL;
+    bool _doLuma;
+    FrameAnalysis *_analyses; // only _analyses[i] is written by the thread that analyzes frame i
+    unsigned int _nFrames;
+};
+
+void
+ImageStatisticsPlugin::analyzeSequence(const InstanceChangedArgs &args,
+                                       bool doRGBA,
+                                       bool doHSVL,
+                                       bool doLuma)
+{
+    OfxRangeD range = _srcClip->getFrameRange();
+    //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
+    int tmin = (int)std::ceil(range.min);
+    int tmax = (int)std::floor(range.max);
+
+    if (tmax < tmin) {
+        return;
+    }
+    std::vector<FrameAnalysis> analyses(tmax - tmin + 1);
+    for (int t = tmin; t <= tmax; ++t) {
+        analyses[t - tmin].time = t;
+    }
+
+    // Analyze several frames concurrently, while bounding the memory used by the source images.
+    unsigned int nFramesMax = 1;
+    if ( getImageEffectHostDescription()->isNatron && (MultiThread::getNumCPUs() > 1) ) {
+        OfxRectD regionOfInterest;
+        getAnalysisRegion(tmin, &regionOfInterest);
+        double par = _srcClip->getPixelAspectRatio();
+        double nPixels = (std::max)(0., (regionOfInterest.x2 - regionOfInterest.x1) * args.renderScale.x / par + 1.) *
+                         (std::max)(0., (regionOfInterest.y2 - regionOfInterest.y1) * args.renderScale.y + 1.);
+        int bytesPerComponent = 4;
+        switch ( _srcClip->getPixelDepth() ) {
+        case eBitDepthUByte:
+            bytesPerComponent = 1;
+            break;
+        case eBitDepthUShort:
+        case eBitDepthHalf:
+            bytesPerComponent = 2;
+            break;
+        default:
+            break;
+        }
+        double frameBytes = nPixels * _srcClip->getPixelComponentCount() * bytesPerComponent;
+        double nFrames = (frameBytes > 0.) ? (kSequenceAnalysisMaxMemory / frameBytes) : 1.;
+        nFramesMax = (unsigned int)(std::max)( 1., (std::min)( (double)MultiThread::getNumCPUs(), nFrames ) );
+    }
+
+    progressStart("Analyzing sequence...");
+    size_t i = 0;
+    while ( i < analyses.size() ) {
+        unsigned int nFrames = (unsigned int)(std::min)( (size_t)nFramesMax, analyses.size() - i );
+        if (nFrames > 1) {
+            SequenceAnalysisProcessor processor(*this, args, doRGBA, doHSVL, doLuma, &analyses[i], nFrames);
+            processor.process();
+        } else {
+            analyzeFrame(args, analyses[i].time, false, doRGBA, doHSVL, doLuma, &analyses[i]);
+        }
+        i += nFrames;
+        if (analyses.size() > 1) {
+            if ( !progressUpdate( (i - 1) / (double)(analyses.size() - 1) ) ) {
+                break;
+            }
+        }
+    }
+    progressEnd();
+
+    // set all the values at once (including the frames analyzed before the analysis was canceled)
+    EditBlock eb(*this, "analyzeSequence");
+    std::string lines;
+    for (size_t j = 0; j < i; ++j) {
+        if (analyses[j].valid) {
+            setResults(analyses[j], doRGBA, doHSVL, doLuma);
+            if (doRGBA) {
+                lines += exportLine(analyses[j]);
+            }
+        }
+    }
+    writeExport(lines);
+} // ImageStatisticsPlugin::analyzeSequence
+
 /* set up and run a processor */
 void
 ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor,
                                        const Image* srcImg,
+                                       const Image* maskImg,
                                        double time,
                                        const OfxRectI &analysisWindow,
                                        const OfxPointD& renderScale,
-                                       const Results &prevResults,
-                                       Results *results)
+                                       bool sampled,
+                                       Results *rgbaResults,
+                                       Results *hsvlResults,
+                                       Results *lumaResults)
 {
     // set the images
     processor.setDstImg( const_cast<Image*>(srcImg) ); // not a bug: we only set dst
@@ -1699,48 +2024,78 @@ ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor,
     // set the render window
     processor.setRenderWindow(analysisWindow, renderScale);
 
-    processor.setPrevResults(time, prevResults);
+    // set the mask
+    if ( doMasking(time) ) {
+        bool maskInvert;
+        _maskInvert->getValueAtTime(time, maskInvert);
+        processor.doMasking(true);
+        processor.setMaskImg(maskImg, maskInvert);
+    }
+
+    // select the statistics to compute
+    processor.setValues( rgbaResults != NULL, hsvlResults != NULL, lumaResults != NULL,
+                         (LuminanceMathEnum)_luminanceMath->getValueAtTime(time),
+                         _percentileLow->getValueAtTime(time),
+                         _percentileHigh->getValueAtTime(time) );
+
+    // analyze about kSampledUpdateSamples pixels
+    if (sampled) {
+        processor.setSamplingStep( stratifiedSamplingStep(analysisWindow, kSampledUpdateSamples) );
+    }
 
     // Call the base class process member, this will call the derived templated process code
     processor.process();
 
+    // find the exact percentiles, if the histograms are not exact
+    while ( !abort() && processor.prepareRefinement() ) {
+        processor.process();
+    }
+
     if ( !abort() ) {
-        processor.getResults(results);
+        processor.getResults(rgbaResults, hsvlResults, lumaResults);
     }
 }
 
-bool
-ImageStatisticsPlugin::computeWindow(const Image* srcImg,
-                                     const OfxPointD& renderScale,
-                                     double time,
-                                     OfxRectI *analysisWindow)
+void
+ImageStatisticsPlugin::getAnalysisRegion(double time,
+                                         OfxRectD *regionOfInterest)
 {
-    OfxRectD regionOfInterest;
     bool restrictToRectangle = _restrictToRectangle->getValueAtTime(time);
 
     if (!restrictToRectangle && _srcClip) {
         // use the src region of definition as rectangle, but avoid infinite rectangle
-        regionOfInterest = _srcClip->getRegionOfDefinition(time);
+        *regionOfInterest = _srcClip->getRegionOfDefinition(time);
         OfxPointD size = getProjectSize();
         OfxPointD offset = getProjectOffset();
-        if (regionOfInterest.x1 <= kOfxFlagInfiniteMin) {
-            regionOfInterest.x1 = offset.x;
+        if (regionOfInterest->x1 <= kOfxFlagInfiniteMin) {
+            regionOfInterest->x1 = offset.x;
         }
-        if (regionOfInterest.x2 >= kOfxFlagInfiniteMax) {
-            regionOfInterest.x2 = offset.x + size.x;
+        if (regionOfInterest->x2 >= kOfxFlagInfiniteMax) {
+            regionOfInterest->x2 = offset.x + size.x;
         }
-        if (regionOfInterest.y1 <= kOfxFlagInfiniteMin) {
-            regionOfInterest.y1 = offset.y;
+        if (regionOfInterest->y1 <= kOfxFlagInfiniteMin) {
+            regionOfInterest->y1 = offset.y;
         }
-        if (regionOfInterest.y2 >= kOfxFlagInfiniteMax) {
-            regionOfInterest.y2 = offset.y + size.y;
+        if (regionOfInterest->y2 >= kOfxFlagInfiniteMax) {
+            regionOfInterest->y2 = offset.y + size.y;
         }
     } else {
-        _btmLeft->getValueAtTime(time, regionOfInterest.x1, regionOfInterest.y1);
-        _size->getValueAtTime(time, regionOfInterest.x2, regionOfInterest.y2);
-        regionOfInterest.x2 += regionOfInterest.x1;
-        regionOfInterest.y2 += regionOfInterest.y1;
+        _btmLeft->getValueAtTime(time, regionOfInterest->x1, regionOfInterest->y1);
+        _size->getValueAtTime(time, regionOfInterest->x2, regionOfInterest->y2);
+        regionOfInterest->x2 += regionOfInterest->x1;
+        regionOfInterest->y2 += regionOfInterest->y1;
     }
+}
+
+bool
+ImageStatisticsPlugin::computeWindow(const Image* srcImg,
+                                     const OfxPointD& renderScale,
+                                     double time,
+                                     OfxRectI *analysisWindow)
+{
+    OfxRectD regionOfInterest;
+
+    getAnalysisRegion(time, &regionOfInterest);
     Coords::toPixelEnclosing(regionOfInterest,
                              renderScale,
                              srcImg->getPixelAspectRatio(),
@@ -1749,84 +2104,170 @@ ImageStatisticsPlugin::computeWindow(const Image* srcImg,
     return Coords::rectIntersection(*analysisWindow, srcImg->getBounds(), analysisWindow);
 }
 
-// update image statistics
+// compute image statistics
 void
-ImageStatisticsPlugin::update(const Image* srcImg,
-                              double time,
-                              const OfxRectI &analysisWindow,
-                              const OfxPointD& renderScale)
+ImageStatisticsPlugin::analyze(const Image* srcImg,
+                               const Image* maskImg,
+                               double time,
+                               const OfxRectI &analysisWindow,
+                               const OfxPointD& renderScale,
+                               bool sampled,
+                               bool doRGBA,
+                               bool doHSVL,
+                               bool doLuma,
+                               FrameAnalysis *analysis)
 {
     // TODO: CHECK if checkDoubleAnalysis param is true and analysisWindow is the same as btmLeft/sizeAnalysis
-    Results results;
-
-    if ( !abort() ) {
-        updateSub<ImageMinMaxMeanProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
-    }
-    if ( !abort() ) {
-        updateSub<ImageSDevProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
+    analysis->time = time;
+    analysis->valid = false;
+    if ( !doRGBA && !doHSVL && !doLuma ) {
+        return;
     }
     if ( !abort() ) {
-        updateSub<ImageSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
+        updateSub(srcImg, maskImg, time, analysisWindow, renderScale, sampled,
+                  doRGBA ? &analysis->rgba : NULL,
+                  doHSVL ? &analysis->hsvl : NULL,
+                  doLuma ? &analysis->luma : NULL);
     }
-    if ( abort() ) {
-        return;
+    analysis->valid = !abort();
+}
+
+// set the values from the analysis of a frame
+void
+ImageStatisticsPlugin::setResults(const FrameAnalysis &analysis,
+                                  bool doRGBA,
+                                  bool doHSVL,
+                                  bool doLuma)
+{
+    const double time = analysis.time;
+
+    if (doRGBA) {
+        const Results &results = analysis.rgba;
+        _statMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
+        _statMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
+        _statMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
+        _statMeanError->setValueAtTime(time, results.meanError.r, results.meanError.g, results.meanError.b, results.meanError.a);
+        _statSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
+        _statSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
+        _statKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+        _statMedian->setValueAtTime(time, results.median.r, results.median.g, results.median.b, results.median.a);
+        _statPercentileLow->setValueAtTime(time, results.percentileLow.r, results.percentileLow.g, results.percentileLow.b, results.percentileLow.a);
+        _statPercentileHigh->setValueAtTime(time, results.percentileHigh.r, results.percentileHigh.g, results.percentileHigh.b, results.percentileHigh.a);
+    }
+    if (doHSVL) {
+        const Results &results = analysis.hsvl;
+        _statHSVLMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
+        _statHSVLMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
+        _statHSVLMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
+        _statHSVLSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
+        _statHSVLSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
+        _statHSVLKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+    }
+    if (doLuma) {
+        const Results &results = analysis.luma;
+        _maxLumaPix->setValueAtTime(time, results.maxPos.x, results.maxPos.y);
+        _maxLumaPixVal->setValueAtTime(time, results.maxVal.r, results.maxVal.g, results.maxVal.b, results.maxVal.a);
+        _minLumaPix->setValueAtTime(time, results.minPos.x, results.minPos.y);
+        _minLumaPixVal->setValueAtTime(time, results.minVal.r, results.minVal.g, results.minVal.b, results.minVal.a);
     }
-    _statMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
-    _statMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
-    _statMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
-    _statSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
-    _statSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-    // printf("skewness = %g %g %g %g\n", results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-    _statKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
 }
 
+// update image statistics
 void
-ImageStatisticsPlugin::updateHSVL(const Image* srcImg,
-                                  double time,
-                                  const OfxRectI &analysisWindow,
-                                  const OfxPointD& renderScale)
+ImageStatisticsPlugin::update(const Image* srcImg,
+                              const Image* maskImg,
+                              double time,
+                              const OfxRectI &analysisWindow,
+                              const OfxPointD& renderScale,
+                              bool sampled,
+                              bool doRGBA,
+                              bool doHSVL,
+                              bool doLuma,
+                              bool doExport)
 {
-    Results results;
+    FrameAnalysis analysis;
 
-    if ( !abort() ) {
-        updateSub<ImageHSVLMinMaxMeanProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
-    }
-    if ( !abort() ) {
-        updateSub<ImageHSVLSDevProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
-    }
-    if ( !abort() ) {
-        updateSub<ImageHSVLSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
-    }
-    if ( abort() ) {
-        return;
+    // estimates are not exported: the exact values follow when the rectangle is released
+    doExport = doExport && !sampled;
+    analyze(srcImg, maskImg, time, analysisWindow, renderScale, sampled, doRGBA || doExport, doHSVL, doLuma, &analysis);
+    if (analysis.valid) {
+        setResults(analysis, doRGBA, doHSVL, doLuma);
+        if (doExport) {
+            // the render thread does not wait for the file: the line is written by endSequenceRender()
+            AutoMutex l(&_exportMutex);
+            _exportQueue[time] = exportLine(analysis);
+        }
     }
-    _statHSVLMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
-    _statHSVLMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
-    _statHSVLMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
-    _statHSVLSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
-    _statHSVLSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-    _statHSVLKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+}
+
+// the columns of the export file
+static const char* exportStatNames[] = {
+    "min", "max", "mean", "meanerror", "sdev", "skewness", "kurtosis", "median", "percentilelow", "percentilehigh"
+};
+
+std::string
+ImageStatisticsPlugin::exportLine(const FrameAnalysis &analysis)
+{
+    if (!analysis.valid) {
+        return std::string();
+    }
+    const Results &results = analysis.rgba;
+    const RGBAValues* statValues[] = {
+        &results.min, &results.max, &results.mean, &results.meanError, &results.sdev, &results.skewness, &results.kurtosis,
+        &results.median, &results.percentileLow, &results.percentileHigh
+    };
+    const int nStats = sizeof(statValues) / sizeof(statValues[0]);
+    std::string line;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%.9g,%lu", analysis.time, results.count);
+    line += buf;
+    for (int i = 0; i < nStats; ++i) {
+        const RGBAValues &v = *statValues[i];
+        snprintf(buf, sizeof(buf), ",%.9g,%.9g,%.9g,%.9g", v.r, v.g, v.b, v.a);
+        line += buf;
+    }
+    line += '\n';
+
+    return line;
 }
 
 void
-ImageStatisticsPlugin::updateLuma(const Image* srcImg,
-                                  double time,
-                                  const OfxRectI &analysisWindow,
-                                  const OfxPointD& renderScale)
+ImageStatisticsPlugin::writeExport(const std::string &lines)
 {
-    Results results;
+    std::string filename;
 
-    if ( !abort() ) {
-        updateSub<ImageLumaProcessor>(srcImg, time, analysisWindow, renderScale, results, &results);
+    _exportFile->getValue(filename);
+    if ( filename.empty() || lines.empty() ) {
+        return;
     }
-    if ( abort() ) {
+
+    // The file is written synchronously by the calling thread (never a render thread, see render()),
+    // and the lock only serializes the writes of this instance. Another process appending to the
+    // same file may interleave its lines with ours, or also write the column names.
+    AutoMutex l(&_exportMutex);
+    FILE* f = fopen_utf8(filename.c_str(), "ab");
+    if (!f) {
+        setPersistentMessage(Message::eMessageError, "", "Cannot write " + filename + ": " + std::strerror(errno));
+
         return;
     }
-    _maxLumaPix->setValueAtTime(time, results.maxPos.x, results.maxPos.y);
-    _maxLumaPixVal->setValueAtTime(time, results.maxVal.r, results.maxVal.g, results.maxVal.b, results.maxVal.a);
-    _minLumaPix->setValueAtTime(time, results.minPos.x, results.minPos.y);
-    _minLumaPixVal->setValueAtTime(time, results.minVal.r, results.minVal.g, results.minVal.b, results.minVal.a);
-}
+    std::string data;
+    std::fseek(f, 0, SEEK_END);
+    if (std::ftell(f) == 0) {
+        data = "time,count";
+        for (size_t i = 0; i < sizeof(exportStatNames) / sizeof(exportStatNames[0]); ++i) {
+            const std::string name = exportStatNames[i];
+            data += "," + name + "_r," + name + "_g," + name + "_b," + name + "_a";
+        }
+        data += '\n';
+    }
+    data += lines;
+    bool written = ( std::fwrite(data.data(), 1, data.size(), f) == data.size() );
+    written = (std::fclose(f) == 0) && written;
+    if (!written) {
+        setPersistentMessage(Message::eMessageError, "", "Cannot write " + filename + ": " + std::strerror(errno));
+    }
+} // ImageStatisticsPlugin::writeExport
 
 class ImageStatisticsInteract
     : public RectangleInteract
@@ -1837,9 +2278,18 @@ public:
                             ImageEffect* effect)
         : RectangleInteract(handle, effect)
         , _restrictToRectangle(NULL)
+        , _interactiveDrag(NULL)
+        , _autoUpdate(NULL)
+        , _sampledUpdate(NULL)
+        , _rectangleDrag(NULL)
     {
         _restrictToRectangle = effect->fetchBooleanParam(kParamRestrictToRectangle);
         addParamToSlaveTo(_restrictToRectangle);
+        _interactiveDrag = effect->fetchBooleanParam(kParamRectangleInteractInteractive);
+        _autoUpdate = effect->fetchBooleanParam(kParamAutoUpdate);
+        _sampledUpdate = effect->fetchBooleanParam(kParamSampledUpdate);
+        _rectangleDrag = effect->fetchBooleanParam(kParamRectangleDrag);
+        assert(_interactiveDrag && _autoUpdate && _sampledUpdate && _rectangleDrag);
     }
 
 private:
@@ -1871,8 +2321,13 @@ private:
     {
         bool restrictToRectangle = _restrictToRectangle->getValueAtTime(args.time);
 
-        if (restrictToRectangle) {
-            return RectangleInteract::penDown(args);
+        if ( restrictToRectangle && RectangleInteract::penDown(args) ) {
+            // values are updated while the rectangle is dragged, so that they may be sampled
+            if ( _interactiveDrag->getValue() && _autoUpdate->getValue() && _sampledUpdate->getValue() ) {
+                _rectangleDrag->setValue(true);
+            }
+
+            return true;
         }
 
         return false;
@@ -1882,11 +2337,14 @@ private:
     {
         bool restrictToRectangle = _restrictToRectangle->getValueAtTime(args.time);
 
-        if (restrictToRectangle) {
-            return RectangleInteract::penUp(args);
+        bool didSomething = restrictToRectangle && RectangleInteract::penUp(args);
+
+        if ( _rectangleDrag->getValue() ) {
+            // triggers the exact update of the values
+            _rectangleDrag->setValue(false);
         }
 
-        return false;
+        return didSomething;
     }
 
     //virtual bool keyDown(const KeyArgs &args) OVERRIDE;
@@ -1895,6 +2353,10 @@ private:
 
 
     BooleanParam* _restrictToRectangle;
+    BooleanParam* _interactiveDrag;
+    BooleanParam* _autoUpdate;
+    BooleanParam* _sampledUpdate;
+    BooleanParam* _rectangleDrag;
 };
 
 class ImageStatisticsOverlayDescriptor
@@ -1965,6 +2427,13 @@ ImageStatisticsPluginFactory::describeInContext(ImageEffectDescriptor &desc,
     srcClip->setIsMask(false);
     srcClip->setOptional(false);
 
+    ClipDescriptor *maskClip = desc.defineClip("Mask");
+    maskClip->addSupportedComponent(ePixelComponentAlpha);
+    maskClip->setTemporalClipAccess(false);
+    maskClip->setOptional(true);
+    maskClip->setSupportsTiles(kSupportsTiles);
+    maskClip->setIsMask(true);
+
     // create the mandated output clip
     ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
     dstClip->addSupportedComponent(ePixelComponentRGBA);
@@ -2049,6 +2518,19 @@ ImageStatisticsPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    // sampledUpdate
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamSampledUpdate);
+        param->setLabel(kParamSampledUpdateLabel);
+        param->setHint(kParamSampledUpdateHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     // interactive
     {
         BooleanParamDescriptor* param = desc.defineBooleanParam(kParamRectangleInteractInteractive);
@@ -2060,6 +2542,36 @@ ImageStatisticsPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    // rectangleDrag
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamRectangleDrag);
+        param->setDefault(false);
+        param->setIsSecretAndDisabled(true);
+        param->setIsPersistent(false);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // exportFile
+    {
+        StringParamDescriptor* param = desc.defineStringParam(kParamExportFile);
+        param->setLabel(kParamExportFileLabel);
+        param->setHint(kParamExportFileHint);
+        param->setStringType(eStringTypeFilePath);
+        param->setFilePathExists(false);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // don't define the mix param
+    ofxsMaskDescribeParams(desc, page);
+
     {
         GroupParamDescriptor* group = desc.defineGroupParam(kParamGroupRGBA);
         if (group) {
@@ -2114,6 +2626,21 @@ ImageStatisticsPluginFactory::describeInContext(ImageEffectDescriptor &desc,
             }
         }
 
+        // statMeanError
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatMeanError);
+            param->setLabel(kParamStatMeanErrorLabel);
+            param->setHint(kParamStatMeanErrorHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // statSDev
         {
             RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatSDev);
@@ -2159,6 +2686,85 @@ ImageStatisticsPluginFactory::describeInContext(ImageEffectDescriptor &desc,
             }
         }
 
+        // statMedian
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatMedian);
+            param->setLabel(kParamStatMedianLabel);
+            param->setHint(kParamStatMedianHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // percentileLow
+        {
+            DoubleParamDescriptor* param = desc.defineDoubleParam(kParamPercentileLow);
+            param->setLabel(kParamPercentileLowLabel);
+            param->setHint(kParamPercentileLowHint);
+            param->setRange(0., 100.);
+            param->setDisplayRange(0., 100.);
+            param->setDefault(1.);
+            param->setAnimates(false);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statPercentileLow
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatPercentileLow);
+            param->setLabel(kParamStatPercentileLowLabel);
+            param->setHint(kParamStatPercentileLowHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // percentileHigh
+        {
+            DoubleParamDescriptor* param = desc.defineDoubleParam(kParamPercentileHigh);
+            param->setLabel(kParamPercentileHighLabel);
+            param->setHint(kParamPercentileHighHint);
+            param->setRange(0., 100.);
+            param->setDisplayRange(0., 100.);
+            param->setDefault(99.);
+            param->setAnimates(false);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statPercentileHigh
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatPercentileHigh);
+            param->setLabel(kParamStatPercentileHighLabel);
+            param->setHint(kParamStatPercentileHighHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // analyzeFrame
         {
             PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeFrame);
@@ -49,6 +49,7 @@
 #include "ofxsCopier.h"
 #include "ofxsCoords.h"
 #include "ofxsFilter.h"
+#include "ofxsBoxReduce.h"
 #include "ofxsOGLTextRenderer.h"
 #include "ofxsOGLHiDPI.h"
 
@@ -373,7 +374,6 @@ LayerContactSheetPlugin::render(const OFX::RenderArguments &args)
                 const size_t axstride = src->getPixelComponentCount();
                 const size_t aystride = awidth * axstride;
                 const size_t depth = (std::min)(axstride, bxstride);
-                const OfxRectD from = {0., 0., (double)awidth, (double)aheight};
                 OfxRectI to;
                 Coords::toPixelEnclosing(imageRoD, args.renderScale, dstPar, &to);
                 to.x1 -= dstBounds.x1;
@@ -381,10 +381,9 @@ LayerContactSheetPlugin::render(const OFX::RenderArguments &args)
                 to.x2 -= dstBounds.x1;
                 to.y2 -= dstBounds.y1;
 
-                ofxsFilterResize2d(a, awidth, aheight, axstride, aystride, depth,
-                                   from, /*zeroOutside=*/false,
-                                   b, bwidth, bheight, bxstride, bystride,
-                                   to);
+                drawResized(a, awidth, aheight, axstride, aystride, depth,
+                            b, bwidth, bheight, bxstride, bystride,
+                            to);
             }
         }
     }
@@ -36,7 +36,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginMirrorName "MirrorOFX"
 #define kPluginMirrorGrouping "Transform"
 #define kPluginMirrorDescription "Flip (vertical mirror) or flop (horizontal mirror) an image. Interlaced video can not be flipped.\n" \
-    "This plugin does not concatenate transforms."
+    "This plugin concatenates transforms."
 #define kPluginMirrorIdentifier "net.sf.openfx.Mirror"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
@@ -354,6 +354,9 @@ public:
 private:
     virtual void render(const RenderArguments &args) OVERRIDE FINAL;
     virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime, int& view, std::string& plane) OVERRIDE FINAL;
+#ifdef OFX_EXTENSIONS_NUKE
+    virtual bool getTransform(const TransformArguments & args, Clip * &transformClip, double transformMatrix[9]) OVERRIDE FINAL;
+#endif
 
     // override the roi call
     virtual void getRegionsOfInterest(const RegionsOfInterestArguments &args, RegionOfInterestSetter &rois) OVERRIDE FINAL;
@@ -511,6 +514,49 @@ MirrorPlugin::isIdentity(const IsIdentityArguments &args,
     return false;
 }
 
+#ifdef OFX_EXTENSIONS_NUKE
+// overridden getTransform
+// Flip and flop map each pixel to exactly one source pixel, so the host can
+// use the source image directly (or concatenate it with downstream transforms).
+bool
+MirrorPlugin::getTransform(const TransformArguments &args,
+                           Clip * &transformClip,
+                           double transformMatrix[9])
+{
+    if (!_srcClip || !_srcClip->isConnected()) {
+        return false;
+    }
+    const double time = args.time;
+    bool flip;
+    bool flop;
+    _flip->getValueAtTime(time, flip);
+    _flop->getValueAtTime(time, flop);
+
+    OfxRectI srcRoD = {0, 0, 0, 0};
+    OfxRectD srcRoDCanonical = _srcClip->getRegionOfDefinition(time);
+    if ( Coords::rectIsEmpty(srcRoDCanonical) ) {
+        return false;
+    }
+    Coords::toPixelEnclosing(srcRoDCanonical, args.renderScale, _srcClip->getPixelAspectRatio(), &srcRoD);
+
+    // the matrix is in pixel coordinates, and maps pixel (x,y) to
+    // (x1 + x2 - 1 - x, y), as in render(), for pixel centers
+    transformClip = _srcClip;
+    transformMatrix[0] = flop ? -1. : 1.;
+    transformMatrix[1] = 0.;
+    transformMatrix[2] = flop ? (srcRoD.x1 + srcRoD.x2) : 0.;
+    transformMatrix[3] = 0.;
+    transformMatrix[4] = flip ? -1. : 1.;
+    transformMatrix[5] = flip ? (srcRoD.y1 + srcRoD.y2) : 0.;
+    transformMatrix[6] = 0.;
+    transformMatrix[7] = 0.;
+    transformMatrix[8] = 1.;
+
+    return true;
+}
+
+#endif
+
 void
 MirrorPlugin::changedClip(const InstanceChangedArgs &args,
                           const std::string &clipName)
@@ -560,6 +606,9 @@ MirrorPluginFactory::describe(ImageEffectDescriptor &desc)
     desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
     desc.setRenderThreadSafety(kRenderThreadSafety);
 #ifdef OFX_EXTENSIONS_NUKE
+    // Enable transform by the host.
+    // It is only possible for transforms which can be represented as a 3x3 matrix.
+    desc.setCanTransform(true);
     // ask the host to render all planes
     desc.setPassThroughForNotProcessedPlanes(ePassThroughLevelRenderAllRequestedPlanes);
 #endif
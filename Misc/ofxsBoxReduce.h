@@ -0,0 +1,129 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/NatronGitHub/openfx-misc>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef openfx_misc_ofxsBoxReduce_h
+#define openfx_misc_ofxsBoxReduce_h
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsMacros.h"
+#include "ofxsFilter.h"
+
+OFXS_NAMESPACE_OFX_ENTER
+
+// Reduce an image by the integer factors kx and ky, by averaging each block of kx*ky pixels.
+// The last column and row of blocks may be incomplete, in which case only the available pixels are averaged.
+// This is much cheaper than ofxsFilterResize2d, and is used before it when the image is
+// much larger than its destination.
+inline void
+boxReduce(const float* a,
+          size_t awidth,
+          size_t aheight,
+          size_t axstride,
+          size_t aystride,
+          size_t kx,
+          size_t ky,
+          std::vector<float>* reduced,
+          size_t* rwidth,
+          size_t* rheight)
+{
+    assert(kx >= 1 && ky >= 1);
+    *rwidth = (awidth + kx - 1) / kx;
+    *rheight = (aheight + ky - 1) / ky;
+    const size_t rystride = *rwidth * axstride;
+    reduced->assign(*rheight * rystride, 0.f);
+    for (size_t ry = 0; ry < *rheight; ++ry) {
+        float* r = &(*reduced)[ry * rystride];
+        const size_t y1 = ry * ky;
+        const size_t y2 = (std::min)(y1 + ky, aheight);
+        // sum the rows of the block
+        for (size_t y = y1; y < y2; ++y) {
+            const float* arow = a + y * aystride;
+            for (size_t rx = 0; rx < *rwidth; ++rx) {
+                const size_t x1 = rx * kx;
+                const size_t x2 = (std::min)(x1 + kx, awidth);
+                float* rpix = r + rx * axstride;
+                for (size_t x = x1; x < x2; ++x) {
+                    const float* apix = arow + x * axstride;
+                    for (size_t c = 0; c < axstride; ++c) {
+                        rpix[c] += apix[c];
+                    }
+                }
+            }
+        }
+        // normalize
+        for (size_t rx = 0; rx < *rwidth; ++rx) {
+            const size_t n = ( (std::min)( (rx + 1) * kx, awidth ) - rx * kx ) * (y2 - y1);
+            const float norm = 1.f / n;
+            float* rpix = r + rx * axstride;
+            for (size_t c = 0; c < axstride; ++c) {
+                rpix[c] *= norm;
+            }
+        }
+    }
+} // boxReduce
+
+// Draw the image a at the position "to" in the image b with ofxsFilterResize2d, first reducing
+// it with boxReduce if it is at least twice as large as the destination.
+inline void
+drawResized(const float* a,
+            size_t awidth,
+            size_t aheight,
+            size_t axstride,
+            size_t aystride,
+            size_t depth,
+            float* b,
+            size_t bwidth,
+            size_t bheight,
+            size_t bxstride,
+            size_t bystride,
+            const OfxRectI& to)
+{
+    const size_t towidth = (std::max)(1, to.x2 - to.x1);
+    const size_t toheight = (std::max)(1, to.y2 - to.y1);
+    // the reduced image must remain at least as large as the destination
+    const size_t kx = (std::max)( (size_t)1, awidth / towidth );
+    const size_t ky = (std::max)( (size_t)1, aheight / toheight );
+
+    if ( (kx < 2) && (ky < 2) ) {
+        const OfxRectD from = {0., 0., (double)awidth, (double)aheight};
+        ofxsFilterResize2d(a, awidth, aheight, axstride, aystride, depth,
+                           from, /*zeroOutside=*/false,
+                           b, bwidth, bheight, bxstride, bystride,
+                           to);
+
+        return;
+    }
+    std::vector<float> reduced;
+    size_t rwidth, rheight;
+    boxReduce(a, awidth, aheight, axstride, aystride, kx, ky, &reduced, &rwidth, &rheight);
+    // the source area, in reduced pixel units (the last block may be incomplete)
+    const OfxRectD from = {0., 0., (double)awidth / kx, (double)aheight / ky};
+    ofxsFilterResize2d(&reduced[0], rwidth, rheight, axstride, rwidth * axstride, depth,
+                       from, /*zeroOutside=*/false,
+                       b, bwidth, bheight, bxstride, bystride,
+                       to);
+} // drawResized
+
+OFXS_NAMESPACE_OFX_EXIT
+
+#endif // openfx_misc_ofxsBoxReduce_h
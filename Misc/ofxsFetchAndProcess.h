@@ -0,0 +1,153 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/NatronGitHub/openfx-misc>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef openfx_misc_ofxsFetchAndProcess_h
+#define openfx_misc_ofxsFetchAndProcess_h
+
+#include <cassert>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsProcessing.H"
+#include "ofxsMacros.h"
+
+OFXS_NAMESPACE_OFX_ENTER
+
+// An image to fetch from a clip (clip may be NULL, in which case the image is NULL)
+struct ImageRequest
+{
+    Clip *clip;
+    double time;
+
+    ImageRequest(Clip *clip_,
+                 double time_)
+        : clip(clip_)
+        , time(time_)
+    {
+    }
+};
+
+// Fetch images on the first thread, and run an image processor on the other threads,
+// so that the upstream renders of the next chunk of frames overlap the processing of the current one.
+// The processor must be set up as for ImageProcessor::process() (images, render window, render scale):
+// process() calls its preProcess() and postProcess(), and the processing threads each run one slice
+// of its render window (see processSlice()).
+class FetchAndProcessProcessor
+    : public MultiThread::Processor
+{
+public:
+    FetchAndProcessProcessor(ImageEffect &effect,
+                             ImageProcessor &processor,
+                             const std::vector<ImageRequest> &requests,
+                             std::vector<const Image*> *images)
+        : _effect(effect)
+        , _processor(processor)
+        , _requests(requests)
+        , _images(images)
+        , _failed(false)
+    {
+        _images->assign(_requests.size(), (const Image*)NULL);
+    }
+
+    void process()
+    {
+        _processor.preProcess();
+        multiThread( MultiThread::getNumCPUs() );
+        _processor.postProcess();
+    }
+
+    bool failed() const
+    {
+        return _failed;
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        if (threadID == 0) {
+            // exceptions must not leave the thread
+            try {
+                for (size_t i = 0; i < _requests.size(); ++i) {
+                    if ( _effect.abort() ) {
+                        break;
+                    }
+                    (*_images)[i] = _requests[i].clip ? _requests[i].clip->fetchImage(_requests[i].time) : 0;
+                }
+            } catch (...) {
+                _failed = true;
+            }
+            if (nThreads == 1) {
+                processSlice(0, 1);
+            }
+        } else {
+            processSlice(threadID - 1, nThreads - 1);
+        }
+    }
+
+    // Process the slice sliceIndex of nSlices of the render window of the processor: this is what
+    // ImageProcessor::process() runs on each of its nSlices threads, between preProcess() and postProcess().
+    void processSlice(unsigned int sliceIndex,
+                      unsigned int nSlices)
+    {
+        assert(sliceIndex < nSlices);
+        static_cast<MultiThread::Processor&>(_processor).multiThreadFunction(sliceIndex, nSlices);
+    }
+
+    ImageEffect &_effect;
+    ImageProcessor &_processor;
+    const std::vector<ImageRequest> &_requests;
+    std::vector<const Image*> *_images;
+    bool _failed; // only written by the first thread
+};
+
+// Fetch the requested images, and run the processor (if not NULL).
+// Images are only fetched from the threads of the multithread suite in Natron: on other hosts,
+// the images are fetched on the render thread, after running the processor.
+inline void
+fetchImagesAndProcess(ImageEffect &effect,
+                      ImageProcessor *processor,
+                      const std::vector<ImageRequest> &requests,
+                      std::vector<const Image*> *images)
+{
+    if ( processor && !requests.empty() && getImageEffectHostDescription()->isNatron && (MultiThread::getNumCPUs() > 1) ) {
+        FetchAndProcessProcessor fetcher(effect, *processor, requests, images);
+        fetcher.process();
+        if ( fetcher.failed() ) {
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+
+        return;
+    }
+    if (processor) {
+        processor->process();
+    }
+    images->assign(requests.size(), (const Image*)NULL);
+    for (size_t i = 0; i < requests.size(); ++i) {
+        if ( effect.abort() ) {
+            return;
+        }
+        (*images)[i] = requests[i].clip ? requests[i].clip->fetchImage(requests[i].time) : 0;
+    }
+}
+
+OFXS_NAMESPACE_OFX_EXIT
+
+#endif // openfx_misc_ofxsFetchAndProcess_h
@@ -0,0 +1,522 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/NatronGitHub/openfx-misc>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef openfx_misc_ofxsHistogram_h
+#define openfx_misc_ofxsHistogram_h
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsProcessing.H"
+#include "ofxsMaskMix.h"
+#include "ofxsMacros.h"
+#include "ofxsReduction.h"
+#include "ofxsSampling.h"
+
+OFXS_NAMESPACE_OFX_ENTER
+
+// Range and histogram analysis of an image, shared by the analysis buttons of the plugins
+// (e.g. Grade's Normalize and ColorLookup's Update Histogram).
+//
+// The analysis computes the minimum and maximum of each component over the pixels where the mask
+// is non-zero, and optionally a histogram of the first components. Values are normalized to [0,1]
+// for integer depths, and may be unpremultiplied first. A histogram that is only displayed may be
+// estimated from a stratified sample of the pixels (see ofxsSampling.h), but then the minimum and
+// maximum are estimates too.
+
+// what to compute
+struct HistogramSettings
+{
+    HistogramSettings()
+        : premult(false)
+        , premultChannel(3)
+        , bins(0)
+        , components(0)
+        , rangemin(0.)
+        , rangemax(0.)
+        , samples(0)
+    {
+    }
+
+    bool premult; // unpremultiply the values by premultChannel before the analysis
+    int premultChannel;
+    int bins; // number of bins of the histogram, or 0 to compute only the minimum and maximum
+    int components; // number of components in the histogram (the first ones), or 0 for all
+    double rangemin; // range covered by the histogram: values outside of the range go to the first or last bin.
+    double rangemax; // If the range is empty, the range of the analyzed values is used (adaptive binning)
+    unsigned long samples; // number of pixels to analyze, or 0 to analyze all pixels
+
+    bool operator ==(const HistogramSettings& other) const
+    {
+        return ( premult == other.premult && premultChannel == other.premultChannel &&
+                 bins == other.bins && components == other.components &&
+                 rangemin == other.rangemin && rangemax == other.rangemax &&
+                 samples == other.samples );
+    }
+};
+
+// the results of the analysis, which are also the partial results computed by each thread
+struct HistogramResults
+{
+    HistogramResults()
+        : count(0)
+        , components(0)
+        , bins(0)
+        , rangemin(0.)
+        , rangemax(0.)
+        , histogram()
+    {
+        std::fill( min, min + 4, +std::numeric_limits<double>::infinity() );
+        std::fill( max, max + 4, -std::numeric_limits<double>::infinity() );
+    }
+
+    unsigned long count; // number of analyzed pixels
+    double min[4]; // in the order of the image components
+    double max[4];
+    int components; // number of components in the histogram
+    int bins;
+    double rangemin; // range covered by the histogram
+    double rangemax;
+    std::vector<unsigned long> histogram; // bins values for each component
+
+    void merge(const HistogramResults& other)
+    {
+        count += other.count;
+        for (int c = 0; c < 4; ++c) {
+            min[c] = (std::min)(min[c], other.min[c]);
+            max[c] = (std::max)(max[c], other.max[c]);
+        }
+        if ( histogram.empty() ) {
+            components = other.components;
+            bins = other.bins;
+            rangemin = other.rangemin;
+            rangemax = other.rangemax;
+            histogram = other.histogram;
+        } else if ( !other.histogram.empty() ) {
+            assert( histogram.size() == other.histogram.size() );
+            for (size_t i = 0; i < histogram.size(); ++i) {
+                histogram[i] += other.histogram[i];
+            }
+        }
+    }
+};
+
+class HistogramProcessorBase
+    : public ImageProcessor
+{
+protected:
+    const Image *_maskImg;
+    bool _doMasking;
+    bool _maskInvert;
+    HistogramSettings _settings;
+    int _nComponents; // number of components in the analyzed image
+    bool _doHistogram; // false during the first pass of an adaptive analysis
+    double _rangemin;
+    double _rangemax;
+    int _samplingStep; // if > 1, one pixel is analyzed in each block of _samplingStep x _samplingStep pixels
+    ThreadReduction<HistogramResults> _partials; // per-thread results, merged once process() has returned
+
+public:
+    HistogramProcessorBase(ImageEffect &instance,
+                           int nComponents)
+        : ImageProcessor(instance)
+        , _maskImg(NULL)
+        , _doMasking(false)
+        , _maskInvert(false)
+        , _settings()
+        , _nComponents(nComponents)
+        , _doHistogram(false)
+        , _rangemin(0.)
+        , _rangemax(0.)
+        , _samplingStep(1)
+        , _partials()
+    {
+    }
+
+    virtual ~HistogramProcessorBase()
+    {
+    }
+
+    void setMaskImg(const Image *v,
+                    bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
+
+    void doMasking(bool v) { _doMasking = v; }
+
+    void setSettings(const HistogramSettings& settings) { _settings = settings; }
+
+    // Analyze the render window. Returns false if the analysis was aborted.
+    bool analyze(HistogramResults* results)
+    {
+        assert(results);
+        int components = _settings.components > 0 ? (std::min)(_settings.components, _nComponents) : _nComponents;
+        bool adaptive = _settings.bins > 0 && !(_settings.rangemin < _settings.rangemax);
+
+        _doHistogram = _settings.bins > 0 && !adaptive;
+        _rangemin = _settings.rangemin;
+        _rangemax = _settings.rangemax;
+        _samplingStep = stratifiedSamplingStep(_renderWindow, _settings.samples);
+        _partials.clear();
+        process();
+        if ( _effect.abort() ) {
+            return false;
+        }
+        _partials.reduce(results);
+        if ( adaptive && (results->count > 0) ) {
+            // second pass: the histogram covers the range of the analyzed values
+            _rangemin = results->min[0];
+            _rangemax = results->max[0];
+            for (int c = 1; c < components; ++c) {
+                _rangemin = (std::min)(_rangemin, results->min[c]);
+                _rangemax = (std::max)(_rangemax, results->max[c]);
+            }
+            if ( !(_rangemin < _rangemax) ) {
+                _rangemax = _rangemin + 1.;
+            }
+            if ( !( _rangemax - _rangemin <= (std::numeric_limits<double>::max)() ) ) {
+                // infinite values: there is no sensible binning
+                return true;
+            }
+            _doHistogram = true;
+            _partials.clear();
+            process();
+            if ( _effect.abort() ) {
+                return false;
+            }
+            _partials.reduce(results);
+        }
+
+        return true;
+    }
+
+protected:
+    // mask value at (x,y), given the mask row at y (which may be NULL)
+    template<class PIX, int maxValue>
+    bool isMasked(const PIX *maskRow,
+                  const OfxRectI &maskBounds,
+                  int x)
+    {
+        float m = 0.f;
+
+        if ( maskRow && (maskBounds.x1 <= x) && (x < maskBounds.x2) ) {
+            m = maskRow[x - maskBounds.x1] / (float)maxValue;
+        }
+        if (_maskInvert) {
+            m = 1.f - m;
+        }
+
+        return !(m > 0.f);
+    }
+
+    // get the mask row at y, or NULL if there is no mask
+    template<class PIX>
+    const PIX * getMaskRow(int y,
+                           OfxRectI *maskBounds)
+    {
+        if (!_maskImg) {
+            return NULL;
+        }
+        *maskBounds = _maskImg->getBounds();
+        if ( (y < maskBounds->y1) || (maskBounds->y2 <= y) ) {
+            return NULL;
+        }
+
+        return (const PIX *) _maskImg->getPixelAddress(maskBounds->x1, y);
+    }
+};
+
+
+template <class PIX, int nComponents, int maxValue>
+class HistogramProcessor
+    : public HistogramProcessorBase
+{
+public:
+    HistogramProcessor(ImageEffect &instance)
+        : HistogramProcessorBase(instance, nComponents)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        const bool unpremult = _settings.premult && (nComponents == 4);
+        const int bins = _settings.bins;
+        const int components = _settings.components > 0 ? (std::min)(_settings.components, nComponents) : nComponents;
+        const double binScale = _doHistogram ? bins / (_rangemax - _rangemin) : 0.;
+        HistogramResults results;
+        if (_doHistogram) {
+            results.components = components;
+            results.bins = bins;
+            results.rangemin = _rangemin;
+            results.rangemax = _rangemax;
+            results.histogram.assign(bins * components, 0);
+        }
+        double *min = results.min;
+        double *max = results.max;
+        unsigned long *histogram = _doHistogram ? &results.histogram[0] : NULL;
+
+        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
+               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            const PIX *rowPix = (const PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            OfxRectI maskBounds;
+            const PIX *maskRow = getMaskRow<PIX>(y, &maskBounds);
+
+            for (int x = nextStratifiedSample(_renderWindow, _samplingStep, procWindow.x1, y);
+                 x < procWindow.x2;
+                 x = nextStratifiedSample(_renderWindow, _samplingStep, x + 1, y)) {
+                if ( _doMasking && isMasked<PIX, maxValue>(maskRow, maskBounds, x) ) {
+                    continue;
+                }
+                const PIX *dstPix = rowPix + (x - procWindow.x1) * nComponents;
+                ++results.count;
+                double v[nComponents];
+                if (unpremult) {
+                    float unpPix[4];
+                    ofxsUnPremult<PIX, nComponents, maxValue>(dstPix, unpPix, _settings.premult, _settings.premultChannel);
+                    for (int c = 0; c < nComponents; ++c) {
+                        v[c] = unpPix[c];
+                    }
+                } else {
+                    for (int c = 0; c < nComponents; ++c) {
+                        v[c] = dstPix[c] / (double)maxValue;
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    min[c] = (std::min)(min[c], v[c]);
+                    max[c] = (std::max)(max[c], v[c]);
+                }
+                if (histogram) {
+                    for (int c = 0; c < components; ++c) {
+                        int bin = 0;
+                        if (v[c] >= _rangemax) {
+                            bin = bins - 1;
+                        } else if (v[c] >= _rangemin) {
+                            bin = (std::min)(static_cast<int>( std::floor( (v[c] - _rangemin) * binScale ) ), bins - 1);
+                        }
+                        ++histogram[c * bins + bin];
+                    }
+                }
+            }
+        }
+
+        _partials.add(procWindow.y1, results);
+    }
+};
+
+
+template <class PIX, int nComponents, int maxValue>
+bool
+analyzeHistogramComponentsDepth(ImageEffect &effect,
+                                const Image* srcImg,
+                                const Image* maskImg,
+                                bool maskInvert,
+                                const OfxRectI& window,
+                                const OfxPointD& renderScale,
+                                const HistogramSettings& settings,
+                                HistogramResults* results)
+{
+    HistogramProcessor<PIX, nComponents, maxValue> processor(effect);
+
+    processor.setDstImg( const_cast<Image*>(srcImg) ); // not a bug: we only set dst
+    if (maskImg) {
+        processor.doMasking(true);
+        processor.setMaskImg(maskImg, maskInvert);
+    }
+    processor.setSettings(settings);
+    processor.setRenderWindow(window, renderScale);
+
+    return processor.analyze(results);
+}
+
+template <int nComponents>
+bool
+analyzeHistogramComponents(ImageEffect &effect,
+                           const Image* srcImg,
+                           const Image* maskImg,
+                           bool maskInvert,
+                           const OfxRectI& window,
+                           const OfxPointD& renderScale,
+                           const HistogramSettings& settings,
+                           HistogramResults* results)
+{
+    switch ( srcImg->getPixelDepth() ) {
+    case eBitDepthUByte:
+        return analyzeHistogramComponentsDepth<unsigned char, nComponents, 255>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    case eBitDepthUShort:
+        return analyzeHistogramComponentsDepth<unsigned short, nComponents, 65535>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    case eBitDepthFloat:
+        return analyzeHistogramComponentsDepth<float, nComponents, 1>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    default:
+        throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+
+    return false;
+}
+
+// Analyze the given window of srcImg, where maskImg (if not NULL) is non-zero.
+// Returns false if the analysis was aborted.
+inline bool
+analyzeHistogram(ImageEffect &effect,
+                 const Image* srcImg,
+                 const Image* maskImg,
+                 bool maskInvert,
+                 const OfxRectI& window,
+                 const OfxPointD& renderScale,
+                 const HistogramSettings& settings,
+                 HistogramResults* results)
+{
+    switch ( srcImg->getPixelComponents() ) {
+    case ePixelComponentAlpha:
+        return analyzeHistogramComponents<1>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    case ePixelComponentXY:
+        return analyzeHistogramComponents<2>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    case ePixelComponentRGB:
+        return analyzeHistogramComponents<3>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    case ePixelComponentRGBA:
+        return analyzeHistogramComponents<4>(effect, srcImg, maskImg, maskInvert, window, renderScale, settings, results);
+    default:
+        throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+
+    return false;
+}
+
+// The last results computed for each frame, so that pressing an analysis button again does not
+// rescan the image. Results are identified by the unique identifiers of the source and mask images
+// given by the host, so that they are recomputed when the input changes. Images without an
+// identifier are never cached.
+class HistogramCache
+{
+public:
+    HistogramCache()
+        : _entries()
+    {
+    }
+
+    // get the cached results for the analysis of srcImg at the given time, or return false
+    bool get(double time,
+             const Image* srcImg,
+             const Image* maskImg,
+             bool maskInvert,
+             const OfxRectI& window,
+             const HistogramSettings& settings,
+             HistogramResults* results) const
+    {
+        Entry key;
+
+        if ( !makeKey(srcImg, maskImg, maskInvert, window, settings, &key) ) {
+            return false;
+        }
+        std::map<double, Entry>::const_iterator it = _entries.find(time);
+        if ( ( it == _entries.end() ) || !it->second.sameKey(key) ) {
+            return false;
+        }
+        *results = it->second.results;
+
+        return true;
+    }
+
+    void set(double time,
+             const Image* srcImg,
+             const Image* maskImg,
+             bool maskInvert,
+             const OfxRectI& window,
+             const HistogramSettings& settings,
+             const HistogramResults& results)
+    {
+        Entry entry;
+
+        if ( !makeKey(srcImg, maskImg, maskInvert, window, settings, &entry) ) {
+            return;
+        }
+        if ( ( _entries.size() >= kMaxFrames ) && ( _entries.find(time) == _entries.end() ) ) {
+            _entries.erase( _entries.begin() );
+        }
+        entry.results = results;
+        _entries[time] = entry;
+    }
+
+    void clear()
+    {
+        _entries.clear();
+    }
+
+private:
+    static const size_t kMaxFrames = 64;
+
+    struct Entry
+    {
+        std::string srcId;
+        std::string maskId;
+        bool maskInvert;
+        OfxRectI window;
+        OfxPointD renderScale;
+        HistogramSettings settings;
+        HistogramResults results;
+
+        bool sameKey(const Entry& other) const
+        {
+            return ( srcId == other.srcId && maskId == other.maskId && maskInvert == other.maskInvert &&
+                     window.x1 == other.window.x1 && window.y1 == other.window.y1 &&
+                     window.x2 == other.window.x2 && window.y2 == other.window.y2 &&
+                     renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+                     settings == other.settings );
+        }
+    };
+
+    static bool makeKey(const Image* srcImg,
+                        const Image* maskImg,
+                        bool maskInvert,
+                        const OfxRectI& window,
+                        const HistogramSettings& settings,
+                        Entry* key)
+    {
+        key->srcId = srcImg->getUniqueIdentifier();
+        if ( key->srcId.empty() ) {
+            return false;
+        }
+        if (maskImg) {
+            key->maskId = maskImg->getUniqueIdentifier();
+            if ( key->maskId.empty() ) {
+                return false;
+            }
+        }
+        key->maskInvert = maskImg ? maskInvert : false;
+        key->window = window;
+        key->renderScale = srcImg->getRenderScale();
+        key->settings = settings;
+
+        return true;
+    }
+
+    std::map<double, Entry> _entries; // indexed by time
+};
+
+OFXS_NAMESPACE_OFX_EXIT
+
+#endif // openfx_misc_ofxsHistogram_h
@@ -0,0 +1,168 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/NatronGitHub/openfx-misc>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef openfx_misc_ofxsReduction_h
+#define openfx_misc_ofxsReduction_h
+
+#include <vector>
+#include <algorithm>
+
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+OFXS_NAMESPACE_OFX_ENTER
+
+// Partial results of a reduction computed by the threads of the multithread suite,
+// e.g. the statistics computed by each call to ImageProcessor::multiThreadProcessImages().
+//
+// Each thread stores its partial result in its own slot, without taking a lock, and the
+// slots are merged once MultiThread::Processor::multiThread() has returned. Slots are padded
+// so that two threads never write to the same cache line.
+// Each partial result is tagged with a key (e.g. the first line of the processed window), and
+// partial results are merged by increasing key, so that the result does not depend on the
+// order in which the threads were scheduled.
+//
+// T must be default-constructible and copyable, and have a member function
+// "void merge(const T& other)", where the partial result "other" comes after *this.
+template <class T>
+class ThreadReduction
+{
+public:
+    ThreadReduction()
+        : _slots( (std::max)( 1u, MultiThread::getNumCPUs() ) )
+        , _overflow()
+        , _overflowMutex()
+    {
+    }
+
+    // store the partial result of the calling thread
+    void add(int key,
+             const T& partial)
+    {
+        unsigned int i = MultiThread::getThreadIndex();
+
+        if ( i < _slots.size() ) {
+            Slot& slot = _slots[i];
+            if (!slot.used) {
+                slot.value = partial;
+                slot.key = key;
+                slot.used = true;
+            } else if (key < slot.key) {
+                // the same thread processed several windows (e.g. the host ran them sequentially)
+                T value = partial;
+                value.merge(slot.value);
+                slot.value = value;
+                slot.key = key;
+            } else {
+                slot.value.merge(partial);
+            }
+        } else {
+            // the calling thread is not one of the threads we prepared slots for
+            // (e.g. a nested call from a spawned thread): keep the partial result aside
+            Slot slot;
+            slot.value = partial;
+            slot.key = key;
+            slot.used = true;
+            AutoMutex l(&_overflowMutex);
+            _overflow.push_back(slot);
+        }
+    }
+
+    // merge all partial results by increasing key. Must be called once all threads have returned.
+    // Returns false if there was no partial result.
+    bool reduce(T* result) const
+    {
+        std::vector<const Slot*> slots;
+
+        for (typename std::vector<Slot>::const_iterator it = _slots.begin(); it != _slots.end(); ++it) {
+            if (it->used) {
+                slots.push_back(&*it);
+            }
+        }
+        for (typename std::vector<Slot>::const_iterator it = _overflow.begin(); it != _overflow.end(); ++it) {
+            slots.push_back(&*it);
+        }
+        std::stable_sort(slots.begin(), slots.end(), slotKeyLess);
+        *result = T();
+        for (typename std::vector<const Slot*>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+            result->merge( (*it)->value );
+        }
+
+        return !slots.empty();
+    }
+
+    // forget all partial results
+    void clear()
+    {
+        for (typename std::vector<Slot>::iterator it = _slots.begin(); it != _slots.end(); ++it) {
+            it->used = false;
+        }
+        _overflow.clear();
+    }
+
+private:
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+    typedef MultiThread::Mutex Mutex;
+    typedef MultiThread::AutoMutex AutoMutex;
+#else
+    typedef tthread::fast_mutex Mutex;
+    typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+    // should be at least the size of a cache line on all supported architectures
+    static const int kCacheLineSize = 128;
+
+    struct Slot
+    {
+        T value;
+        int key;
+        bool used;
+        char padding[kCacheLineSize]; // keep the slots of different threads on different cache lines
+
+        Slot()
+            : value()
+            , key(0)
+            , used(false)
+        {
+        }
+    };
+
+    static bool slotKeyLess(const Slot* a,
+                            const Slot* b)
+    {
+        return a->key < b->key;
+    }
+
+    std::vector<Slot> _slots; // indexed by thread index
+    std::vector<Slot> _overflow; // partial results from other threads, protected by _overflowMutex
+    Mutex _overflowMutex;
+
+private:  // noncopyable
+    ThreadReduction( const ThreadReduction& );
+    ThreadReduction& operator=( const ThreadReduction& );
+};
+
+OFXS_NAMESPACE_OFX_EXIT
+
+#endif // openfx_misc_ofxsReduction_h
@@ -0,0 +1,97 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/NatronGitHub/openfx-misc>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef openfx_misc_ofxsSampling_h
+#define openfx_misc_ofxsSampling_h
+
+#include <cmath>
+#include <algorithm>
+
+#include "ofxCore.h"
+#include "ofxsMacros.h"
+
+OFXS_NAMESPACE_OFX_ENTER
+
+// Stratified sampling of a window, used to estimate statistics or histograms from a subset of the pixels.
+//
+// The window is divided in blocks of step x step pixels, and one pixel is analyzed in each block.
+// In each row of blocks, the analyzed pixels are on the same line, so that other lines are skipped.
+// Positions are pseudo-random, but only depend on the window and the step, so that several passes
+// (or the windows processed by several threads) analyze the same pixels.
+
+// the step giving about nSamples analyzed pixels in the window (1 if all pixels should be analyzed)
+inline int
+stratifiedSamplingStep(const OfxRectI& window,
+                       double nSamples)
+{
+    double nPixels = (double)(window.x2 - window.x1) * (window.y2 - window.y1);
+
+    if ( !(nSamples > 0.) || (nPixels <= nSamples) ) {
+        return 1;
+    }
+
+    return (std::max)( 1, (int)std::floor( std::sqrt(nPixels / nSamples) ) );
+}
+
+inline unsigned int
+stratifiedSamplingHash(unsigned int a,
+                       unsigned int b)
+{
+    unsigned int h = a * 0x9e3779b1u ^ (b + 0x7f4a7c15u) * 0x85ebca77u;
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+
+    return h;
+}
+
+// Returns the first analyzed pixel of line y at or after x, or window.x2 if there is none.
+inline int
+nextStratifiedSample(const OfxRectI& window,
+                     int step,
+                     int x,
+                     int y)
+{
+    if (step <= 1) {
+        return x;
+    }
+    unsigned int by = (y - window.y1) / step;
+    int blockY = window.y1 + by * step;
+    int blockHeight = (std::min)(step, window.y2 - blockY);
+    if ( y != blockY + (int)(stratifiedSamplingHash(by, 0xffffffffu) % blockHeight) ) {
+        return window.x2;
+    }
+    for (unsigned int bx = (x - window.x1) / step; window.x1 + (int)bx * step < window.x2; ++bx) {
+        int blockX = window.x1 + bx * step;
+        int blockWidth = (std::min)(step, window.x2 - blockX);
+        int sx = blockX + (int)(stratifiedSamplingHash(bx, by) % blockWidth);
+        if (sx >= x) {
+            return sx;
+        }
+    }
+
+    return window.x2;
+}
+
+OFXS_NAMESPACE_OFX_EXIT
+
+#endif // openfx_misc_ofxsSampling_h
@@ -37,7 +37,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginName "PositionOFX"
 #define kPluginGrouping "Transform"
 #define kPluginDescription "Translate an image by an integer number of pixels.\n" \
-    "This plugin does not concatenate transforms."
+    "This plugin concatenates transforms."
 #define kPluginIdentifier "net.sf.openfx.Position"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
@@ -105,6 +105,9 @@ public:
 private:
     virtual void render(const RenderArguments &args) OVERRIDE FINAL;
     virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime, int& view, std::string& plane) OVERRIDE FINAL;
+#ifdef OFX_EXTENSIONS_NUKE
+    virtual bool getTransform(const TransformArguments & args, Clip * &transformClip, double transformMatrix[9]) OVERRIDE FINAL;
+#endif
 
     // override the rod call
     virtual bool getRegionOfDefinition(const RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
@@ -292,6 +295,50 @@ PositionPlugin::isIdentity(const IsIdentityArguments &args,
     return false;
 }
 
+#ifdef OFX_EXTENSIONS_NUKE
+// overridden getTransform
+// The translation is an integer number of pixels, so that the host can use
+// the source image as-is (or concatenate it with downstream transforms)
+// instead of copying every pixel in render().
+bool
+PositionPlugin::getTransform(const TransformArguments &args,
+                             Clip * &transformClip,
+                             double transformMatrix[9])
+{
+    if (!_srcClip || !_srcClip->isConnected()) {
+        return false;
+    }
+    const double time = args.time;
+    double par = _dstClip->getPixelAspectRatio();
+    OfxPointD t_canonical;
+    _translate->getValueAtTime(time, t_canonical.x, t_canonical.y);
+    OfxPointI t_pixel;
+
+    // rounding is done by going to pixels, same as in render()
+    t_pixel.x = (int)std::floor(t_canonical.x * args.renderScale.x / par + 0.5);
+    t_pixel.y = (int)std::floor(t_canonical.y * args.renderScale.y + 0.5);
+    if (_srcClip->getFieldOrder() == eFieldBoth) {
+        // round to an even y
+        t_pixel.y = t_pixel.y - (t_pixel.y & 1);
+    }
+
+    // the matrix is in pixel coordinates
+    transformClip = _srcClip;
+    transformMatrix[0] = 1.;
+    transformMatrix[1] = 0.;
+    transformMatrix[2] = t_pixel.x;
+    transformMatrix[3] = 0.;
+    transformMatrix[4] = 1.;
+    transformMatrix[5] = t_pixel.y;
+    transformMatrix[6] = 0.;
+    transformMatrix[7] = 0.;
+    transformMatrix[8] = 1.;
+
+    return true;
+}
+
+#endif
+
 mDeclarePluginFactory(PositionPluginFactory, {ofxsThreadSuiteCheck();}, {});
 struct PositionInteractParam
 {
@@ -337,6 +384,9 @@ PositionPluginFactory::describe(ImageEffectDescriptor &desc)
 
     desc.setOverlayInteractDescriptor(new PositionOverlayDescriptor<PositionInteractParam>);
 #ifdef OFX_EXTENSIONS_NUKE
+    // Enable transform by the host.
+    // It is only possible for transforms which can be represented as a 3x3 matrix.
+    desc.setCanTransform(true);
     // ask the host to render all planes
     desc.setPassThroughForNotProcessedPlanes(ePassThroughLevelRenderAllRequestedPlanes);
 #endif
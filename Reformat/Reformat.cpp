@@ -26,11 +26,14 @@
 #include <iostream>
 #include <limits>
 #include <algorithm>
+#include <vector>
 
 #include "ofxsTransform3x3.h"
 #include "ofxsTransformInteract.h"
 #include "ofxsFormatResolution.h"
 #include "ofxsCoords.h"
+#include "ofxsMaskMix.h"
+#include "ofxsMultiThread.h"
 #include "ofxsThreadSuite.h"
 
 using namespace OFX;
@@ -165,6 +168,435 @@ static bool gHostCanTransform;
 static bool gHostIsNatron = false;
 static bool gHostSupportsFormat = false;
 
+////////////////////////////////////////////////////////////////////////////////
+// Separable polyphase resize, used when the transform is a scale (possibly with
+// flip/flop) followed by a translation.
+// In that case, the filter phases are the same on every row (resp. column), so
+// the filter weights are computed once per output column and once per output row,
+// and the image is resized by a horizontal pass followed by a vertical pass.
+// When downscaling, the filter footprint is widened by the scale factor, so that all
+// source pixels contribute to the result, as Transform3x3Plugin::render does when it
+// filters over the footprint of the output pixel (see ofxsFilterInterpolate2DSuper).
+
+// filter radius, in pixels, when not stretched
+static double
+resizeFilterSupport(FilterEnum filter)
+{
+    switch (filter) {
+    case eFilterImpulse:
+    case eFilterBox:
+
+        return 0.5;
+    case eFilterBilinear:
+    case eFilterCubic:
+
+        return 1.;
+    case eFilterKeys:
+    case eFilterSimon:
+    case eFilterRifman:
+    case eFilterMitchell:
+    case eFilterParzen:
+    case eFilterNotch:
+
+        return 2.;
+    }
+
+    return 2.;
+}
+
+// cubic convolution kernel with parameter a (Keys: a=-0.5, Simon: a=-0.75, Rifman: a=-1)
+static inline double
+resizeCubicConvolution(double x,
+                       double a)
+{
+    if (x < 1.) {
+        return ( (a + 2.) * x - (a + 3.) ) * x * x + 1.;
+    } else if (x < 2.) {
+        return ( ( (x - 5.) * x + 8. ) * x - 4. ) * a;
+    }
+
+    return 0.;
+}
+
+// Mitchell-Netravali cubic kernel with parameters B and C
+static inline double
+resizeMitchellNetravali(double x,
+                        double B,
+                        double C)
+{
+    if (x < 1.) {
+        return ( ( (12. - 9. * B - 6. * C) * x + (-18. + 12. * B + 6. * C) ) * x * x + (6. - 2. * B) ) / 6.;
+    } else if (x < 2.) {
+        return ( ( ( (-B - 6. * C) * x + (6. * B + 30. * C) ) * x + (-12. * B - 48. * C) ) * x + (8. * B + 24. * C) ) / 6.;
+    }
+
+    return 0.;
+}
+
+// filter kernel, with the same parameters as the filters in ofxsFilter.h
+static double
+resizeFilterKernel(FilterEnum filter,
+                   double x)
+{
+    x = std::abs(x);
+    switch (filter) {
+    case eFilterImpulse:
+    case eFilterBox:
+
+        return (x < 0.5) ? 1. : 0.;
+    case eFilterBilinear:
+
+        return (x < 1.) ? (1. - x) : 0.;
+    case eFilterCubic:
+
+        // cubic spline with zero derivatives at the sample points
+        return (x < 1.) ? ( 1. - x * x * (3. - 2. * x) ) : 0.;
+    case eFilterKeys:
+
+        return resizeCubicConvolution(x, -0.5);
+    case eFilterSimon:
+
+        return resizeCubicConvolution(x, -0.75);
+    case eFilterRifman:
+
+        return resizeCubicConvolution(x, -1.);
+    case eFilterMitchell:
+
+        return resizeMitchellNetravali(x, 1. / 3., 1. / 3.);
+    case eFilterParzen:
+
+        return resizeMitchellNetravali(x, 1., 0.);
+    case eFilterNotch:
+
+        return resizeMitchellNetravali(x, 1.5, -0.25);
+    }
+
+    return 0.;
+}
+
+// the filter taps for each output pixel along one axis
+struct ResizeTaps
+{
+    std::vector<int> first; // first source pixel
+    std::vector<int> count; // number of source pixels (may be 0)
+    std::vector<float> weights; // maxCount weights per output pixel
+    int maxCount;
+
+    ResizeTaps()
+        : first()
+        , count()
+        , weights()
+        , maxCount(0)
+    {
+    }
+};
+
+// Compute the taps for output pixels o1 <= o < o2, given that the center of output pixel o
+// maps to source position a * (o + 0.5) + b (in pixel coordinates).
+// Only source pixels s1 <= s < s2 are valid: pixels outside are either black or
+// replaced by the closest valid pixel, depending on blackOutside.
+static void
+resizeComputeTaps(FilterEnum filter,
+                  double a,
+                  double b,
+                  int o1,
+                  int o2,
+                  int s1,
+                  int s2,
+                  bool blackOutside,
+                  ResizeTaps* taps)
+{
+    assert(o1 <= o2);
+    const int n = o2 - o1;
+    const double scale = (std::max)( 1., std::abs(a) );
+    const double radius = resizeFilterSupport(filter) * scale;
+    const int maxCount = (filter == eFilterImpulse) ? 1 : ( (int)std::ceil(2 * radius) + 1 );
+
+    taps->maxCount = maxCount;
+    taps->first.assign(n, 0);
+    taps->count.assign(n, 0);
+    taps->weights.assign( (size_t)n * maxCount, 0.f );
+    if (s2 <= s1) {
+        // no valid source pixel
+
+        return;
+    }
+    std::vector<double> w(maxCount);
+    for (int i = 0; i < n; ++i) {
+        const double s = a * (o1 + i + 0.5) + b;
+        float* weights = &taps->weights[(size_t)i * maxCount];
+        if (filter == eFilterImpulse) {
+            int j = (int)std::floor(s);
+            if ( (j < s1) || (s2 <= j) ) {
+                if (blackOutside) {
+                    continue;
+                }
+                j = (std::max)( s1, (std::min)(j, s2 - 1) );
+            }
+            taps->first[i] = j;
+            taps->count[i] = 1;
+            weights[0] = 1.f;
+            continue;
+        }
+        // position in the source, in pixel index units
+        const double u = s - 0.5;
+        const int j1 = (int)std::ceil(u - radius);
+        const int j2 = (std::min)( (int)std::floor(u + radius), j1 + maxCount - 1 );
+        double sum = 0.;
+        for (int j = j1; j <= j2; ++j) {
+            w[j - j1] = resizeFilterKernel(filter, (j - u) / scale);
+            sum += w[j - j1];
+        }
+        if (sum == 0.) {
+            continue;
+        }
+        // clip the taps to the valid source pixels
+        const int k1 = (std::max)(j1, s1);
+        const int k2 = (std::min)(j2, s2 - 1);
+        if (k2 < k1) {
+            // all taps are outside
+            if (!blackOutside) {
+                taps->first[i] = (j2 < s1) ? s1 : (s2 - 1);
+                taps->count[i] = 1;
+                weights[0] = 1.f;
+            }
+            continue;
+        }
+        taps->first[i] = k1;
+        taps->count[i] = k2 - k1 + 1;
+        for (int j = k1; j <= k2; ++j) {
+            weights[j - k1] = (float)(w[j - j1] / sum);
+        }
+        if (!blackOutside) {
+            // the weights of the taps outside go to the closest valid pixel
+            for (int j = j1; j < k1; ++j) {
+                weights[0] += (float)(w[j - j1] / sum);
+            }
+            for (int j = k2 + 1; j <= j2; ++j) {
+                weights[k2 - k1] += (float)(w[j - j1] / sum);
+            }
+        }
+    }
+} // resizeComputeTaps
+
+// horizontal pass: resample source rows y1 <= y < y2 to a float buffer with the width of the render window
+template <class PIX, int nComponents>
+class ResizeRowsProcessor
+    : public MultiThread::Processor
+{
+public:
+    ResizeRowsProcessor(ImageEffect &instance,
+                        const Image* srcImg,
+                        const ResizeTaps& taps,
+                        bool clamp,
+                        int y1,
+                        int y2,
+                        float* tmpPixelData)
+        : _effect(instance)
+        , _srcImg(srcImg)
+        , _taps(taps)
+        , _clamp(clamp)
+        , _y1(y1)
+        , _y2(y2)
+        , _tmpPixelData(tmpPixelData)
+    {
+        assert(_srcImg && _tmpPixelData && _y1 <= _y2);
+    }
+
+    /** @brief called to process everything */
+    void process(void)
+    {
+        const unsigned int width = (unsigned int)_taps.first.size();
+        const unsigned int height = (unsigned int)(_y2 - _y1);
+        // make sure there are at least 4096 pixels per CPU and at least 1 line par CPU
+        unsigned int nCPUs = ( (std::min)(width, 4096u) * height ) / 4096u;
+
+        // make sure the number of CPUs is valid (and use at least 1 CPU)
+        nCPUs = (std::max)( 1u, (std::min)( nCPUs, MultiThread::getNumCPUs() ) );
+
+        // call the base multi threading code, should put a pre & post thread calls in too
+        multiThread(nCPUs);
+    }
+
+private:
+    /** @brief function that will be called in each thread. ID is from 0..nThreads-1 nThreads are the number of threads it is being run over */
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        int y_begin = 0;
+        int y_end = 0;
+
+        MultiThread::getThreadRange(threadID, nThreads, _y1, _y2, &y_begin, &y_end);
+        if (y_end <= y_begin) {
+            return;
+        }
+        const int width = (int)_taps.first.size();
+        const int maxCount = _taps.maxCount;
+        const OfxRectI& srcBounds = _srcImg->getBounds();
+        for (int y = y_begin; y < y_end; ++y) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            float* tmpPix = _tmpPixelData + (size_t)(y - _y1) * width * nComponents;
+            const PIX* srcRow = (const PIX*)_srcImg->getPixelAddress(srcBounds.x1, y);
+            if (!srcRow) {
+                std::fill(tmpPix, tmpPix + (size_t)width * nComponents, 0.f);
+                continue;
+            }
+            for (int x = 0; x < width; ++x, tmpPix += nComponents) {
+                float v[nComponents];
+                for (int c = 0; c < nComponents; ++c) {
+                    v[c] = 0.f;
+                }
+                const int count = _taps.count[x];
+                if (count > 0) {
+                    const float* weights = &_taps.weights[(size_t)x * maxCount];
+                    const PIX* srcPix = srcRow + (size_t)(_taps.first[x] - srcBounds.x1) * nComponents;
+                    for (int j = 0; j < count; ++j, srcPix += nComponents) {
+                        const float w = weights[j];
+                        for (int c = 0; c < nComponents; ++c) {
+                            v[c] += w * srcPix[c];
+                        }
+                    }
+                    if (_clamp) {
+                        // clamp to the range of the source values
+                        srcPix = srcRow + (size_t)(_taps.first[x] - srcBounds.x1) * nComponents;
+                        for (int c = 0; c < nComponents; ++c) {
+                            float vmin = srcPix[c];
+                            float vmax = srcPix[c];
+                            for (int j = 1; j < count; ++j) {
+                                vmin = (std::min)(vmin, (float)srcPix[j * nComponents + c]);
+                                vmax = (std::max)(vmax, (float)srcPix[j * nComponents + c]);
+                            }
+                            v[c] = (std::max)( vmin, (std::min)(v[c], vmax) );
+                        }
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    tmpPix[c] = v[c];
+                }
+            }
+        }
+    }
+
+    ImageEffect &_effect;      /**< @brief effect to render with */
+    const Image* _srcImg;
+    const ResizeTaps& _taps;
+    const bool _clamp;
+    const int _y1;
+    const int _y2;
+    float* const _tmpPixelData;
+};
+
+// vertical pass: resample the float buffer (rows y1 <= y < y2) to the destination image
+template <class PIX, int nComponents, int maxValue>
+class ResizeColsProcessor
+    : public MultiThread::Processor
+{
+public:
+    ResizeColsProcessor(ImageEffect &instance,
+                        Image* dstImg,
+                        const OfxRectI& renderWindow,
+                        const ResizeTaps& taps,
+                        bool clamp,
+                        int y1,
+                        const float* tmpPixelData)
+        : _effect(instance)
+        , _dstImg(dstImg)
+        , _renderWindow(renderWindow)
+        , _taps(taps)
+        , _clamp(clamp)
+        , _y1(y1)
+        , _tmpPixelData(tmpPixelData)
+    {
+        assert(_dstImg && _tmpPixelData);
+    }
+
+    /** @brief called to process everything */
+    void process(void)
+    {
+        const unsigned int width = (unsigned int)(_renderWindow.x2 - _renderWindow.x1);
+        const unsigned int height = (unsigned int)(_renderWindow.y2 - _renderWindow.y1);
+        // make sure there are at least 4096 pixels per CPU and at least 1 line par CPU
+        unsigned int nCPUs = ( (std::min)(width, 4096u) * height ) / 4096u;
+
+        // make sure the number of CPUs is valid (and use at least 1 CPU)
+        nCPUs = (std::max)( 1u, (std::min)( nCPUs, MultiThread::getNumCPUs() ) );
+
+        // call the base multi threading code, should put a pre & post thread calls in too
+        multiThread(nCPUs);
+    }
+
+private:
+    /** @brief function that will be called in each thread. ID is from 0..nThreads-1 nThreads are the number of threads it is being run over */
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        int y_begin = 0;
+        int y_end = 0;
+
+        MultiThread::getThreadRange(threadID, nThreads, _renderWindow.y1, _renderWindow.y2, &y_begin, &y_end);
+        if (y_end <= y_begin) {
+            return;
+        }
+        const int width = _renderWindow.x2 - _renderWindow.x1;
+        const int maxCount = _taps.maxCount;
+        for (int y = y_begin; y < y_end; ++y) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            PIX* dstPix = (PIX*)_dstImg->getPixelAddress(_renderWindow.x1, y);
+            assert(dstPix);
+            if (!dstPix) {
+                continue;
+            }
+            const int i = y - _renderWindow.y1;
+            const int count = _taps.count[i];
+            const float* weights = &_taps.weights[(size_t)i * maxCount];
+            const float* tmpCol = (count > 0) ? ( _tmpPixelData + (size_t)(_taps.first[i] - _y1) * width * nComponents ) : NULL;
+            for (int x = 0; x < width; ++x, dstPix += nComponents) {
+                float v[nComponents];
+                for (int c = 0; c < nComponents; ++c) {
+                    v[c] = 0.f;
+                }
+                if (count > 0) {
+                    const float* tmpPix = tmpCol + (size_t)x * nComponents;
+                    for (int j = 0; j < count; ++j, tmpPix += (size_t)width * nComponents) {
+                        const float w = weights[j];
+                        for (int c = 0; c < nComponents; ++c) {
+                            v[c] += w * tmpPix[c];
+                        }
+                    }
+                    if (_clamp) {
+                        // clamp to the range of the source values
+                        tmpPix = tmpCol + (size_t)x * nComponents;
+                        for (int c = 0; c < nComponents; ++c) {
+                            float vmin = tmpPix[c];
+                            float vmax = tmpPix[c];
+                            for (int j = 1; j < count; ++j) {
+                                vmin = (std::min)(vmin, tmpPix[(size_t)j * width * nComponents + c]);
+                                vmax = (std::max)(vmax, tmpPix[(size_t)j * width * nComponents + c]);
+                            }
+                            v[c] = (std::max)( vmin, (std::min)(v[c], vmax) );
+                        }
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    dstPix[c] = ofxsClampIfInt<PIX, maxValue>(v[c], 0, maxValue);
+                }
+            }
+        }
+    }
+
+    ImageEffect &_effect;      /**< @brief effect to render with */
+    Image* _dstImg;
+    const OfxRectI _renderWindow;
+    const ResizeTaps& _taps;
+    const bool _clamp;
+    const int _y1;
+    const float* const _tmpPixelData;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class ReformatPlugin
@@ -220,6 +652,8 @@ public:
 
 private:
     virtual bool getRegionOfDefinition(const RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
+    virtual void getRegionsOfInterest(const RegionsOfInterestArguments &args, RegionOfInterestSetter &rois) OVERRIDE FINAL;
+    virtual void render(const RenderArguments &args) OVERRIDE FINAL;
     virtual bool isIdentity(double time) OVERRIDE FINAL;
     virtual bool getInverseTransformCanonical(double time, int view, double amount, bool invert, Matrix3x3* invtransform) const OVERRIDE FINAL;
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
@@ -257,6 +691,33 @@ private:
                          OfxRectD* rect, // the rect to which the input format is mapped
                          OfxRectI* format) const; // the full format (only useful if host supports format, really)
 
+    bool getResizeTransform(double time,
+                            const OfxPointD& renderScale,
+                            double* ax,
+                            double* bx,
+                            double* ay,
+                            double* by) const;
+
+    bool renderResize(const RenderArguments &args);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderResizeForComponents(const RenderArguments &args,
+                                   const Image* src,
+                                   Image* dst,
+                                   double ax,
+                                   double bx,
+                                   double ay,
+                                   double by);
+
+    template <class PIX, int maxValue>
+    void renderResizeForDepth(const RenderArguments &args,
+                              const Image* src,
+                              Image* dst,
+                              double ax,
+                              double bx,
+                              double ay,
+                              double by);
+
     // NON-GENERIC
     BooleanParam* _useRoD;
     ChoiceParam *_type;
@@ -322,6 +783,241 @@ ReformatPlugin::isIdentity(const double time)
     return false;
 }
 
+// If the transform is a scale (possibly with flip/flop) followed by a translation,
+// return it in pixel coordinates at the given render scale:
+// the center of the output pixel (x,y) maps to the source position (ax * (x + 0.5) + bx, ay * (y + 0.5) + by).
+bool
+ReformatPlugin::getResizeTransform(const double time,
+                                   const OfxPointD& renderScale,
+                                   double* ax,
+                                   double* bx,
+                                   double* ay,
+                                   double* by) const
+{
+    if ( !_srcClip || !_srcClip->isConnected() ) {
+        return false;
+    }
+    Matrix3x3 invtransform;
+    // the view is not used by Reformat
+    if ( !getInverseTransformCanonical(time, 0, 1., false, &invtransform) ) {
+        return false;
+    }
+    if ( (invtransform(0,1) != 0.) || (invtransform(1,0) != 0.) ||
+         (invtransform(2,0) != 0.) || (invtransform(2,1) != 0.) || (invtransform(2,2) != 1.) ||
+         (invtransform(0,0) == 0.) || (invtransform(1,1) == 0.) ) {
+        // turn, or degenerate transform
+        return false;
+    }
+    const double srcPar = _srcClip->getPixelAspectRatio();
+    const double dstPar = _dstClip->getPixelAspectRatio();
+    *ax = invtransform(0,0) * dstPar / srcPar;
+    *bx = invtransform(0,2) * renderScale.x / srcPar;
+    *ay = invtransform(1,1);
+    *by = invtransform(1,2) * renderScale.y;
+
+    return true;
+}
+
+// override the roi call
+// The resize filter is stretched when downscaling, so the region of interest
+// is larger than the one computed by Transform3x3Plugin.
+void
+ReformatPlugin::getRegionsOfInterest(const RegionsOfInterestArguments &args,
+                                     RegionOfInterestSetter &rois)
+{
+    const double time = args.time;
+    double ax, bx, ay, by;
+
+    if ( !getResizeTransform(time, args.renderScale, &ax, &bx, &ay, &by) ) {
+        Transform3x3Plugin::getRegionsOfInterest(args, rois);
+
+        return;
+    }
+    const double srcPar = _srcClip->getPixelAspectRatio();
+    const double dstPar = _dstClip->getPixelAspectRatio();
+    FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+    // filter radius in source pixels, plus one pixel for rounding
+    const double rx = resizeFilterSupport(filter) * (std::max)( 1., std::abs(ax) ) + 1.;
+    const double ry = resizeFilterSupport(filter) * (std::max)( 1., std::abs(ay) ) + 1.;
+
+    // map the region of interest to source pixel coordinates, see getResizeTransform()
+    const OfxRectD& roi = args.regionOfInterest;
+    double sx1 = ax * roi.x1 * args.renderScale.x / dstPar + bx;
+    double sx2 = ax * roi.x2 * args.renderScale.x / dstPar + bx;
+    double sy1 = ay * roi.y1 * args.renderScale.y + by;
+    double sy2 = ay * roi.y2 * args.renderScale.y + by;
+    if (sx2 < sx1) {
+        std::swap(sx1, sx2);
+    }
+    if (sy2 < sy1) {
+        std::swap(sy1, sy2);
+    }
+    OfxRectD srcRoI;
+    srcRoI.x1 = (sx1 - rx) * srcPar / args.renderScale.x;
+    srcRoI.x2 = (sx2 + rx) * srcPar / args.renderScale.x;
+    srcRoI.y1 = (sy1 - ry) / args.renderScale.y;
+    srcRoI.y2 = (sy2 + ry) / args.renderScale.y;
+    rois.setRegionOfInterest(*_srcClip, srcRoI);
+}
+
+// the overridden render function
+void
+ReformatPlugin::render(const RenderArguments &args)
+{
+    if ( !renderResize(args) ) {
+        Transform3x3Plugin::render(args);
+    }
+}
+
+// Render using the separable resize if the transform is a scale and a translation.
+// Return false if the generic Transform3x3 render must be used instead.
+bool
+ReformatPlugin::renderResize(const RenderArguments &args)
+{
+    if ( (args.fieldToRender == eFieldLower) || (args.fieldToRender == eFieldUpper) ) {
+        // fielded rendering is handled by Transform3x3Plugin
+        return false;
+    }
+    const double time = args.time;
+    double ax, bx, ay, by;
+    if ( !getResizeTransform(time, args.renderScale, &ax, &bx, &ay, &by) ) {
+        return false;
+    }
+    auto_ptr<const Image> src( _srcClip->fetchImage(time) );
+    if ( !src.get() ) {
+        return false;
+    }
+#ifdef OFX_EXTENSIONS_NUKE
+    if ( !src->getTransformIsIdentity() ) {
+        // an upstream transform has to be concatenated
+        return false;
+    }
+#endif
+    auto_ptr<Image> dst( _dstClip->fetchImage(time) );
+    if ( !dst.get() ) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+    checkBadRenderScaleOrField(dst, args);
+    checkBadRenderScaleOrField(src, args);
+    BitDepthEnum dstBitDepth = dst->getPixelDepth();
+    PixelComponentEnum dstComponents = dst->getPixelComponents();
+    if ( ( dstBitDepth != src->getPixelDepth() ) || ( dstComponents != src->getPixelComponents() ) ) {
+        setPersistentMessage(Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        renderResizeForDepth<unsigned char, 255>(args, src.get(), dst.get(), ax, bx, ay, by);
+        break;
+    case eBitDepthUShort:
+        renderResizeForDepth<unsigned short, 65535>(args, src.get(), dst.get(), ax, bx, ay, by);
+        break;
+    case eBitDepthFloat:
+        renderResizeForDepth<float, 1>(args, src.get(), dst.get(), ax, bx, ay, by);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+
+    return true;
+} // ReformatPlugin::renderResize
+
+template <class PIX, int maxValue>
+void
+ReformatPlugin::renderResizeForDepth(const RenderArguments &args,
+                                     const Image* src,
+                                     Image* dst,
+                                     double ax,
+                                     double bx,
+                                     double ay,
+                                     double by)
+{
+    switch ( dst->getPixelComponentCount() ) {
+    case 1:
+        renderResizeForComponents<PIX, 1, maxValue>(args, src, dst, ax, bx, ay, by);
+        break;
+    case 2:
+        renderResizeForComponents<PIX, 2, maxValue>(args, src, dst, ax, bx, ay, by);
+        break;
+    case 3:
+        renderResizeForComponents<PIX, 3, maxValue>(args, src, dst, ax, bx, ay, by);
+        break;
+    case 4:
+        renderResizeForComponents<PIX, 4, maxValue>(args, src, dst, ax, bx, ay, by);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+ReformatPlugin::renderResizeForComponents(const RenderArguments &args,
+                                          const Image* src,
+                                          Image* dst,
+                                          double ax,
+                                          double bx,
+                                          double ay,
+                                          double by)
+{
+    const double time = args.time;
+    const OfxRectI& renderWindow = args.renderWindow;
+
+    if ( Coords::rectIsEmpty(renderWindow) ) {
+        return;
+    }
+    FilterEnum filter = args.renderQualityDraft ? eFilterImpulse : (FilterEnum)_filter->getValueAtTime(time);
+    bool clamp = _clamp->getValueAtTime(time);
+    bool blackOutside = _blackOutside->getValueAtTime(time);
+    // as in ofxsFilter.h, only filters with negative lobes need explicit clamping
+    clamp = clamp && (filter == eFilterKeys || filter == eFilterSimon || filter == eFilterRifman || filter == eFilterMitchell);
+
+    // the valid source pixels are the source RoD, restricted to the pixels actually given by the host
+    OfxRectI srcRoDPixel;
+    Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, _srcClip->getPixelAspectRatio(), &srcRoDPixel);
+    OfxRectI srcValid;
+    if ( !Coords::rectIntersection<OfxRectI>(srcRoDPixel, src->getBounds(), &srcValid) ) {
+        srcValid.x1 = srcValid.y1 = srcValid.x2 = srcValid.y2 = 0;
+    }
+
+    ResizeTaps tapsX;
+    ResizeTaps tapsY;
+    resizeComputeTaps(filter, ax, bx, renderWindow.x1, renderWindow.x2, srcValid.x1, srcValid.x2, blackOutside, &tapsX);
+    resizeComputeTaps(filter, ay, by, renderWindow.y1, renderWindow.y2, srcValid.y1, srcValid.y2, blackOutside, &tapsY);
+
+    // the source rows used by the vertical pass
+    int y1 = srcValid.y2;
+    int y2 = srcValid.y1;
+    for (std::size_t i = 0; i < tapsY.first.size(); ++i) {
+        if (tapsY.count[i] > 0) {
+            y1 = (std::min)(y1, tapsY.first[i]);
+            y2 = (std::max)(y2, tapsY.first[i] + tapsY.count[i]);
+        }
+    }
+    if (y2 <= y1) {
+        // nothing from the source contributes to the render window
+        y1 = y2 = 0;
+    }
+    const int width = renderWindow.x2 - renderWindow.x1;
+    const std::size_t tmpSize = (std::max)( (std::size_t)1, (std::size_t)(y2 - y1) * width * nComponents );
+    auto_ptr<ImageMemory> tmpData( new ImageMemory(sizeof(float) * tmpSize, this) );
+    float* tmpPixelData = tmpData.get() ? (float*)tmpData->lock() : NULL;
+    if (!tmpPixelData) {
+        throwSuiteStatusException(kOfxStatErrMemory);
+    }
+
+    if (y1 < y2) {
+        ResizeRowsProcessor<PIX, nComponents> rows(*this, src, tapsX, clamp, y1, y2, tmpPixelData);
+        rows.process();
+        if ( abort() ) {
+            return;
+        }
+    }
+    ResizeColsProcessor<PIX, nComponents, maxValue> cols(*this, dst, renderWindow, tapsY, clamp, y1, tmpPixelData);
+    cols.process();
+} // ReformatPlugin::renderResizeForComponents
+
 // recturn the input format in pixel units (we use a RectD in case the input format is the RoD)
 void
 ReformatPlugin::getInputFormat(const double time,
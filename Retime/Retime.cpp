@@ -28,12 +28,17 @@
    - selection of the integration filter (box or nearest) and shutter time
    - handle fielded input correctly
 
-   - retiming based on optical flow computation will be done separately
+   - the Motion filter uses block matching, a dense optical flow computation would give better results
  */
 
 #include <cmath> // for floor
 #include <cfloat> // DBL_MAX
 #include <cassert>
+#include <algorithm>
+#include <limits>
+#include <list>
+#include <string>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsThreadSuite.h"
@@ -41,9 +46,25 @@
 
 #include "ofxsProcessing.H"
 #include "ofxsImageBlender.H"
+#include "ofxsCoords.h"
 #include "ofxsCopier.h"
 #include "ofxsMacros.h"
 
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef MultiThread::Mutex Mutex;
+typedef MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -54,8 +75,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "See also: https://web.archive.org/web/20220627032808/http://www.opticalenquiry.com/nuke/index.php?title=Retime"
 
 #define kPluginIdentifier "net.sf.openfx.Retime"
+// History:
+// version 1.0: initial version
+// version 1.1: Motion filter (motion-compensated interpolation)
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -83,6 +107,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamFilterOptionNone "None", "Do not interpolate, ask for images with fractional time to the input effect. Useful if the input effect can interpolate itself.", "none"
 #define kParamFilterOptionNearest "Nearest", "Pick input image with nearest integer time.", "nearest"
 #define kParamFilterOptionLinear "Linear", "Blend the two nearest images with linear interpolation.", "linear"
+#define kParamFilterOptionMotion "Motion", "Estimate the motion between the two nearest images by coarse-to-fine block matching, and blend the two images warped along the motion vectors. Where a pixel is occluded in one of the images, it is taken from the other one.", "motion"
 // TODO:
 #define kParamFilterOptionBox "Box", "Weighted average of images over the shutter time (shutter time is defined in the output sequence).", "box" // requires shutter parameter
 
@@ -91,11 +116,34 @@ enum FilterEnum
     eFilterNone,
     eFilterNearest,
     eFilterLinear,
+    eFilterMotion,
     //eFilterBox,
 };
 
 #define kParamFilterDefault eFilterLinear
 
+#define kParamMotionBlockSize "motionBlockSize"
+#define kParamMotionBlockSizeLabel "Block Size"
+#define kParamMotionBlockSizeHint "Size of the blocks used for motion estimation, in pixels at full resolution. Larger blocks give a more robust motion, smaller blocks follow small objects better. Only used by the Motion filter."
+#define kParamMotionBlockSizeDefault 16
+
+#define kParamMotionSearchRange "motionSearchRange"
+#define kParamMotionSearchRangeLabel "Search Range"
+#define kParamMotionSearchRangeHint "Largest motion between two consecutive source images that can be detected, in pixels at full resolution. Only used by the Motion filter."
+#define kParamMotionSearchRangeDefault 32
+
+#define kParamMotionScore "motionScore"
+#define kParamMotionScoreLabel "Match Score"
+#define kParamMotionScoreHint "Block matching score computation method. Only used by the Motion filter."
+#define kParamMotionScoreOptionSSD "SSD", "Sum of Squared Differences", "ssd"
+#define kParamMotionScoreOptionZNCC "ZNCC", "Zero-mean Normalized Cross-Correlation, less sensitive to illumination changes", "zncc"
+
+enum MotionScoreEnum
+{
+    eMotionScoreSSD = 0,
+    eMotionScoreZNCC,
+};
+
 #define kPageTimeWarp "timeWarp"
 #define kPageTimeWarpLabel "Time Warp"
 
@@ -104,6 +152,573 @@ enum FilterEnum
 #define kParamWarpHint "Curve that maps input range (after applying speed) to the output range. A low positive slope slows down the input clip, and a negative slope plays it backwards."
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Motion-compensated interpolation (eFilterMotion)
+//
+// The motion between the two source images is estimated in both directions by block matching on the luminance,
+// coarse-to-fine on an image pyramid. Each output pixel is then a blend of the two source images, sampled
+// along the forward and backward motion vectors. The forward-backward consistency of the vectors is used to
+// detect occlusions: a pixel which is occluded in one of the images is taken from the other one.
+
+#define kMotionCoarseRadius 4 // search radius at the coarsest pyramid level
+#define kMotionRefineRadius 1 // search radius at the other levels, around the vector from the coarser level
+#define kMotionMaxLevel 5 // coarsest pyramid level
+#define kMotionConsistencyThreshold 1. // forward-backward inconsistency (in pixels) at which a sample gets half weight
+#define kMotionCacheSize 4 // number of source image pairs for which the motion is kept
+
+// floor(a / b) for b > 0
+static inline int
+floorDiv(int a,
+         int b)
+{
+    return (a >= 0) ? (a / b) : -( (-a + b - 1) / b );
+}
+
+// number of pyramid levels, so that the search radius at the coarsest level is small
+static int
+motionLevels(int searchRange)
+{
+    int levels = 1;
+
+    while ( ( (searchRange >> (levels - 1)) > kMotionCoarseRadius ) && (levels <= kMotionMaxLevel) ) {
+        ++levels;
+    }
+
+    return levels;
+}
+
+// Compute the grid where the motion vectors of the render window are computed (at level 0), and the region
+// of the source images that is read to compute them (also used by getRegionsOfInterest).
+// The vectors must be known wherever a pixel of the render window may come from, and the grid is aligned
+// on the coarsest blocks so that the blocks of consecutive levels are nested and tiles share the same blocks.
+static void
+motionRects(const OfxRectI& renderWindow,
+            int blockSize,
+            int searchRange,
+            int levels,
+            OfxRectI* grid,
+            OfxRectI* lumaRect)
+{
+    const int align = blockSize << (levels - 1);
+
+    grid->x1 = floorDiv(renderWindow.x1 - searchRange, align) * align;
+    grid->y1 = floorDiv(renderWindow.y1 - searchRange, align) * align;
+    grid->x2 = -floorDiv(-(renderWindow.x2 + searchRange), align) * align;
+    grid->y2 = -floorDiv(-(renderWindow.y2 + searchRange), align) * align;
+    // blocks on the border of the grid may be matched up to searchRange outside of it
+    *lumaRect = *grid;
+    lumaRect->x1 -= searchRange + align;
+    lumaRect->y1 -= searchRange + align;
+    lumaRect->x2 += searchRange + align;
+    lumaRect->y2 += searchRange + align;
+}
+
+// a single-channel float image, used for motion estimation
+struct LumaImage
+{
+    OfxRectI bounds;
+    std::vector<float> data;
+
+    LumaImage()
+        : data()
+    {
+        bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+    }
+
+    bool isEmpty() const
+    {
+        return bounds.x2 <= bounds.x1 || bounds.y2 <= bounds.y1;
+    }
+
+    // take nearest pixel if outside of the bounds (more chance to get a match than with black)
+    float get(int x,
+              int y) const
+    {
+        x = (std::max)( bounds.x1, (std::min)(x, bounds.x2 - 1) );
+        y = (std::max)( bounds.y1, (std::min)(y, bounds.y2 - 1) );
+
+        return data[(size_t)(y - bounds.y1) * (bounds.x2 - bounds.x1) + (x - bounds.x1)];
+    }
+};
+
+// extract the luminance of img within rect
+template <class PIX, int nComponents, int maxValue>
+static void
+extractLuma(const Image& img,
+            const OfxRectI& rect,
+            LumaImage* luma)
+{
+    if ( !Coords::rectIntersection<OfxRectI>(rect, img.getBounds(), &luma->bounds) ) {
+        luma->bounds.x1 = luma->bounds.y1 = luma->bounds.x2 = luma->bounds.y2 = 0;
+        luma->data.clear();
+
+        return;
+    }
+    const int width = luma->bounds.x2 - luma->bounds.x1;
+    luma->data.resize( (size_t)width * (luma->bounds.y2 - luma->bounds.y1) );
+    float* dstPix = &luma->data.front();
+    for (int y = luma->bounds.y1; y < luma->bounds.y2; ++y) {
+        const PIX* srcPix = (const PIX*)img.getPixelAddress(luma->bounds.x1, y);
+        assert(srcPix);
+        for (int x = 0; x < width; ++x, srcPix += nComponents, ++dstPix) {
+            if (nComponents >= 3) {
+                // Rec.709 luminance
+                *dstPix = (0.2126f * srcPix[0] + 0.7152f * srcPix[1] + 0.0722f * srcPix[2]) / maxValue;
+            } else {
+                *dstPix = (float)srcPix[0] / maxValue;
+            }
+        }
+    }
+}
+
+// half-resolution image, for the next pyramid level
+static void
+halfLuma(const LumaImage& src,
+         LumaImage* dst)
+{
+    dst->bounds.x1 = floorDiv(src.bounds.x1, 2);
+    dst->bounds.y1 = floorDiv(src.bounds.y1, 2);
+    dst->bounds.x2 = -floorDiv(-src.bounds.x2, 2);
+    dst->bounds.y2 = -floorDiv(-src.bounds.y2, 2);
+    dst->data.resize( (size_t)(dst->bounds.x2 - dst->bounds.x1) * (dst->bounds.y2 - dst->bounds.y1) );
+    float* dstPix = dst->data.empty() ? NULL : &dst->data.front();
+    for (int y = dst->bounds.y1; y < dst->bounds.y2; ++y) {
+        for (int x = dst->bounds.x1; x < dst->bounds.x2; ++x, ++dstPix) {
+            *dstPix = 0.25f * ( src.get(2 * x, 2 * y) + src.get(2 * x + 1, 2 * y) +
+                                src.get(2 * x, 2 * y + 1) + src.get(2 * x + 1, 2 * y + 1) );
+        }
+    }
+}
+
+// one motion vector per block of blockSize x blockSize pixels
+struct MotionField
+{
+    OfxRectI grid; // the region covered by the blocks, in pixel coordinates
+    int blockSize;
+    int nx;
+    int ny;
+    std::vector<float> vx;
+    std::vector<float> vy;
+
+    MotionField()
+        : blockSize(1)
+        , nx(0)
+        , ny(0)
+        , vx()
+        , vy()
+    {
+        grid.x1 = grid.y1 = grid.x2 = grid.y2 = 0;
+    }
+
+    void setGrid(const OfxRectI& g,
+                 int b)
+    {
+        grid = g;
+        blockSize = b;
+        nx = (grid.x2 - grid.x1) / blockSize;
+        ny = (grid.y2 - grid.y1) / blockSize;
+        vx.assign( (size_t)nx * ny, 0.f );
+        vy.assign( (size_t)nx * ny, 0.f );
+    }
+
+    // the motion vector at (x,y) in pixel coordinates, interpolated between the block centers
+    OfxPointD getVector(double x,
+                        double y) const
+    {
+        OfxPointD v = {0., 0.};
+
+        if ( (nx == 0) || (ny == 0) ) {
+            return v;
+        }
+        double u = (std::max)( 0., (std::min)( (x - grid.x1) / blockSize - 0.5, (double)(nx - 1) ) );
+        double w = (std::max)( 0., (std::min)( (y - grid.y1) / blockSize - 0.5, (double)(ny - 1) ) );
+        int i0 = (int)u;
+        int j0 = (int)w;
+        int i1 = (std::min)(i0 + 1, nx - 1);
+        int j1 = (std::min)(j0 + 1, ny - 1);
+        double a = u - i0;
+        double b = w - j0;
+        size_t k00 = (size_t)j0 * nx + i0;
+        size_t k10 = (size_t)j0 * nx + i1;
+        size_t k01 = (size_t)j1 * nx + i0;
+        size_t k11 = (size_t)j1 * nx + i1;
+        v.x = (1 - b) * ( (1 - a) * vx[k00] + a * vx[k10] ) + b * ( (1 - a) * vx[k01] + a * vx[k11] );
+        v.y = (1 - b) * ( (1 - a) * vy[k00] + a * vy[k10] ) + b * ( (1 - a) * vy[k01] + a * vy[k11] );
+
+        return v;
+    }
+};
+
+// the motion between two source images, in both directions
+struct MotionFieldPair
+{
+    double fromTime;
+    double toTime;
+    std::string fromId; // unique identifiers of the source images
+    std::string toId;
+    OfxPointD renderScale;
+    int blockSize;
+    int searchRange;
+    MotionScoreEnum score;
+    MotionField forward; // from fromTime to toTime, indexed by the position in the image at fromTime
+    MotionField backward; // from toTime to fromTime, indexed by the position in the image at toTime
+
+    MotionFieldPair()
+        : fromTime(0.)
+        , toTime(0.)
+        , fromId()
+        , toId()
+        , blockSize(0)
+        , searchRange(0)
+        , score(eMotionScoreSSD)
+        , forward()
+        , backward()
+    {
+        renderScale.x = renderScale.y = 1.;
+    }
+
+    bool sameKey(const MotionFieldPair& other) const
+    {
+        return ( fromTime == other.fromTime && toTime == other.toTime && fromId == other.fromId && toId == other.toId &&
+                 renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+                 blockSize == other.blockSize && searchRange == other.searchRange && score == other.score );
+    }
+};
+
+// score of the block of size blockSize at (x,y) in ref, compared with the block displaced by (dx,dy) in other (lower is better).
+// These are the SSD and ZNCC scores of TrackerPM, computed on the luminance.
+static double
+blockScore(const LumaImage& ref,
+           const LumaImage& other,
+           int x,
+           int y,
+           int blockSize,
+           int dx,
+           int dy,
+           MotionScoreEnum score)
+{
+    if (score == eMotionScoreSSD) {
+        double ssd = 0.;
+        for (int j = 0; j < blockSize; ++j) {
+            for (int i = 0; i < blockSize; ++i) {
+                double d = (double)ref.get(x + i, y + j) - other.get(x + dx + i, y + dy + j);
+                ssd += d * d;
+            }
+        }
+
+        return ssd;
+    }
+    assert(score == eMotionScoreZNCC);
+    double refMean = 0.;
+    double otherMean = 0.;
+    for (int j = 0; j < blockSize; ++j) {
+        for (int i = 0; i < blockSize; ++i) {
+            refMean += ref.get(x + i, y + j);
+            otherMean += other.get(x + dx + i, y + dy + j);
+        }
+    }
+    refMean /= blockSize * blockSize;
+    otherMean /= blockSize * blockSize;
+    double ncc = 0.;
+    double otherSsq = 0.;
+    for (int j = 0; j < blockSize; ++j) {
+        for (int i = 0; i < blockSize; ++i) {
+            double r = ref.get(x + i, y + j) - refMean;
+            double o = other.get(x + dx + i, y + dy + j) - otherMean;
+            ncc -= r * o;
+            otherSsq += o * o;
+        }
+    }
+    double sdev = std::sqrt(otherSsq);
+
+    return (sdev != 0.) ? (ncc / sdev) : std::numeric_limits<double>::infinity();
+}
+
+// compute the motion vectors of all blocks of one pyramid level, one row of blocks per thread
+class BlockMatchingProcessor
+    : public MultiThread::Processor
+{
+public:
+    BlockMatchingProcessor(ImageEffect &instance,
+                           const LumaImage& ref,
+                           const LumaImage& other,
+                           const MotionField* parent,
+                           int radius,
+                           bool subpixel,
+                           MotionScoreEnum score,
+                           MotionField* field)
+        : _effect(instance)
+        , _ref(ref)
+        , _other(other)
+        , _parent(parent)
+        , _radius(radius)
+        , _subpixel(subpixel)
+        , _score(score)
+        , _field(field)
+    {
+        assert(_field);
+    }
+
+    /** @brief called to process everything */
+    void process(void)
+    {
+        unsigned int nCPUs = (std::max)( 1u, (std::min)( (unsigned int)_field->ny, MultiThread::getNumCPUs() ) );
+
+        multiThread(nCPUs);
+    }
+
+private:
+    /** @brief function that will be called in each thread. ID is from 0..nThreads-1 nThreads are the number of threads it is being run over */
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        int j_begin = 0;
+        int j_end = 0;
+
+        MultiThread::getThreadRange(threadID, nThreads, 0, _field->ny, &j_begin, &j_end);
+        const int b = _field->blockSize;
+        for (int j = j_begin; j < j_end; ++j) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            for (int i = 0; i < _field->nx; ++i) {
+                const int x = _field->grid.x1 + i * b;
+                const int y = _field->grid.y1 + j * b;
+                int px = 0;
+                int py = 0;
+                if (_parent) {
+                    size_t k = (size_t)(std::min)(j / 2, _parent->ny - 1) * _parent->nx + (std::min)(i / 2, _parent->nx - 1);
+                    px = (int)std::floor(2 * _parent->vx[k] + 0.5);
+                    py = (int)std::floor(2 * _parent->vy[k] + 0.5);
+                }
+                // the predicted displacement is tested first, so that it is kept in flat areas
+                double bestScore = blockScore(_ref, _other, x, y, b, px, py, _score);
+                int bx = px;
+                int by = py;
+                for (int dy = -_radius; dy <= _radius; ++dy) {
+                    for (int dx = -_radius; dx <= _radius; ++dx) {
+                        if ( (dx == 0) && (dy == 0) ) {
+                            continue;
+                        }
+                        double score = blockScore(_ref, _other, x, y, b, px + dx, py + dy, _score);
+                        if (score < bestScore) {
+                            bestScore = score;
+                            bx = px + dx;
+                            by = py + dy;
+                        }
+                    }
+                }
+                double sx = bx;
+                double sy = by;
+                if ( _subpixel && (bestScore < std::numeric_limits<double>::infinity()) ) {
+                    // subpixel refinement by fitting a parabola, as in TrackerPM
+                    double scorepc = blockScore(_ref, _other, x, y, b, bx - 1, by, _score);
+                    double scorenc = blockScore(_ref, _other, x, y, b, bx + 1, by, _score);
+                    if ( (bestScore < scorepc) && (bestScore <= scorenc) ) {
+                        // don't simplify the denominator, 2*bestScore - scorenc - scorepc may cause an underflow.
+                        double denom = (bestScore - scorenc) + (bestScore - scorepc);
+                        if (denom != 0.) {
+                            sx += 0.5 * (scorenc - scorepc) / denom;
+                        }
+                    }
+                    double scorecp = blockScore(_ref, _other, x, y, b, bx, by - 1, _score);
+                    double scorecn = blockScore(_ref, _other, x, y, b, bx, by + 1, _score);
+                    if ( (bestScore < scorecp) && (bestScore <= scorecn) ) {
+                        double denom = (bestScore - scorecn) + (bestScore - scorecp);
+                        if (denom != 0.) {
+                            sy += 0.5 * (scorecn - scorecp) / denom;
+                        }
+                    }
+                }
+                _field->vx[(size_t)j * _field->nx + i] = (float)sx;
+                _field->vy[(size_t)j * _field->nx + i] = (float)sy;
+            }
+        }
+    } // multiThreadFunction
+
+    ImageEffect &_effect;
+    const LumaImage& _ref;
+    const LumaImage& _other;
+    const MotionField* _parent;
+    int _radius;
+    bool _subpixel;
+    MotionScoreEnum _score;
+    MotionField* _field;
+};
+
+// estimate the motion from ref to other, coarse-to-fine.
+// grid is the region where vectors are computed (at level 0), and must be aligned on blockSize << (levels-1).
+static void
+estimateMotion(ImageEffect &effect,
+               const std::vector<LumaImage>& refPyramid,
+               const std::vector<LumaImage>& otherPyramid,
+               const OfxRectI& grid,
+               int blockSize,
+               int searchRange,
+               MotionScoreEnum score,
+               MotionField* field)
+{
+    const int levels = (int)refPyramid.size();
+    MotionField parent;
+
+    for (int level = levels - 1; level >= 0; --level) {
+        MotionField current;
+        OfxRectI levelGrid;
+        levelGrid.x1 = grid.x1 / (1 << level); // exact, since the grid is aligned
+        levelGrid.y1 = grid.y1 / (1 << level);
+        levelGrid.x2 = grid.x2 / (1 << level);
+        levelGrid.y2 = grid.y2 / (1 << level);
+        current.setGrid(levelGrid, blockSize);
+        int radius = (level == levels - 1) ? ( (searchRange + (1 << level) - 1) >> level ) : kMotionRefineRadius;
+        BlockMatchingProcessor processor(effect, refPyramid[level], otherPyramid[level],
+                                         (level == levels - 1) ? NULL : &parent,
+                                         radius, level == 0, score, &current);
+        processor.process();
+        if ( effect.abort() ) {
+            return;
+        }
+        std::swap(parent, current);
+    }
+    std::swap(*field, parent);
+}
+
+// bilinear interpolation of img at (x,y) in pixel coordinates, taking the nearest pixel outside of the image bounds
+template <class PIX, int nComponents>
+static void
+sampleBilinear(const Image* img,
+               double x,
+               double y,
+               float* pix)
+{
+    const OfxRectI& bounds = img->getBounds();
+
+    if ( (bounds.x2 <= bounds.x1) || (bounds.y2 <= bounds.y1) ) {
+        std::fill(pix, pix + nComponents, 0.f);
+
+        return;
+    }
+    // pixel centers are at half-integer coordinates
+    double fx = x - 0.5;
+    double fy = y - 0.5;
+    int x0 = (int)std::floor(fx);
+    int y0 = (int)std::floor(fy);
+    float ax = (float)(fx - x0);
+    float ay = (float)(fy - y0);
+    int x1 = (std::max)( bounds.x1, (std::min)(x0 + 1, bounds.x2 - 1) );
+    int y1 = (std::max)( bounds.y1, (std::min)(y0 + 1, bounds.y2 - 1) );
+    x0 = (std::max)( bounds.x1, (std::min)(x0, bounds.x2 - 1) );
+    y0 = (std::max)( bounds.y1, (std::min)(y0, bounds.y2 - 1) );
+    const PIX* p00 = (const PIX*)img->getPixelAddress(x0, y0);
+    const PIX* p10 = (const PIX*)img->getPixelAddress(x1, y0);
+    const PIX* p01 = (const PIX*)img->getPixelAddress(x0, y1);
+    const PIX* p11 = (const PIX*)img->getPixelAddress(x1, y1);
+    for (int c = 0; c < nComponents; ++c) {
+        pix[c] = (1.f - ay) * ( (1.f - ax) * p00[c] + ax * p10[c] ) + ay * ( (1.f - ax) * p01[c] + ax * p11[c] );
+    }
+}
+
+class RetimeMotionProcessorBase
+    : public ImageProcessor
+{
+protected:
+    const Image *_fromImg;
+    const Image *_toImg;
+    float _blend;
+    const MotionFieldPair* _motion;
+
+public:
+    RetimeMotionProcessorBase(ImageEffect &instance)
+        : ImageProcessor(instance)
+        , _fromImg(NULL)
+        , _toImg(NULL)
+        , _blend(0.f)
+        , _motion(NULL)
+    {
+    }
+
+    void setValues(const Image* fromImg,
+                   const Image* toImg,
+                   float blend,
+                   const MotionFieldPair* motion)
+    {
+        _fromImg = fromImg;
+        _toImg = toImg;
+        _blend = blend;
+        _motion = motion;
+    }
+};
+
+template <class PIX, int nComponents, int maxValue>
+class RetimeMotionProcessor
+    : public RetimeMotionProcessorBase
+{
+public:
+    RetimeMotionProcessor(ImageEffect &instance)
+        : RetimeMotionProcessorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_fromImg && _toImg && _motion);
+        const double b = _blend;
+        const MotionField& forward = _motion->forward;
+        const MotionField& backward = _motion->backward;
+        const double tau2 = kMotionConsistencyThreshold * kMotionConsistencyThreshold;
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                const double px = x + 0.5;
+                const double py = y + 0.5;
+                // position of this pixel in the image at fromTime, and forward-backward inconsistency at that position
+                OfxPointD vf = forward.getVector(px, py);
+                double qfx = px - b * vf.x;
+                double qfy = py - b * vf.y;
+                OfxPointD vfq = forward.getVector(qfx, qfy);
+                OfxPointD vbt = backward.getVector(qfx + vfq.x, qfy + vfq.y);
+                double errf2 = (vfq.x + vbt.x) * (vfq.x + vbt.x) + (vfq.y + vbt.y) * (vfq.y + vbt.y);
+                // position of this pixel in the image at toTime, and backward-forward inconsistency at that position
+                OfxPointD vb = backward.getVector(px, py);
+                double qbx = px - (1. - b) * vb.x;
+                double qby = py - (1. - b) * vb.y;
+                OfxPointD vbq = backward.getVector(qbx, qby);
+                OfxPointD vfs = forward.getVector(qbx + vbq.x, qby + vbq.y);
+                double errb2 = (vbq.x + vfs.x) * (vbq.x + vfs.x) + (vbq.y + vfs.y) * (vbq.y + vfs.y);
+                // inconsistent vectors mean that the pixel is occluded in the other image
+                double wf = (1. - b) / (1. + errf2 / tau2);
+                double wb = b / (1. + errb2 / tau2);
+                double wsum = wf + wb;
+                if (wsum > 1e-6) {
+                    wf /= wsum;
+                    wb /= wsum;
+                } else {
+                    wf = 1. - b;
+                    wb = b;
+                }
+                float fromPix[nComponents];
+                float toPix[nComponents];
+                sampleBilinear<PIX, nComponents>(_fromImg, qfx, qfy, fromPix);
+                sampleBilinear<PIX, nComponents>(_toImg, qbx, qby, toPix);
+                for (int c = 0; c < nComponents; ++c) {
+                    float v = (float)(wf * fromPix[c] + wb * toPix[c]);
+                    if (maxValue == 1) {
+                        dstPix[c] = PIX(v);
+                    } else {
+                        dstPix[c] = PIX( (std::max)( 0.f, (std::min)(v + 0.5f, (float)maxValue) ) );
+                    }
+                }
+            }
+        }
+    } // multiThreadProcessImages
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class RetimePlugin
@@ -119,6 +734,11 @@ private:
     ParametricParam  *_warp;      /**< @brief only used in the filter or general context. */
     DoubleParam  *_duration;   /**< @brief how long the output should be as a proportion of input. General context only. */
     ChoiceParam  *_filter;   /**< @brief how images are interpolated (or not). */
+    IntParam *_motionBlockSize;
+    IntParam *_motionSearchRange;
+    ChoiceParam *_motionScore;
+    Mutex _motionCacheMutex;
+    std::list<MotionFieldPair> _motionCache; // most recently used first
 
 public:
     /** @brief ctor */
@@ -133,6 +753,11 @@ public:
         , _warp(NULL)
         , _duration(NULL)
         , _filter(NULL)
+        , _motionBlockSize(NULL)
+        , _motionSearchRange(NULL)
+        , _motionScore(NULL)
+        , _motionCacheMutex()
+        , _motionCache()
     {
 
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -159,6 +784,10 @@ public:
         }
         _filter = fetchChoiceParam(kParamFilter);
         assert(_filter);
+        _motionBlockSize = fetchIntParam(kParamMotionBlockSize);
+        _motionSearchRange = fetchIntParam(kParamMotionSearchRange);
+        _motionScore = fetchChoiceParam(kParamMotionScore);
+        assert(_motionBlockSize && _motionSearchRange && _motionScore);
     }
 
     /* Override the render */
@@ -167,8 +796,14 @@ public:
     template <int nComponents>
     void renderInternal(const RenderArguments &args, double sourceTime, FilterEnum filter, BitDepthEnum dstBitDepth);
 
+    template <class PIX, int nComponents, int maxValue>
+    void renderMotion(const RenderArguments &args, double sourceTime);
+
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const FramesNeededArguments &args, FramesNeededSetter &frames) OVERRIDE FINAL;
+    virtual void getRegionsOfInterest(const RegionsOfInterestArguments &args, RegionOfInterestSetter &rois) OVERRIDE FINAL;
+    virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+    virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
     virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime, int& view, std::string& plane) OVERRIDE FINAL;
 
     /* override the time domain action, only for the general context */
@@ -182,6 +817,12 @@ private:
 
 
     bool isIdentityInternal(OfxTime time, Clip* &identityClip, OfxTime &identityTime);
+
+    // block size and search range of the motion estimation, in pixels at renderScale
+    void getMotionParameters(double time, const OfxPointD& renderScale, int* blockSize, int* searchRange) const;
+
+    bool getCachedMotion(const OfxRectI& grid, MotionFieldPair* motion);
+    void setCachedMotion(const MotionFieldPair& motion);
 };
 
 
@@ -327,6 +968,208 @@ RetimePlugin::setupAndProcess(ImageBlenderBase &processor,
     processor.process();
 } // RetimePlugin::setupAndProcess
 
+// motion-compensated interpolation between the two source images around sourceTime
+template <class PIX, int nComponents, int maxValue>
+void
+RetimePlugin::renderMotion(const RenderArguments &args,
+                           double sourceTime)
+{
+    const double time = args.time;
+
+    // get a dst image
+    auto_ptr<Image>  dst( _dstClip->fetchImage(time) );
+
+    if ( !dst.get() ) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+# ifndef NDEBUG
+    BitDepthEnum dstBitDepth    = dst->getPixelDepth();
+    PixelComponentEnum dstComponents  = dst->getPixelComponents();
+    if ( ( dstBitDepth != _dstClip->getPixelDepth() ) ||
+         ( dstComponents != _dstClip->getPixelComponents() ) ) {
+        setPersistentMessage(Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+    checkBadRenderScaleOrField(dst, args);
+# endif
+
+    // figure the two images we are blending between
+    double fromTime, toTime;
+    double blend;
+    framesNeeded(sourceTime, args.fieldToRender, &fromTime, &toTime, &blend);
+
+    // fetch the two source images
+    auto_ptr<Image> fromImg( ( _srcClip && _srcClip->isConnected() ) ?
+                                  _srcClip->fetchImage(fromTime) : 0 );
+    auto_ptr<Image> toImg( ( _srcClip && _srcClip->isConnected() ) ?
+                                _srcClip->fetchImage(toTime) : 0 );
+
+# ifndef NDEBUG
+    // make sure bit depths are sane
+    if ( fromImg.get() ) {
+        checkBadRenderScaleOrField(fromImg, args);
+        checkComponents(*fromImg, dstBitDepth, dstComponents);
+    }
+    if ( toImg.get() ) {
+        checkBadRenderScaleOrField(toImg, args);
+        checkComponents(*toImg, dstBitDepth, dstComponents);
+    }
+# endif
+
+    MotionFieldPair motion;
+    motion.fromTime = fromTime;
+    motion.toTime = toTime;
+    motion.renderScale = args.renderScale;
+    getMotionParameters(time, args.renderScale, &motion.blockSize, &motion.searchRange);
+    motion.score = (MotionScoreEnum)_motionScore->getValueAtTime(time);
+    // the motion is only cached if the host can tell when the source images change
+    bool cacheable = false;
+    if ( fromImg.get() && toImg.get() ) {
+        motion.fromId = fromImg->getUniqueIdentifier();
+        motion.toId = toImg->getUniqueIdentifier();
+        cacheable = !motion.fromId.empty() && !motion.toId.empty();
+    }
+
+    const int levels = motionLevels(motion.searchRange);
+    OfxRectI grid;
+    OfxRectI lumaRect;
+    motionRects(args.renderWindow, motion.blockSize, motion.searchRange, levels, &grid, &lumaRect);
+
+    bool motionValid = cacheable && getCachedMotion(grid, &motion);
+    if ( !motionValid && fromImg.get() && toImg.get() ) {
+        std::vector<LumaImage> fromPyramid(levels);
+        std::vector<LumaImage> toPyramid(levels);
+        extractLuma<PIX, nComponents, maxValue>(*fromImg, lumaRect, &fromPyramid[0]);
+        extractLuma<PIX, nComponents, maxValue>(*toImg, lumaRect, &toPyramid[0]);
+        if ( !fromPyramid[0].isEmpty() && !toPyramid[0].isEmpty() ) {
+            for (int level = 1; level < levels; ++level) {
+                halfLuma(fromPyramid[level - 1], &fromPyramid[level]);
+                halfLuma(toPyramid[level - 1], &toPyramid[level]);
+            }
+            estimateMotion(*this, fromPyramid, toPyramid, grid, motion.blockSize, motion.searchRange, motion.score, &motion.forward);
+            estimateMotion(*this, toPyramid, fromPyramid, grid, motion.blockSize, motion.searchRange, motion.score, &motion.backward);
+            if ( abort() ) {
+                return;
+            }
+            if (cacheable) {
+                setCachedMotion(motion);
+            }
+            motionValid = true;
+        }
+    }
+
+    if (!motionValid) {
+        // no motion can be computed, blend the images
+        ImageBlender<PIX, nComponents> processor(*this);
+        processor.setDstImg( dst.get() );
+        processor.setFromImg( fromImg.get() );
+        processor.setToImg( toImg.get() );
+        processor.setRenderWindow(args.renderWindow, args.renderScale);
+        processor.setBlend( (float)blend );
+        processor.process();
+
+        return;
+    }
+
+    RetimeMotionProcessor<PIX, nComponents, maxValue> processor(*this);
+    processor.setDstImg( dst.get() );
+    processor.setValues(fromImg.get(), toImg.get(), (float)blend, &motion);
+    processor.setRenderWindow(args.renderWindow, args.renderScale);
+    processor.process();
+} // RetimePlugin::renderMotion
+
+void
+RetimePlugin::getMotionParameters(double time,
+                                  const OfxPointD& renderScale,
+                                  int* blockSize,
+                                  int* searchRange) const
+{
+    *blockSize = (std::max)( 4, (int)std::floor(_motionBlockSize->getValueAtTime(time) * renderScale.x + 0.5) );
+    *searchRange = (std::max)( 1, (int)std::floor(_motionSearchRange->getValueAtTime(time) * renderScale.x + 0.5) );
+}
+
+// get the cached motion with the same key as motion, if it covers grid
+bool
+RetimePlugin::getCachedMotion(const OfxRectI& grid,
+                              MotionFieldPair* motion)
+{
+    AutoMutex guard(&_motionCacheMutex);
+
+    for (std::list<MotionFieldPair>::iterator it = _motionCache.begin(); it != _motionCache.end(); ++it) {
+        const OfxRectI& cachedGrid = it->forward.grid;
+        if ( it->sameKey(*motion) &&
+             (cachedGrid.x1 <= grid.x1) && (grid.x2 <= cachedGrid.x2) &&
+             (cachedGrid.y1 <= grid.y1) && (grid.y2 <= cachedGrid.y2) ) {
+            // move it to the front of the list
+            _motionCache.splice(_motionCache.begin(), _motionCache, it);
+            *motion = _motionCache.front();
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+RetimePlugin::setCachedMotion(const MotionFieldPair& motion)
+{
+    AutoMutex guard(&_motionCacheMutex);
+
+    _motionCache.push_front(motion);
+    while (_motionCache.size() > kMotionCacheSize) {
+        _motionCache.pop_back();
+    }
+}
+
+void
+RetimePlugin::changedParam(const InstanceChangedArgs & /*args*/,
+                           const std::string & /*paramName*/)
+{
+    // the cached motion may not be valid anymore (changes of the source images are detected by their unique identifiers)
+    AutoMutex guard(&_motionCacheMutex);
+
+    _motionCache.clear();
+}
+
+void
+RetimePlugin::changedClip(const InstanceChangedArgs & /*args*/,
+                          const std::string &clipName)
+{
+    if (clipName == kOfxImageEffectSimpleSourceClipName) {
+        AutoMutex guard(&_motionCacheMutex);
+
+        _motionCache.clear();
+    }
+}
+
+void
+RetimePlugin::getRegionsOfInterest(const RegionsOfInterestArguments &args,
+                                   RegionOfInterestSetter &rois)
+{
+    if ( !_srcClip || !_srcClip->isConnected() ) {
+        return;
+    }
+    const double time = args.time;
+    FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+    if (filter != eFilterMotion) {
+        // default is the render window
+        return;
+    }
+    // motion estimation reads the same region as renderMotion, so that all tiles compute the same vectors
+    int blockSize, searchRange;
+    getMotionParameters(time, args.renderScale, &blockSize, &searchRange);
+    const double par = _srcClip->getPixelAspectRatio();
+    OfxRectI roiPixel;
+    Coords::toPixelEnclosing(args.regionOfInterest, args.renderScale, par, &roiPixel);
+    OfxRectI grid;
+    OfxRectI lumaRect;
+    motionRects(roiPixel, blockSize, searchRange, motionLevels(searchRange), &grid, &lumaRect);
+    OfxRectD roi;
+    Coords::toCanonical(lumaRect, args.renderScale, par, &roi);
+    rois.setRegionOfInterest(*_srcClip, roi);
+}
+
 void
 RetimePlugin::getFramesNeeded(const FramesNeededArguments &args,
                               FramesNeededSetter &frames)
@@ -364,7 +1207,7 @@ RetimePlugin::getFramesNeeded(const FramesNeededArguments &args,
         range.max = sourceTime;
     } else if (filter == eFilterNearest) {
         range.min = range.max = std::floor(sourceTime + 0.5);
-    } else if (filter == eFilterLinear) {
+    } else if ( (filter == eFilterLinear) || (filter == eFilterMotion) ) {
         // figure the two images we are blending between
         double fromTime, toTime;
         double blend;
@@ -488,18 +1331,30 @@ RetimePlugin::renderInternal(const RenderArguments &args,
 {
     switch (dstBitDepth) {
     case eBitDepthUByte: {
-        ImageBlender<unsigned char, nComponents> fred(*this);
-        setupAndProcess(fred, args, sourceTime, filter);
+        if (filter == eFilterMotion) {
+            renderMotion<unsigned char, nComponents, 255>(args, sourceTime);
+        } else {
+            ImageBlender<unsigned char, nComponents> fred(*this);
+            setupAndProcess(fred, args, sourceTime, filter);
+        }
         break;
     }
     case eBitDepthUShort: {
-        ImageBlender<unsigned short, nComponents> fred(*this);
-        setupAndProcess(fred, args, sourceTime, filter);
+        if (filter == eFilterMotion) {
+            renderMotion<unsigned short, nComponents, 65535>(args, sourceTime);
+        } else {
+            ImageBlender<unsigned short, nComponents> fred(*this);
+            setupAndProcess(fred, args, sourceTime, filter);
+        }
         break;
     }
     case eBitDepthFloat: {
-        ImageBlender<float, nComponents> fred(*this);
-        setupAndProcess(fred, args, sourceTime, filter);
+        if (filter == eFilterMotion) {
+            renderMotion<float, nComponents, 1>(args, sourceTime);
+        } else {
+            ImageBlender<float, nComponents> fred(*this);
+            setupAndProcess(fred, args, sourceTime, filter);
+        }
         break;
     }
     default:
@@ -756,6 +1611,8 @@ RetimePluginFactory::describeInContext(ImageEffectDescriptor &desc,
         param->appendOption(kParamFilterOptionNearest);
         assert(param->getNOptions() == eFilterLinear);
         param->appendOption(kParamFilterOptionLinear);
+        assert(param->getNOptions() == eFilterMotion);
+        param->appendOption(kParamFilterOptionMotion);
         //assert(param->getNOptions() == eFilterBox);
         //param->appendOption(kParamFilterOptionBox, kParamFilterOptionBoxHint);
         param->setDefault( (int)kParamFilterDefault );
@@ -763,6 +1620,41 @@ RetimePluginFactory::describeInContext(ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMotionBlockSize);
+        param->setLabel(kParamMotionBlockSizeLabel);
+        param->setHint(kParamMotionBlockSizeHint);
+        param->setDefault(kParamMotionBlockSizeDefault);
+        param->setRange(4, 256);
+        param->setDisplayRange(4, 64);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMotionSearchRange);
+        param->setLabel(kParamMotionSearchRangeLabel);
+        param->setHint(kParamMotionSearchRangeHint);
+        param->setDefault(kParamMotionSearchRangeDefault);
+        param->setRange(1, 1024);
+        param->setDisplayRange(1, 256);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamMotionScore);
+        param->setLabel(kParamMotionScoreLabel);
+        param->setHint(kParamMotionScoreHint);
+        assert(param->getNOptions() == eMotionScoreSSD);
+        param->appendOption(kParamMotionScoreOptionSSD);
+        assert(param->getNOptions() == eMotionScoreZNCC);
+        param->appendOption(kParamMotionScoreOptionZNCC);
+        param->setDefault( (int)eMotionScoreSSD );
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 } // RetimePluginFactory::describeInContext
 
 /** @brief The create instance function, the plugin must return an object derived from the \ref ImageEffect class */
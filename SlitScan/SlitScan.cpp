@@ -24,8 +24,9 @@
 #include <cmath> // for floor
 #include <climits> // for INT_MAX
 #include <cassert>
-#include <set>
 #include <map>
+#include <list>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsThreadSuite.h"
@@ -37,6 +38,21 @@
 #include "ofxsCopier.h"
 #include "ofxsMacros.h"
 
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -65,8 +81,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "net.sf.openfx.SlitScan"
 // History:
 // version 1.0: initial version
+// version 1.1: add cache size parameter
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -130,25 +147,281 @@ enum FilterEnum
 
 #define kParamFilterDefault eFilterNearest
 
+typedef std::map<double, OfxRectI> TimeWindows; // for each source time, the window read in the source image (in pixel coordinates)
+
+#define kParamCacheSize "cacheSize"
+#define kParamCacheSizeLabel "Cache Size (MB)"
+#define kParamCacheSizeHint "Memory (in megabytes) used to keep copies of the source frames between renders, so that consecutive output frames, which need almost the same source frames, do not fetch them again. The least recently used frames are removed first. Frames are only added to the cache when it can hold all the source frames needed by a render. 0 disables the cache. The cache is cleared when a parameter or an input of this effect changes, but changes made upstream of this effect cannot be detected: set the cache size to 0 to clear it."
+#define kParamCacheSizeDefault 0
+
+// A copy of the pixels of a source frame within a window, kept across renders by SourceImagesCache.
+// OFX images cannot be held after the render action returns, so the pixels are copied.
+struct CachedFrame
+{
+    double time;
+    int view;
+    OfxPointD renderScale;
+    FieldEnum field;
+    BitDepthEnum depth;
+    PixelComponentEnum components;
+    OfxRectI window; // the window that was requested (in pixel coordinates)
+    OfxRectI bounds; // the intersection of the window with the source image bounds
+    int pixelBytes;
+    std::vector<unsigned char> pixels;
+    int users; // number of renders using this frame (protected by the cache mutex)
+    bool stale; // the frame was removed from the cache while in use, and will be deleted when released
+
+    size_t size() const
+    {
+        return sizeof(CachedFrame) + pixels.size();
+    }
+
+    const void * getPixelAddress(int x,
+                                 int y) const
+    {
+        if ( (x < bounds.x1) || (x >= bounds.x2) || (y < bounds.y1) || (y >= bounds.y2) ) {
+            return NULL;
+        }
+
+        return &pixels[ ( (size_t)(y - bounds.y1) * (bounds.x2 - bounds.x1) + (x - bounds.x1) ) * pixelBytes ];
+    }
+};
+
+// size of a pixel in bytes, or 0 if the depth is not supported
+static int
+getPixelBytes(BitDepthEnum depth,
+              int nComponents)
+{
+    switch (depth) {
+    case eBitDepthUByte:
+
+        return nComponents;
+    case eBitDepthUShort:
+    case eBitDepthHalf:
+
+        return nComponents * 2;
+    case eBitDepthFloat:
+
+        return nComponents * 4;
+    default:
+
+        return 0;
+    }
+}
+
+// Instance-level cache of source frames, with least recently used eviction.
+// Consecutive output frames need almost the same set of source frames, which do not have to be fetched again.
+// Frames are identified by their time and view, so that the views of a multi-view project do not share frames.
+class SourceImagesCache
+{
+public:
+    SourceImagesCache()
+        : _mutex()
+        , _frames()
+        , _size(0)
+        , _budget(0)
+    {
+    }
+
+    ~SourceImagesCache()
+    {
+        for (FramesList::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            assert( (*it)->users == 0 );
+            delete *it;
+        }
+    }
+
+    bool isEnabled() const
+    {
+        AutoMutex guard(&_mutex);
+
+        return _budget > 0;
+    }
+
+    size_t getBudget() const
+    {
+        AutoMutex guard(&_mutex);
+
+        return _budget;
+    }
+
+    // set the memory budget (in bytes), 0 disables the cache
+    void setBudget(size_t budget)
+    {
+        AutoMutex guard(&_mutex);
+
+        _budget = budget;
+        evict();
+    }
+
+    // remove all frames (e.g. because the parameters or the inputs changed)
+    void clear()
+    {
+        AutoMutex guard(&_mutex);
+
+        for (FramesList::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            (*it)->stale = true;
+        }
+        evict();
+    }
+
+    // return the cached frame at time and view which contains window, or NULL. The frame must be released.
+    const CachedFrame* acquire(double time,
+                               int view,
+                               const OfxPointD& renderScale,
+                               FieldEnum field,
+                               BitDepthEnum depth,
+                               PixelComponentEnum components,
+                               const OfxRectI& window)
+    {
+        AutoMutex guard(&_mutex);
+
+        for (FramesList::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            CachedFrame* f = *it;
+            if ( !f->stale && (f->time == time) && (f->view == view) &&
+                 (f->renderScale.x == renderScale.x) && (f->renderScale.y == renderScale.y) &&
+                 (f->field == field) && (f->depth == depth) && (f->components == components) &&
+                 (f->window.x1 <= window.x1) && (window.x2 <= f->window.x2) &&
+                 (f->window.y1 <= window.y1) && (window.y2 <= f->window.y2) ) {
+                ++f->users;
+                // most recently used frames are at the front of the list
+                _frames.splice(_frames.begin(), _frames, it);
+
+                return f;
+            }
+        }
+
+        return NULL;
+    }
+
+    // copy window from img into the cache, and return the cached frame, or NULL if it does not fit in the cache.
+    // The frame must be released.
+    const CachedFrame* insert(double time,
+                              int view,
+                              const OfxPointD& renderScale,
+                              FieldEnum field,
+                              const Image* img,
+                              const OfxRectI& window)
+    {
+        int pixelBytes = getPixelBytes( img->getPixelDepth(), img->getPixelComponentCount() );
+        if (pixelBytes == 0) {
+            return NULL;
+        }
+        OfxRectI bounds;
+        if ( !Coords::rectIntersection<OfxRectI>(window, img->getBounds(), &bounds) ) {
+            bounds.x1 = bounds.x2 = window.x1;
+            bounds.y1 = bounds.y2 = window.y1;
+        }
+        size_t rowBytes = (size_t)(bounds.x2 - bounds.x1) * pixelBytes;
+        size_t size = sizeof(CachedFrame) + rowBytes * (bounds.y2 - bounds.y1);
+        {
+            AutoMutex guard(&_mutex);
+            if (size > _budget) {
+                return NULL;
+            }
+        }
+
+        // copy the pixels without holding the lock
+        auto_ptr<CachedFrame> f(new CachedFrame);
+        f->time = time;
+        f->view = view;
+        f->renderScale = renderScale;
+        f->field = field;
+        f->depth = img->getPixelDepth();
+        f->components = img->getPixelComponents();
+        f->window = window;
+        f->bounds = bounds;
+        f->pixelBytes = pixelBytes;
+        f->pixels.resize(rowBytes * (bounds.y2 - bounds.y1));
+        for (int y = bounds.y1; y < bounds.y2; ++y) {
+            const unsigned char* srcPix = (const unsigned char*)img->getPixelAddress(bounds.x1, y);
+            assert(srcPix);
+            std::copy(srcPix, srcPix + rowBytes, &f->pixels[(y - bounds.y1) * rowBytes]);
+        }
+        f->users = 1;
+        f->stale = false;
+
+        AutoMutex guard(&_mutex);
+        _frames.push_front( f.get() );
+        _size += f->size();
+        evict();
+
+        return f.release();
+    }
+
+    void release(const CachedFrame* frame)
+    {
+        AutoMutex guard(&_mutex);
+        CachedFrame* f = const_cast<CachedFrame*>(frame);
+
+        assert(f->users > 0);
+        --f->users;
+        if (f->users == 0) {
+            evict();
+        }
+    }
+
+private:
+    // remove stale frames which are not used anymore, and the least recently used frames until the cache fits in the budget.
+    // must be called with the mutex locked
+    void evict()
+    {
+        FramesList::iterator it = _frames.end();
+        while ( it != _frames.begin() ) {
+            --it;
+            CachedFrame* f = *it;
+            if (f->users > 0) {
+                continue;
+            }
+            if (f->stale || _size > _budget) {
+                _size -= f->size();
+                it = _frames.erase(it);
+                delete f;
+            }
+        }
+    }
+
+    typedef std::list<CachedFrame*> FramesList;
+    mutable Mutex _mutex;
+    FramesList _frames; // most recently used first
+    size_t _size; // memory used by the frames in the list, in bytes
+    size_t _budget;
+};
+
 class SourceImages
 {
 public:
     SourceImages(const ImageEffect& effect,
-                 Clip *srcClip)
+                 Clip *srcClip,
+                 SourceImagesCache *cache,
+                 const OfxPointD& renderScale,
+                 FieldEnum field,
+                 int view)
         : _effect(effect)
         , _srcClip(srcClip)
+        , _cache(cache)
+        , _renderScale(renderScale)
+        , _field(field)
+        , _view(view)
     {
         if (_srcClip && !_srcClip->isConnected()) {
             _srcClip = NULL;
         }
+        if ( _cache && !_cache->isEnabled() ) {
+            _cache = NULL;
+        }
     }
 
     ~SourceImages()
     {
-        for (ImagesMap::const_iterator it = _images.begin();
-             it != _images.end();
+        for (SourcesMap::const_iterator it = _sources.begin();
+             it != _sources.end();
              ++it) {
-            delete it->second;
+            delete it->second.image;
+            if (it->second.cached) {
+                assert(_cache);
+                _cache->release(it->second.cached);
+            }
         }
     }
 
@@ -157,32 +430,62 @@ public:
         return _srcClip != NULL;
     }
 
-    const Image* fetch(double time,
-                       bool nofetch = false) const
+    /** @brief fetch the source image at time, if it was not fetched yet
+
+       window is the part of the image that will be read, in pixel coordinates.
+       If cacheable is true, a copy of the window is kept in the cache.
+     */
+    void fetch(double time,
+               const OfxRectI& window,
+               bool cacheable) const
     {
         if (!_srcClip) {
-            return NULL;
+            return;
         }
-        ImagesMap::const_iterator it = _images.find(time);
-        if ( it != _images.end() ) {
-            return it->second;
+        if ( _sources.find(time) != _sources.end() ) {
+            return;
         }
-        if (nofetch) {
-            assert(false);
-
-            return NULL;
+        Source source;
+        if (_cache) {
+            source.cached = _cache->acquire(time, _view, _renderScale, _field, _srcClip->getPixelDepth(), _srcClip->getPixelComponents(), window);
         }
-
-        return _images[time] = _srcClip->fetchImage(time);
+        if (!source.cached) {
+            // only fetch the part of the image that will be read
+            OfxRectD bounds;
+            Coords::toCanonical(window, _renderScale, _srcClip->getPixelAspectRatio(), &bounds);
+            auto_ptr<const Image> img( _srcClip->fetchImage(time, bounds) );
+            if ( img.get() && _cache && cacheable ) {
+                // keep a copy of the window for the next renders, and release the image
+                source.cached = _cache->insert(time, _view, _renderScale, _field, img.get(), window);
+            }
+            if (!source.cached) {
+                source.image = img.release();
+            }
+        }
+        _sources[time] = source;
     }
 
-    void fetchSet(const std::set<double> &times) const
+    /** @brief fetch the source images at the times in windows
+
+       Each time only covers the rows or columns where it is used, and these move with each output frame,
+       so that a window would never be found in the cache by the next renders. If the cache can hold them,
+       the images are thus fetched and cached over the whole cacheWindow instead. Otherwise, only the
+       windows are fetched, and they are not added to the cache, where they would evict useful frames.
+     */
+    void fetchSet(const TimeWindows &windows,
+                  const OfxRectI& cacheWindow) const
     {
-        for (std::set<double>::const_iterator it = times.begin();
-             it != times.end() && !_effect.abort();
+        bool cacheable = false;
+        if ( _cache && _srcClip && !windows.empty() ) {
+            int pixelBytes = getPixelBytes( _srcClip->getPixelDepth(), _srcClip->getPixelComponentCount() );
+            size_t size = ( sizeof(CachedFrame) + (size_t)(cacheWindow.x2 - cacheWindow.x1) * (cacheWindow.y2 - cacheWindow.y1) * pixelBytes ) * windows.size();
+            cacheable = (pixelBytes > 0) && (size <= _cache->getBudget());
+        }
+        for (TimeWindows::const_iterator it = windows.begin();
+             it != windows.end() && !_effect.abort();
              ++it) {
-            //printf("fetching %g\n", *it);
-            fetch(*it);
+            //printf("fetching %g\n", it->first);
+            fetch(it->first, cacheable ? cacheWindow : it->second, cacheable);
         }
     }
 
@@ -197,20 +500,46 @@ public:
                                  int x,
                                  int y) const
     {
-        const Image* img = fetch(time, true);
+        SourcesMap::const_iterator it = _sources.find(time);
 
-        if (img) {
-            return img->getPixelAddress(x, y);
+        if ( it == _sources.end() ) {
+            // all images must have been fetched before processing
+            assert(!_srcClip);
+
+            return NULL;
+        }
+        if (it->second.image) {
+            return it->second.image->getPixelAddress(x, y);
+        }
+        if (it->second.cached) {
+            return it->second.cached->getPixelAddress(x, y);
         }
 
         return NULL;
     }
 
 private:
-    typedef std::map<double, const Image*> ImagesMap;
+    // a source image, either fetched from the clip or copied in the cache
+    struct Source
+    {
+        const Image* image;
+        const CachedFrame* cached;
+
+        Source()
+            : image(NULL)
+            , cached(NULL)
+        {
+        }
+    };
+
+    typedef std::map<double, Source> SourcesMap;
     const ImageEffect& _effect;
     Clip *_srcClip;            /**< @brief Mandated input clips */
-    mutable ImagesMap _images;
+    SourceImagesCache *_cache;
+    OfxPointD _renderScale;
+    FieldEnum _field;
+    int _view;
+    mutable SourcesMap _sources;
 };
 
 class SlitScanProcessorBase;
@@ -231,6 +560,8 @@ private:
     BooleanParam *_retimeAbsolute;
     Int2DParam *_frameRange;
     ChoiceParam *_filter;   /**< @brief how images are interpolated (or not). */
+    IntParam *_cacheSize;
+    SourceImagesCache _cache;
 
 public:
     /** @brief ctor */
@@ -245,6 +576,8 @@ public:
         , _retimeAbsolute(NULL)
         , _frameRange(NULL)
         , _filter(NULL)
+        , _cacheSize(NULL)
+        , _cache()
     {
 
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -257,7 +590,9 @@ public:
         _retimeAbsolute = fetchBooleanParam(kParamRetimeAbsolute);
         _frameRange = fetchInt2DParam(kParamFrameRange);
         _filter = fetchChoiceParam(kParamFilter);
-        assert(_retimeFunction && _retimeOffset && _retimeGain && _retimeAbsolute && _frameRange && _filter);
+        _cacheSize = fetchIntParam(kParamCacheSize);
+        assert(_retimeFunction && _retimeOffset && _retimeGain && _retimeAbsolute && _frameRange && _filter && _cacheSize);
+        _cache.setBudget( (size_t)(std::max)(0, _cacheSize->getValue()) * 1024 * 1024 );
 
         // finally
         syncPrivateData();
@@ -280,6 +615,17 @@ private:
         if ( (paramName == kParamRetimeFunction) && (args.reason == eChangeUserEdit) ) {
             updateVisibility();
         }
+        if (paramName == kParamCacheSize) {
+            _cache.setBudget( (size_t)(std::max)(0, _cacheSize->getValue()) * 1024 * 1024 );
+        }
+        // the cached frames may not correspond to the parameters anymore
+        _cache.clear();
+    }
+
+    virtual void changedClip(const InstanceChangedArgs & /*args*/,
+                             const std::string & /*clipName*/) OVERRIDE FINAL
+    {
+        _cache.clear();
     }
 
     /** @brief The sync private data action, called when the effect needs to sync any private data to persistent parameters */
@@ -433,7 +779,53 @@ SlitScanPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &args,
     return false;
 }
 
-// build the set of times needed to render renderWindow
+// add the window (x1,y1)-(x2,y2) to the window read in the source image at time t
+static void
+addTimeWindow(double t,
+              int x1,
+              int y1,
+              int x2,
+              int y2,
+              TimeWindows *sourceImagesWindows)
+{
+    TimeWindows::iterator it = sourceImagesWindows->find(t);
+
+    if ( it == sourceImagesWindows->end() ) {
+        OfxRectI r;
+        r.x1 = x1;
+        r.y1 = y1;
+        r.x2 = x2;
+        r.y2 = y2;
+        (*sourceImagesWindows)[t] = r;
+    } else {
+        OfxRectI &r = it->second;
+        r.x1 = (std::min)(r.x1, x1);
+        r.y1 = (std::min)(r.y1, y1);
+        r.x2 = (std::max)(r.x2, x2);
+        r.y2 = (std::max)(r.y2, y2);
+    }
+}
+
+// add the window (x1,y1)-(x2,y2) to the source images used for the source time srcTime
+static void
+addRetimeWindow(double srcTime,
+                FilterEnum filter,
+                int x1,
+                int y1,
+                int x2,
+                int y2,
+                TimeWindows *sourceImagesWindows)
+{
+    // same rule as in SlitScanProcessor
+    if ( (filter == eFilterNearest) || (srcTime == (int)srcTime) ) {
+        addTimeWindow(std::floor(srcTime + 0.5), x1, y1, x2, y2, sourceImagesWindows);
+    } else {
+        addTimeWindow(std::floor(srcTime), x1, y1, x2, y2, sourceImagesWindows);
+        addTimeWindow(std::ceil(srcTime), x1, y1, x2, y2, sourceImagesWindows);
+    }
+}
+
+// build the set of times needed to render renderWindow, with the window read in each source image
 template<class PIX, int maxValue>
 void
 buildTimes(const ImageEffect& effect,
@@ -444,12 +836,15 @@ buildTimes(const ImageEffect& effect,
            double retimeOffset,
            bool retimeAbsolute,
            FilterEnum filter,
-           std::set<double> *sourceImagesTimes)
+           TimeWindows *sourceImagesWindows)
 {
     for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
         if ( effect.abort() ) {
             return;
         }
+        // consecutive pixels with the same source time are added at once
+        int runStart = renderWindow.x1;
+        double runTime = 0.;
         for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
             PIX* mapPix = retimeGain != 0. ? (PIX*)retimeMap->getPixelAddress(x, y) : NULL;
             double mapVal = mapPix ? (double)(*mapPix) / maxValue  : 0.;
@@ -457,54 +852,54 @@ buildTimes(const ImageEffect& effect,
             if (!retimeAbsolute) {
                 srcTime += time;
             }
-            if (srcTime == (int)srcTime) {
-                sourceImagesTimes->insert(srcTime);
-            } else {
-                if (filter == eFilterNearest) {
-                    sourceImagesTimes->insert( std::floor(srcTime + 0.5) );
-                } else {
-                    sourceImagesTimes->insert( std::floor(srcTime) );
-                    sourceImagesTimes->insert( std::ceil(srcTime) );
-                }
+            if (x == renderWindow.x1) {
+                runTime = srcTime;
+            } else if (srcTime != runTime) {
+                addRetimeWindow(runTime, filter, runStart, y, x, y + 1, sourceImagesWindows);
+                runStart = x;
+                runTime = srcTime;
             }
         }
+        if (renderWindow.x1 < renderWindow.x2) {
+            addRetimeWindow(runTime, filter, runStart, y, renderWindow.x2, y + 1, sourceImagesWindows);
+        }
     }
 }
 
+// build the set of times needed to render renderWindow with a slit, with the window read in each source image.
+// With a horizontal slit, each source image is only read on the lines where its time is used,
+// and with a vertical slit on the columns where its time is used.
 void
 buildTimesSlit(double time,
-               double a,
-               double b,
+               const OfxRectI& renderWindow,
+               const OfxRectI& srcRoDPixel,
+               RetimeFunctionEnum retimeFunction,
                double retimeGain,
                double retimeOffset,
                bool retimeAbsolute,
                FilterEnum filter,
-               std::set<double> *sourceImagesTimes)
+               TimeWindows *sourceImagesWindows)
 {
-    a = a * retimeGain + retimeOffset;
-    b = b * retimeGain + retimeOffset;
-    if (!retimeAbsolute) {
-        a += time;
-        b += time;
-    }
-    if (a > b) {
-        std::swap(a, b);
-    }
-    int tmin, tmax;
-    switch (filter) {
-    case eFilterNearest: {
-        tmin = (int)std::floor(a + 0.5);
-        tmax = (int)std::floor(b + 0.5);
-        break;
-    }
-    case eFilterLinear: {
-        tmin = (int)std::floor(a);
-        tmax = (int)std::ceil(b);
-        break;
-    }
-    }
-    for (int t = tmin; t <= tmax; ++t) {
-        sourceImagesTimes->insert(t);
+    if (retimeFunction == eRetimeFunctionHorizontalSlit) {
+        for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+            // same retime function as in SlitScanProcessor
+            double srcTime = (double)(y - srcRoDPixel.y1) / (srcRoDPixel.y2 - 1 - srcRoDPixel.y1);
+            srcTime = srcTime * retimeGain + retimeOffset;
+            if (!retimeAbsolute) {
+                srcTime += time;
+            }
+            addRetimeWindow(srcTime, filter, renderWindow.x1, y, renderWindow.x2, y + 1, sourceImagesWindows);
+        }
+    } else {
+        assert(retimeFunction == eRetimeFunctionVerticalSlit);
+        for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
+            double srcTime = (double)(x - srcRoDPixel.x1) / (srcRoDPixel.x2 - 1 - srcRoDPixel.x1);
+            srcTime = srcTime * retimeGain + retimeOffset;
+            if (!retimeAbsolute) {
+                srcTime += time;
+            }
+            addRetimeWindow(srcTime, filter, x, renderWindow.y1, x + 1, renderWindow.y2, sourceImagesWindows);
+        }
     }
 }
 
@@ -723,22 +1118,15 @@ SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
         Coords::toPixelEnclosing(srcRod, args.renderScale, _srcClip->getPixelAspectRatio(), &srcRoDPixel);
     }
 
-    SourceImages sourceImages(*this, _srcClip);
-    std::set<double> sourceImagesTimes;
+    SourceImages sourceImages(*this, _srcClip, &_cache, args.renderScale, args.fieldToRender, args.renderView);
+    TimeWindows sourceImagesWindows;
 
     auto_ptr<const Image> retimeMap;
 
     switch (retimeFunction) {
-    case eRetimeFunctionHorizontalSlit: {
-        double a = (double)(args.renderWindow.y1 - srcRoDPixel.y1) / (srcRoDPixel.y2 - 1 - srcRoDPixel.y1);
-        double b = (double)(args.renderWindow.y2 - 1 - srcRoDPixel.y1) / (srcRoDPixel.y2 - 1 - srcRoDPixel.y1);
-        buildTimesSlit(time, a, b, retimeGain, retimeOffset, retimeAbsolute, filter, &sourceImagesTimes);
-        break;
-    }
+    case eRetimeFunctionHorizontalSlit:
     case eRetimeFunctionVerticalSlit: {
-        double a = (double)(args.renderWindow.x1 - srcRoDPixel.y1) / (srcRoDPixel.x2 - 1 - srcRoDPixel.x1);
-        double b = (double)(args.renderWindow.x2 - 1 - srcRoDPixel.x1) / (srcRoDPixel.x2 - 1 - srcRoDPixel.x1);
-        buildTimesSlit(time, a, b, retimeGain, retimeOffset, retimeAbsolute, filter, &sourceImagesTimes);
+        buildTimesSlit(time, args.renderWindow, srcRoDPixel, retimeFunction, retimeGain, retimeOffset, retimeAbsolute, filter, &sourceImagesWindows);
         break;
     }
     case eRetimeFunctionRetimeMap: {
@@ -748,16 +1136,9 @@ SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
         if ( !retimeMap.get() ) {
             // empty retimeMap or no gain, we need only one or two images
             double identityTime = retimeAbsolute ? retimeOffset : (time + retimeOffset);
-            if (identityTime == (int)identityTime) {
-                sourceImagesTimes.insert(identityTime);
-            } else {
-                if (filter == eFilterNearest) {
-                    sourceImagesTimes.insert( std::floor(identityTime + 0.5) );
-                } else {
-                    sourceImagesTimes.insert( std::floor(identityTime) );
-                    sourceImagesTimes.insert( std::ceil(identityTime) );
-                }
-            }
+            addRetimeWindow(identityTime, filter,
+                            args.renderWindow.x1, args.renderWindow.y1, args.renderWindow.x2, args.renderWindow.y2,
+                            &sourceImagesWindows);
         } else {
             retimeMap.reset(_retimeMapClip ? _retimeMapClip->fetchImage(time) : NULL);
             assert(retimeMap->getPixelComponents() == ePixelComponentAlpha);
@@ -776,7 +1157,7 @@ SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
                                                retimeOffset,
                                                retimeAbsolute,
                                                filter,
-                                               &sourceImagesTimes);
+                                               &sourceImagesWindows);
                 break;
             case eBitDepthUShort:
                 buildTimes<unsigned short, 65535>(*this,
@@ -787,7 +1168,7 @@ SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
                                                   retimeOffset,
                                                   retimeAbsolute,
                                                   filter,
-                                                  &sourceImagesTimes);
+                                                  &sourceImagesWindows);
                 break;
             case eBitDepthFloat:
                 buildTimes<float, 1>(*this,
@@ -798,7 +1179,7 @@ SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
                                      retimeOffset,
                                      retimeAbsolute,
                                      filter,
-                                     &sourceImagesTimes);
+                                     &sourceImagesWindows);
                 break;
             default:
                 setPersistentMessage(Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
@@ -812,7 +1193,12 @@ SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
     if ( abort() ) {
         return;
     }
-    sourceImages.fetchSet(sourceImagesTimes);
+    // the window that may be cached: the render window, within the source RoD
+    OfxRectI cacheWindow;
+    if ( !Coords::rectIntersection<OfxRectI>(args.renderWindow, srcRoDPixel, &cacheWindow) ) {
+        cacheWindow = args.renderWindow;
+    }
+    sourceImages.fetchSet(sourceImagesWindows, cacheWindow);
     if ( abort() ) {
         return;
     }
@@ -1038,6 +1424,19 @@ SlitScanPluginFactory::describeInContext(ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamCacheSize);
+        param->setLabel(kParamCacheSizeLabel);
+        param->setHint(kParamCacheSizeHint);
+        param->setRange(0, INT_MAX);
+        param->setDisplayRange(0, 4096);
+        param->setDefault(kParamCacheSizeDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 } // SlitScanPluginFactory::describeInContext
 
 /** @brief The create instance function, the plugin must return an object derived from the \ref ImageEffect class */
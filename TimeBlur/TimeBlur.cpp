@@ -25,6 +25,7 @@
 #include <climits> // for INT_MAX
 #include <cassert>
 #include <algorithm>
+#include <vector>
 #ifdef DEBUG
 #include <cstdio>
 #endif
@@ -38,6 +39,7 @@
 #include "ofxsShutter.h"
 #include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
+#include "ofxsFetchAndProcess.h"
 
 using namespace OFX;
 
@@ -308,6 +310,7 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor,
     // We chose not to reproduce this bug: when divisions = 1 both the RoD
     // and the image correspond to the start of shutter time.
 
+    OptionalImagesHolder_RAII srcImgs; // the images of the current chunk
     int imin;
     int imax = 0;
     const int n = divisions;
@@ -326,15 +329,20 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor,
             }
         }
 
-        // fetch the source images
-        OptionalImagesHolder_RAII srcImgs;
-        for (int i = imin; i < imax; ++i) {
-            if ( abort() ) {
-                return;
+        if (imin == 0) {
+            // fetch the images of the first chunk
+            std::vector<ImageRequest> requests;
+            for (int i = imin; i < imax; ++i) {
+                requests.push_back( ImageRequest(_srcClip, range.min + i * interval) );
             }
-            const Image* src = _srcClip ? _srcClip->fetchImage(range.min + i * interval) : 0;
-            //std::printf("TimeBlur: fetchimage(%g)\n", range.min + i * interval);
-#         ifndef NDEBUG
+            fetchImagesAndProcess(*this, NULL, requests, &srcImgs.images);
+        }
+        if ( abort() ) {
+            return;
+        }
+#     ifndef NDEBUG
+        for (size_t i = 0; i < srcImgs.images.size(); ++i) {
+            const Image* src = srcImgs.images[i];
             if (src) {
                 checkBadRenderScaleOrField(src, args);
                 BitDepthEnum srcBitDepth      = src->getPixelDepth();
@@ -343,9 +351,8 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor,
                     throwSuiteStatusException(kOfxStatErrImageFormat);
                 }
             }
-#         endif
-            srcImgs.images.push_back(src);
         }
+#     endif
 
         // set the images
         if (lastPass) {
@@ -358,8 +365,17 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor,
 
         processor.setValues(lastPass ? divisions : 0);
 
-        // Call the base class process member, this will call the derived templated process code
-        processor.process();
+        // Call the base class process member, this will call the derived templated process code,
+        // while the images of the next chunk are being fetched
+        OptionalImagesHolder_RAII nextImgs;
+        std::vector<ImageRequest> requests;
+        for (int i = imax; i < (std::min)(imax + kFrameChunk, n); ++i) {
+            //std::printf("TimeBlur: fetchimage(%g)\n", range.min + i * interval);
+            requests.push_back( ImageRequest(_srcClip, range.min + i * interval) );
+        }
+        fetchImagesAndProcess(*this, &processor, requests, &nextImgs.images);
+        // the images of this chunk are released by nextImgs
+        std::swap(srcImgs.images, nextImgs.images);
     }
 } // TimeBlurPlugin::setupAndProcess
 
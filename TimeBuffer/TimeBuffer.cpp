@@ -24,6 +24,7 @@
 #include <cmath>
 #include <cfloat> // DBL_MAX
 #include <algorithm>
+#include <vector>
 //#include <iostream>
 #ifdef DEBUG
 #include <iostream>
@@ -75,8 +76,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping "Time"
 // History:
 // version 1.0: initial version
+// version 1.1: double-buffered storage, copies are done outside of the lock
+// version 1.2: ring of previous frames (TimeBufferWrite "History Size"), read with TimeBufferRead "Frame Offset"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTilesRead 0
 #define kSupportsTilesWrite 0
@@ -102,6 +105,20 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStartFrameLabel "Start Frame"
 #define kParamStartFrameHint "First frame of the effect. TimeBufferRead outputs a black and transparent image for this frame and all frames before. The size of the black image is either the size of the Source clip, or the project size if it is not connected."
 
+#define kParamFrameOffset "frameOffset"
+#define kParamFrameOffsetLabel "Frame Offset"
+#define kParamFrameOffsetHint \
+    "TimeBufferRead at time t outputs the frame written by TimeBufferWrite at time t - Frame Offset.\n" \
+    "The TimeBufferRead with a Frame Offset of 1 synchronizes with TimeBufferWrite, and there must be exactly one such instance for each buffer name. " \
+    "Any number of TimeBufferRead instances with a larger Frame Offset may read the same buffer: they read the previous frames kept by TimeBufferWrite, which must have a History Size at least equal to the largest Frame Offset."
+
+#define kParamHistorySize "historySize"
+#define kParamHistorySizeLabel "History Size"
+#define kParamHistorySizeHint \
+    "Number of previous frames kept in the buffer, which may be read by TimeBufferRead instances with a Frame Offset up to this value.\n" \
+    "All frames are stored in a single allocation of (History Size + 1) frames, which is only reallocated when the frame size grows or when this value changes (this resets the history)."
+#define kParamHistorySizeMax 64
+
 #define kParamUnorderedRender "unorderedRender"
 #define kParamUnorderedRenderLabel "Unordered Render"
 #define kParamUnorderedRenderHint \
@@ -148,7 +165,8 @@ sleep(const unsigned int milliseconds)
    We maintain a global map from the buffer name to the buffer data.
 
    The buffer data contains:
-   - an image buffers stored with its valid read time (which is the write time +1), or an invalid date
+   - a ring of History Size + 1 image buffers, stored in a single allocation (the slab): the front frame is the last written frame, the back frame is the next one to be written, and the others are the history
+   - the valid read time of the front frame (which is the write time +1), or an invalid date
    - the pointer to the read and the write instances, which should be unique, or NULL if it is not yet created.
 
 
@@ -160,8 +178,8 @@ sleep(const unsigned int milliseconds)
  * if t > startTime:
    - the buffer is locked, and if it doesn't have date t, then either the render fails, a black image is rendered, or the buffer is used anyway, depending on the user-chosen strategy
    - if it is marked as dirty, it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-   - when the buffer is locked and clean, it is copied to output and unlocked
-   - the buffer is re-locked for writing, and marked as dirty, with date t+1, then unlocked
+   - when the buffer is locked and clean, the front frame is marked as being read, the buffer is marked as dirty, with date t+1, and unlocked
+   - the front frame is copied to output, and the buffer is re-locked to mark that the front frame is not being read anymore
 
    When TimeBufferReadPlugin::getRegionOfDefinition(t) is called:
  * if the write instance does not exist, an error is displayed and render fails
@@ -172,15 +190,27 @@ sleep(const unsigned int milliseconds)
    - if it is marked as dirty ,it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
    - when the buffer is locked and clean, the buffer's RoD is returned and it is unlocked
 
+   A TimeBufferRead with a Frame Offset k > 1 does not synchronize with TimeBufferWrite: when its render(t) is called,
+   the frame written at time t-k is looked up in the history, marked as being read, copied to output without holding the lock, and unmarked.
+   If it is not in the history, the user-chosen strategy for unordered render is applied.
+   Any number of such instances may share a buffer.
+
 
    When TimeBufferWritePlugin::render(t) is called:
    - if the read instance does not exist, an error is displayed and render fails
    - if the "Sync" input is not connected, issue an error message (it should be connected to TimeBufferRead)
    - the buffer is locked for writing, and if it doesn't have date t+1 or is not dirty, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
-   - src is copied to the buffer, and it is marked as not dirty, then unlocked
+   - if the frame size grew or History Size changed, the slab is reallocated once no frame is being read, and the history is lost
+   - the back frame is the oldest frame in the ring: once it is not being read, the buffer is unlocked, and src is copied to the back frame
+   - the buffer is re-locked, the back frame becomes the front frame, and the buffer is marked as not dirty, then unlocked
    - src is also copied to output.
 
 
+   The slab is never freed, and only reallocated when the frame size grows or History Size changes, so that no allocation happens at each frame.
+   The copies are done outside of the mutex: the only operations done while the buffer is locked are the checks and the rotation of the ring.
+   The rotation is not a lock-free index flip: it must be consistent with the date, the dirty flag and the reader counts of the frames,
+   which a single atomic cannot cover, and the Makefile build (and the compilers of some OFX hosts) still allows C++98, where std::atomic is not available.
+
    There is a "Reset" button both in TimeBufferRead and TimeBufferWrite, which resets the lock and the buffer.
 
    There is a "Info.." button both in TimeBufferRead and TimeBufferWrite, which gives information about all available buffers.
@@ -191,14 +221,12 @@ sleep(const unsigned int milliseconds)
 
  */
 
-struct TimeBuffer
+// an image stored in a TimeBuffer
+struct TimeBufferFrame
 {
-    ImageEffect *readInstance; // written only once, not protected by mutex
-    ImageEffect *writeInstance; // written only once, not protected by mutex
-    mutable Mutex mutex;
-    double time; // can store any integer from 0 to 2^53
-    bool dirty; // TimeBufferRead sets this to true and sets date to t+1, TimeBufferWrite sets this to false
-    std::vector<unsigned char> pixelData;
+    size_t dataOffset; // offset of the pixel data in the TimeBuffer slab
+    double writeTime; // time at which TimeBufferWrite wrote this frame, or -DBL_MAX if it is not valid
+    int readers; // number of TimeBufferRead instances copying this frame without holding the mutex
     OfxRectI bounds;
     PixelComponentEnum pixelComponents;
     int pixelComponentCount;
@@ -207,22 +235,102 @@ struct TimeBuffer
     OfxPointD renderScale;
     double par;
 
-    TimeBuffer()
-        : readInstance(NULL)
-        , writeInstance(NULL)
-        , mutex()
-        , time(-DBL_MAX)
-        , dirty(true)
-        , pixelData()
+    TimeBufferFrame()
+        : dataOffset(0)
+        , writeTime(-DBL_MAX)
+        , readers(0)
         , pixelComponents(ePixelComponentNone)
         , pixelComponentCount(0)
         , bitDepth(eBitDepthNone)
         , rowBytes(0)
         , par(1.)
     {
+        reset();
+    }
+
+    // reset the frame properties (the pixel data stays allocated in the slab)
+    void reset()
+    {
+        writeTime = -DBL_MAX;
+        pixelComponents = ePixelComponentNone;
+        pixelComponentCount = 0;
+        bitDepth = eBitDepthNone;
+        rowBytes = 0;
+        par = 1.;
         bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
         renderScale.x = renderScale.y = 1;
     }
+
+    bool isEmpty() const
+    {
+        return rowBytes == 0 || bounds.y2 <= bounds.y1;
+    }
+};
+
+struct TimeBuffer
+{
+    ImageEffect *readInstance; // written only once, not protected by mutex
+    ImageEffect *writeInstance; // written only once, not protected by mutex
+    mutable Mutex mutex;
+    double time; // can store any integer from 0 to 2^53
+    bool dirty; // TimeBufferRead sets this to true and sets date to t+1, TimeBufferWrite sets this to false
+    std::vector<unsigned char> slab; // pixel data of all frames, never shrinks
+    size_t frameBytes; // size of the slab slot of each frame
+    std::vector<TimeBufferFrame> frames; // ring of history+1 frames: the back frame is filled by TimeBufferWrite while the others may be read
+    int front; // index of the last written frame
+
+    TimeBuffer()
+        : readInstance(NULL)
+        , writeInstance(NULL)
+        , mutex()
+        , time(-DBL_MAX)
+        , dirty(true)
+        , slab()
+        , frameBytes(0)
+        , frames(2)
+        , front(0)
+    {
+    }
+
+    // reset the buffer to a clean state (must be called with the mutex locked)
+    void reset()
+    {
+        time = -DBL_MAX;
+        dirty = true;
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            if (frames[i].readers == 0) {
+                frames[i].reset();
+            }
+        }
+    }
+
+    // the frame in the history that was written at time t, or NULL
+    TimeBufferFrame* findFrame(double t)
+    {
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            if (frames[i].writeTime == t) {
+                return &frames[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    bool isReadingAny() const
+    {
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            if (frames[i].readers > 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    const unsigned char* getPixelData(const TimeBufferFrame& frame) const
+    {
+        return &slab[frame.dataOffset];
+    }
 };
 
 // This is the global map from buffer names to buffers.
@@ -247,6 +355,7 @@ public:
         , _srcClip(NULL)
         , _bufferName(NULL)
         , _startFrame(NULL)
+        , _frameOffset(NULL)
         , _unorderedRender(NULL)
         , _timeOut(NULL)
         , _resetTrigger(NULL)
@@ -273,11 +382,12 @@ public:
 
         _bufferName = fetchStringParam(kParamBufferName);
         _startFrame = fetchIntParam(kParamStartFrame);
+        _frameOffset = fetchIntParam(kParamFrameOffset);
         _unorderedRender = fetchChoiceParam(kParamUnorderedRender);
         _timeOut = fetchDoubleParam(kParamTimeOut);
         _resetTrigger = fetchBooleanParam(kParamResetTrigger);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
-        assert(_bufferName && _startFrame && _unorderedRender && _sublabel);
+        assert(_bufferName && _startFrame && _frameOffset && _unorderedRender && _sublabel);
 
         std::string name;
         _bufferName->getValue(name);
@@ -300,6 +410,15 @@ private:
     virtual bool getRegionOfDefinition(const RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    void renderHistory(const RenderArguments &args, TimeBuffer* timeBuffer, int frameOffset, Image* dst);
+    bool getRegionOfDefinitionHistory(const RegionOfDefinitionArguments &args, TimeBuffer* timeBuffer, int frameOffset, OfxRectD &rod);
+
+    // a TimeBufferRead with a Frame Offset larger than 1 reads the history of the buffer, and does not own it
+    bool isHistoryReader() const
+    {
+        return _frameOffset->getValue() > 1;
+    }
+
     void setName(const std::string &name)
     {
         if (name == _name) {
@@ -315,12 +434,19 @@ private:
                 // we may free this buffer
                 {
                     AutoMutex guard( gTimeBufferMapMutex.get() );
-                    gTimeBufferMap->erase(_name);
+                    gTimeBufferMap->erase(_projectId + '.' + _groupId + '.' + _name);
                 }
                 delete _buffer;
-                _buffer = 0;
-                _name.clear();
             }
+            _buffer = 0;
+        }
+        _name.clear();
+        if ( !name.empty() && isHistoryReader() ) {
+            // the buffer is owned by the TimeBufferRead and TimeBufferWrite instances with the same name
+            _name = name;
+            clearPersistentMessage();
+
+            return;
         }
         if (!name.empty() && !_buffer) {
             TimeBuffer* timeBuffer = 0;
@@ -371,6 +497,9 @@ private:
     void check()
     {
 #ifdef DEBUG
+        if ( isHistoryReader() ) {
+            return;
+        }
         std::string key = _projectId + '.' + _groupId + '.' + _name;
         AutoMutex guard( gTimeBufferMapMutex.get() );
         TimeBufferMap::const_iterator it = gTimeBufferMap->find(key);
@@ -424,6 +553,16 @@ private:
 
             return NULL;
         }
+        if ( isHistoryReader() ) {
+            if (!timeBuffer->writeInstance) {
+                setPersistentMessage(Message::eMessageError, "", std::string("No TimeBufferWrite exists with name \"") + _name + "\".");
+                throwSuiteStatusException(kOfxStatFailed);
+
+                return NULL;
+            }
+
+            return timeBuffer;
+        }
         if (timeBuffer && !timeBuffer->readInstance) {
             setPersistentMessage(Message::eMessageError, "", std::string("Another TimeBufferRead already exists with name \"") + _name + "\". Try using another name.");
             throwSuiteStatusException(kOfxStatFailed);
@@ -453,6 +592,7 @@ private:
     Clip *_srcClip;
     StringParam *_bufferName;
     IntParam *_startFrame;
+    IntParam *_frameOffset;
     ChoiceParam *_unorderedRender;
     DoubleParam *_timeOut;
     BooleanParam *_resetTrigger;
@@ -497,6 +637,12 @@ TimeBufferReadPlugin::render(const RenderArguments &args)
 
         return;
     }
+    int frameOffset = _frameOffset->getValue();
+    if (frameOffset > 1) {
+        renderHistory(args, timeBuffer, frameOffset, dst.get());
+
+        return;
+    }
     int startFrame = _startFrame->getValue();
     // * if t <= startTime:
     //   - a black image is rendered
@@ -564,7 +710,8 @@ TimeBufferReadPlugin::render(const RenderArguments &args)
         }
         guard.relock();
     }
-    if ( (args.renderScale.x != timeBuffer->renderScale.x) || (args.renderScale.y != timeBuffer->renderScale.y) ) {
+    TimeBufferFrame& frame = timeBuffer->frames[timeBuffer->front];
+    if ( (args.renderScale.x != frame.renderScale.x) || (args.renderScale.y != frame.renderScale.y) ) {
         UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
         switch (e) {
         case eUnorderedRenderError:
@@ -581,22 +728,120 @@ TimeBufferReadPlugin::render(const RenderArguments &args)
             return;
         }
     }
-    //   - when the buffer is locked and clean, it is copied to output and unlocked
-    copyPixels( *this, args.renderWindow, args.renderScale,
-                (void*)&timeBuffer->pixelData.front(),
-                timeBuffer->bounds,
-                timeBuffer->pixelComponents,
-                timeBuffer->pixelComponentCount,
-                timeBuffer->bitDepth,
-                timeBuffer->rowBytes,
-                dst.get() );
-    //   - the buffer is re-locked for writing, and marked as dirty, with date t+1, then unlocked
+    if ( frame.isEmpty() ) {
+        // nothing was written yet (can only happen with eUnorderedRenderLast)
+        fillBlack( *this, args.renderWindow, args.renderScale, dst.get() );
+        timeBuffer->dirty = true;
+        timeBuffer->time = time + 1;
+        clearPersistentMessage();
+
+        return;
+    }
+    //   - when the buffer is locked and clean, the front frame is marked as being read, the buffer is marked as dirty, with date t+1, and unlocked.
+    //     From now on, TimeBufferWrite may fill the back frame.
+    ++frame.readers;
     timeBuffer->dirty = true;
     timeBuffer->time = time + 1;
+    guard.unlock();
+    //   - the front frame is copied to output, and the buffer is re-locked to mark that the front frame is not being read anymore
+    try {
+        copyPixels( *this, args.renderWindow, args.renderScale,
+                    (void*)timeBuffer->getPixelData(frame),
+                    frame.bounds,
+                    frame.pixelComponents,
+                    frame.pixelComponentCount,
+                    frame.bitDepth,
+                    frame.rowBytes,
+                    dst.get() );
+    } catch (...) {
+        guard.relock();
+        --frame.readers;
+        throw;
+    }
+    guard.relock();
+    --frame.readers;
     clearPersistentMessage();
     //std::cout << "render! OK\n";
 } // TimeBufferReadPlugin::render
 
+// render for a TimeBufferRead with a Frame Offset larger than 1, which reads a frame from the history without synchronizing with TimeBufferWrite
+void
+TimeBufferReadPlugin::renderHistory(const RenderArguments &args,
+                                    TimeBuffer* timeBuffer,
+                                    int frameOffset,
+                                    Image* dst)
+{
+    const double writeTime = args.time - frameOffset;
+    int startFrame = _startFrame->getValue();
+
+    if (writeTime < startFrame) {
+        fillBlack( *this, args.renderWindow, args.renderScale, dst );
+        clearPersistentMessage();
+
+        return;
+    }
+    AutoMutex guard(timeBuffer->mutex);
+    TimeBufferFrame* frame = timeBuffer->findFrame(writeTime);
+    if (!frame) {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+            setPersistentMessage(Message::eMessageError, "", "The requested frame is not in the buffer history. Frames must be rendered in sequential order, and the History Size of TimeBufferWrite must be at least the Frame Offset.");
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        case eUnorderedRenderBlack:
+            fillBlack( *this, args.renderWindow, args.renderScale, dst );
+
+            return;
+        case eUnorderedRenderLast:
+            frame = &timeBuffer->frames[timeBuffer->front];
+            break;
+        }
+    }
+    if ( (args.renderScale.x != frame->renderScale.x) || (args.renderScale.y != frame->renderScale.y) ) {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+        case eUnorderedRenderLast:
+            setPersistentMessage(Message::eMessageError, "", "Frames must be rendered in sequential order with the same renderScale");
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        case eUnorderedRenderBlack:
+            fillBlack( *this, args.renderWindow, args.renderScale, dst );
+
+            return;
+        }
+    }
+    if ( frame->isEmpty() ) {
+        fillBlack( *this, args.renderWindow, args.renderScale, dst );
+        clearPersistentMessage();
+
+        return;
+    }
+    // the frame cannot be overwritten by TimeBufferWrite while it is being read
+    ++frame->readers;
+    guard.unlock();
+    try {
+        copyPixels( *this, args.renderWindow, args.renderScale,
+                    (void*)timeBuffer->getPixelData(*frame),
+                    frame->bounds,
+                    frame->pixelComponents,
+                    frame->pixelComponentCount,
+                    frame->bitDepth,
+                    frame->rowBytes,
+                    dst );
+    } catch (...) {
+        guard.relock();
+        --frame->readers;
+        throw;
+    }
+    guard.relock();
+    --frame->readers;
+    clearPersistentMessage();
+} // TimeBufferReadPlugin::renderHistory
+
 /* Override the clip preferences, we need to say we are setting the frame varying flag */
 void
 TimeBufferReadPlugin::getClipPreferences(ClipPreferencesSetter &clipPreferences)
@@ -626,6 +871,10 @@ TimeBufferReadPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &a
 
         return false;
     }
+    int frameOffset = _frameOffset->getValue();
+    if (frameOffset > 1) {
+        return getRegionOfDefinitionHistory(args, timeBuffer, frameOffset, rod);
+    }
     // * if t <= startTime:
     // - the RoD is empty
     int startFrame = _startFrame->getValue();
@@ -679,7 +928,8 @@ TimeBufferReadPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &a
         }
         guard.relock();
     }
-    if ( (args.renderScale.x != timeBuffer->renderScale.x) || (args.renderScale.y != timeBuffer->renderScale.y) ) {
+    const TimeBufferFrame& frame = timeBuffer->frames[timeBuffer->front];
+    if ( (args.renderScale.x != frame.renderScale.x) || (args.renderScale.y != frame.renderScale.y) ) {
         UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
         switch (e) {
         case eUnorderedRenderError:
@@ -695,15 +945,76 @@ TimeBufferReadPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &a
         }
     }
     // - when the buffer is locked and clean, the buffer's RoD is returned and it is unlocked
-    Coords::toCanonical(timeBuffer->bounds,
-                        timeBuffer->renderScale,
-                        timeBuffer->par,
+    Coords::toCanonical(frame.bounds,
+                        frame.renderScale,
+                        frame.par,
                         &rod);
     clearPersistentMessage();
 
     return true;
 } // TimeBufferReadPlugin::getRegionOfDefinition
 
+bool
+TimeBufferReadPlugin::getRegionOfDefinitionHistory(const RegionOfDefinitionArguments &args,
+                                                   TimeBuffer* timeBuffer,
+                                                   int frameOffset,
+                                                   OfxRectD &rod)
+{
+    const double writeTime = args.time - frameOffset;
+    int startFrame = _startFrame->getValue();
+
+    if (writeTime < startFrame) {
+        clearPersistentMessage();
+
+        return false; // use default behavior
+    }
+    AutoMutex guard(timeBuffer->mutex);
+    const TimeBufferFrame* frame = timeBuffer->findFrame(writeTime);
+    if (!frame) {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+            setPersistentMessage(Message::eMessageError, "", "The requested frame is not in the buffer history. Frames must be rendered in sequential order, and the History Size of TimeBufferWrite must be at least the Frame Offset.");
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return false;
+        case eUnorderedRenderBlack:
+
+            return false;     // use default behavior
+        case eUnorderedRenderLast:
+            frame = &timeBuffer->frames[timeBuffer->front];
+            break;
+        }
+    }
+    if ( (args.renderScale.x != frame->renderScale.x) || (args.renderScale.y != frame->renderScale.y) ) {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+        case eUnorderedRenderLast:
+            setPersistentMessage(Message::eMessageError, "", "Frames must be rendered in sequential order with the same renderScale");
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return false;
+        case eUnorderedRenderBlack:
+            clearPersistentMessage();
+
+            return false;
+        }
+    }
+    if ( frame->isEmpty() ) {
+        clearPersistentMessage();
+
+        return false;
+    }
+    Coords::toCanonical(frame->bounds,
+                        frame->renderScale,
+                        frame->par,
+                        &rod);
+    clearPersistentMessage();
+
+    return true;
+} // TimeBufferReadPlugin::getRegionOfDefinitionHistory
+
 void
 TimeBufferReadPlugin::changedParam(const InstanceChangedArgs & /*args*/,
                                    const std::string &paramName)
@@ -714,6 +1025,12 @@ TimeBufferReadPlugin::changedParam(const InstanceChangedArgs & /*args*/,
         _sublabel->setValue(name);
         // check if a TimeBufferRead with the same name exists. If yes, issue an error, else clearPersistentMeassage()
         setName(name);
+    } else if (paramName == kParamFrameOffset) {
+        // the instance may become the owner of the buffer, or a history reader
+        std::string name;
+        _bufferName->getValue(name);
+        setName("");
+        setName(name);
     } else if (paramName == kParamReset) {
         TimeBuffer* timeBuffer = 0;
         // * if the write instance does not exist, an error is displayed and render fails
@@ -725,15 +1042,7 @@ TimeBufferReadPlugin::changedParam(const InstanceChangedArgs & /*args*/,
         }
         // reset the buffer to a clean state
         AutoMutex guard(timeBuffer->mutex);
-        timeBuffer->time = -DBL_MAX;
-        timeBuffer->dirty = true;
-        timeBuffer->pixelComponents = ePixelComponentNone;
-        timeBuffer->pixelComponentCount = 0;
-        timeBuffer->bitDepth = eBitDepthNone;
-        timeBuffer->rowBytes = 0;
-        timeBuffer->par = 1.;
-        timeBuffer->bounds.x1 = timeBuffer->bounds.y1 = timeBuffer->bounds.x2 = timeBuffer->bounds.y2 = 0;
-        timeBuffer->renderScale.x = timeBuffer->renderScale.y = 1;
+        timeBuffer->reset();
         _resetTrigger->setValue( !_resetTrigger->getValue() ); // trigger a render
     } else if (paramName == kParamInfo) {
         // give information about allocated buffers
@@ -826,6 +1135,18 @@ TimeBufferReadPluginFactory::describeInContext(ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamFrameOffset);
+        param->setLabel(kParamFrameOffsetLabel);
+        param->setHint(kParamFrameOffsetHint);
+        param->setRange(1, kParamHistorySizeMax);
+        param->setDisplayRange(1, 8);
+        param->setDefault(1);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamUnorderedRender);
         param->setLabel(kParamUnorderedRenderLabel);
@@ -920,6 +1241,7 @@ public:
         , _srcClip(NULL)
         , _syncClip(NULL)
         , _bufferName(NULL)
+        , _historySize(NULL)
         , _resetTrigger(NULL)
         , _sublabel(NULL)
         , _buffer(NULL)
@@ -944,9 +1266,10 @@ public:
         assert(_syncClip && _syncClip->getPixelComponents() == ePixelComponentRGBA);
 
         _bufferName = fetchStringParam(kParamBufferName);
+        _historySize = fetchIntParam(kParamHistorySize);
         _resetTrigger = fetchBooleanParam(kParamResetTrigger);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
-        assert(_bufferName && _sublabel);
+        assert(_bufferName && _historySize && _sublabel);
         std::string name;
         _bufferName->getValue(name);
         setName(name);
@@ -985,13 +1308,13 @@ private:
                 // we may free this buffer
                 {
                     AutoMutex guard( gTimeBufferMapMutex.get() );
-                    gTimeBufferMap->erase(_name);
+                    gTimeBufferMap->erase(_projectId + '.' + _groupId + '.' + _name);
                 }
                 delete _buffer;
-                _buffer = 0;
-                _name.clear();
             }
+            _buffer = 0;
         }
+        _name.clear();
         if (!name.empty() && !_buffer) {
             TimeBuffer* timeBuffer = 0;
             {
@@ -1123,6 +1446,7 @@ private:
     Clip *_srcClip;
     Clip *_syncClip;
     StringParam *_bufferName;
+    IntParam *_historySize;
     BooleanParam *_resetTrigger;
     StringParam *_sublabel;
     TimeBuffer *_buffer; // associated TimeBuffer
@@ -1197,17 +1521,58 @@ TimeBufferWritePlugin::render(const RenderArguments &args)
             setPersistentMessage(Message::eMessageError, "", "The TimeBuffer has wrong properties. Check that the corresponding TimeBufferRead effect is connected to the Sync input.");
             throwSuiteStatusException(kOfxStatFailed);
         }
-        // - src is copied to the buffer, and it is marked as not dirty, then unlocked
-        std::vector<unsigned char> pixelData;
-        timeBuffer->bounds = args.renderWindow;
-        timeBuffer->pixelComponents = src->getPixelComponents();
-        timeBuffer->pixelComponentCount = src->getPixelComponentCount();
-        timeBuffer->bitDepth = src->getPixelDepth();
-        timeBuffer->rowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * timeBuffer->pixelComponentCount * sizeof(float);
-        timeBuffer->renderScale = args.renderScale;
-        timeBuffer->par = src->getPixelAspectRatio();
-        timeBuffer->pixelData.resize( (size_t)timeBuffer->rowBytes * (args.renderWindow.y2 - args.renderWindow.y1) );
-        copyPixels(*this, args.renderWindow, args.renderScale, src.get(), &timeBuffer->pixelData.front(), timeBuffer->bounds, timeBuffer->pixelComponents, timeBuffer->pixelComponentCount, timeBuffer->bitDepth, timeBuffer->rowBytes);
+        const std::size_t frameCount = (std::size_t)_historySize->getValue() + 1;
+        const int rowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * src->getPixelComponentCount() * sizeof(float);
+        const std::size_t dataSize = (std::size_t)rowBytes * (args.renderWindow.y2 - args.renderWindow.y1);
+        // - if the frame size grew or History Size changed, the slab is reallocated once no frame is being read, and the history is lost
+        // - the back frame is the oldest frame in the ring: wait until it is not being read by a TimeBufferRead
+        int delay = 1; // initial delay, in milliseconds
+        for (;;) {
+            bool realloc = (timeBuffer->frames.size() != frameCount) || (timeBuffer->frameBytes < dataSize);
+            if ( realloc ? !timeBuffer->isReadingAny() : (timeBuffer->frames[(timeBuffer->front + 1) % timeBuffer->frames.size()].readers == 0) ) {
+                if (realloc) {
+                    timeBuffer->frameBytes = (std::max)(timeBuffer->frameBytes, dataSize);
+                    timeBuffer->slab.resize(timeBuffer->frameBytes * frameCount);
+                    timeBuffer->frames.assign( frameCount, TimeBufferFrame() );
+                    for (std::size_t i = 0; i < frameCount; ++i) {
+                        timeBuffer->frames[i].dataOffset = i * timeBuffer->frameBytes;
+                    }
+                    timeBuffer->front = (int)frameCount - 1;
+                }
+                break;
+            }
+            guard.unlock();
+            sleep(delay);
+            if ( abort() ) {
+                return;
+            }
+            delay = (std::min)(delay * 2, 100);
+            guard.relock();
+        }
+        const int back = (timeBuffer->front + 1) % (int)timeBuffer->frames.size();
+        TimeBufferFrame& frame = timeBuffer->frames[back];
+        frame.reset(); // the frame is not valid while it is being written
+        // - the buffer is unlocked, and src is copied to the back frame (the other frames may still be read by TimeBufferRead)
+        guard.unlock();
+        if (dataSize > 0) {
+            copyPixels(*this, args.renderWindow, args.renderScale, src.get(), &timeBuffer->slab[frame.dataOffset], args.renderWindow, src->getPixelComponents(), src->getPixelComponentCount(), src->getPixelDepth(), rowBytes);
+        }
+        // - the buffer is re-locked, the back frame becomes the front frame, and the buffer is marked as not dirty, then unlocked
+        guard.relock();
+        if ( (timeBuffer->time != time + 1) || !timeBuffer->dirty ) {
+            // the buffer was reset while copying
+            setPersistentMessage(Message::eMessageError, "", "The TimeBuffer was reset while rendering.");
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        frame.writeTime = time;
+        frame.bounds = args.renderWindow;
+        frame.pixelComponents = src->getPixelComponents();
+        frame.pixelComponentCount = src->getPixelComponentCount();
+        frame.bitDepth = src->getPixelDepth();
+        frame.rowBytes = rowBytes;
+        frame.renderScale = args.renderScale;
+        frame.par = src->getPixelAspectRatio();
+        timeBuffer->front = back;
         timeBuffer->dirty = false;
     }
     // - src is also copied to output.
@@ -1244,15 +1609,7 @@ TimeBufferWritePlugin::changedParam(const InstanceChangedArgs & /*args*/,
 
             return;
         }
-        timeBuffer->time = -DBL_MAX;
-        timeBuffer->dirty = true;
-        timeBuffer->pixelComponents = ePixelComponentNone;
-        timeBuffer->pixelComponentCount = 0;
-        timeBuffer->bitDepth = eBitDepthNone;
-        timeBuffer->rowBytes = 0;
-        timeBuffer->par = 1.;
-        timeBuffer->bounds.x1 = timeBuffer->bounds.y1 = timeBuffer->bounds.x2 = timeBuffer->bounds.y2 = 0;
-        timeBuffer->renderScale.x = timeBuffer->renderScale.y = 1;
+        timeBuffer->reset();
         _resetTrigger->setValue( !_resetTrigger->getValue() ); // trigger a render
     } else if (paramName == kParamInfo) {
         // give information about allocated buffers
@@ -1338,6 +1695,18 @@ TimeBufferWritePluginFactory::describeInContext(ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamHistorySize);
+        param->setLabel(kParamHistorySizeLabel);
+        param->setHint(kParamHistorySizeHint);
+        param->setRange(1, kParamHistorySizeMax);
+        param->setDisplayRange(1, 8);
+        param->setDefault(1);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamReset);
         param->setLabel(kParamResetLabel);
@@ -32,20 +32,7 @@
 #include "ofxsCoords.h"
 #include "ofxsThreadSuite.h"
 #include "ofxsMultiThread.h"
-#ifdef OFX_USE_MULTITHREAD_MUTEX
-namespace {
-typedef MultiThread::Mutex Mutex;
-typedef MultiThread::AutoMutex AutoMutex;
-}
-#else
-// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
-// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
-#include "fast_mutex.h"
-namespace {
-typedef tthread::fast_mutex Mutex;
-typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
-}
-#endif
+#include "ofxsReduction.h"
 
 using namespace OFX;
 
@@ -61,8 +48,13 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "Canceling a tracking operation will not wipe all the data analysed so far. If you resume a previously canceled tracking, " \
     "the tracker will continue tracking, picking up the previous/next frame as reference. "
 #define kPluginIdentifier "net.sf.openfx.TrackerPM"
+// History:
+// version 1.0: initial version
+// version 1.1: SSD, NCC and ZNCC scores are computed from correlation terms and summed-area tables
+// version 1.2: add coarse-to-fine search (Pyramid Levels)
+// version 1.3: when tracking a range, each frame is fetched once
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 3 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -79,6 +71,13 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamScoreOptionNCC "NCC", "Normalized Cross-Correlation", "ncc"
 #define kParamScoreOptionZNCC "ZNCC", "Zero-mean Normalized Cross-Correlation, less sensitive to illumination changes", "zncc"
 
+#define kParamPyramidLevels "pyramidLevels"
+#define kParamPyramidLevelsLabel "Pyramid Levels"
+#define kParamPyramidLevelsHint "Number of resolution levels used for the search. With 1 level, the search is exhaustive over the whole search area at full resolution. " \
+    "With more levels, the exhaustive search is done on images downscaled by a factor of 2 per level, and the match is then refined at each finer level " \
+    "around the position found at the previous level. This is much faster for large search areas, but may miss small or thin patterns. " \
+    "Levels where the pattern would be smaller than 8 pixels are not used."
+
 
 enum TrackerScoreEnum
 {
@@ -89,6 +88,30 @@ enum TrackerScoreEnum
 };
 
 class TrackerPMProcessorBase;
+
+// The images kept from one tracking step to the next by trackRange(), so that each frame is fetched once:
+// the other image of a step is the reference image of the next step (unless a reference frame is set),
+// and the reference image and mask are kept while the reference frame does not change.
+struct TrackerPMImages
+{
+    auto_ptr<const Image> ref;
+    OfxTime refTime;
+    auto_ptr<const Image> mask;
+    OfxTime maskTime;
+    auto_ptr<const Image> other;
+    OfxTime otherTime;
+
+    TrackerPMImages()
+        : ref()
+        , refTime(0.)
+        , mask()
+        , maskTime(0.)
+        , other()
+        , otherTime(0.)
+    {
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class TrackerPMPlugin
@@ -99,6 +122,7 @@ public:
     TrackerPMPlugin(OfxImageEffectHandle handle)
         : GenericTrackerPlugin(handle)
         , _score(NULL)
+        , _pyramidLevels(NULL)
         , _center(NULL)
         , _offset(NULL)
         , _referenceFrame(NULL)
@@ -113,7 +137,8 @@ public:
         _maskClip = fetchClip(getContext() == eContextPaint ? "Brush" : "Mask");
         assert(!_maskClip || !_maskClip->isConnected() || _maskClip->getPixelComponents() == ePixelComponentAlpha);
         _score = fetchChoiceParam(kParamScore);
-        assert(_score);
+        _pyramidLevels = fetchIntParam(kParamPyramidLevels);
+        assert(_score && _pyramidLevels);
 
         _center = fetchDouble2DParam(kParamTrackingCenterPoint);
         _offset = fetchDouble2DParam(kParamTrackingOffset);
@@ -137,7 +162,10 @@ private:
     virtual void trackRange(const TrackArguments& args);
 
     template <int nComponents>
-    void trackInternal(OfxTime refTime, OfxTime otherTime, const TrackArguments& args);
+    void trackInternal(OfxTime refTime, OfxTime otherTime, const TrackArguments& args, TrackerPMImages* images);
+
+    // return true if img contains the part of the given canonical rectangle which is inside the source RoD
+    bool imageContains(const Image* img, OfxTime time, const OfxRectD& bounds);
 
     template <class PIX, int nComponents, int maxValue>
     void trackInternalForDepth(OfxTime refTime,
@@ -164,6 +192,7 @@ private:
 
     Clip *_maskClip;
     ChoiceParam* _score;
+    IntParam* _pyramidLevels;
     Double2DParam* _center;
     Double2DParam* _offset;
     IntParam* _referenceFrame;
@@ -176,6 +205,27 @@ private:
 };
 
 
+// the best match found in a part of the search window
+struct TrackerMatch
+{
+    OfxPointD point;
+    double score;
+
+    TrackerMatch()
+        : score( std::numeric_limits<double>::infinity() )
+    {
+        point.x = point.y = 0.;
+    }
+
+    // keep the first best match, as a sequential search would
+    void merge(const TrackerMatch &other)
+    {
+        if (other.score < score) {
+            *this = other;
+        }
+    }
+};
+
 class TrackerPMProcessorBase
     : public ImageProcessor
 {
@@ -183,8 +233,8 @@ protected:
     const Image *_otherImg;
     OfxRectI _refRectPixel;
     OfxPointI _refCenterI;
-    std::pair<OfxPointD, double> _bestMatch; //< the results for the current processor
-    Mutex _bestMatchMutex; //< this is used so we can multi-thread the tracking and protect the shared results
+    ThreadReduction<TrackerMatch> _matches; //< the results of each thread
+    TrackerMatch _bestMatch; //< the results for the current processor
 
 public:
     TrackerPMProcessorBase(ImageEffect &instance)
@@ -192,48 +242,180 @@ public:
         , _otherImg(NULL)
         , _refRectPixel()
         , _refCenterI()
+        , _matches()
+        , _bestMatch()
     {
-        _bestMatch.second = std::numeric_limits<double>::infinity();
     }
 
     virtual ~TrackerPMProcessorBase()
     {
     }
 
-    /** @brief set the processing parameters. return false if processing cannot be done. */
+    /** @brief set the processing parameters. return false if processing cannot be done.
+     * The search is done on a pyramid of the given number of levels (1 means an exhaustive search at full resolution).
+     * Must be called after setRenderWindow(), which gives the search window at full resolution. */
     virtual bool setValues(const Image *ref, const Image *other, const Image *mask,
-                           const OfxRectI& pattern, const OfxPointI& centeri) = 0;
+                           const OfxRectI& pattern, const OfxPointI& centeri, int levels) = 0;
 
     /**
-     * @brief Retrieves the results of the track. Must be called once process() returns so it is thread safe.
+     * @brief Merges the results of all threads. Must be called once process() returns.
      **/
-    const OfxPointD& getBestMatch() const { return _bestMatch.first; }
+    void reduceResults()
+    {
+        _matches.reduce(&_bestMatch);
+        refineResults();
+    }
+
+    /**
+     * @brief Retrieves the results of the track. Must be called once reduceResults() returns so it is thread safe.
+     **/
+    const OfxPointD& getBestMatch() const { return _bestMatch.point; }
+
+    double getBestScore() const { return _bestMatch.score; }
 
-    double getBestScore() const { return _bestMatch.second; }
+protected:
+    /**
+     * @brief Refines the match found by process() at the coarsest pyramid level down to full resolution.
+     **/
+    virtual void refineResults() = 0;
 };
 
 
-// The "masked", "filter" and "clamp" template parameters allow filter-specific optimization
-// by the compiler, using the same generic code for all filters.
+// Dot product of two contiguous rows, with independent accumulators so that the loop can be pipelined
+// or vectorized by the compiler.
+static inline double
+dotRow(const double *a,
+       const double *b,
+       int n)
+{
+    double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+    int j = 0;
+
+    for (; j + 4 <= n; j += 4) {
+        s0 += a[j] * b[j];
+        s1 += a[j + 1] * b[j + 1];
+        s2 += a[j + 2] * b[j + 2];
+        s3 += a[j + 3] * b[j + 3];
+    }
+    for (; j < n; ++j) {
+        s0 += a[j] * b[j];
+    }
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+// floor(a/2) and ceil(a/2) for negative numbers too
+static inline int
+floorHalf(int a)
+{
+    return (a >= 0) ? (a / 2) : -( (1 - a) / 2 );
+}
+
+static inline int
+ceilHalf(int a)
+{
+    return -floorHalf(-a);
+}
+
+// One level of the search pyramid: the pattern and the other image at a given resolution.
+// Level 0 is the full resolution, and each level has half the resolution of the previous one.
+struct TrackerPMLevel
+{
+    OfxRectI pattern; //< the pattern window, relative to the pattern center
+    int patternWidth;
+    int patternHeight;
+    OfxRectI search; //< the candidate positions of the pattern center in the other image
+    OfxRectI otherRect; //< the pixel rectangle of the other image covered by otherData
+    int otherWidth;
+    size_t otherPlaneSize;
+    auto_ptr<ImageMemory> kernelImg;
+    double *kernelData; //< the pattern (or pattern kernel) for each component, followed by the weight (or weight kernel)
+    auto_ptr<ImageMemory> otherBufImg;
+    double *otherData; //< the other image for each component, followed by its square for each component
+    auto_ptr<ImageMemory> satImg;
+    double *satData; //< the summed-area tables of the other image and of its square, if the weight is uniform
+    bool uniformWeight;
+    double weight; //< the weight, if it is uniform
+    double weightTotal;
+    double patternConstant; //< the term of the score that only depends on the pattern
+    double satTolerance; //< the rounding error of the summed-area tables
+
+    TrackerPMLevel()
+        : pattern()
+        , patternWidth(0)
+        , patternHeight(0)
+        , search()
+        , otherRect()
+        , otherWidth(0)
+        , otherPlaneSize(0)
+        , kernelImg()
+        , kernelData(NULL)
+        , otherBufImg()
+        , otherData(NULL)
+        , satImg()
+        , satData(NULL)
+        , uniformWeight(false)
+        , weight(0.)
+        , weightTotal(0.)
+        , patternConstant(0.)
+        , satTolerance(0.)
+    {
+    }
+
+    size_t patternSize() const { return (size_t)patternWidth * patternHeight; }
+
+    // set the pattern and search windows, and compute the area of the other image covered by the search
+    // (plus one pixel for the subpixel refinement)
+    void setWindows(const OfxRectI& patternWindow,
+                    const OfxRectI& searchWindow)
+    {
+        pattern = patternWindow;
+        patternWidth = pattern.x2 - pattern.x1;
+        patternHeight = pattern.y2 - pattern.y1;
+        search = searchWindow;
+        otherRect.x1 = (search.x1 - 1) + pattern.x1;
+        otherRect.x2 = (search.x2 + 1) + (pattern.x2 - 1);
+        otherRect.y1 = (search.y1 - 1) + pattern.y1;
+        otherRect.y2 = (search.y2 + 1) + (pattern.y2 - 1);
+        otherWidth = otherRect.x2 - otherRect.x1;
+        otherPlaneSize = (size_t)otherWidth * (otherRect.y2 - otherRect.y1);
+    }
+};
+
+#define kTrackerPMLevelsMax 4
+#define kTrackerPMLevelsMinPatternSize 8 // the pattern must be at least this size at the coarsest level
+#define kTrackerPMLevelsRefineRadius 2 // the search radius at the finer levels
+#define kTrackerPMLevelsRefineIterations 8 // the maximum number of times the search window is moved at each finer level
+
+// The SSD, NCC and ZNCC scores are computed from a constant term, which only depends on the pattern,
+// a cross-correlation term between the pattern and the other image, and the (weighted) sums of
+// the other image values and of their squares over the candidate window:
+// - SSD: sum(w^2.(R-O)^2) = sum(w^2.R^2) - 2.sum(w^2.R.O) + sum(w^2.O^2)
+// - NCC: -sum(w.R.O) / sqrt(sum(w.O^2))
+// - ZNCC: -sum(w.(R-Rmean).O) / sqrt(sum(w.O^2) - sum(w.O)^2/sum(w))
+// The other image is first copied to a contiguous buffer covering the search area, with the nearest
+// pixel outside of the image, so that each term is a dot product of contiguous rows.
+// If the pattern weight is uniform (no mask), the window sums are computed from summed-area tables.
+// SAD is computed directly from the same buffers.
+//
+// With several pyramid levels, the exhaustive search is done at the coarsest level only, and the best
+// match is then refined at each finer level within a small window around the position found at the
+// previous level.
 template <class PIX, int nComponents, int maxValue, TrackerScoreEnum scoreType>
 class TrackerPMProcessor
     : public TrackerPMProcessorBase
 {
 protected:
-    auto_ptr<ImageMemory> _patternImg;
-    PIX *_patternData;
-    auto_ptr<ImageMemory> _weightImg;
-    float *_weightData;
-    double _weightTotal;
+    static const int scoreComps = (nComponents < 3) ? nComponents : 3; ///we're not interested in the alpha channel for RGBA images
+    TrackerPMLevel _levels[kTrackerPMLevelsMax];
+    int _nLevels;
+    int _level; //< the level searched by process()
 
 public:
     TrackerPMProcessor(ImageEffect &instance)
         : TrackerPMProcessorBase(instance)
-        , _patternImg()
-        , _patternData(NULL)
-        , _weightImg()
-        , _weightData(NULL)
-        , _weightTotal(0.)
+        , _nLevels(0)
+        , _level(0)
     {
     }
 
@@ -247,64 +429,275 @@ private:
                            const Image *other,
                            const Image *mask,
                            const OfxRectI& pattern,
-                           const OfxPointI& centeri) OVERRIDE FINAL
+                           const OfxPointI& centeri,
+                           int levels) OVERRIDE FINAL
     {
-        size_t rowsize = pattern.x2 - pattern.x1;
-        size_t nPix = rowsize * (pattern.y2 - pattern.y1);
-
-
         // This happens if the pattern is empty. Most probably this is because it is totally outside the image
         // we better return quickly.
-        if (nPix == 0) {
+        if ( (pattern.x2 <= pattern.x1) || (pattern.y2 <= pattern.y1) ) {
             return false;
         }
 
-        _patternImg.reset( new ImageMemory(sizeof(PIX) * nComponents * nPix, &_effect) );
-        _weightImg.reset( new ImageMemory(sizeof(float) * nPix, &_effect) );
         _otherImg = other;
         _refRectPixel = pattern;
         _refCenterI = centeri;
 
-        _patternData = (PIX*)_patternImg->lock();
-        _weightData = (float*)_weightImg->lock();
+        // build the pyramid: stop when the pattern becomes too small to be matched
+        _nLevels = 1;
+        _levels[0].setWindows(pattern, _renderWindow);
+        extractPattern(ref, mask, &_levels[0]);
+        extractOther(&_levels[0]);
+        levels = (std::max)( 1, (std::min)(levels, kTrackerPMLevelsMax) );
+        while (_nLevels < levels) {
+            const TrackerPMLevel &src = _levels[_nLevels - 1];
+            OfxRectI patternWindow = {floorHalf(src.pattern.x1), floorHalf(src.pattern.y1), ceilHalf(src.pattern.x2), ceilHalf(src.pattern.y2)};
+            if ( (patternWindow.x2 - patternWindow.x1 < kTrackerPMLevelsMinPatternSize) ||
+                 (patternWindow.y2 - patternWindow.y1 < kTrackerPMLevelsMinPatternSize) ) {
+                break;
+            }
+            OfxRectI searchWindow = {floorHalf(src.search.x1), floorHalf(src.search.y1), ceilHalf(src.search.x2), ceilHalf(src.search.y2)};
+            TrackerPMLevel &dst = _levels[_nLevels];
+            dst.setWindows(patternWindow, searchWindow);
+            downsamplePattern(src, &dst);
+            downsampleOther(src, &dst);
+            ++_nLevels;
+        }
+        for (int l = 0; l < _nLevels; ++l) {
+            if ( !prepareLevel(&_levels[l]) ) {
+                return false;
+            }
+        }
 
-        // sliding pointers
-        long patternIdx = 0; // sliding index
-        PIX *patternPtr = _patternData;
-        float *weightPtr = _weightData;
-        _weightTotal = 0.;
+        // process() does the exhaustive search at the coarsest level
+        _level = _nLevels - 1;
+        if (_level > 0) {
+            const OfxPointD rsOne = {1., 1.};
+            setRenderWindow(_levels[_level].search, rsOne);
+        }
 
-        // extract ref and mask
-        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                PIX *refPix = (PIX*) ref->getPixelAddress(_refCenterI.x + j, _refCenterI.y + i);
+        return true;
+    } // setValues
 
+    // extract the pattern and its weight from the reference image and the mask
+    void extractPattern(const Image *ref,
+                        const Image *mask,
+                        TrackerPMLevel *level)
+    {
+        size_t nPix = level->patternSize();
+
+        level->kernelImg.reset( new ImageMemory(sizeof(double) * (scoreComps + 1) * nPix, &_effect) );
+        level->kernelData = (double*)level->kernelImg->lock();
+        double *weightData = level->kernelData + scoreComps * nPix;
+
+        for (int i = 0; i < level->patternHeight; ++i) {
+            for (int j = 0; j < level->patternWidth; ++j) {
+                size_t patternIdx = (size_t)i * level->patternWidth + j;
+                int refx = _refCenterI.x + level->pattern.x1 + j;
+                int refy = _refCenterI.y + level->pattern.y1 + i;
+                const PIX *refPix = (const PIX*) ref->getPixelAddress(refx, refy);
+                float weight;
                 if (!refPix) {
                     // no reference pixel, set weight to 0
-                    *weightPtr = 0.f;
-                    for (int c = 0; c < nComponents; ++c) {
-                        patternPtr[c] = PIX();
-                    }
+                    weight = 0.f;
+                } else if (!mask) {
+                    // no mask, weight is uniform
+                    weight = 1.f;
                 } else {
-                    if (!mask) {
-                        // no mask, weight is uniform
-                        *weightPtr = 1.f;
-                    } else {
-                        PIX *maskPix = (PIX*) mask->getPixelAddress(_refCenterI.x + j, _refCenterI.y + i);
-                        // weight is zero if there's a mask but we're outside of it
-                        *weightPtr = maskPix ? (*maskPix / (float)maxValue) : 0.f;
+                    const PIX *maskPix = (const PIX*) mask->getPixelAddress(refx, refy);
+                    // weight is zero if there's a mask but we're outside of it
+                    weight = maskPix ? (*maskPix / (float)maxValue) : 0.f;
+                }
+                weightData[patternIdx] = weight;
+                for (int c = 0; c < scoreComps; ++c) {
+                    level->kernelData[c * nPix + patternIdx] = refPix ? (double)refPix[c] : 0.;
+                }
+            }
+        }
+    }
+
+    // copy the other image over the search area, taking the nearest pixel outside of the image
+    // (more chance to get a track than with black)
+    void extractOther(TrackerPMLevel *level)
+    {
+        level->otherBufImg.reset( new ImageMemory(sizeof(double) * 2 * scoreComps * level->otherPlaneSize, &_effect) );
+        level->otherData = (double*)level->otherBufImg->lock();
+        const OfxRectI &otherBounds = _otherImg->getBounds();
+        for (int y = level->otherRect.y1; y < level->otherRect.y2; ++y) {
+            int othery = (std::max)( otherBounds.y1, (std::min)(y, otherBounds.y2 - 1) );
+            double *otherPtr = level->otherData + (size_t)(y - level->otherRect.y1) * level->otherWidth;
+            for (int x = level->otherRect.x1; x < level->otherRect.x2; ++x, ++otherPtr) {
+                int otherx = (std::max)( otherBounds.x1, (std::min)(x, otherBounds.x2 - 1) );
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                assert(otherPix);
+                for (int c = 0; c < scoreComps; ++c) {
+                    otherPtr[c * level->otherPlaneSize] = otherPix ? (double)otherPix[c] : 0.;
+                }
+            }
+        }
+    }
+
+    // the pattern at half resolution: the weight is averaged, and each component is the weighted average
+    void downsamplePattern(const TrackerPMLevel &src,
+                           TrackerPMLevel *dst)
+    {
+        size_t srcPix = src.patternSize();
+        size_t nPix = dst->patternSize();
+
+        dst->kernelImg.reset( new ImageMemory(sizeof(double) * (scoreComps + 1) * nPix, &_effect) );
+        dst->kernelData = (double*)dst->kernelImg->lock();
+        const double *srcWeight = src.kernelData + scoreComps * srcPix;
+        double *weightData = dst->kernelData + scoreComps * nPix;
+        for (int i = dst->pattern.y1; i < dst->pattern.y2; ++i) {
+            for (int j = dst->pattern.x1; j < dst->pattern.x2; ++j) {
+                size_t patternIdx = (size_t)(i - dst->pattern.y1) * dst->patternWidth + (j - dst->pattern.x1);
+                double weight = 0.;
+                double value[3] = {0., 0., 0.};
+                for (int si = 2 * i; si < 2 * i + 2; ++si) {
+                    for (int sj = 2 * j; sj < 2 * j + 2; ++sj) {
+                        if ( (src.pattern.x1 <= sj) && (sj < src.pattern.x2) && (src.pattern.y1 <= si) && (si < src.pattern.y2) ) {
+                            size_t srcIdx = (size_t)(si - src.pattern.y1) * src.patternWidth + (sj - src.pattern.x1);
+                            double w = srcWeight[srcIdx];
+                            weight += w;
+                            for (int c = 0; c < scoreComps; ++c) {
+                                value[c] += w * src.kernelData[c * srcPix + srcIdx];
+                            }
+                        }
                     }
-                    for (int c = 0; c < nComponents; ++c) {
-                        patternPtr[c] = refPix[c];
+                }
+                weightData[patternIdx] = weight / 4;
+                for (int c = 0; c < scoreComps; ++c) {
+                    dst->kernelData[c * nPix + patternIdx] = (weight > 0.) ? (value[c] / weight) : 0.;
+                }
+            }
+        }
+    }
+
+    // the other image at half resolution, taking the nearest pixel outside of the source area
+    void downsampleOther(const TrackerPMLevel &src,
+                         TrackerPMLevel *dst)
+    {
+        dst->otherBufImg.reset( new ImageMemory(sizeof(double) * 2 * scoreComps * dst->otherPlaneSize, &_effect) );
+        dst->otherData = (double*)dst->otherBufImg->lock();
+        for (int y = dst->otherRect.y1; y < dst->otherRect.y2; ++y) {
+            double *otherPtr = dst->otherData + (size_t)(y - dst->otherRect.y1) * dst->otherWidth;
+            for (int x = dst->otherRect.x1; x < dst->otherRect.x2; ++x, ++otherPtr) {
+                double value[3] = {0., 0., 0.};
+                for (int sy = 2 * y; sy < 2 * y + 2; ++sy) {
+                    int srcy = (std::max)( src.otherRect.y1, (std::min)(sy, src.otherRect.y2 - 1) );
+                    for (int sx = 2 * x; sx < 2 * x + 2; ++sx) {
+                        int srcx = (std::max)( src.otherRect.x1, (std::min)(sx, src.otherRect.x2 - 1) );
+                        size_t srcIdx = (size_t)(srcy - src.otherRect.y1) * src.otherWidth + (srcx - src.otherRect.x1);
+                        for (int c = 0; c < scoreComps; ++c) {
+                            value[c] += src.otherData[c * src.otherPlaneSize + srcIdx];
+                        }
                     }
                 }
-                _weightTotal += *weightPtr;
+                for (int c = 0; c < scoreComps; ++c) {
+                    otherPtr[c * dst->otherPlaneSize] = value[c] / 4;
+                }
             }
         }
+    }
 
-        return (_weightTotal > 0);
-    } // setValues
+    // compute the pattern kernels, the squares of the other image and the summed-area tables.
+    // Returns false if the total weight of the pattern is zero.
+    bool prepareLevel(TrackerPMLevel *level)
+    {
+        size_t nPix = level->patternSize();
+        double *weightData = level->kernelData + scoreComps * nPix;
+
+        level->weightTotal = 0.;
+        level->uniformWeight = true;
+        level->weight = weightData[0];
+        double refMean[3] = {0., 0., 0.};
+        for (size_t p = 0; p < nPix; ++p) {
+            double weight = weightData[p];
+            if (weight != level->weight) {
+                level->uniformWeight = false;
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                refMean[c] += weight * level->kernelData[c * nPix + p];
+            }
+            level->weightTotal += weight;
+        }
+        if ( !(level->weightTotal > 0) ) {
+            return false;
+        }
+        for (int c = 0; c < scoreComps; ++c) {
+            refMean[c] /= level->weightTotal;
+        }
+
+        // compute the pattern kernels, and the weight kernel
+        level->patternConstant = 0.;
+        for (size_t p = 0; p < nPix; ++p) {
+            double weight = weightData[p];
+            for (int c = 0; c < scoreComps; ++c) {
+                double &k = level->kernelData[c * nPix + p];
+                switch (scoreType) {
+                case eTrackerSSD:
+                    // reference is squared in SSD, so is the weight
+                    level->patternConstant += weight * weight * k * k;
+                    k *= weight * weight;
+                    break;
+                case eTrackerSAD:
+                    break;
+                case eTrackerNCC:
+                    k *= weight;
+                    break;
+                case eTrackerZNCC:
+                    k = weight * (k - refMean[c]);
+                    break;
+                }
+            }
+            if (scoreType == eTrackerSSD) {
+                weightData[p] = weight * weight;
+            }
+        }
+
+        // the squares of the other image
+        for (int c = 0; c < scoreComps; ++c) {
+            const double *src = level->otherData + c * level->otherPlaneSize;
+            double *dst = level->otherData + (scoreComps + c) * level->otherPlaneSize;
+            for (size_t i = 0; i < level->otherPlaneSize; ++i) {
+                dst[i] = src[i] * src[i];
+            }
+        }
+
+        // compute the summed-area tables of the other image and its square
+        level->satData = NULL;
+        level->satTolerance = 0.;
+        if ( level->uniformWeight && (scoreType != eTrackerSAD) ) {
+            int otherHeight = level->otherRect.y2 - level->otherRect.y1;
+            size_t satRowSize = level->otherWidth + 1;
+            size_t satPlaneSize = satRowSize * (otherHeight + 1);
+            level->satImg.reset( new ImageMemory(sizeof(double) * 2 * scoreComps * satPlaneSize, &_effect) );
+            level->satData = (double*)level->satImg->lock();
+            for (int plane = 0; plane < 2 * scoreComps; ++plane) {
+                const double *src = level->otherData + plane * level->otherPlaneSize;
+                double *sat = level->satData + plane * satPlaneSize;
+                std::fill(sat, sat + satRowSize, 0.);
+                for (int y = 0; y < otherHeight; ++y) {
+                    const double *srcRow = src + (size_t)y * level->otherWidth;
+                    const double *prevRow = sat + (size_t)y * satRowSize;
+                    double *satRow = sat + (size_t)(y + 1) * satRowSize;
+                    double rowSum = 0.;
+                    satRow[0] = 0.;
+                    for (int x = 0; x < level->otherWidth; ++x) {
+                        rowSum += srcRow[x];
+                        satRow[x + 1] = prevRow[x + 1] + rowSum;
+                    }
+                }
+                if (plane >= scoreComps) {
+                    // the tables of squares have the largest values
+                    level->satTolerance += 16. * DBL_EPSILON * sat[satPlaneSize - 1];
+                }
+            }
+            // the sums of squares are scaled as in computeScore(): by the squared weight in SSD, by the weight otherwise
+            level->satTolerance *= (scoreType == eTrackerSSD) ? (level->weight * level->weight) : level->weight;
+        }
+
+        return true;
+    } // prepareLevel
 
     void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
     {
@@ -324,88 +717,105 @@ private:
         }
     }
 
+    // sum of a plane of the other image over the window of the pattern at (x,y), using the summed-area table
+    static double boxSum(const TrackerPMLevel &level,
+                         int plane,
+                         int x,
+                         int y)
+    {
+        size_t satRowSize = level.otherWidth + 1;
+        size_t satPlaneSize = satRowSize * (level.otherRect.y2 - level.otherRect.y1 + 1);
+        const double *sat = level.satData + plane * satPlaneSize;
+        size_t x1 = x + level.pattern.x1 - level.otherRect.x1;
+        size_t y1 = y + level.pattern.y1 - level.otherRect.y1;
+        size_t x2 = x1 + level.patternWidth;
+        size_t y2 = y1 + level.patternHeight;
+
+        return (sat[y2 * satRowSize + x2] - sat[y1 * satRowSize + x2]) - (sat[y2 * satRowSize + x1] - sat[y1 * satRowSize + x1]);
+    }
+
     template<enum TrackerScoreEnum scoreTypeE>
-    double computeScore(int x,
-                        int y,
-                        const double refMean[3])
+    double computeScore(const TrackerPMLevel &level,
+                        int x,
+                        int y)
     {
-        double score = 0;
+        assert(level.otherRect.x1 <= x + level.pattern.x1 && x + level.pattern.x2 <= level.otherRect.x2 &&
+               level.otherRect.y1 <= y + level.pattern.y1 && y + level.pattern.y2 <= level.otherRect.y2);
+        const size_t nPix = level.patternSize();
+        const double *weightData = level.kernelData + scoreComps * nPix;
+        const size_t otherOffset = (size_t)(y + level.pattern.y1 - level.otherRect.y1) * level.otherWidth + (x + level.pattern.x1 - level.otherRect.x1);
+        double score = 0.;
         double otherSsq = 0.;
-        double otherMean[3];
-        const int scoreComps = (std::min)(nComponents, 3);
-
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                otherMean[c] = 0;
-            }
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                    // take nearest pixel in other image (more chance to get a track than with black)
-                    int otherx = x + j;
-                    int othery = y + i;
-                    otherx = (std::max)( _otherImg->getBounds().x1, (std::min)(otherx, _otherImg->getBounds().x2 - 1) );
-                    othery = (std::max)( _otherImg->getBounds().y1, (std::min)(othery, _otherImg->getBounds().y2 - 1) );
-                    const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
-                    for (int c = 0; c < scoreComps; ++c) {
-                        otherMean[c] += *weightPtr * otherPix[c];
+        double tolerance = level.satTolerance;
+
+        for (int c = 0; c < scoreComps; ++c) {
+            const double *kernel = level.kernelData + c * nPix;
+            const double *other = level.otherData + c * level.otherPlaneSize + otherOffset;
+            const double *otherSq = level.otherData + (scoreComps + c) * level.otherPlaneSize + otherOffset;
+
+            if (scoreTypeE == eTrackerSAD) {
+                for (int i = 0; i < level.patternHeight; ++i) {
+                    const double *k = kernel + (size_t)i * level.patternWidth;
+                    const double *w = weightData + (size_t)i * level.patternWidth;
+                    const double *o = other + (size_t)i * level.otherWidth;
+                    for (int j = 0; j < level.patternWidth; ++j) {
+                        score += w[j] * std::abs(k[j] - o[j]);
                     }
                 }
+                continue;
             }
-            for (int c = 0; c < scoreComps; ++c) {
-                otherMean[c] /= _weightTotal;
-            }
-        }
-
-        // sliding pointers
-        long patternIdx = 0; // sliding index
-        const PIX *patternPtr = _patternData;
-        float *weightPtr = _weightData;
-
-        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                const PIX * const refPix = patternPtr;
-                const float weight = *weightPtr;
-
-                // take nearest pixel in other image (more chance to get a track than with black)
-                int otherx = x + j;
-                int othery = y + i;
-                otherx = (std::max)( _otherImg->getBounds().x1, (std::min)(otherx, _otherImg->getBounds().x2 - 1) );
-                othery = (std::max)( _otherImg->getBounds().y1, (std::min)(othery, _otherImg->getBounds().y2 - 1) );
-                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
 
-                ///the search window & pattern window have been intersected to the reference image's bounds
-                assert(refPix && otherPix);
-                for (int c = 0; c < scoreComps; ++c) {
-                    switch (scoreTypeE) {
-                    case eTrackerSSD:
-                        // reference is squared in SSD, so is the weight
-                        score += weight * weight * aggregateSD(refPix[c], otherPix[c]);
-                        break;
-                    case eTrackerSAD:
-                        score += weight * aggregateAD(refPix[c], otherPix[c]);
-                        break;
-                    case eTrackerNCC:
-                        score += weight * aggregateCC(refPix[c], otherPix[c]);
-                        otherSsq -= weight * aggregateCC(otherPix[c], otherPix[c]);
-                        break;
-                    case eTrackerZNCC:
-                        score += weight * aggregateNCC(refPix[c], refMean[c], otherPix[c], otherMean[c]);
-                        otherSsq -= weight * aggregateNCC(otherPix[c], otherMean[c], otherPix[c], otherMean[c]);
-                        break;
+            double cross = 0.;
+            double sum = 0.;
+            double sumSq = 0.;
+            for (int i = 0; i < level.patternHeight; ++i) {
+                const double *k = kernel + (size_t)i * level.patternWidth;
+                const double *o = other + (size_t)i * level.otherWidth;
+                cross += dotRow(k, o, level.patternWidth);
+                if (!level.uniformWeight) {
+                    const double *w = weightData + (size_t)i * level.patternWidth;
+                    if (scoreTypeE == eTrackerZNCC) {
+                        sum += dotRow(w, o, level.patternWidth);
                     }
+                    sumSq += dotRow(w, otherSq + (size_t)i * level.otherWidth, level.patternWidth);
+                }
+            }
+            if (level.uniformWeight) {
+                if (scoreTypeE == eTrackerZNCC) {
+                    sum = level.weight * boxSum(level, c, x, y);
                 }
+                sumSq = (scoreTypeE == eTrackerSSD ? level.weight * level.weight : level.weight) * boxSum(level, scoreComps + c, x, y);
+            } else {
+                tolerance += 16. * DBL_EPSILON * sumSq;
+            }
+            switch (scoreTypeE) {
+            case eTrackerSSD:
+                score += sumSq - 2. * cross;
+                otherSsq += sumSq;
+                break;
+            case eTrackerSAD:
+                break;
+            case eTrackerNCC:
+                score -= cross;
+                otherSsq += sumSq;
+                break;
+            case eTrackerZNCC:
+                score -= cross;
+                otherSsq += sumSq - sum * sum / level.weightTotal;
+                break;
+            }
+        }
+        if (scoreTypeE == eTrackerSSD) {
+            // a perfect match has a zero score, up to the rounding errors
+            score += level.patternConstant;
+            if ( score <= 16. * DBL_EPSILON * (level.patternConstant + otherSsq) ) {
+                score = 0.;
             }
         }
         if ( (scoreTypeE == eTrackerNCC) || (scoreTypeE == eTrackerZNCC) ) {
-            double sdev = std::sqrt( (std::max)(otherSsq, 0.) );
-            if (sdev != 0.) {
-                score /= sdev;
+            // the sum of squares is zero if the window is uniform, up to the rounding errors
+            if (otherSsq > tolerance) {
+                score /= std::sqrt(otherSsq);
             } else {
                 score = std::numeric_limits<double>::infinity();
             }
@@ -414,136 +824,144 @@ private:
         return score;
     } // computeScore
 
+    // find the best match within a window of candidate positions
     template<enum TrackerScoreEnum scoreTypeE>
-    void multiThreadProcessImagesForScore(const OfxRectI& procWindow, const OfxPointD& rs)
+    double searchWindow(const TrackerPMLevel &level,
+                        const OfxRectI &window,
+                        OfxPointI *point)
     {
-        unused(rs);
-        assert(rs.x == 1. && rs.y == 1.);
-        assert(_patternImg.get() && _patternData && _weightImg.get() && _weightData && _otherImg && _weightTotal > 0.);
-        assert(scoreType == scoreTypeE);
         double bestScore = std::numeric_limits<double>::infinity();
-        OfxPointI point;
-        point.x = -1;
-        point.y = -1;
-
-        ///For every pixel in the sub window of the search area we find the pixel
-        ///that minimize the sum of squared differences between the pattern in the ref image
-        ///and the pattern in the other image.
 
-        const int scoreComps = (std::min)(nComponents, 3);
-        double refMean[3];
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                refMean[c] = 0;
-            }
-        }
-        if (scoreTypeE == eTrackerZNCC) {
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                    const PIX *refPix = patternPtr;
-                    for (int c = 0; c < scoreComps; ++c) {
-                        refMean[c] += *weightPtr * refPix[c];
-                    }
-                }
-            }
-            for (int c = 0; c < scoreComps; ++c) {
-                refMean[c] /= _weightTotal;
-            }
-        }
-
-        ///we're not interested in the alpha channel for RGBA images
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+        for (int y = window.y1; y < window.y2; ++y) {
             if ( _effect.abort() ) {
                 break;
             }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                double score = computeScore<scoreTypeE>(x, y, refMean);
+            for (int x = window.x1; x < window.x2; ++x) {
+                double score = computeScore<scoreTypeE>(level, x, y);
                 if (score < bestScore) {
                     bestScore = score;
-                    point.x = x;
-                    point.y = y;
+                    point->x = x;
+                    point->y = y;
                 }
             }
         }
 
-        // do the subpixel refinement, only if the score is a possible winner
-        // TODO: only do this for the best match
+        return bestScore;
+    }
+
+    // compute the subpixel position of a match at full resolution, by fitting a parabola
+    // through the scores of the neighbors in each direction
+    template<enum TrackerScoreEnum scoreTypeE>
+    TrackerMatch subpixelMatch(const OfxPointI &point,
+                               double bestScore)
+    {
+        const TrackerPMLevel &level = _levels[0];
         double dx = 0.;
         double dy = 0.;
-
-        _bestMatchMutex.lock();
-        if (_bestMatch.second < bestScore) {
-            _bestMatchMutex.unlock();
-        } else {
-            // don't block other threads
-            _bestMatchMutex.unlock();
-            // compute subpixel position.
-            double scorepc = computeScore<scoreTypeE>(point.x - 1, point.y, refMean);
-            double scorenc = computeScore<scoreTypeE>(point.x + 1, point.y, refMean);
-            if ( (bestScore < scorepc) && (bestScore <= scorenc) ) {
-                // don't simplify the denominator in the following expression,
-                // 2*bestScore - scorenc - scorepc may cause an underflow.
-                double factor = 1. / ( (bestScore - scorenc) + (bestScore - scorepc) );
-                if (factor != 0.) {
-                    dx = 0.5 * (scorenc - scorepc) * factor;
-                    assert(-0.5 < dx && dx <= 0.5);
-                }
-            }
-            double scorecp = computeScore<scoreTypeE>(point.x, point.y - 1, refMean);
-            double scorecn = computeScore<scoreTypeE>(point.x, point.y + 1, refMean);
-            if ( (bestScore < scorecp) && (bestScore <= scorecn) ) {
-                // don't simplify the denominator in the following expression,
-                // 2*bestScore - scorenc - scorepc may cause an underflow.
-                double factor = 1. / ( (bestScore - scorecn) + (bestScore - scorecp) );
-                if (factor != 0.) {
-                    dy = 0.5 * (scorecn - scorecp) / ( (bestScore - scorecn) + (bestScore - scorecp) );
-                    assert(-0.5 < dy && dy <= 0.5);
-                }
+        double scorepc = computeScore<scoreTypeE>(level, point.x - 1, point.y);
+        double scorenc = computeScore<scoreTypeE>(level, point.x + 1, point.y);
+
+        if ( (bestScore < scorepc) && (bestScore <= scorenc) ) {
+            // don't simplify the denominator in the following expression,
+            // 2*bestScore - scorenc - scorepc may cause an underflow.
+            double factor = 1. / ( (bestScore - scorenc) + (bestScore - scorepc) );
+            if (factor != 0.) {
+                dx = 0.5 * (scorenc - scorepc) * factor;
+                assert(-0.5 < dx && dx <= 0.5);
             }
-            // check again...
-            {
-                AutoMutex lock(_bestMatchMutex);
-                if (_bestMatch.second > bestScore) {
-                    _bestMatch.second = bestScore;
-                    _bestMatch.first.x = point.x + dx;
-                    _bestMatch.first.y = point.y + dy;
-                }
+        }
+        double scorecp = computeScore<scoreTypeE>(level, point.x, point.y - 1);
+        double scorecn = computeScore<scoreTypeE>(level, point.x, point.y + 1);
+        if ( (bestScore < scorecp) && (bestScore <= scorecn) ) {
+            // don't simplify the denominator in the following expression,
+            // 2*bestScore - scorenc - scorepc may cause an underflow.
+            double factor = 1. / ( (bestScore - scorecn) + (bestScore - scorecp) );
+            if (factor != 0.) {
+                dy = 0.5 * (scorecn - scorecp) / ( (bestScore - scorecn) + (bestScore - scorecp) );
+                assert(-0.5 < dy && dy <= 0.5);
             }
         }
-    } // multiThreadProcessImagesForScore
+        TrackerMatch match;
+        match.score = bestScore;
+        match.point.x = point.x + dx;
+        match.point.y = point.y + dy;
 
-    double aggregateSD(PIX refPix,
-                       PIX otherPix)
-    {
-        double d = (double)refPix - otherPix;
-
-        return d * d;
+        return match;
     }
 
-    double aggregateAD(PIX refPix,
-                       PIX otherPix)
+    template<enum TrackerScoreEnum scoreTypeE>
+    void multiThreadProcessImagesForScore(const OfxRectI& procWindow, const OfxPointD& rs)
     {
-        return std::abs( (double)refPix - otherPix );
-    }
+        unused(rs);
+        assert(rs.x == 1. && rs.y == 1.);
+        assert(_otherImg && _levels[_level].kernelData && _levels[_level].otherData && _levels[_level].weightTotal > 0.);
+        assert(scoreType == scoreTypeE);
+        OfxPointI point;
+        point.x = -1;
+        point.y = -1;
 
-    double aggregateCC(PIX refPix,
-                       PIX otherPix)
-    {
-        return -(double)refPix * otherPix;
-    }
+        ///For every pixel in the sub window of the search area we find the pixel
+        ///that minimize the sum of squared differences between the pattern in the ref image
+        ///and the pattern in the other image.
+        double bestScore = searchWindow<scoreTypeE>(_levels[_level], procWindow, &point);
+
+        if ( bestScore != std::numeric_limits<double>::infinity() ) {
+            TrackerMatch match;
+            if (_level == 0) {
+                // do the subpixel refinement of the best match in this part of the search window
+                // TODO: only do this for the best match
+                match = subpixelMatch<scoreTypeE>(point, bestScore);
+            } else {
+                // the match is refined at the finer levels by refineResults()
+                match.score = bestScore;
+                match.point.x = point.x;
+                match.point.y = point.y;
+            }
+            _matches.add(procWindow.y1, match);
+        }
+    } // multiThreadProcessImagesForScore
 
-    double aggregateNCC(PIX refPix,
-                        double refMean,
-                        PIX otherPix,
-                        double otherMean)
+    virtual void refineResults() OVERRIDE FINAL
     {
-        return -(refPix - refMean) * (otherPix - otherMean);
+        if ( (_level == 0) || ( _bestMatch.score == std::numeric_limits<double>::infinity() ) ) {
+            return;
+        }
+        OfxPointI point;
+        point.x = (int)_bestMatch.point.x;
+        point.y = (int)_bestMatch.point.y;
+        double bestScore = _bestMatch.score;
+        for (int l = _level - 1; l >= 0 && !_effect.abort(); --l) {
+            const TrackerPMLevel &level = _levels[l];
+            // the match at the previous level covers 2x2 pixels at this level
+            OfxRectI window;
+            window.x1 = 2 * point.x - kTrackerPMLevelsRefineRadius;
+            window.x2 = 2 * point.x + 2 + kTrackerPMLevelsRefineRadius;
+            window.y1 = 2 * point.y - kTrackerPMLevelsRefineRadius;
+            window.y2 = 2 * point.y + 2 + kTrackerPMLevelsRefineRadius;
+            for (int i = 0; i < kTrackerPMLevelsRefineIterations; ++i) {
+                Coords::rectIntersection(window, level.search, &window);
+                bestScore = searchWindow<scoreType>(level, window, &point);
+                if ( bestScore == std::numeric_limits<double>::infinity() ) {
+                    _bestMatch = TrackerMatch();
+
+                    return;
+                }
+                // if the best match is on the border of the window, the minimum may be outside: move the window
+                bool onBorder = ( ( (point.x == window.x1) && (window.x1 > level.search.x1) ) ||
+                                  ( (point.x == window.x2 - 1) && (window.x2 < level.search.x2) ) ||
+                                  ( (point.y == window.y1) && (window.y1 > level.search.y1) ) ||
+                                  ( (point.y == window.y2 - 1) && (window.y2 < level.search.y2) ) );
+                if (!onBorder) {
+                    break;
+                }
+                window.x1 = point.x - kTrackerPMLevelsRefineRadius;
+                window.x2 = point.x + 1 + kTrackerPMLevelsRefineRadius;
+                window.y1 = point.y - kTrackerPMLevelsRefineRadius;
+                window.y2 = point.y + 1 + kTrackerPMLevelsRefineRadius;
+            }
+        }
+        _bestMatch = subpixelMatch<scoreType>(point, bestScore);
     }
 };
 
@@ -574,6 +992,7 @@ TrackerPMPlugin::trackRange(const TrackArguments& args)
     }
 
     bool enableRefFrame = _enableReferenceFrame->getValue();
+    TrackerPMImages images;
 
     while ( args.forward ? (t <= args.last) : (t >= args.last) ) {
         OfxTime refFrame;
@@ -589,12 +1008,12 @@ TrackerPMPlugin::trackRange(const TrackArguments& args)
                srcComponents == ePixelComponentAlpha);
 
         if (srcComponents == ePixelComponentRGBA) {
-            trackInternal<4>(refFrame, t, args);
+            trackInternal<4>(refFrame, t, args, &images);
         } else if (srcComponents == ePixelComponentRGB) {
-            trackInternal<3>(refFrame, t, args);
+            trackInternal<3>(refFrame, t, args, &images);
         } else {
             assert(srcComponents == ePixelComponentAlpha);
-            trackInternal<1>(refFrame, t, args);
+            trackInternal<1>(refFrame, t, args, &images);
         }
         if (args.forward) {
             ++t;
@@ -739,7 +1158,7 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
     // set the render window
     processor.setRenderWindow(trackSearchBoundsPixel, rsOne);
 
-    bool canProcess = processor.setValues(refImg, otherImg, maskImg, refRectPixel, refCenterI);
+    bool canProcess = processor.setValues( refImg, otherImg, maskImg, refRectPixel, refCenterI, _pyramidLevels->getValueAtTime(refTime) );
 
     if (!canProcess) {
         // can't track: erase any existing track
@@ -748,10 +1167,7 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
     } else {
         // Call the base class process member, this will call the derived templated process code
         processor.process();
-
-        //////////////////////////////////
-        // TODO: subpixel interpolation //
-        //////////////////////////////////
+        processor.reduceResults();
 
         ///ok the score is now computed, update the center
         if ( processor.getBestScore() == std::numeric_limits<double>::infinity() ) {
@@ -826,7 +1242,8 @@ template <int nComponents>
 void
 TrackerPMPlugin::trackInternal(OfxTime refTime,
                                OfxTime otherTime,
-                               const TrackArguments& args)
+                               const TrackArguments& args,
+                               TrackerPMImages* images)
 {
     OfxRectD refRect;
 
@@ -862,31 +1279,45 @@ TrackerPMPlugin::trackInternal(OfxTime refTime,
     OfxRectD otherBounds;
     getOtherBounds(prevTimeCenterWithOffset, searchRect, &otherBounds);
 
-    auto_ptr<const Image> srcRef( ( _srcClip && _srcClip->isConnected() ) ?
-                                       _srcClip->fetchImage(refTime, refBounds) : 0 );
-    auto_ptr<const Image> srcOther( ( _srcClip && _srcClip->isConnected() ) ?
-                                         _srcClip->fetchImage(otherTime, otherBounds) : 0 );
-    if ( !srcRef.get() || !srcOther.get() ) {
-        return;
-    }
-    // renderScale should never be something else than 1 when called from ActionInstanceChanged
-    if ( srcRef.get() ) {
-        checkBadRenderScale(srcRef, args);
-        checkRenderScaleOne(srcRef);
+    // reuse the images from the previous step if they contain the pattern
+    auto_ptr<const Image> &srcRef = images->ref;
+    if ( images->other.get() && (images->otherTime == refTime) && imageContains(images->other.get(), refTime, refBounds) ) {
+        srcRef.reset( images->other.release() );
+        images->refTime = refTime;
+    } else if ( !srcRef.get() || (images->refTime != refTime) || !imageContains(srcRef.get(), refTime, refBounds) ) {
+        srcRef.reset( ( _srcClip && _srcClip->isConnected() ) ?
+                      _srcClip->fetchImage(refTime, refBounds) : 0 );
+        images->refTime = refTime;
+        // renderScale should never be something else than 1 when called from ActionInstanceChanged
+        if ( srcRef.get() ) {
+            checkBadRenderScale(srcRef, args);
+            checkRenderScaleOne(srcRef);
+        }
     }
+    auto_ptr<const Image> &srcOther = images->other;
+    srcOther.reset( ( _srcClip && _srcClip->isConnected() ) ?
+                    _srcClip->fetchImage(otherTime, otherBounds) : 0 );
+    images->otherTime = otherTime;
     if ( srcOther.get() ) {
         checkBadRenderScale(srcOther, args);
         checkRenderScaleOne(srcOther);
     }
+    if ( !srcRef.get() || !srcOther.get() ) {
+        return;
+    }
 
     BitDepthEnum srcBitDepth = srcRef->getPixelDepth();
 
     //  mask cannot be black and transparent, so an empty mask means mask is disabled.
     // auto ptr for the mask.
-    auto_ptr<const Image> mask( ( _maskClip && _maskClip->isConnected() ) ?
-                                     _maskClip->fetchImage(refTime) : 0 );
-    if ( mask.get() ) {
-        checkBadRenderScale(mask, args);
+    auto_ptr<const Image> &mask = images->mask;
+    if ( !mask.get() || (images->maskTime != refTime) ) {
+        mask.reset( ( _maskClip && _maskClip->isConnected() ) ?
+                    _maskClip->fetchImage(refTime) : 0 );
+        images->maskTime = refTime;
+        if ( mask.get() ) {
+            checkBadRenderScale(mask, args);
+        }
     }
 
     OfxRectD trackSearchBounds;
@@ -910,6 +1341,27 @@ TrackerPMPlugin::trackInternal(OfxTime refTime,
     }
 } // TrackerPMPlugin::trackInternal
 
+bool
+TrackerPMPlugin::imageContains(const Image* img,
+                               OfxTime time,
+                               const OfxRectD& bounds)
+{
+    const OfxPointD rsOne = {1., 1.};
+    const double par = _srcClip->getPixelAspectRatio();
+    OfxRectI boundsPixel;
+    Coords::toPixelEnclosing(bounds, rsOne, par, &boundsPixel);
+    // a fetched image is limited to the source region of definition
+    OfxRectI rodPixel;
+    Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), rsOne, par, &rodPixel);
+    if ( !Coords::rectIntersection(boundsPixel, rodPixel, &boundsPixel) ) {
+        return true;
+    }
+    const OfxRectI &imgBounds = img->getBounds();
+
+    return imgBounds.x1 <= boundsPixel.x1 && boundsPixel.x2 <= imgBounds.x2 &&
+           imgBounds.y1 <= boundsPixel.y1 && boundsPixel.y2 <= imgBounds.y2;
+}
+
 mDeclarePluginFactory(TrackerPMPluginFactory, {ofxsThreadSuiteCheck();}, {});
 void
 TrackerPMPluginFactory::describe(ImageEffectDescriptor &desc)
@@ -1145,6 +1597,20 @@ TrackerPMPluginFactory::describeInContext(ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+
+    // pyramidLevels
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamPyramidLevels);
+        param->setLabel(kParamPyramidLevelsLabel);
+        param->setHint(kParamPyramidLevelsHint);
+        param->setRange(1, kTrackerPMLevelsMax);
+        param->setDisplayRange(1, kTrackerPMLevelsMax);
+        param->setDefault(1);
+        param->setEvaluateOnChange(false); // The tracker is identity always
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 } // TrackerPMPluginFactory::describeInContext
 
 ImageEffect*